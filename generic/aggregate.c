@@ -0,0 +1,245 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * aggregation - a pipeline run on the server with its results read
+ * through an ordinary cursor object, starting from the first batch the
+ * aggregate command returns
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_aggregateBuildCommand --
+ *
+ *      Build the aggregate command.  Each element of pipeline, whatever
+ *      its name, is a stage, in order.
+ *
+ * Results:
+ *      1 if a stage writes its results out with $out, else 0.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_aggregateBuildCommand (mongotcl_clientData *md, const char *collection, const bson *pipeline, int batchSize, int allowDiskUse, bson *out) {
+	bson_iterator it;
+	int writes = 0;
+	int i = 0;
+
+	bson_init (out);
+	bson_append_string (out, "aggregate", collection);
+	bson_append_start_array (out, "pipeline");
+	bson_iterator_init (&it, pipeline);
+	while (bson_iterator_next (&it) != BSON_EOO) {
+		bson_iterator stage;
+		char name[16];
+
+		if (bson_iterator_type (&it) == BSON_OBJECT) {
+			bson_iterator_subiterator (&it, &stage);
+			if (bson_iterator_next (&stage) != BSON_EOO && strcmp (bson_iterator_key (&stage), "$out") == 0) {
+				writes = 1;
+			}
+		}
+
+		snprintf (name, sizeof (name), "%d", i++);
+		bson_append_element (out, name, &it);
+	}
+	bson_append_finish_array (out);
+
+	bson_append_start_object (out, "cursor");
+	if (batchSize > 0) {
+		bson_append_int (out, "batchSize", batchSize);
+	}
+	bson_append_finish_object (out);
+
+	if (allowDiskUse) {
+		bson_append_bool (out, "allowDiskUse", 1);
+	}
+
+	if (md->op_max_time_ms > 0) {
+		bson_append_int (out, "maxTimeMS", md->op_max_time_ms);
+	}
+	bson_finish (out);
+	return writes;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_aggregateObjCmd --
+ *
+ *      Implements "$mongo aggregate namespace pipelineBson ?-batch_size
+ *      n? ?-allow_disk_use? ?-name name?".
+ *
+ *      Runs the aggregate command and creates a cursor object holding
+ *      its first batch as if it had been the reply to a query, so the
+ *      rest is fetched with getMore like any other cursor's.  A pipeline
+ *      that writes with $out goes to the primary; others follow the
+ *      read preference.
+ *
+ * Results:
+ *      A standard Tcl result; the cursor's name is left in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_aggregateObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	mongotcl_cursorClientData *mc;
+	const char *ns;
+	char *commandName = "#auto";
+	bson *pipeline;
+	bson command;
+	bson out;
+	bson_iterator it;
+	bson_iterator cursorIt;
+	Tcl_DString db;
+	Tcl_DString cursorNs;
+	mongo *conn = md->conn;
+	mongo_reply *reply;
+	int64_t cursorId = 0;
+	int batchSize = 0;
+	int allowDiskUse = 0;
+	int options = 0;
+	int status;
+	int bodyLen = 0;
+	int num = 0;
+	char *data;
+	int i;
+
+	if (objc < 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "namespace pipelineBson ?-batch_size n? ?-allow_disk_use? ?-name name?");
+		return TCL_ERROR;
+	}
+
+	ns = Tcl_GetString (objv[2]);
+	if (strchr (ns, '.') == NULL) {
+		Tcl_AppendResult (interp, "invalid namespace '", ns, "'", NULL);
+		Tcl_SetErrorCode (interp, "MONGO", "NS_INVALID", NULL);
+		return TCL_ERROR;
+	}
+
+	if (mongotcl_cmdNameObjToBson (interp, objv[3], &pipeline) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	for (i = 4; i < objc; i++) {
+		char *option = Tcl_GetString (objv[i]);
+
+		if (strcmp (option, "-allow_disk_use") == 0) {
+			allowDiskUse = 1;
+		} else if (strcmp (option, "-batch_size") == 0 && i + 1 < objc) {
+			if (Tcl_GetIntFromObj (interp, objv[++i], &batchSize) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (batchSize < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("batch size must not be negative", -1));
+				return TCL_ERROR;
+			}
+		} else if (strcmp (option, "-name") == 0 && i + 1 < objc) {
+			commandName = Tcl_GetString (objv[++i]);
+		} else {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -batch_size, -allow_disk_use or -name", option));
+			return TCL_ERROR;
+		}
+	}
+
+	Tcl_DStringInit (&db);
+	mongotcl_namespaceToDb (ns, &db);
+
+	if (!mongotcl_aggregateBuildCommand (md, ns + Tcl_DStringLength (&db) + 1, pipeline, batchSize, allowDiskUse, &command)) {
+		if (mongotcl_selectReadConnection (interp, md, &conn, &options) == TCL_ERROR) {
+			bson_destroy (&command);
+			Tcl_DStringFree (&db);
+			return TCL_ERROR;
+		}
+	}
+
+	status = mongotcl_runReadCommand (conn, Tcl_DStringValue (&db), &command, options, &out);
+	bson_destroy (&command);
+	Tcl_DStringFree (&db);
+
+	if (status != MONGO_OK) {
+		return mongotcl_setMongoError (interp, conn);
+	}
+
+	if (bson_find (&cursorIt, &out, "cursor") != BSON_OBJECT) {
+		bson_destroy (&out);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("aggregate reply has no cursor", -1));
+		Tcl_SetErrorCode (interp, "MONGO", "CURSOR_QUERY_FAIL", NULL);
+		return TCL_ERROR;
+	}
+
+	/* the cursor's namespace for getMore, and the size of the batch */
+	Tcl_DStringInit (&cursorNs);
+	Tcl_DStringAppend (&cursorNs, ns, -1);
+	bson_iterator_subiterator (&cursorIt, &it);
+	while (bson_iterator_next (&it) != BSON_EOO) {
+		const char *key = bson_iterator_key (&it);
+
+		if (strcmp (key, "id") == 0) {
+			cursorId = bson_iterator_long (&it);
+		} else if (strcmp (key, "ns") == 0 && bson_iterator_type (&it) == BSON_STRING) {
+			Tcl_DStringSetLength (&cursorNs, 0);
+			Tcl_DStringAppend (&cursorNs, bson_iterator_string (&it), -1);
+		} else if (strcmp (key, "firstBatch") == 0 && bson_iterator_type (&it) == BSON_ARRAY) {
+			bson_iterator doc;
+
+			bson_iterator_subiterator (&it, &doc);
+			while (bson_iterator_next (&doc) != BSON_EOO) {
+				int size;
+
+				bson_little_endian32 (&size, bson_iterator_value (&doc));
+				bodyLen += size;
+				num++;
+			}
+		}
+	}
+
+	reply = (mongo_reply *)bson_malloc (sizeof (mongo_header) + sizeof (mongo_reply_fields) + bodyLen);
+	memset (reply, 0, sizeof (mongo_header) + sizeof (mongo_reply_fields));
+	reply->head.len = (int)(sizeof (mongo_header) + sizeof (mongo_reply_fields)) + bodyLen;
+	reply->head.op = 1;
+	reply->fields.cursorID = cursorId;
+	reply->fields.num = num;
+
+	data = &reply->objs;
+	bson_iterator_subiterator (&cursorIt, &it);
+	while (bson_iterator_next (&it) != BSON_EOO) {
+		if (strcmp (bson_iterator_key (&it), "firstBatch") == 0 && bson_iterator_type (&it) == BSON_ARRAY) {
+			bson_iterator doc;
+
+			bson_iterator_subiterator (&it, &doc);
+			while (bson_iterator_next (&doc) != BSON_EOO) {
+				int size;
+
+				bson_little_endian32 (&size, bson_iterator_value (&doc));
+				memcpy (data, bson_iterator_value (&doc), size);
+				data += size;
+			}
+		}
+	}
+	bson_destroy (&out);
+
+	if (mongotcl_createCursorObjCmd (interp, md, commandName, Tcl_DStringValue (&cursorNs), &mc) == TCL_ERROR) {
+		Tcl_DStringFree (&cursorNs);
+		bson_free (reply);
+		return TCL_ERROR;
+	}
+	Tcl_DStringFree (&cursorNs);
+
+	mc->conn = conn;
+	mc->batch_size = batchSize;
+	mc->cursor->options = options;
+	mongotcl_cursorInstallReply (mc->cursor, conn, reply);
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
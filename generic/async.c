@@ -0,0 +1,631 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * asynchronous requests - commands and queries sent without waiting,
+ * any number of them in flight on the object's one connection, with
+ * replies matched back to their requests by responseTo and delivered
+ * to callbacks through the event loop
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <assert.h>
+#include <stdlib.h>
+
+static void mongotcl_asyncDispatchProc (ClientData clientData);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncFree --
+ *
+ *      Free an asynchronous request.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_asyncFree (mongotcl_asyncRequest *ar) {
+	Tcl_DecrRefCount (ar->callback);
+	if (ar->result != NULL) {
+		Tcl_DecrRefCount (ar->result);
+	}
+	ckfree ((char *)ar);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncScheduleDispatch --
+ *
+ *      Arrange for the callbacks of completed requests to run once the
+ *      interpreter is idle.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_asyncScheduleDispatch (mongotcl_clientData *md) {
+	if (!md->async_dispatch_scheduled) {
+		Tcl_DoWhenIdle (mongotcl_asyncDispatchProc, (ClientData)md);
+		md->async_dispatch_scheduled = 1;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncFinish --
+ *
+ *      Record the outcome of a request whose reply arrived, or which
+ *      failed, and schedule its callback.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_asyncFinish (mongotcl_clientData *md, mongotcl_asyncRequest *ar, int failed, Tcl_Obj *resultObj) {
+	ar->done = 1;
+	ar->failed = failed;
+	ar->result = resultObj;
+	Tcl_IncrRefCount (resultObj);
+	md->async_pending--;
+	mongotcl_asyncScheduleDispatch (md);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncWatch --
+ *
+ *      Watch the connection for replies while requests are in flight,
+ *      and stop once none are.
+ *
+ *----------------------------------------------------------------------
+ */
+static void mongotcl_asyncReadableProc (ClientData clientData, int mask);
+
+static void
+mongotcl_asyncWatch (mongotcl_clientData *md) {
+	if (md->async_pending > 0 && md->async_fd < 0) {
+		md->async_fd = md->conn->sock;
+		Tcl_CreateFileHandler (md->async_fd, TCL_READABLE, mongotcl_asyncReadableProc, (ClientData)md);
+	} else if (md->async_pending == 0 && md->async_fd >= 0) {
+		Tcl_DeleteFileHandler (md->async_fd);
+		md->async_fd = -1;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncFailAll --
+ *
+ *      Fail every request still in flight with message, as when the
+ *      connection is lost or replaced.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_asyncFailAll (mongotcl_clientData *md, const char *message) {
+	mongotcl_asyncRequest *ar;
+
+	for (ar = md->async_head; ar != NULL; ar = ar->next) {
+		if (!ar->done) {
+			mongotcl_asyncFinish (md, ar, 1, Tcl_NewStringObj (message, -1));
+		}
+	}
+
+	assert (md->async_pending == 0);
+	mongotcl_asyncWatch (md);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncComplete --
+ *
+ *      Hand a reply to the request it answers.  A command's result is
+ *      the reply document as a list; a query's is a list of the
+ *      documents in its first batch.  The reply is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_asyncComplete (mongotcl_clientData *md, mongo_reply *reply) {
+	mongotcl_asyncRequest *ar;
+	Tcl_Obj *resultObj;
+	bson_iterator it;
+	const char *data = &reply->objs;
+
+	for (ar = md->async_head; ar != NULL; ar = ar->next) {
+		if (!ar->done && ar->request_id == reply->head.responseTo) {
+			break;
+		}
+	}
+
+	/* nobody asked for it; requests are only ever failed as a whole, so
+	 * this can't be the late reply to one of ours */
+	if (ar == NULL) {
+		bson_free (reply);
+		return;
+	}
+
+	if (reply->fields.cursorID != 0) {
+		Tcl_DString msg;
+
+		Tcl_DStringInit (&msg);
+		mongotcl_wireBuildKillCursors (&msg, reply->fields.cursorID);
+		mongotcl_wireSend (md->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+		Tcl_DStringFree (&msg);
+	}
+
+	/* QueryFailure */
+	if (reply->fields.flag & 0x02) {
+		const char *message = "query failed";
+
+		if (reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, data, "$err") == BSON_STRING) {
+			message = bson_iterator_string (&it);
+		}
+		mongotcl_asyncFinish (md, ar, 1, Tcl_NewStringObj (message, -1));
+		bson_free (reply);
+		return;
+	}
+
+	if (ar->type == MONGOTCL_ASYNC_COMMAND) {
+		int ok = 0;
+
+		if (reply->fields.num > 0) {
+			switch (mongotcl_bsonFindRaw (&it, data, "ok")) {
+				case BSON_DOUBLE: {
+					ok = (bson_iterator_double (&it) != 0.0);
+					break;
+				}
+
+				case BSON_INT:
+				case BSON_LONG:
+				case BSON_BOOL: {
+					ok = bson_iterator_bool (&it);
+					break;
+				}
+
+				default: {
+					break;
+				}
+			}
+		}
+
+		if (!ok) {
+			const char *message = "command failed";
+
+			if (reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, data, "errmsg") == BSON_STRING) {
+				message = bson_iterator_string (&it);
+			}
+			resultObj = Tcl_NewStringObj (message, -1);
+		} else {
+			resultObj = mongotcl_bsontolist_raw (md->interp, Tcl_NewObj (), data, 0);
+		}
+		mongotcl_asyncFinish (md, ar, !ok, resultObj);
+	} else {
+		int i;
+
+		resultObj = Tcl_NewObj ();
+		for (i = 0; i < reply->fields.num; i++) {
+			int size;
+
+			Tcl_ListObjAppendElement (NULL, resultObj, mongotcl_bsontolist_raw (md->interp, Tcl_NewObj (), data, 0));
+			bson_little_endian32 (&size, data);
+			data += size;
+		}
+		mongotcl_asyncFinish (md, ar, 0, resultObj);
+	}
+
+	bson_free (reply);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncReadableProc --
+ *
+ *      File handler for the connection while requests are in flight.
+ *      Reads a reply, and any others that came in with it, and hands
+ *      each to its request.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_asyncReadableProc (ClientData clientData, int mask) {
+	mongotcl_clientData *md = (mongotcl_clientData *)clientData;
+
+	do {
+		mongo_reply *reply;
+
+		if (mongotcl_wireReadReply (md->conn, &reply) != MONGO_OK) {
+			mongotcl_asyncFailAll (md, md->conn->errstr);
+			return;
+		}
+		mongotcl_asyncComplete (md, reply);
+	} while (md->async_pending > 0 && mongotcl_wireBuffered (md->conn) > 0);
+
+	mongotcl_asyncWatch (md);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncDispatchProc --
+ *
+ *      Run the callbacks of completed requests, in the order the
+ *      requests were made, as
+ *
+ *          {*}$callback $requestId ok|error $result
+ *
+ *      Completed requests are unlinked before any callback runs, so a
+ *      callback may make new requests or delete the object.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_asyncDispatchProc (ClientData clientData) {
+	mongotcl_clientData *md = (mongotcl_clientData *)clientData;
+	Tcl_Interp *interp = md->interp;
+	mongotcl_asyncRequest *ready = NULL;
+	mongotcl_asyncRequest **tailPtr = &ready;
+	mongotcl_asyncRequest **arPtr = &md->async_head;
+
+	md->async_dispatch_scheduled = 0;
+
+	while (*arPtr != NULL) {
+		mongotcl_asyncRequest *ar = *arPtr;
+
+		if (ar->done) {
+			*arPtr = ar->next;
+			ar->next = NULL;
+			*tailPtr = ar;
+			tailPtr = &ar->next;
+		} else {
+			arPtr = &ar->next;
+		}
+	}
+	md->async_tail = NULL;
+	for (arPtr = &md->async_head; *arPtr != NULL; arPtr = &(*arPtr)->next) {
+		md->async_tail = *arPtr;
+	}
+
+	Tcl_Preserve ((ClientData)interp);
+	while (ready != NULL) {
+		mongotcl_asyncRequest *ar = ready;
+		Tcl_Obj *cmdObj = Tcl_DuplicateObj (ar->callback);
+
+		ready = ar->next;
+
+		Tcl_IncrRefCount (cmdObj);
+		Tcl_ListObjAppendElement (NULL, cmdObj, Tcl_NewIntObj (ar->request_id));
+		Tcl_ListObjAppendElement (NULL, cmdObj, Tcl_NewStringObj (ar->failed ? "error" : "ok", -1));
+		Tcl_ListObjAppendElement (NULL, cmdObj, ar->result);
+
+		if (Tcl_EvalObjEx (interp, cmdObj, TCL_EVAL_GLOBAL) != TCL_OK) {
+			Tcl_BackgroundError (interp);
+		}
+
+		Tcl_DecrRefCount (cmdObj);
+		mongotcl_asyncFree (ar);
+	}
+	Tcl_Release ((ClientData)interp);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncDrain --
+ *
+ *      Read the replies to every request in flight, leaving their
+ *      callbacks to run when the interpreter is idle.  Must be called
+ *      before anything else reads from the connection.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set, in which
+ *      case the requests have failed.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_asyncDrain (mongotcl_clientData *md) {
+	while (md->async_pending > 0) {
+		mongo_reply *reply;
+
+		if (mongotcl_wireReadReply (md->conn, &reply) != MONGO_OK) {
+			mongotcl_asyncFailAll (md, md->conn->errstr);
+			return MONGO_ERROR;
+		}
+		mongotcl_asyncComplete (md, reply);
+	}
+
+	mongotcl_asyncWatch (md);
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncReset --
+ *
+ *      Fail the requests in flight on a connection that is being
+ *      closed or replaced.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_asyncReset (mongotcl_clientData *md) {
+	if (md->async_pending > 0) {
+		mongotcl_asyncFailAll (md, "connection reset");
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncCleanup --
+ *
+ *      Free all asynchronous requests without running their callbacks,
+ *      when the mongo object is deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_asyncCleanup (mongotcl_clientData *md) {
+	mongotcl_asyncRequest *ar = md->async_head;
+
+	md->async_pending = 0;
+	mongotcl_asyncWatch (md);
+
+	if (md->async_dispatch_scheduled) {
+		Tcl_CancelIdleCall (mongotcl_asyncDispatchProc, (ClientData)md);
+		md->async_dispatch_scheduled = 0;
+	}
+
+	while (ar != NULL) {
+		mongotcl_asyncRequest *next = ar->next;
+
+		mongotcl_asyncFree (ar);
+		ar = next;
+	}
+
+	md->async_head = NULL;
+	md->async_tail = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncSend --
+ *
+ *      Send a request built in msg and add it to the requests in
+ *      flight.  Replies to our own pipelined writes must be read
+ *      first, so that only asynchronous replies are ever outstanding
+ *      while requests are in flight.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_asyncSend (Tcl_Interp *interp, mongotcl_clientData *md, Tcl_DString *msg, int requestId, enum mongotcl_asyncType type, Tcl_Obj *callbackObj) {
+	mongotcl_asyncRequest *ar;
+
+	if (md->pipeline_pending > 0 && mongotcl_pipelineDrain (md) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	if (mongotcl_cursorSettle (md, md->conn) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	if (mongotcl_wireSend (md->conn, Tcl_DStringValue (msg), Tcl_DStringLength (msg)) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	ar = (mongotcl_asyncRequest *)ckalloc (sizeof (mongotcl_asyncRequest));
+	ar->request_id = requestId;
+	ar->type = type;
+	ar->done = 0;
+	ar->failed = 0;
+	ar->result = NULL;
+	ar->callback = callbackObj;
+	Tcl_IncrRefCount (callbackObj);
+	ar->next = NULL;
+
+	if (md->async_tail == NULL) {
+		md->async_head = ar;
+	} else {
+		md->async_tail->next = ar;
+	}
+	md->async_tail = ar;
+	md->async_pending++;
+	mongotcl_asyncWatch (md);
+
+	Tcl_SetObjResult (interp, Tcl_NewIntObj (requestId));
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_asyncObjCmd --
+ *
+ *      Implements
+ *
+ *          $mongo async command db bson callback
+ *          $mongo async find namespace query ?-fields bson? ?-limit n?
+ *              ?-skip n? callback
+ *          $mongo async pending
+ *          $mongo async wait
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_asyncObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	int subIndex;
+
+    static CONST char *subOptions[] = {
+        "command",
+        "find",
+        "pending",
+        "wait",
+        NULL
+    };
+
+    enum subOptions {
+        SUBOPT_COMMAND,
+        SUBOPT_FIND,
+        SUBOPT_PENDING,
+        SUBOPT_WAIT
+    };
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "command|find|pending|wait ?args?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "subcommand", TCL_EXACT, &subIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	switch ((enum subOptions) subIndex) {
+		case SUBOPT_COMMAND: {
+			bson *commandBson;
+			Tcl_DString msg;
+			int requestId;
+			int status;
+
+			if (objc != 6) {
+				Tcl_WrongNumArgs (interp, 3, objv, "db bson callback");
+				return TCL_ERROR;
+			}
+
+			if (mongotcl_cmdNameObjToBson (interp, objv[4], &commandBson) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			Tcl_DStringInit (&msg);
+			requestId = mongotcl_wireBuildCommand (&msg, Tcl_GetString (objv[3]), commandBson);
+			status = mongotcl_asyncSend (interp, md, &msg, requestId, MONGOTCL_ASYNC_COMMAND, objv[5]);
+			Tcl_DStringFree (&msg);
+			return status;
+		}
+
+		case SUBOPT_FIND: {
+			bson *queryBson;
+			bson *fieldsBson = NULL;
+			int limit = 0;
+			int skip = 0;
+			Tcl_DString msg;
+			int requestId;
+			int status;
+			int i;
+
+			static CONST char *findOptions[] = {
+				"-fields",
+				"-limit",
+				"-skip",
+				NULL
+			};
+
+			enum findOptions {
+				FIND_FIELDS,
+				FIND_LIMIT,
+				FIND_SKIP
+			};
+
+			if (objc < 6 || (objc - 6) % 2 != 0) {
+				Tcl_WrongNumArgs (interp, 3, objv, "namespace query ?-fields bson? ?-limit n? ?-skip n? callback");
+				return TCL_ERROR;
+			}
+
+			if (mongotcl_cmdNameObjToBson (interp, objv[4], &queryBson) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			for (i = 5; i < objc - 1; i += 2) {
+				int optIndex;
+
+				if (Tcl_GetIndexFromObj (interp, objv[i], findOptions, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+					return TCL_ERROR;
+				}
+
+				switch ((enum findOptions) optIndex) {
+					case FIND_FIELDS: {
+						if (mongotcl_cmdNameObjToBson (interp, objv[i + 1], &fieldsBson) == TCL_ERROR) {
+							return TCL_ERROR;
+						}
+						break;
+					}
+
+					case FIND_LIMIT: {
+						if (Tcl_GetIntFromObj (interp, objv[i + 1], &limit) == TCL_ERROR) {
+							return TCL_ERROR;
+						}
+						break;
+					}
+
+					case FIND_SKIP: {
+						if (Tcl_GetIntFromObj (interp, objv[i + 1], &skip) == TCL_ERROR) {
+							return TCL_ERROR;
+						}
+						break;
+					}
+				}
+			}
+
+			/* a negative count asks for a single batch with no cursor */
+			Tcl_DStringInit (&msg);
+			requestId = mongotcl_wireBuildQuery (&msg, Tcl_GetString (objv[3]), 0, skip, -abs (limit), queryBson, fieldsBson);
+			status = mongotcl_asyncSend (interp, md, &msg, requestId, MONGOTCL_ASYNC_FIND, objv[objc - 1]);
+			Tcl_DStringFree (&msg);
+			return status;
+		}
+
+		case SUBOPT_PENDING: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewIntObj (md->async_pending));
+			break;
+		}
+
+		case SUBOPT_WAIT: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			if (mongotcl_asyncDrain (md) != MONGO_OK) {
+				return mongotcl_setMongoError (interp, md->conn);
+			}
+
+			if (md->async_dispatch_scheduled) {
+				Tcl_CancelIdleCall (mongotcl_asyncDispatchProc, (ClientData)md);
+				mongotcl_asyncDispatchProc ((ClientData)md);
+			}
+			break;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -152,6 +152,33 @@ mongotcl_bsontolist(Tcl_Interp *interp, const bson *b) {
     return mongotcl_bsontolist_raw (interp, listObj, b->data , 0);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_bsonFindRaw --
+ *
+ *    Like bson_find but on raw bson data, such as a document inside a
+ *    reply we read off the wire.
+ *
+ * Results:
+ *    The type of the element, positioning the iterator on it, or
+ *    BSON_EOO if the key isn't present.
+ *
+ *----------------------------------------------------------------------
+ */
+bson_type
+mongotcl_bsonFindRaw (bson_iterator *it, const char *data, const char *key) {
+    bson_type t;
+
+    bson_iterator_from_buffer (it, data);
+    while ((t = bson_iterator_next (it)) != BSON_EOO) {
+        if (strcmp (bson_iterator_key (it), key) == 0) {
+            return t;
+        }
+    }
+    return BSON_EOO;
+}
+
 int
 mongotcl_bsontoarray_raw (Tcl_Interp *interp, char *arrayName, char *typeArrayName, const char *data , int depth) {
     bson_iterator i;
@@ -0,0 +1,687 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * bulk write object - queues inserts, updates and removes against one
+ * namespace and sends them together
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <assert.h>
+
+/* allowance for the statement wrapper around each update/delete */
+#define MONGOTCL_BULK_STATEMENT_OVERHEAD 64
+
+typedef struct mongotcl_bulkCounts {
+	int nInserted;
+	int nMatched;
+	int nModified;
+	int nUpserted;
+	int nRemoved;
+} mongotcl_bulkCounts;
+
+
+/*
+ *--------------------------------------------------------------
+ *
+ * mongotcl_bulkClear -- discard all queued operations
+ *
+ *--------------------------------------------------------------
+ */
+static void
+mongotcl_bulkClear (mongotcl_bulkClientData *mb)
+{
+	int i;
+
+	for (i = 0; i < mb->nOps; i++) {
+		bson_destroy (&mb->ops[i].doc);
+		if (mb->ops[i].type == MONGOTCL_BULK_UPDATE) {
+			bson_destroy (&mb->ops[i].update);
+		}
+	}
+	mb->nOps = 0;
+}
+
+
+/*
+ *--------------------------------------------------------------
+ *
+ * mongotcl_bulkObjectDelete -- command deletion callback routine.
+ *
+ * Results:
+ *      ...discards queued operations.
+ *      ...frees memory.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------
+ */
+void
+mongotcl_bulkObjectDelete (ClientData clientData)
+{
+	mongotcl_bulkClientData *mb = (mongotcl_bulkClientData *)clientData;
+
+	assert (mb->bulk_magic == MONGOTCL_BULK_MAGIC);
+
+	mongotcl_bulkClear (mb);
+	if (mb->ops != NULL) {
+		ckfree ((char *)mb->ops);
+	}
+
+	/* take it off its mongo object's list unless that has gone */
+	if (mb->md != NULL) {
+		if (mb->live_prev != NULL) {
+			mb->live_prev->live_next = mb->live_next;
+		} else {
+			mb->md->live_bulks = mb->live_next;
+		}
+
+		if (mb->live_next != NULL) {
+			mb->live_next->live_prev = mb->live_prev;
+		}
+	}
+	ckfree (mb->ns);
+	ckfree ((char *)clientData);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_bulkForget --
+ *
+ *      The mongo object is going away; detach its bulk objects so they
+ *      don't touch it.  They can then only be deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_bulkForget (mongotcl_clientData *md)
+{
+	mongotcl_bulkClientData *mb;
+	mongotcl_bulkClientData *next;
+
+	for (mb = md->live_bulks; mb != NULL; mb = next) {
+		next = mb->live_next;
+		mb->md = NULL;
+		mb->live_prev = NULL;
+		mb->live_next = NULL;
+	}
+	md->live_bulks = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_bulkAddOp --
+ *
+ *      Queue an operation, taking private copies of the bson objects
+ *      so the caller is free to reuse them.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_bulkAddOp (Tcl_Interp *interp, mongotcl_bulkClientData *mb, enum mongotcl_bulkOpType type, Tcl_Obj *docObj, Tcl_Obj *updateObj, int upsert, int multi)
+{
+	mongotcl_bulkOp *op;
+	bson *doc;
+	bson *update = NULL;
+
+	if (mongotcl_cmdNameObjToBson (interp, docObj, &doc) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (updateObj != NULL && mongotcl_cmdNameObjToBson (interp, updateObj, &update) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (!doc->finished || (update != NULL && !update->finished)) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("bson object is not finished", -1));
+		Tcl_SetErrorCode (interp, "MONGO", "BSON_NOT_FINISHED", NULL);
+		return TCL_ERROR;
+	}
+
+	if (mb->nOps == mb->opsAllocated) {
+		mb->opsAllocated = (mb->opsAllocated == 0) ? 64 : mb->opsAllocated * 2;
+		mb->ops = (mongotcl_bulkOp *)ckrealloc ((char *)mb->ops, sizeof (mongotcl_bulkOp) * mb->opsAllocated);
+	}
+
+	op = &mb->ops[mb->nOps++];
+	op->type = type;
+	op->upsert = upsert;
+	op->multi = multi;
+	bson_copy (&op->doc, doc);
+	if (update != NULL) {
+		bson_copy (&op->update, update);
+	}
+
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_bulkOpSize --
+ *
+ *      Approximate the number of bytes the operation adds to a write
+ *      command.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_bulkOpSize (mongotcl_bulkOp *op)
+{
+	int size = bson_size (&op->doc) + MONGOTCL_BULK_STATEMENT_OVERHEAD;
+
+	if (op->type == MONGOTCL_BULK_UPDATE) {
+		size += bson_size (&op->update);
+	}
+	return size;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_bulkWriteCommand --
+ *
+ *      Send ops[start] through ops[end - 1], which are all of the same
+ *      type, as one insert, update or delete write command.  Counts
+ *      are accumulated and write errors are appended to errorList
+ *      with their index in the bulk.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *      *hadErrors is set if the server rejected any operation.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_bulkWriteCommand (Tcl_Interp *interp, mongotcl_bulkClientData *mb, int start, int end, mongotcl_bulkCounts *counts, Tcl_Obj *errorList, Tcl_Obj *wcErrorList, int *hadErrors)
+{
+	static CONST char *commandNames[] = {"insert", "update", "delete"};
+	static CONST char *arrayNames[] = {"documents", "updates", "deletes"};
+	mongo *conn = mb->md->conn;
+	enum mongotcl_bulkOpType type = mb->ops[start].type;
+	Tcl_DString db;
+	bson command;
+	bson out;
+	bson_iterator it;
+	bson_iterator sub;
+	char key[16];
+	int n = 0;
+	int i;
+	int status;
+
+	bson_init (&command);
+	bson_append_string (&command, commandNames[type], strchr (mb->ns, '.') + 1);
+	bson_append_start_array (&command, arrayNames[type]);
+
+	for (i = start; i < end; i++) {
+		mongotcl_bulkOp *op = &mb->ops[i];
+
+		snprintf (key, sizeof (key), "%d", i - start);
+
+		switch (type) {
+			case MONGOTCL_BULK_INSERT: {
+				bson_append_bson (&command, key, &op->doc);
+				break;
+			}
+
+			case MONGOTCL_BULK_UPDATE: {
+				bson_append_start_object (&command, key);
+				bson_append_bson (&command, "q", &op->doc);
+				bson_append_bson (&command, "u", &op->update);
+				bson_append_bool (&command, "upsert", op->upsert);
+				bson_append_bool (&command, "multi", op->multi);
+				bson_append_finish_object (&command);
+				break;
+			}
+
+			case MONGOTCL_BULK_REMOVE: {
+				bson_append_start_object (&command, key);
+				bson_append_bson (&command, "q", &op->doc);
+				bson_append_int (&command, "limit", op->multi ? 0 : 1);
+				bson_append_finish_object (&command);
+				break;
+			}
+		}
+	}
+
+	bson_append_finish_array (&command);
+	bson_append_bool (&command, "ordered", mb->ordered);
+	mongotcl_appendWriteConcern (&command, mb->md->write_concern);
+
+	if (bson_finish (&command) != BSON_OK) {
+		bson_destroy (&command);
+		conn->err = MONGO_BSON_INVALID;
+		return MONGO_ERROR;
+	}
+
+	Tcl_DStringInit (&db);
+	mongotcl_namespaceToDb (mb->ns, &db);
+	status = mongo_run_command (conn, Tcl_DStringValue (&db), &command, &out);
+	Tcl_DStringFree (&db);
+	bson_destroy (&command);
+
+	if (status != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (bson_find (&it, &out, "n") != BSON_EOO) {
+		n = bson_iterator_int (&it);
+	}
+
+	switch (type) {
+		case MONGOTCL_BULK_INSERT: {
+			counts->nInserted += n;
+			break;
+		}
+
+		case MONGOTCL_BULK_UPDATE: {
+			int nUpserted = 0;
+
+			if (bson_find (&it, &out, "upserted") == BSON_ARRAY) {
+				bson_iterator_subiterator (&it, &sub);
+				while (bson_iterator_next (&sub)) {
+					nUpserted++;
+				}
+			}
+			counts->nUpserted += nUpserted;
+			counts->nMatched += n - nUpserted;
+
+			if (bson_find (&it, &out, "nModified") != BSON_EOO) {
+				counts->nModified += bson_iterator_int (&it);
+			}
+			break;
+		}
+
+		case MONGOTCL_BULK_REMOVE: {
+			counts->nRemoved += n;
+			break;
+		}
+	}
+
+	if (bson_find (&it, &out, "writeErrors") == BSON_ARRAY) {
+		bson_iterator_subiterator (&it, &sub);
+		while (bson_iterator_next (&sub)) {
+			bson_iterator field;
+			Tcl_Obj *errorObj = Tcl_NewObj ();
+
+			bson_iterator_subiterator (&sub, &field);
+			while (bson_iterator_next (&field)) {
+				const char *fieldName = bson_iterator_key (&field);
+
+				if (strcmp (fieldName, "index") == 0) {
+					Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj ("index", -1));
+					Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewIntObj (start + bson_iterator_int (&field)));
+				} else if (strcmp (fieldName, "code") == 0) {
+					Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj ("code", -1));
+					Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewIntObj (bson_iterator_int (&field)));
+				} else if (strcmp (fieldName, "errmsg") == 0) {
+					Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj ("errmsg", -1));
+					Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj (bson_iterator_string (&field), -1));
+				}
+			}
+			Tcl_ListObjAppendElement (interp, errorList, errorObj);
+			*hadErrors = 1;
+		}
+	}
+
+	if (bson_find (&it, &out, "writeConcernError") == BSON_OBJECT) {
+		bson_iterator field;
+		Tcl_Obj *errorObj = Tcl_NewObj ();
+
+		bson_iterator_subiterator (&it, &field);
+		while (bson_iterator_next (&field)) {
+			const char *fieldName = bson_iterator_key (&field);
+
+			if (strcmp (fieldName, "code") == 0) {
+				Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj ("code", -1));
+				Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewIntObj (bson_iterator_int (&field)));
+			} else if (strcmp (fieldName, "errmsg") == 0) {
+				Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj ("errmsg", -1));
+				Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj (bson_iterator_string (&field), -1));
+			}
+		}
+		Tcl_ListObjAppendElement (interp, wcErrorList, errorObj);
+	}
+
+	bson_destroy (&out);
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_bulkExecute --
+ *
+ *      Send every queued operation.
+ *
+ *      With an acknowledged write concern and a server that supports
+ *      write commands, runs of operations of the same type are sent as
+ *      insert, update and delete commands bounded by maxWriteBatchSize
+ *      and maxBsonObjectSize.  If ordered, execution stops after the
+ *      first command reporting a write error.
+ *
+ *      Otherwise each operation is sent unacknowledged, back to back,
+ *      and if the write concern is acknowledged a single trailing
+ *      getLastError reports the outcome of the last operation.  Counts
+ *      are then the number of operations sent.
+ *
+ * Results:
+ *      A standard Tcl result; on success a list of key-value pairs
+ *      with the counts, writeErrors and writeConcernErrors.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_bulkExecute (Tcl_Interp *interp, mongotcl_bulkClientData *mb)
+{
+	mongotcl_clientData *md = mb->md;
+	mongotcl_bulkCounts counts = {0, 0, 0, 0, 0};
+	Tcl_Obj *errorList = Tcl_NewObj ();
+	Tcl_Obj *wcErrorList = Tcl_NewObj ();
+	Tcl_Obj *resultObj;
+	int i;
+
+	Tcl_IncrRefCount (errorList);
+	Tcl_IncrRefCount (wcErrorList);
+
+	if (md->pipeline_pending > 0 && mongotcl_pipelineDrain (md) != MONGO_OK) {
+		goto mongo_error;
+	}
+
+	if (mongotcl_flushWrites (md) != MONGO_OK) {
+		goto mongo_error;
+	}
+
+	if (mb->nOps > 0 && mongotcl_probeServerLimits (md) != MONGO_OK) {
+		goto mongo_error;
+	}
+
+	if (mongotcl_writeConcernIsAcknowledged (md->write_concern) && md->max_wire_version >= 2) {
+		int start;
+
+		for (start = 0; start < mb->nOps; ) {
+			int batchBytes = 0;
+			int hadErrors = 0;
+			int end;
+
+			for (end = start; end < mb->nOps && mb->ops[end].type == mb->ops[start].type && end - start < md->max_write_batch_size; end++) {
+				int opBytes = mongotcl_bulkOpSize (&mb->ops[end]);
+
+				if (end > start && batchBytes + opBytes > md->conn->max_bson_size) {
+					break;
+				}
+				batchBytes += opBytes;
+			}
+
+			if (mongotcl_bulkWriteCommand (interp, mb, start, end, &counts, errorList, wcErrorList, &hadErrors) != MONGO_OK) {
+				goto mongo_error;
+			}
+
+			if (hadErrors && mb->ordered) {
+				break;
+			}
+			start = end;
+		}
+	} else {
+		for (i = 0; i < mb->nOps; i++) {
+			if (mongotcl_sendWriteOp (md, mb->ns, &mb->ops[i], md->unack_write_concern) != MONGO_OK) {
+				goto mongo_error;
+			}
+
+			switch (mb->ops[i].type) {
+				case MONGOTCL_BULK_INSERT: {
+					counts.nInserted++;
+					break;
+				}
+
+				case MONGOTCL_BULK_UPDATE: {
+					counts.nMatched++;
+					break;
+				}
+
+				case MONGOTCL_BULK_REMOVE: {
+					counts.nRemoved++;
+					break;
+				}
+			}
+		}
+
+		if (mb->nOps > 0 && mongotcl_checkLastError (md, mb->ns) != MONGO_OK) {
+			Tcl_Obj *errorObj;
+
+			if (md->conn->err != MONGO_WRITE_ERROR) {
+				goto mongo_error;
+			}
+
+			/* getLastError describes only the last operation on the
+			 * connection, so earlier failures go unreported */
+			errorObj = Tcl_NewObj ();
+			Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj ("index", -1));
+			Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewIntObj (mb->nOps - 1));
+			Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj ("code", -1));
+			Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewIntObj (md->conn->errcode));
+			Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj ("errmsg", -1));
+			Tcl_ListObjAppendElement (interp, errorObj, Tcl_NewStringObj (md->conn->errstr, -1));
+			Tcl_ListObjAppendElement (interp, errorList, errorObj);
+		}
+	}
+
+	mongotcl_bulkClear (mb);
+
+	resultObj = Tcl_NewObj ();
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewStringObj ("nInserted", -1));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewIntObj (counts.nInserted));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewStringObj ("nMatched", -1));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewIntObj (counts.nMatched));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewStringObj ("nModified", -1));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewIntObj (counts.nModified));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewStringObj ("nUpserted", -1));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewIntObj (counts.nUpserted));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewStringObj ("nRemoved", -1));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewIntObj (counts.nRemoved));
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewStringObj ("writeErrors", -1));
+	Tcl_ListObjAppendElement (interp, resultObj, errorList);
+	Tcl_ListObjAppendElement (interp, resultObj, Tcl_NewStringObj ("writeConcernErrors", -1));
+	Tcl_ListObjAppendElement (interp, resultObj, wcErrorList);
+	Tcl_SetObjResult (interp, resultObj);
+
+	Tcl_DecrRefCount (errorList);
+	Tcl_DecrRefCount (wcErrorList);
+	return TCL_OK;
+
+  mongo_error:
+	/* the queue is kept so the caller can retry after reconnecting */
+	Tcl_DecrRefCount (errorList);
+	Tcl_DecrRefCount (wcErrorList);
+	return mongotcl_setMongoError (interp, md->conn);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_bulkObjectObjCmd --
+ *
+ *    dispatches the subcommands of a mongo bulk object command
+ *
+ * Results:
+ *    stuff
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_bulkObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	int         optIndex;
+	mongotcl_bulkClientData *mb = (mongotcl_bulkClientData *)cData;
+
+	static CONST char *options[] = {
+		"insert",
+		"update",
+		"upsert",
+		"remove",
+		"execute",
+		"delete",
+		NULL
+	};
+
+	enum options {
+		OPT_BULK_INSERT,
+		OPT_BULK_UPDATE,
+		OPT_BULK_UPSERT,
+		OPT_BULK_REMOVE,
+		OPT_BULK_EXECUTE,
+		OPT_BULK_DELETE
+	};
+
+	/* basic validation of command line arguments */
+	if (objc < 2) {
+		Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (mb->md == NULL && optIndex != OPT_BULK_DELETE) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("the bulk object's mongo object has been deleted", -1));
+		Tcl_SetErrorCode (interp, "MONGO", "BULK_INVALID", NULL);
+		return TCL_ERROR;
+	}
+
+	switch ((enum options) optIndex) {
+		case OPT_BULK_INSERT: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "bson");
+				return TCL_ERROR;
+			}
+
+			return mongotcl_bulkAddOp (interp, mb, MONGOTCL_BULK_INSERT, objv[2], NULL, 0, 0);
+		}
+
+		case OPT_BULK_UPDATE:
+		case OPT_BULK_UPSERT: {
+			int multi = 0;
+
+			if (objc < 4 || objc > 5) {
+				Tcl_WrongNumArgs (interp, 2, objv, "condBson opBson ?multi?");
+				return TCL_ERROR;
+			}
+
+			if (objc == 5) {
+				if (strcmp (Tcl_GetString (objv[4]), "multi") != 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("fifth argument is not 'multi'", -1));
+					return TCL_ERROR;
+				}
+				multi = 1;
+			}
+
+			return mongotcl_bulkAddOp (interp, mb, MONGOTCL_BULK_UPDATE, objv[2], objv[3], (optIndex == OPT_BULK_UPSERT), multi);
+		}
+
+		case OPT_BULK_REMOVE: {
+			int multi = 1;
+
+			if (objc < 3 || objc > 4) {
+				Tcl_WrongNumArgs (interp, 2, objv, "condBson ?single?");
+				return TCL_ERROR;
+			}
+
+			if (objc == 4) {
+				if (strcmp (Tcl_GetString (objv[3]), "single") != 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("fourth argument is not 'single'", -1));
+					return TCL_ERROR;
+				}
+				multi = 0;
+			}
+
+			return mongotcl_bulkAddOp (interp, mb, MONGOTCL_BULK_REMOVE, objv[2], NULL, 0, multi);
+		}
+
+		case OPT_BULK_EXECUTE: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 1, objv, "execute");
+				return TCL_ERROR;
+			}
+
+			return mongotcl_bulkExecute (interp, mb);
+		}
+
+		case OPT_BULK_DELETE: {
+			Tcl_DeleteCommandFromToken (interp, mb->cmdToken);
+			break;
+		}
+	}
+
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_createBulkObjCmd --
+ *
+ *      Create a mongo bulk write object...
+ *
+ *      Give it an interp, mongo object client data, a MongoDB
+ *      namespace and whether the operations are ordered.
+ *
+ *      If successful, creates a new uniquely named Tcl command.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_createBulkObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, char *namespace, int ordered)
+{
+	mongotcl_bulkClientData *mb;
+	static unsigned long nextAutoCounter = 0;
+	char commandName[32];
+
+	if (strchr (namespace, '.') == NULL) {
+		Tcl_AppendResult (interp, "invalid namespace '", namespace, "'", NULL);
+		Tcl_SetErrorCode (interp, "MONGO", "NS_INVALID", NULL);
+		return TCL_ERROR;
+	}
+
+	mb = (mongotcl_bulkClientData *)ckalloc (sizeof (mongotcl_bulkClientData));
+	mb->bulk_magic = MONGOTCL_BULK_MAGIC;
+	mb->interp = interp;
+	mb->md = md;
+	mb->ordered = ordered;
+	mb->nOps = 0;
+	mb->opsAllocated = 0;
+	mb->ops = NULL;
+	mb->ns = ckalloc (strlen (namespace) + 1);
+	strcpy (mb->ns, namespace);
+
+	mb->live_prev = NULL;
+	mb->live_next = md->live_bulks;
+	if (md->live_bulks != NULL) {
+		md->live_bulks->live_prev = mb;
+	}
+	md->live_bulks = mb;
+
+	snprintf (commandName, sizeof (commandName), "bulk%lu", nextAutoCounter++);
+
+	mb->cmdToken = Tcl_CreateObjCommand (interp, commandName, mongotcl_bulkObjectObjCmd, mb, mongotcl_bulkObjectDelete);
+	Tcl_SetObjResult (interp, Tcl_NewStringObj (commandName, -1));
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
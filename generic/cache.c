@@ -0,0 +1,483 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * query cache - the complete results of cursor queries kept for a while
+ * on the mongo object, so repeating the same query within the time to
+ * live is answered without going to the server
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+
+#define MONGOTCL_REPLY_HEADER_SIZE ((int)(sizeof (mongo_header) + sizeof (mongo_reply_fields)))
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheInit --
+ *
+ *      Set up an empty, disabled query cache on a new mongo object.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cacheInit (mongotcl_clientData *md) {
+	md->cache_enabled = 0;
+	md->cache_ttl_ms = MONGOTCL_DEFAULT_CACHE_TTL;
+	md->cache_max_bytes = MONGOTCL_DEFAULT_CACHE_BYTES;
+	md->cache_bytes = 0;
+	Tcl_InitObjHashTable (&md->cache);
+	md->cache_head = NULL;
+	md->cache_tail = NULL;
+	md->cache_hits = 0;
+	md->cache_misses = 0;
+	md->cache_evictions = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheKey --
+ *
+ *      Build the key a cursor's query is cached under: its namespace,
+ *      skip and limit and the raw bytes of its query, which carries
+ *      any sort, and of its fields.
+ *
+ * Results:
+ *      A new byte array object with a reference count of zero.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+mongotcl_cacheKey (mongo_cursor *cursor) {
+	Tcl_DString key;
+	Tcl_Obj *keyObj;
+	int empty = 0;
+
+	Tcl_DStringInit (&key);
+	Tcl_DStringAppend (&key, cursor->ns, (int)strlen (cursor->ns) + 1);
+	Tcl_DStringAppend (&key, (char *)&cursor->skip, sizeof (cursor->skip));
+	Tcl_DStringAppend (&key, (char *)&cursor->limit, sizeof (cursor->limit));
+
+	if (cursor->query != NULL) {
+		Tcl_DStringAppend (&key, cursor->query->data, bson_size (cursor->query));
+	} else {
+		Tcl_DStringAppend (&key, (char *)&empty, sizeof (empty));
+	}
+
+	if (cursor->fields != NULL) {
+		Tcl_DStringAppend (&key, cursor->fields->data, bson_size (cursor->fields));
+	} else {
+		Tcl_DStringAppend (&key, (char *)&empty, sizeof (empty));
+	}
+
+	keyObj = Tcl_NewByteArrayObj ((unsigned char *)Tcl_DStringValue (&key), Tcl_DStringLength (&key));
+	Tcl_DStringFree (&key);
+	return keyObj;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheRemove --
+ *
+ *      Drop an entry from the cache and free it.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_cacheRemove (mongotcl_clientData *md, mongotcl_cacheEntry *entry) {
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		md->cache_head = entry->next;
+	}
+
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		md->cache_tail = entry->prev;
+	}
+
+	Tcl_DeleteHashEntry (entry->hashEntry);
+	md->cache_bytes -= entry->size;
+	ckfree (entry->ns);
+	ckfree ((char *)entry->reply);
+	ckfree ((char *)entry);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheFetch --
+ *
+ *      Called before a cursor's query is sent.  If the same query's
+ *      results are cached and haven't expired, install them as the
+ *      cursor's one and only batch.  Otherwise, if the query can be
+ *      cached, start recording the documents the cursor returns.
+ *
+ * Results:
+ *      1 if the cursor was answered from the cache, else 0.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_cacheFetch (mongotcl_cursorClientData *mc) {
+	mongotcl_clientData *md = mc->md;
+	mongo_cursor *cursor = mc->cursor;
+	mongotcl_cacheEntry *entry;
+	Tcl_HashEntry *hashEntry;
+	Tcl_Obj *keyObj;
+	mongo_reply *reply;
+
+	if (md == NULL || !md->cache_enabled || (cursor->options & (MONGO_TAILABLE | MONGO_EXHAUST))) {
+		return 0;
+	}
+
+	keyObj = mongotcl_cacheKey (cursor);
+	Tcl_IncrRefCount (keyObj);
+
+	if ((hashEntry = Tcl_FindHashEntry (&md->cache, (char *)keyObj)) != NULL) {
+		entry = (mongotcl_cacheEntry *)Tcl_GetHashValue (hashEntry);
+
+		if (entry->expires <= mongotcl_milliseconds ()) {
+			mongotcl_cacheRemove (md, entry);
+		} else {
+			Tcl_DecrRefCount (keyObj);
+
+			/* most recently used goes to the front */
+			if (entry->prev != NULL) {
+				entry->prev->next = entry->next;
+				if (entry->next != NULL) {
+					entry->next->prev = entry->prev;
+				} else {
+					md->cache_tail = entry->prev;
+				}
+				entry->prev = NULL;
+				entry->next = md->cache_head;
+				md->cache_head->prev = entry;
+				md->cache_head = entry;
+			}
+
+			reply = (mongo_reply *)bson_malloc (entry->reply->head.len);
+			memcpy (reply, entry->reply, entry->reply->head.len);
+			mc->conn = md->conn;
+			mongotcl_cursorInstallReply (cursor, md->conn, reply);
+			md->cache_hits++;
+			return 1;
+		}
+	}
+
+	md->cache_misses++;
+	mc->cache_key = keyObj;
+	mc->cache_count = 0;
+	Tcl_DStringInit (&mc->cache_data);
+	return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheRecord --
+ *
+ *      Note the document the recording cursor just returned.  Give up
+ *      recording if the results couldn't fit in the cache anyway.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cacheRecord (mongotcl_cursorClientData *mc) {
+	mongo_cursor *cursor = mc->cursor;
+
+	Tcl_DStringAppend (&mc->cache_data, cursor->current.data, bson_size (&cursor->current));
+	mc->cache_count++;
+
+	if (mc->md == NULL || Tcl_DStringLength (&mc->cache_data) > mc->md->cache_max_bytes) {
+		mongotcl_cacheAbandon (mc);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheAbandon --
+ *
+ *      Stop recording a cursor's results without caching them.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cacheAbandon (mongotcl_cursorClientData *mc) {
+	if (mc->cache_key == NULL) {
+		return;
+	}
+
+	Tcl_DecrRefCount (mc->cache_key);
+	mc->cache_key = NULL;
+	Tcl_DStringFree (&mc->cache_data);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheStore --
+ *
+ *      The recording cursor is exhausted, so its results are complete;
+ *      cache them as a single reply, evicting the least recently used
+ *      entries to stay within the byte budget.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cacheStore (mongotcl_cursorClientData *mc) {
+	mongotcl_clientData *md = mc->md;
+	mongotcl_cacheEntry *entry;
+	Tcl_HashEntry *hashEntry;
+	int dataLen = Tcl_DStringLength (&mc->cache_data);
+	int size;
+	int new;
+
+	if (md == NULL || !md->cache_enabled) {
+		mongotcl_cacheAbandon (mc);
+		return;
+	}
+
+	size = MONGOTCL_REPLY_HEADER_SIZE + dataLen;
+	if (size > md->cache_max_bytes) {
+		mongotcl_cacheAbandon (mc);
+		return;
+	}
+
+	/* the same query may have been cached by another cursor meanwhile */
+	if ((hashEntry = Tcl_FindHashEntry (&md->cache, (char *)mc->cache_key)) != NULL) {
+		mongotcl_cacheRemove (md, (mongotcl_cacheEntry *)Tcl_GetHashValue (hashEntry));
+	}
+
+	while (md->cache_tail != NULL && md->cache_bytes + size > md->cache_max_bytes) {
+		mongotcl_cacheRemove (md, md->cache_tail);
+		md->cache_evictions++;
+	}
+
+	entry = (mongotcl_cacheEntry *)ckalloc (sizeof (mongotcl_cacheEntry));
+	entry->ns = ckalloc (strlen (mc->cursor->ns) + 1);
+	strcpy (entry->ns, mc->cursor->ns);
+	entry->size = size;
+	entry->expires = mongotcl_milliseconds () + md->cache_ttl_ms;
+
+	entry->reply = (mongo_reply *)ckalloc (size);
+	memset (entry->reply, 0, MONGOTCL_REPLY_HEADER_SIZE);
+	entry->reply->head.len = size;
+	entry->reply->head.op = 1;
+	entry->reply->fields.num = mc->cache_count;
+	memcpy (&entry->reply->objs, Tcl_DStringValue (&mc->cache_data), dataLen);
+
+	entry->hashEntry = Tcl_CreateHashEntry (&md->cache, (char *)mc->cache_key, &new);
+	Tcl_SetHashValue (entry->hashEntry, entry);
+
+	entry->prev = NULL;
+	entry->next = md->cache_head;
+	if (md->cache_head != NULL) {
+		md->cache_head->prev = entry;
+	} else {
+		md->cache_tail = entry;
+	}
+	md->cache_head = entry;
+	md->cache_bytes += size;
+
+	mongotcl_cacheAbandon (mc);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheInvalidate --
+ *
+ *      Drop the cached results of queries on namespaces matching the
+ *      glob pattern, or all of them if pattern is NULL.
+ *
+ * Results:
+ *      The number of entries dropped.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_cacheInvalidate (mongotcl_clientData *md, const char *pattern) {
+	mongotcl_cacheEntry *entry;
+	mongotcl_cacheEntry *next;
+	int dropped = 0;
+
+	for (entry = md->cache_head; entry != NULL; entry = next) {
+		next = entry->next;
+		if (pattern == NULL || Tcl_StringMatch (entry->ns, pattern)) {
+			mongotcl_cacheRemove (md, entry);
+			dropped++;
+		}
+	}
+	return dropped;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheCleanup --
+ *
+ *      Free the query cache of a mongo object being deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cacheCleanup (mongotcl_clientData *md) {
+	mongotcl_cacheInvalidate (md, NULL);
+	Tcl_DeleteHashTable (&md->cache);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cacheObjCmd --
+ *
+ *      Implements "$mongo cache on ?-ttl ms? ?-max_bytes n?|off|
+ *      invalidate ?pattern?|status".
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_cacheObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	int subIndex;
+
+    static CONST char *subOptions[] = {
+        "on",
+        "off",
+        "invalidate",
+        "status",
+        NULL
+    };
+
+    enum subOptions {
+        SUBOPT_ON,
+        SUBOPT_OFF,
+        SUBOPT_INVALIDATE,
+        SUBOPT_STATUS
+    };
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "on|off|invalidate|status ?args?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "subcommand", TCL_EXACT, &subIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	switch ((enum subOptions) subIndex) {
+		case SUBOPT_ON: {
+			int ttl = md->cache_ttl_ms;
+			int maxBytes = md->cache_max_bytes;
+			int i;
+
+			if ((objc & 1) == 0) {
+				Tcl_WrongNumArgs (interp, 3, objv, "?-ttl ms? ?-max_bytes n?");
+				return TCL_ERROR;
+			}
+
+			for (i = 3; i < objc; i += 2) {
+				char *option = Tcl_GetString (objv[i]);
+				int value;
+
+				if (Tcl_GetIntFromObj (interp, objv[i + 1], &value) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				if (value < 0) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s must not be negative", option));
+					return TCL_ERROR;
+				}
+
+				if (strcmp (option, "-ttl") == 0) {
+					ttl = value;
+				} else if (strcmp (option, "-max_bytes") == 0) {
+					maxBytes = value;
+				} else {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -ttl or -max_bytes", option));
+					return TCL_ERROR;
+				}
+			}
+
+			md->cache_enabled = 1;
+			md->cache_ttl_ms = ttl;
+			md->cache_max_bytes = maxBytes;
+
+			while (md->cache_tail != NULL && md->cache_bytes > md->cache_max_bytes) {
+				mongotcl_cacheRemove (md, md->cache_tail);
+				md->cache_evictions++;
+			}
+			break;
+		}
+
+		case SUBOPT_OFF: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			md->cache_enabled = 0;
+			mongotcl_cacheInvalidate (md, NULL);
+			break;
+		}
+
+		case SUBOPT_INVALIDATE: {
+			if (objc != 3 && objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "?pattern?");
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewIntObj (mongotcl_cacheInvalidate (md, (objc == 4) ? Tcl_GetString (objv[3]) : NULL)));
+			break;
+		}
+
+		case SUBOPT_STATUS: {
+			Tcl_Obj *listObj = Tcl_NewObj ();
+
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("enabled", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewBooleanObj (md->cache_enabled));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("ttl", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->cache_ttl_ms));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("max_bytes", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->cache_max_bytes));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("bytes", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->cache_bytes));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("entries", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->cache.numEntries));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("hits", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (md->cache_hits));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("misses", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (md->cache_misses));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("evictions", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (md->cache_evictions));
+			Tcl_SetObjResult (interp, listObj);
+			break;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
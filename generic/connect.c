@@ -0,0 +1,958 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * connection setup - replica set seeds are connected to at once with
+ * non-blocking sockets and asked isMaster, and the first primary to
+ * answer wins, instead of the driver trying seeds one at a time;
+ * servers can also be reached through a unix domain socket, and
+ * socket options are applied to every connection made
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* addresses tried per host name, and connections in flight at once */
+#define MONGOTCL_MAX_HOST_ADDRS 4
+
+#define MONGOTCL_MAX_CONNECT_ATTEMPTS 64
+
+/* message header plus reply fields preceding the first document */
+#define MONGOTCL_REPLY_PREAMBLE 36
+
+typedef struct mongotcl_resolvedHost
+{
+	char host[256];
+	int port;
+	int nAddrs;
+	struct sockaddr_storage addrs[MONGOTCL_MAX_HOST_ADDRS];
+	socklen_t addrLens[MONGOTCL_MAX_HOST_ADDRS];
+	struct mongotcl_resolvedHost *next;
+} mongotcl_resolvedHost;
+
+enum mongotcl_attemptState {
+	ATTEMPT_CONNECTING,
+	ATTEMPT_READING,
+	ATTEMPT_CLOSED
+};
+
+typedef struct mongotcl_connectAttempt
+{
+	char host[256];
+	int port;
+	int fd;
+	enum mongotcl_attemptState state;
+	Tcl_WideInt deadline;
+	int requestId;
+	char lenBuf[4];
+	char *reply;
+	int have;
+	int len;
+} mongotcl_connectAttempt;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resolveHost --
+ *
+ *      Look up the addresses of host, consulting the cache first so
+ *      reconnects after a failover don't wait on DNS.
+ *
+ * Results:
+ *      The cache entry, or NULL if the name doesn't resolve.
+ *
+ *----------------------------------------------------------------------
+ */
+static mongotcl_resolvedHost *
+mongotcl_resolveHost (mongotcl_clientData *md, const char *host, int port) {
+	mongotcl_resolvedHost *rh;
+	struct addrinfo hints;
+	struct addrinfo *result;
+	struct addrinfo *ai;
+	char portString[16];
+
+	for (rh = md->resolved_hosts; rh != NULL; rh = rh->next) {
+		if (rh->port == port && strcmp (rh->host, host) == 0) {
+			return rh;
+		}
+	}
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf (portString, sizeof (portString), "%d", port);
+
+	if (getaddrinfo (host, portString, &hints, &result) != 0) {
+		return NULL;
+	}
+
+	rh = (mongotcl_resolvedHost *)ckalloc (sizeof (mongotcl_resolvedHost));
+	strncpy (rh->host, host, sizeof (rh->host) - 1);
+	rh->host[sizeof (rh->host) - 1] = '\0';
+	rh->port = port;
+	rh->nAddrs = 0;
+	for (ai = result; ai != NULL && rh->nAddrs < MONGOTCL_MAX_HOST_ADDRS; ai = ai->ai_next) {
+		memcpy (&rh->addrs[rh->nAddrs], ai->ai_addr, ai->ai_addrlen);
+		rh->addrLens[rh->nAddrs] = ai->ai_addrlen;
+		rh->nAddrs++;
+	}
+	freeaddrinfo (result);
+
+	rh->next = md->resolved_hosts;
+	md->resolved_hosts = rh;
+	return rh;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_connectFlushCache --
+ *
+ *      Forget every resolved address.  Done when no seed could be
+ *      reached, in case the addresses changed.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_connectFlushCache (mongotcl_clientData *md) {
+	mongotcl_resolvedHost *rh = md->resolved_hosts;
+
+	while (rh != NULL) {
+		mongotcl_resolvedHost *next = rh->next;
+
+		ckfree ((char *)rh);
+		rh = next;
+	}
+
+	md->resolved_hosts = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_attemptClose --
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_attemptClose (mongotcl_connectAttempt *a) {
+	if (a->fd >= 0) {
+		close (a->fd);
+		a->fd = -1;
+	}
+
+	if (a->reply != NULL) {
+		ckfree (a->reply);
+		a->reply = NULL;
+	}
+
+	a->state = ATTEMPT_CLOSED;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_attemptStart --
+ *
+ *      Begin a non-blocking connect to every address of host, unless
+ *      it has been tried already during this connect.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_attemptStart (mongotcl_clientData *md, mongotcl_connectAttempt *attempts, int *nAttemptsPtr, const char *host, int port, int timeout) {
+	mongotcl_resolvedHost *rh;
+	Tcl_WideInt deadline;
+	int i;
+
+	for (i = 0; i < *nAttemptsPtr; i++) {
+		if (attempts[i].port == port && strcmp (attempts[i].host, host) == 0) {
+			return;
+		}
+	}
+
+	if ((rh = mongotcl_resolveHost (md, host, port)) == NULL) {
+		return;
+	}
+
+	deadline = mongotcl_milliseconds () + timeout;
+
+	for (i = 0; i < rh->nAddrs && *nAttemptsPtr < MONGOTCL_MAX_CONNECT_ATTEMPTS; i++) {
+		mongotcl_connectAttempt *a = &attempts[(*nAttemptsPtr)++];
+		int fd;
+
+		strcpy (a->host, rh->host);
+		a->port = port;
+		a->fd = -1;
+		a->state = ATTEMPT_CLOSED;
+		a->reply = NULL;
+		a->have = 0;
+		a->len = 0;
+		a->deadline = deadline;
+
+		if ((fd = socket (rh->addrs[i].ss_family, SOCK_STREAM, 0)) < 0) {
+			continue;
+		}
+		a->fd = fd;
+
+		fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK);
+		if (connect (fd, (struct sockaddr *)&rh->addrs[i], rh->addrLens[i]) < 0 && errno != EINPROGRESS) {
+			mongotcl_attemptClose (a);
+			continue;
+		}
+
+		a->state = ATTEMPT_CONNECTING;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_attemptSendIsMaster --
+ *
+ *      Once connected, send isMaster.  The message is tiny, so a fresh
+ *      socket's send buffer always takes it whole.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_attemptSendIsMaster (mongotcl_connectAttempt *a) {
+	Tcl_DString msg;
+	bson command;
+	int err = 0;
+	socklen_t errLen = sizeof (err);
+	ssize_t sent;
+
+	if (getsockopt (a->fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err != 0) {
+		return MONGO_ERROR;
+	}
+
+	bson_init (&command);
+	bson_append_int (&command, "ismaster", 1);
+	bson_finish (&command);
+
+	Tcl_DStringInit (&msg);
+	a->requestId = mongotcl_wireBuildCommand (&msg, "admin", &command);
+	bson_destroy (&command);
+
+	sent = send (a->fd, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg), 0);
+	if (sent != Tcl_DStringLength (&msg)) {
+		Tcl_DStringFree (&msg);
+		return MONGO_ERROR;
+	}
+
+	Tcl_DStringFree (&msg);
+	a->state = ATTEMPT_READING;
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_attemptRead --
+ *
+ *      Read what has arrived of the isMaster reply.
+ *
+ * Results:
+ *      1 if the reply is complete, 0 if more is needed, -1 on error.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_attemptRead (mongotcl_connectAttempt *a) {
+	ssize_t got;
+
+	if (a->reply == NULL) {
+		if ((got = recv (a->fd, a->lenBuf + a->have, 4 - a->have, 0)) <= 0) {
+			return (got < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+		}
+
+		a->have += (int)got;
+		if (a->have < 4) {
+			return 0;
+		}
+
+		bson_little_endian32 (&a->len, a->lenBuf);
+		if (a->len < MONGOTCL_REPLY_PREAMBLE + 5 || a->len > 16 * 1024 * 1024) {
+			return -1;
+		}
+
+		a->reply = ckalloc (a->len);
+		memcpy (a->reply, a->lenBuf, 4);
+	}
+
+	if ((got = recv (a->fd, a->reply + a->have, a->len - a->have, 0)) <= 0) {
+		return (got < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+	}
+
+	a->have += (int)got;
+	return (a->have == a->len);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_attemptFollow --
+ *
+ *      Start attempts to a "host:port" a member told us about.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_attemptFollow (mongotcl_clientData *md, mongotcl_connectAttempt *attempts, int *nAttemptsPtr, const char *hostPort, int timeout) {
+	char host[256];
+	char *colon;
+	int port = MONGO_DEFAULT_PORT;
+
+	strncpy (host, hostPort, sizeof (host) - 1);
+	host[sizeof (host) - 1] = '\0';
+	if ((colon = strrchr (host, ':')) != NULL) {
+		*colon = '\0';
+		port = atoi (colon + 1);
+	}
+
+	mongotcl_attemptStart (md, attempts, nAttemptsPtr, host, port, timeout);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_attemptEvaluate --
+ *
+ *      Examine a complete isMaster reply.  A primary of the right set
+ *      wins; otherwise the primary and hosts it names are tried too.
+ *
+ * Results:
+ *      1 if this attempt is the primary, else 0 and it is closed.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_attemptEvaluate (mongotcl_clientData *md, mongotcl_connectAttempt *attempts, int *nAttemptsPtr, mongotcl_connectAttempt *a, int timeout, int *maxBsonSizePtr) {
+	const char *doc = a->reply + MONGOTCL_REPLY_PREAMBLE;
+	const char *setName = md->conn->replica_set->name;
+	bson_iterator it;
+	bson_iterator sub;
+	int responseTo;
+
+	bson_little_endian32 (&responseTo, a->reply + 8);
+	if (responseTo != a->requestId) {
+		goto reject;
+	}
+
+	if (setName != NULL && *setName != '\0') {
+		if (mongotcl_bsonFindRaw (&it, doc, "setName") != BSON_STRING || strcmp (bson_iterator_string (&it), setName) != 0) {
+			goto reject;
+		}
+	}
+
+	if (mongotcl_bsonFindRaw (&it, doc, "ismaster") == BSON_BOOL && bson_iterator_bool (&it)) {
+		*maxBsonSizePtr = MONGO_DEFAULT_MAX_BSON_SIZE;
+		if (mongotcl_bsonFindRaw (&it, doc, "maxBsonObjectSize") != BSON_EOO) {
+			*maxBsonSizePtr = bson_iterator_int (&it);
+		}
+		return 1;
+	}
+
+	if (mongotcl_bsonFindRaw (&it, doc, "primary") == BSON_STRING) {
+		mongotcl_attemptFollow (md, attempts, nAttemptsPtr, bson_iterator_string (&it), timeout);
+	}
+
+	if (mongotcl_bsonFindRaw (&it, doc, "hosts") == BSON_ARRAY) {
+		bson_iterator_subiterator (&it, &sub);
+		while (bson_iterator_next (&sub)) {
+			if (bson_iterator_type (&sub) == BSON_STRING) {
+				mongotcl_attemptFollow (md, attempts, nAttemptsPtr, bson_iterator_string (&sub), timeout);
+			}
+		}
+	}
+
+  reject:
+	mongotcl_attemptClose (a);
+	return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_attemptAdopt --
+ *
+ *      Hand the winning socket to the driver as the connection to the
+ *      primary, set up the way mongo_replica_set_client leaves it.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_attemptAdopt (mongotcl_clientData *md, mongotcl_connectAttempt *a, int maxBsonSize) {
+	mongo *conn = md->conn;
+	int one = 1;
+
+	fcntl (a->fd, F_SETFL, fcntl (a->fd, F_GETFL, 0) & ~O_NONBLOCK);
+	setsockopt (a->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof (one));
+
+	conn->sock = a->fd;
+	conn->connected = 1;
+	conn->max_bson_size = maxBsonSize;
+	conn->replica_set->primary_connected = 1;
+	conn->err = MONGO_CONN_SUCCESS;
+	conn->errstr[0] = '\0';
+
+	if (conn->primary == NULL) {
+		conn->primary = (mongo_host_port *)bson_malloc (sizeof (mongo_host_port));
+	}
+	strncpy (conn->primary->host, a->host, sizeof (conn->primary->host) - 1);
+	conn->primary->host[sizeof (conn->primary->host) - 1] = '\0';
+	conn->primary->port = a->port;
+	conn->primary->next = NULL;
+
+	if (conn->op_timeout_ms > 0) {
+		mongo_set_op_timeout (conn, conn->op_timeout_ms);
+	}
+
+	/* the socket now belongs to the driver */
+	a->fd = -1;
+	mongotcl_attemptClose (a);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_replicaSetConnect --
+ *
+ *      Connect to the primary of the replica set configured with
+ *      replica_set_init and replica_set_add_seed.  All seeds are
+ *      connected to concurrently, each attempt abandoned after
+ *      md->connect_timeout_ms, and members the seeds point to are
+ *      tried as they are learned of.  The first primary wins.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_replicaSetConnect (mongotcl_clientData *md) {
+	mongo *conn = md->conn;
+	mongotcl_connectAttempt attempts[MONGOTCL_MAX_CONNECT_ATTEMPTS];
+	int nAttempts = 0;
+	int winner = -1;
+	int maxBsonSize = MONGO_DEFAULT_MAX_BSON_SIZE;
+	mongo_host_port *seed;
+	int i;
+
+	if (conn->replica_set == NULL) {
+		conn->err = MONGO_CONN_NO_PRIMARY;
+		strcpy (conn->errstr, "replica_set_init has not been called");
+		return MONGO_ERROR;
+	}
+
+	mongo_disconnect (conn);
+
+	for (seed = conn->replica_set->seeds; seed != NULL; seed = seed->next) {
+		mongotcl_attemptStart (md, attempts, &nAttempts, seed->host, seed->port, md->connect_timeout_ms);
+	}
+
+	while (winner < 0) {
+		struct pollfd fds[MONGOTCL_MAX_CONNECT_ATTEMPTS];
+		int which[MONGOTCL_MAX_CONNECT_ATTEMPTS];
+		int nfds = 0;
+		int wait = -1;
+		Tcl_WideInt now = mongotcl_milliseconds ();
+
+		for (i = 0; i < nAttempts; i++) {
+			mongotcl_connectAttempt *a = &attempts[i];
+
+			if (a->state == ATTEMPT_CLOSED) {
+				continue;
+			}
+
+			if (now >= a->deadline) {
+				mongotcl_attemptClose (a);
+				continue;
+			}
+
+			fds[nfds].fd = a->fd;
+			fds[nfds].events = (a->state == ATTEMPT_CONNECTING) ? POLLOUT : POLLIN;
+			fds[nfds].revents = 0;
+			which[nfds++] = i;
+
+			if (wait < 0 || a->deadline - now < wait) {
+				wait = (int)(a->deadline - now);
+			}
+		}
+
+		if (nfds == 0) {
+			break;
+		}
+
+		if (poll (fds, nfds, wait) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (i = 0; i < nfds && winner < 0; i++) {
+			mongotcl_connectAttempt *a = &attempts[which[i]];
+
+			if (fds[i].revents == 0) {
+				continue;
+			}
+
+			if (a->state == ATTEMPT_CONNECTING) {
+				if (mongotcl_attemptSendIsMaster (a) != MONGO_OK) {
+					mongotcl_attemptClose (a);
+				}
+				continue;
+			}
+
+			switch (mongotcl_attemptRead (a)) {
+				case 1: {
+					if (mongotcl_attemptEvaluate (md, attempts, &nAttempts, a, md->connect_timeout_ms, &maxBsonSize)) {
+						winner = which[i];
+					}
+					break;
+				}
+
+				case -1: {
+					mongotcl_attemptClose (a);
+					break;
+				}
+			}
+		}
+	}
+
+	if (winner >= 0) {
+		mongotcl_attemptAdopt (md, &attempts[winner], maxBsonSize);
+	}
+
+	for (i = 0; i < nAttempts; i++) {
+		mongotcl_attemptClose (&attempts[i]);
+	}
+
+	if (winner < 0) {
+		mongotcl_connectFlushCache (md);
+		conn->err = MONGO_CONN_NO_PRIMARY;
+		strcpy (conn->errstr, "no primary found among replica set members");
+		return MONGO_ERROR;
+	}
+
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_unixOpen --
+ *
+ *      Connect to a server listening on a unix domain socket, which the
+ *      driver can't do, and hand the socket to the driver.  Like
+ *      mongo_client, the server must be a primary.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_unixOpen (mongo *conn, const char *path) {
+	struct sockaddr_un addr;
+	bson out;
+	bson_iterator it;
+	int isMaster;
+	int fd;
+
+	mongo_disconnect (conn);
+
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		conn->err = MONGO_CONN_ADDR_FAIL;
+		strcpy (conn->errstr, "unix socket path too long");
+		return MONGO_ERROR;
+	}
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		conn->err = MONGO_CONN_NO_SOCKET;
+		strncpy (conn->errstr, strerror (errno), MONGO_ERR_LEN - 1);
+		conn->errstr[MONGO_ERR_LEN - 1] = '\0';
+		return MONGO_ERROR;
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+
+	if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+		conn->err = MONGO_CONN_FAIL;
+		strncpy (conn->errstr, strerror (errno), MONGO_ERR_LEN - 1);
+		conn->errstr[MONGO_ERR_LEN - 1] = '\0';
+		close (fd);
+		return MONGO_ERROR;
+	}
+
+	conn->sock = fd;
+	conn->connected = 1;
+	conn->err = MONGO_CONN_SUCCESS;
+	conn->errstr[0] = '\0';
+
+	if (conn->primary == NULL) {
+		conn->primary = (mongo_host_port *)bson_malloc (sizeof (mongo_host_port));
+	}
+	strncpy (conn->primary->host, path, sizeof (conn->primary->host) - 1);
+	conn->primary->host[sizeof (conn->primary->host) - 1] = '\0';
+	conn->primary->port = 0;
+	conn->primary->next = NULL;
+
+	if (conn->op_timeout_ms > 0) {
+		mongo_set_op_timeout (conn, conn->op_timeout_ms);
+	}
+
+	if (mongo_simple_int_command (conn, "admin", "ismaster", 1, &out) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	isMaster = (bson_find (&it, &out, "ismaster") == BSON_BOOL && bson_iterator_bool (&it));
+	conn->max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
+	if (bson_find (&it, &out, "maxBsonObjectSize") != BSON_EOO) {
+		conn->max_bson_size = bson_iterator_int (&it);
+	}
+	bson_destroy (&out);
+
+	if (!isMaster) {
+		conn->err = MONGO_CONN_NOT_MASTER;
+		strcpy (conn->errstr, "server is not the primary");
+		return MONGO_ERROR;
+	}
+
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_unixConnect --
+ *
+ *      Connect the object to a server listening on a unix domain socket.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_unixConnect (mongotcl_clientData *md, const char *path) {
+	return mongotcl_unixOpen (md->conn, path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_connectSide --
+ *
+ *      Open a connection of its own to the server the object is
+ *      connected to, for traffic that mustn't hold up the object's
+ *      connection, with the same socket options.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the error set on conn, which the
+ *      caller must mongo_destroy either way.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_connectSide (mongotcl_clientData *md, mongo *conn) {
+	mongo_host_port *primary = md->conn->primary;
+	int status;
+
+	mongo_init (conn);
+
+	if (primary == NULL) {
+		conn->err = MONGO_CONN_FAIL;
+		strcpy (conn->errstr, "not connected");
+		return MONGO_ERROR;
+	}
+
+	if (primary->host[0] == '/') {
+		status = mongotcl_unixOpen (conn, primary->host);
+	} else {
+		status = mongo_client (conn, primary->host, primary->port);
+	}
+
+	if (status == MONGO_OK) {
+		mongotcl_applySocketOptions (md, conn);
+	}
+	return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_applySocketOptions --
+ *
+ *      Set the socket options chosen with "$mongo configure" on a
+ *      connection's socket.  Options never configured are left at the
+ *      system defaults.  TCP options are skipped on unix sockets.
+ *
+ * Results:
+ *      0 on success, else the errno of the first failure.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_applySocketOptions (mongotcl_clientData *md, mongo *conn) {
+	struct sockaddr_storage addr;
+	socklen_t addrLen = sizeof (addr);
+	int isTcp = 1;
+
+	if (!conn->connected) {
+		return 0;
+	}
+
+	if (getsockname (conn->sock, (struct sockaddr *)&addr, &addrLen) == 0 && addr.ss_family == AF_UNIX) {
+		isTcp = 0;
+	}
+
+	if (isTcp && md->sock_nodelay >= 0 && setsockopt (conn->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&md->sock_nodelay, sizeof (int)) < 0) {
+		return errno;
+	}
+
+	if (isTcp && md->sock_keepalive >= 0 && setsockopt (conn->sock, SOL_SOCKET, SO_KEEPALIVE, (char *)&md->sock_keepalive, sizeof (int)) < 0) {
+		return errno;
+	}
+
+	if (md->sock_sndbuf > 0 && setsockopt (conn->sock, SOL_SOCKET, SO_SNDBUF, (char *)&md->sock_sndbuf, sizeof (int)) < 0) {
+		return errno;
+	}
+
+	if (md->sock_rcvbuf > 0 && setsockopt (conn->sock, SOL_SOCKET, SO_RCVBUF, (char *)&md->sock_rcvbuf, sizeof (int)) < 0) {
+		return errno;
+	}
+
+	return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_reconnect --
+ *
+ *      Reestablish the object's connection: in parallel for a replica
+ *      set, by path for a unix socket, through the driver otherwise.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_reconnect (mongotcl_clientData *md) {
+	mongo *conn = md->conn;
+	int status;
+
+	mongotcl_resetConnectionState (md);
+
+	if (conn->replica_set != NULL) {
+		status = mongotcl_replicaSetConnect (md);
+	} else if (conn->primary != NULL && conn->primary->host[0] == '/') {
+		char path[sizeof (conn->primary->host)];
+
+		strcpy (path, conn->primary->host);
+		status = mongotcl_unixConnect (md, path);
+	} else {
+		status = mongo_reconnect (conn);
+	}
+
+	if (status == MONGO_OK) {
+		mongotcl_applySocketOptions (md, conn);
+	}
+	return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_configureObjCmd --
+ *
+ *      Implements "$mongo configure ?-nodelay bool? ?-sndbuf bytes?
+ *      ?-rcvbuf bytes? ?-keepalive bool? ?-coalesce bool?".  With no
+ *      options, returns the socket's current settings.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_configureObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	int i;
+	int err;
+
+    static CONST char *configOptions[] = {
+        "-nodelay",
+        "-sndbuf",
+        "-rcvbuf",
+        "-keepalive",
+        "-coalesce",
+        NULL
+    };
+
+    enum configOptions {
+        CONFIG_NODELAY,
+        CONFIG_SNDBUF,
+        CONFIG_RCVBUF,
+        CONFIG_KEEPALIVE,
+        CONFIG_COALESCE
+    };
+
+	if (objc == 2) {
+		Tcl_Obj *listObj = Tcl_NewObj ();
+
+		for (i = 0; configOptions[i] != NULL; i++) {
+			int value = -1;
+			socklen_t valueLen = sizeof (value);
+
+			switch ((enum configOptions) i) {
+				case CONFIG_NODELAY: {
+					value = md->sock_nodelay;
+					if (md->conn->connected) {
+						getsockopt (md->conn->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&value, &valueLen);
+					}
+					value = (value > 0);
+					break;
+				}
+
+				case CONFIG_SNDBUF: {
+					value = md->sock_sndbuf;
+					if (md->conn->connected) {
+						getsockopt (md->conn->sock, SOL_SOCKET, SO_SNDBUF, (char *)&value, &valueLen);
+					}
+					break;
+				}
+
+				case CONFIG_RCVBUF: {
+					value = md->sock_rcvbuf;
+					if (md->conn->connected) {
+						getsockopt (md->conn->sock, SOL_SOCKET, SO_RCVBUF, (char *)&value, &valueLen);
+					}
+					break;
+				}
+
+				case CONFIG_KEEPALIVE: {
+					value = md->sock_keepalive;
+					if (md->conn->connected) {
+						getsockopt (md->conn->sock, SOL_SOCKET, SO_KEEPALIVE, (char *)&value, &valueLen);
+					}
+					value = (value > 0);
+					break;
+				}
+
+				case CONFIG_COALESCE: {
+					value = md->coalesce;
+					break;
+				}
+			}
+
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (configOptions[i], -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (value));
+		}
+
+		Tcl_SetObjResult (interp, listObj);
+		return TCL_OK;
+	}
+
+	if ((objc - 2) % 2 != 0) {
+		Tcl_WrongNumArgs (interp, 2, objv, "?-nodelay bool? ?-sndbuf bytes? ?-rcvbuf bytes? ?-keepalive bool? ?-coalesce bool?");
+		return TCL_ERROR;
+	}
+
+	for (i = 2; i < objc; i += 2) {
+		int optIndex;
+		int value;
+
+		if (Tcl_GetIndexFromObj (interp, objv[i], configOptions, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum configOptions) optIndex) {
+			case CONFIG_NODELAY:
+			case CONFIG_KEEPALIVE: {
+				if (Tcl_GetBooleanFromObj (interp, objv[i + 1], &value) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				if (optIndex == CONFIG_NODELAY) {
+					md->sock_nodelay = value;
+				} else {
+					md->sock_keepalive = value;
+				}
+				break;
+			}
+
+			case CONFIG_COALESCE: {
+				if (Tcl_GetBooleanFromObj (interp, objv[i + 1], &value) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				/* writes queued when the process exits still go out */
+				if (value && !md->coalesce) {
+					Tcl_CreateExitHandler (mongotcl_flushExitProc, (ClientData)md);
+				} else if (!value && md->coalesce) {
+					Tcl_DeleteExitHandler (mongotcl_flushExitProc, (ClientData)md);
+					if (mongotcl_flushWrites (md) != MONGO_OK) {
+						md->coalesce = 0;
+						return mongotcl_setMongoError (interp, md->conn);
+					}
+				}
+				md->coalesce = value;
+				break;
+			}
+
+			case CONFIG_SNDBUF:
+			case CONFIG_RCVBUF: {
+				if (Tcl_GetIntFromObj (interp, objv[i + 1], &value) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				if (value <= 0) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s must be positive", configOptions[optIndex]));
+					return TCL_ERROR;
+				}
+
+				if (optIndex == CONFIG_SNDBUF) {
+					md->sock_sndbuf = value;
+				} else {
+					md->sock_rcvbuf = value;
+				}
+				break;
+			}
+		}
+	}
+
+	if ((err = mongotcl_applySocketOptions (md, md->conn)) != 0) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("error setting socket options: %s", strerror (err)));
+		return TCL_ERROR;
+	}
+
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -10,6 +10,47 @@
 #include <assert.h>
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorRelease --
+ *
+ *      Let go of the cursor's query: collect any batch read ahead for
+ *      it, have its server cursor killed if it is still open, and free
+ *      its reply.  The cursor structure must be readied again with
+ *      mongotcl_cursorReuse before it is used.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cursorRelease (mongotcl_cursorClientData *mc) {
+	mongo_cursor *cursor = mc->cursor;
+
+	if (mc->md != NULL && mc->prefetch_request != 0) {
+		mongotcl_cursorSettle (mc->md, mc->conn);
+	}
+
+	/* a batch read ahead but never used carries the latest cursor ID */
+	if (mc->prefetch_reply != NULL) {
+		mongotcl_cursorInstallReply (cursor, mc->conn, mc->prefetch_reply);
+		mc->prefetch_reply = NULL;
+	}
+	mc->prefetch_failed = 0;
+
+	/* killed with others in one message rather than by the driver */
+	if (cursor->reply != NULL && cursor->reply->fields.cursorID != 0) {
+		if (mc->md != NULL) {
+			mongotcl_cursorKill (mc->md, cursor->conn, cursor->reply->fields.cursorID);
+		}
+		cursor->reply->fields.cursorID = 0;
+	}
+
+	bson_free (cursor->reply);
+	cursor->reply = NULL;
+	cursor->current.data = NULL;
+}
+
+
 /*
  *--------------------------------------------------------------
  *
@@ -31,18 +72,42 @@ mongotcl_cursorObjectDelete (ClientData clientData)
 
     assert (mc->cursor_magic == MONGOTCL_CURSOR_MAGIC);
 
-    mongo_cursor_destroy(mc->cursor);
+	mongotcl_listenStop (mc);
+	mongotcl_cacheAbandon (mc);
+	mongotcl_cursorRelease (mc);
+
+	/* drop this cursor from the object's list of those reading ahead */
+	if (mc->md != NULL && mc->prefetch) {
+		mongotcl_cursorClientData **link;
+
+		for (link = &mc->md->prefetch_cursors; *link != NULL; link = &(*link)->prefetch_next) {
+			if (*link == mc) {
+				*link = mc->prefetch_next;
+				break;
+			}
+		}
+	}
+	mongotcl_cursorUntrack (mc);
+	mongotcl_resumeCleanup (mc);
+	mongotcl_cursorFree (mc->md, mc->cursor);
+
+	if (mc->queryBson != NULL) {
+		bson_destroy (mc->queryBson);
+		ckfree ((char *)mc->queryBson);
+	}
 
 	if (mc->fieldsBson != NULL) {
 		bson_destroy (mc->fieldsBson);
 		ckfree ((char *)mc->fieldsBson);
 	}
 
-    ckfree((char *)mc->cursor);
-    ckfree((char *)clientData);
+	mc->cursor = NULL;
+
+	/* a listener callback may be deleting the cursor under its own feet */
+    Tcl_EventuallyFree(clientData, TCL_DYNAMIC);
 }
 
-
+
 /*
  *--------------------------------------------------------------
  *
@@ -189,6 +254,596 @@ mongotcl_tcllist_to_cursor_fields (Tcl_Interp *interp, Tcl_Obj *fieldList, mongo
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorInstallReply --
+ *
+ *      Make a reply we read ourselves the cursor's current batch, as if
+ *      the driver had sent the query or getMore on conn itself.  The
+ *      cursor takes ownership of the reply.
+ *
+ * Results:
+ *      MONGO_OK, or MONGO_ERROR with the cursor error set if the server
+ *      reported the query failed.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_cursorInstallReply (mongo_cursor *cursor, mongo *conn, mongo_reply *reply) {
+	if (cursor->reply != NULL) {
+		bson_free (cursor->reply);
+	}
+
+	cursor->conn = conn;
+	cursor->reply = reply;
+	cursor->flags |= MONGO_CURSOR_QUERY_SENT;
+	cursor->current.data = NULL;
+
+	/* CursorNotFound */
+	if (reply->fields.flag & 0x01) {
+		cursor->err = MONGO_CURSOR_INVALID;
+		return MONGO_ERROR;
+	}
+
+	/* QueryFailure */
+	if (reply->fields.flag & 0x02) {
+		cursor->err = MONGO_CURSOR_QUERY_FAIL;
+		return MONGO_ERROR;
+	}
+
+	cursor->seen += reply->fields.num;
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorFetchesBatches --
+ *
+ *      Return 1 if we send the cursor's query and getMores ourselves
+ *      rather than leaving them to the driver, which always asks for
+ *      its whole limit and can't read ahead.  Resumable cursors are ours
+ *      too, as the driver frees a cursor whose getMore fails.  Exhaust
+ *      cursors and those with a negative (single batch) limit stay with
+ *      the driver.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_cursorFetchesBatches (mongotcl_cursorClientData *mc) {
+	return (mc->batch_size > 0 || mc->prefetch || mc->resume_field != NULL) && mc->cursor->limit >= 0 && !(mc->cursor->options & MONGO_EXHAUST);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorBatchCount --
+ *
+ *      Work out how many documents to ask for in the cursor's next
+ *      batch: its batch size, capped at what is left of its limit.
+ *
+ * Results:
+ *      The count, 0 to leave it to the server, or -1 if the limit has
+ *      already been reached.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_cursorBatchCount (mongotcl_cursorClientData *mc) {
+	mongo_cursor *cursor = mc->cursor;
+	int n = mc->batch_size;
+
+	if (cursor->limit > 0) {
+		int remaining = cursor->limit - cursor->seen;
+
+		if (remaining <= 0) {
+			return -1;
+		}
+
+		if (n == 0 || n > remaining) {
+			n = remaining;
+		}
+	}
+
+	return n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorBatchDone --
+ *
+ *      Return 1 if the cursor has returned every document of its
+ *      current batch, so the next one would have to be fetched.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_cursorBatchDone (mongo_cursor *cursor) {
+	mongo_reply *reply = cursor->reply;
+
+	if (reply == NULL) {
+		return 0;
+	}
+
+	if (cursor->current.data == NULL) {
+		return reply->fields.num == 0;
+	}
+
+	return cursor->current.data + bson_size (&cursor->current) >= (char *)reply + reply->head.len;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorPrefetch --
+ *
+ *      If the cursor reads ahead, send the getMore for its next batch
+ *      now so the server is producing it while the script works through
+ *      the current one.  The reply is collected by mongotcl_cursorSettle.
+ *
+ *      Tailable cursors don't read ahead, since an await_data getMore
+ *      can sit on the connection until the server's wait runs out.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_cursorPrefetch (mongotcl_cursorClientData *mc) {
+	mongo_cursor *cursor = mc->cursor;
+	Tcl_DString msg;
+	int requestId;
+	int n;
+
+	if (!mc->prefetch || mc->md == NULL || mc->prefetch_request != 0 || mc->prefetch_reply != NULL) {
+		return;
+	}
+
+	if (cursor->reply == NULL || cursor->reply->fields.cursorID == 0 || (cursor->options & MONGO_TAILABLE)) {
+		return;
+	}
+
+	if ((n = mongotcl_cursorBatchCount (mc)) < 0) {
+		return;
+	}
+
+	Tcl_DStringInit (&msg);
+	requestId = mongotcl_wireBuildGetMore (&msg, cursor->ns, n, cursor->reply->fields.cursorID);
+	if (mongotcl_wireSend (mc->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg)) == MONGO_OK) {
+		mc->prefetch_request = requestId;
+	}
+	Tcl_DStringFree (&msg);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorSettle --
+ *
+ *      Read the replies to every getMore read ahead on a connection and
+ *      hold each for its cursor, so the next reply read from it is the
+ *      right one.  Must be called before anything else reads from a
+ *      connection a cursor may be reading ahead on.
+ *
+ * Results:
+ *      MONGO_OK, or MONGO_ERROR if the connection failed, in which case
+ *      the cursors waiting on it fail on their next batch.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_cursorSettle (mongotcl_clientData *md, mongo *conn) {
+	mongotcl_cursorClientData *mc;
+
+	for (;;) {
+		mongo_reply *reply;
+
+		for (mc = md->prefetch_cursors; mc != NULL; mc = mc->prefetch_next) {
+			if (mc->conn == conn && mc->prefetch_request != 0) {
+				break;
+			}
+		}
+
+		if (mc == NULL) {
+			return MONGO_OK;
+		}
+
+		if (mongotcl_wireReadReply (conn, &reply) != MONGO_OK) {
+			mongotcl_cursorPrefetchReset (md, conn);
+			return MONGO_ERROR;
+		}
+
+		for (mc = md->prefetch_cursors; mc != NULL; mc = mc->prefetch_next) {
+			if (mc->conn == conn && mc->prefetch_request == reply->head.responseTo) {
+				break;
+			}
+		}
+
+		if (mc == NULL) {
+			bson_free (reply);
+			continue;
+		}
+
+		mc->prefetch_request = 0;
+		mc->prefetch_reply = reply;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorPrefetchReset --
+ *
+ *      The connection has been closed or replaced, so the replies to
+ *      getMores read ahead on it will never come.  Fail the cursors
+ *      waiting on them.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cursorPrefetchReset (mongotcl_clientData *md, mongo *conn) {
+	mongotcl_cursorClientData *mc;
+
+	for (mc = md->prefetch_cursors; mc != NULL; mc = mc->prefetch_next) {
+		if (mc->conn == conn && mc->prefetch_request != 0) {
+			mc->prefetch_request = 0;
+			mc->prefetch_failed = 1;
+		}
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorPrefetchForget --
+ *
+ *      The mongo object is going away; detach the cursors reading ahead
+ *      on it so they don't touch it when they are deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cursorPrefetchForget (mongotcl_clientData *md) {
+	mongotcl_cursorClientData *mc;
+	mongotcl_cursorClientData *next;
+
+	for (mc = md->prefetch_cursors; mc != NULL; mc = next) {
+		next = mc->prefetch_next;
+		mc->md = NULL;
+		mc->prefetch_next = NULL;
+		if (mc->prefetch_request != 0) {
+			mc->prefetch_request = 0;
+			mc->prefetch_failed = 1;
+		}
+	}
+	md->prefetch_cursors = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorSendQuery --
+ *
+ *      Send a cursor's query on conn asking for its first batch only,
+ *      and install the reply.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_cursorSendQuery (Tcl_Interp *interp, mongotcl_cursorClientData *mc, mongo *conn) {
+	mongo_cursor *cursor = mc->cursor;
+	const bson *query = cursor->query;
+	bson empty;
+	Tcl_DString msg;
+	mongo_reply *reply;
+	int status;
+
+	if (query == NULL) {
+		query = bson_empty (&empty);
+	}
+
+	Tcl_DStringInit (&msg);
+	mongotcl_wireBuildQuery (&msg, cursor->ns, cursor->options, cursor->skip, mongotcl_cursorBatchCount (mc), query, cursor->fields);
+	status = mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+	Tcl_DStringFree (&msg);
+
+	if (status != MONGO_OK || mongotcl_wireReadReply (conn, &reply) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, conn);
+	}
+
+	if (mongotcl_cursorInstallReply (cursor, conn, reply) != MONGO_OK) {
+		return mongotcl_setCursorError (interp, cursor);
+	}
+
+	mongotcl_cursorPrefetch (mc);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorNextBatch --
+ *
+ *      The cursor's current batch is used up; install the next one,
+ *      either the one read ahead or one fetched now with our batch
+ *      size.  If there is nothing left to fetch the cursor is left as
+ *      it is for the driver to report it exhausted.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_cursorNextBatch (Tcl_Interp *interp, mongotcl_cursorClientData *mc) {
+	mongo_cursor *cursor = mc->cursor;
+	mongo_reply *reply;
+
+	if (mc->prefetch_request != 0) {
+		mongotcl_cursorSettle (mc->md, mc->conn);
+	}
+
+	if (mc->prefetch_failed) {
+		mc->prefetch_failed = 0;
+		cursor->err = MONGO_CURSOR_INVALID;
+		return mongotcl_setCursorError (interp, cursor);
+	}
+
+	if (mc->prefetch_reply != NULL) {
+		reply = mc->prefetch_reply;
+		mc->prefetch_reply = NULL;
+	} else {
+		Tcl_DString msg;
+		int status;
+		int n;
+
+		if (cursor->reply->fields.cursorID == 0 || (n = mongotcl_cursorBatchCount (mc)) < 0) {
+			return TCL_OK;
+		}
+
+		Tcl_DStringInit (&msg);
+		mongotcl_wireBuildGetMore (&msg, cursor->ns, n, cursor->reply->fields.cursorID);
+		status = mongotcl_wireSend (mc->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+		Tcl_DStringFree (&msg);
+
+		if (status != MONGO_OK || mongotcl_wireReadReply (mc->conn, &reply) != MONGO_OK) {
+			return mongotcl_setMongoError (interp, mc->conn);
+		}
+	}
+
+	if (mongotcl_cursorInstallReply (cursor, mc->conn, reply) != MONGO_OK) {
+		return mongotcl_setCursorError (interp, cursor);
+	}
+
+	mongotcl_cursorPrefetch (mc);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorHedgedQuery --
+ *
+ *      Send a cursor's query as a hedged read and install the first
+ *      reply to arrive as its first batch.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_cursorHedgedQuery (Tcl_Interp *interp, mongotcl_cursorClientData *mc) {
+	mongo_cursor *cursor = mc->cursor;
+	const bson *query = cursor->query;
+	bson empty;
+	mongo *conn;
+	mongo_reply *reply;
+
+	if (query == NULL) {
+		query = bson_empty (&empty);
+	}
+
+	if (mongotcl_hedgedQuery (interp, mc->md, cursor->ns, cursor->options, cursor->skip, mongotcl_cursorFetchesBatches (mc) ? mongotcl_cursorBatchCount (mc) : cursor->limit, query, cursor->fields, &conn, &reply) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	mc->conn = conn;
+	cursor->options |= MONGO_SLAVE_OK;
+	if (mongotcl_cursorInstallReply (cursor, conn, reply) != MONGO_OK) {
+		return mongotcl_setCursorError (interp, cursor);
+	}
+
+	if (mongotcl_cursorFetchesBatches (mc)) {
+		mongotcl_cursorPrefetch (mc);
+	}
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorExplain --
+ *
+ *      Ask the server how it would run the cursor's query, with its
+ *      skip, limit and fields, without disturbing the cursor.  The query
+ *      goes where the cursor's own would, by read preference.
+ *
+ * Results:
+ *      A standard Tcl result; the explain document, as a list, is left
+ *      in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_cursorExplain (Tcl_Interp *interp, mongotcl_cursorClientData *mc) {
+	mongo_cursor *cursor = mc->cursor;
+	int options = cursor->options & ~(MONGO_TAILABLE | MONGO_AWAIT_DATA | MONGO_EXHAUST);
+	bson_iterator it;
+	bson empty;
+	bson query;
+	Tcl_DString msg;
+	mongo_reply *reply;
+	mongo *conn;
+	int status;
+
+	if (mc->md->pipeline_pending > 0 && mongotcl_pipelineDrain (mc->md) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, mc->md->conn);
+	}
+
+	if (mongotcl_flushWrites (mc->md) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, mc->md->conn);
+	}
+
+	if (mongotcl_selectReadConnection (interp, mc->md, &conn, &options) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	bson_init (&query);
+	if (cursor->query != NULL && bson_find (&it, cursor->query, "$query") != BSON_EOO) {
+		bson_iterator_init (&it, cursor->query);
+		while (bson_iterator_next (&it)) {
+			bson_append_element (&query, NULL, &it);
+		}
+	} else {
+		bson_append_bson (&query, "$query", (cursor->query != NULL) ? cursor->query : bson_empty (&empty));
+	}
+	bson_append_bool (&query, "$explain", 1);
+	bson_finish (&query);
+
+	Tcl_DStringInit (&msg);
+	mongotcl_wireBuildQuery (&msg, cursor->ns, options, cursor->skip, -abs (cursor->limit), &query, cursor->fields);
+	status = mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+	Tcl_DStringFree (&msg);
+	bson_destroy (&query);
+
+	if (status != MONGO_OK || mongotcl_wireReadReply (conn, &reply) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, conn);
+	}
+
+	if ((reply->fields.flag & 0x03) || reply->fields.num == 0) {
+		const char *message = "query failed";
+
+		if ((reply->fields.flag & 0x02) && reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, &reply->objs, "$err") == BSON_STRING) {
+			message = bson_iterator_string (&it);
+		}
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (message, -1));
+		Tcl_SetErrorCode (interp, "MONGO", "CURSOR_QUERY_FAIL", NULL);
+		bson_free (reply);
+		return TCL_ERROR;
+	}
+
+	Tcl_SetObjResult (interp, mongotcl_bsontolist_raw (interp, Tcl_NewObj (), &reply->objs, 0));
+	bson_free (reply);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorNext --
+ *
+ *      Move the cursor on to its next document, sending its query or
+ *      fetching another batch as needed.
+ *
+ * Results:
+ *      A standard Tcl result; a boolean in interp, 0 if the cursor is
+ *      exhausted.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_cursorNext (Tcl_Interp *interp, mongotcl_cursorClientData *mc) {
+	if (mc->md->pipeline_pending > 0 && mongotcl_pipelineDrain (mc->md) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, mc->conn);
+	}
+
+	if (mongotcl_flushWrites (mc->md) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, mc->md->conn);
+	}
+
+	/* the query hasn't gone out yet, so route it by read preference */
+	if (mc->cursor->reply == NULL && !(mc->cursor->flags & MONGO_CURSOR_QUERY_SENT)) {
+		mongo *conn;
+		int options = mc->cursor->options;
+
+		if (mongotcl_cacheFetch (mc)) {
+			/* answered from the query cache */
+		} else if (mongotcl_hedgeApplies (mc->md)) {
+			if (mongotcl_cursorHedgedQuery (interp, mc) == TCL_ERROR) {
+				mongotcl_cacheAbandon (mc);
+				return TCL_ERROR;
+			}
+		} else {
+			if (mongotcl_selectReadConnection (interp, mc->md, &conn, &options) == TCL_ERROR) {
+				mongotcl_cacheAbandon (mc);
+				return TCL_ERROR;
+			}
+			mc->conn = conn;
+			mc->cursor->conn = conn;
+			mc->cursor->options = options;
+
+			if (mongotcl_cursorFetchesBatches (mc) && mongotcl_cursorSendQuery (interp, mc, conn) == TCL_ERROR) {
+				mongotcl_cacheAbandon (mc);
+				return TCL_ERROR;
+			}
+		}
+	} else {
+		mongotcl_drainConnection (mc->md, mc->conn);
+
+		if ((mongotcl_cursorFetchesBatches (mc) || mc->prefetch_reply != NULL || mc->prefetch_failed) && mongotcl_cursorBatchDone (mc->cursor) && mongotcl_cursorNextBatch (interp, mc) == TCL_ERROR) {
+			mongotcl_cacheAbandon (mc);
+			return TCL_ERROR;
+		}
+	}
+
+	if (mongo_cursor_next (mc->cursor) == MONGO_OK) {
+		mc->docs_read++;
+		if (mc->resume_field != NULL) {
+			mongotcl_resumeRemember (mc);
+		}
+		if (mc->cache_key != NULL) {
+			mongotcl_cacheRecord (mc);
+		}
+		Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
+	} else {
+		if (mc->cursor->err == MONGO_CURSOR_EXHAUSTED) {
+			/* the results are complete, so they can be cached */
+			if (mc->cache_key != NULL) {
+				mongotcl_cacheStore (mc);
+			}
+			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (0));
+		} else {
+			bson_iterator it;
+
+			mongotcl_cacheAbandon (mc);
+
+			/* keep the server's error code, such as ExceededTimeLimit */
+			if (mc->cursor->err == MONGO_CURSOR_QUERY_FAIL && mc->cursor->reply != NULL && mc->cursor->reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, &mc->cursor->reply->objs, "code") != BSON_EOO) {
+				mc->conn->lasterrcode = bson_iterator_int (&it);
+			}
+			return mongotcl_setCursorError (interp, mc->cursor);
+		}
+	}
+	return TCL_OK;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -212,12 +867,18 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 		"to_list",
 		"to_array",
         "init",
+		"rewind",
         "set_query",
         "set_fields",
         "set_skip",
         "set_limit",
 		"set_options",
+		"set_batch_size",
+		"set_prefetch",
+		"set_resumable",
+		"listen",
 		"data",
+		"explain",
 		"delete",
         NULL
     };
@@ -227,12 +888,18 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 		OPT_CURSOR_TO_LIST,
 		OPT_CURSOR_TO_ARRAY,
         OPT_CURSOR_INIT,
+		OPT_CURSOR_REWIND,
         OPT_CURSOR_SET_QUERY,
         OPT_CURSOR_SET_FIELDS,
         OPT_CURSOR_SET_SKIP,
         OPT_CURSOR_SET_LIMIT,
         OPT_CURSOR_SET_OPTIONS,
+        OPT_CURSOR_SET_BATCH_SIZE,
+        OPT_CURSOR_SET_PREFETCH,
+		OPT_CURSOR_SET_RESUMABLE,
+        OPT_CURSOR_LISTEN,
         OPT_CURSOR_DATA,
+		OPT_CURSOR_EXPLAIN,
 		OPT_CURSOR_DELETE
     };
 
@@ -246,6 +913,47 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 		return TCL_ERROR;
     }
 
+	/* the mongo object has been deleted; only the current document
+	 * can still be looked at */
+	if (mc->md == NULL && optIndex != OPT_CURSOR_TO_LIST && optIndex != OPT_CURSOR_TO_ARRAY && optIndex != OPT_CURSOR_DATA && optIndex != OPT_CURSOR_DELETE) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("the cursor's mongo object has been deleted", -1));
+		Tcl_SetErrorCode (interp, "MONGO", "CURSOR_INVALID", NULL);
+		return TCL_ERROR;
+	}
+
+	/* "next -timeout ms" runs under its own deadline; if the query
+	 * hasn't been sent yet the server is asked to give up after ms too */
+	if (optIndex == OPT_CURSOR_NEXT && mc->md->op_max_time_ms == 0) {
+		int ms;
+
+		if (mongotcl_timeoutOption (interp, &objc, objv, &ms) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+
+		if (ms > 0) {
+			Tcl_WideInt start = mongotcl_milliseconds ();
+			const bson *query = mc->cursor->query;
+			int queryPending = (mc->cursor->reply == NULL && !(mc->cursor->flags & MONGO_CURSOR_QUERY_SENT));
+			bson limited;
+			int result;
+
+			if (queryPending) {
+				mongotcl_bsonWithMaxTime (query, ms, 1, &limited);
+				mc->cursor->query = &limited;
+			}
+
+			mongotcl_opTimeoutBegin (mc->md, ms);
+			result = mongotcl_cursorObjectObjCmd (cData, interp, objc, objv);
+			result = mongotcl_opTimeoutEnd (interp, mc->md, ms, start, result);
+
+			if (queryPending) {
+				mc->cursor->query = query;
+				bson_destroy (&limited);
+			}
+			return result;
+		}
+	}
+
 	switch ((enum options) optIndex) {
 		case OPT_CURSOR_INIT: {
 			char *ns;
@@ -256,7 +964,36 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 			}
 
 			ns = Tcl_GetString (objv[2]);
-			mongo_cursor_init (mc->cursor, mc->conn, ns);
+			mongotcl_cacheAbandon (mc);
+			mongotcl_cursorRelease (mc);
+			mongotcl_resumeReset (mc);
+			mongotcl_cursorReuse (mc->cursor, mc->conn, ns, 0);
+
+			/* a resumable cursor stays sorted on its resume field */
+			if (mc->resume_field != NULL) {
+				return mongotcl_resumeSort (interp, mc, NULL);
+			}
+			break;
+		}
+
+		case OPT_CURSOR_REWIND: {
+			const char *ns;
+
+			if (objc > 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?namespace?");
+				return TCL_ERROR;
+			}
+
+			/* the server cursor is killed but the query, fields, skip,
+			 * limit, options and batch size stay for the next query */
+			mongotcl_listenStop (mc);
+			mongotcl_cacheAbandon (mc);
+			mongotcl_cursorRelease (mc);
+			mongotcl_resumeReset (mc);
+
+			ns = (objc == 3) ? Tcl_GetString (objv[2]) : mc->cursor->ns;
+			mc->conn = mc->md->conn;
+			mongotcl_cursorReuse (mc->cursor, mc->conn, ns, 1);
 			break;
 		}
 
@@ -272,6 +1009,10 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 				return TCL_ERROR;
 			}
 
+			mongotcl_resumeReset (mc);
+			if (mc->resume_field != NULL) {
+				return mongotcl_resumeSort (interp, mc, bson);
+			}
 			mongo_cursor_set_query (mc->cursor, bson);
 
 			break;
@@ -298,6 +1039,7 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 				return TCL_ERROR;
 			}
 
+			mongotcl_resumeReset (mc);
 			mongo_cursor_set_skip (mc->cursor, skip);
 			break;
 		}
@@ -314,6 +1056,7 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 				return TCL_ERROR;
 			}
 
+			mongotcl_resumeReset (mc);
 			mongo_cursor_set_limit (mc->cursor, limit);
 			break;
 		}
@@ -399,10 +1142,89 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 			break;
 		}
 
+		case OPT_CURSOR_SET_BATCH_SIZE: {
+			int batchSize;
+
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "batchSize");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[2], &batchSize) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (batchSize < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("batch size must not be negative", -1));
+				return TCL_ERROR;
+			}
+
+			mc->batch_size = batchSize;
+			break;
+		}
+
+		case OPT_CURSOR_SET_PREFETCH: {
+			int prefetch;
+
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "boolean");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetBooleanFromObj (interp, objv[2], &prefetch) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (prefetch && !mc->prefetch) {
+				mc->prefetch_next = mc->md->prefetch_cursors;
+				mc->md->prefetch_cursors = mc;
+				mc->prefetch = 1;
+			} else if (!prefetch && mc->prefetch) {
+				mongotcl_cursorClientData **link;
+
+				/* a batch already read ahead is still used */
+				if (mc->prefetch_request != 0) {
+					mongotcl_cursorSettle (mc->md, mc->conn);
+				}
+
+				for (link = &mc->md->prefetch_cursors; *link != NULL; link = &(*link)->prefetch_next) {
+					if (*link == mc) {
+						*link = mc->prefetch_next;
+						break;
+					}
+				}
+				mc->prefetch_next = NULL;
+				mc->prefetch = 0;
+			}
+			break;
+		}
+
+		case OPT_CURSOR_SET_RESUMABLE: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "field");
+				return TCL_ERROR;
+			}
+
+			return mongotcl_resumeSetField (interp, mc, Tcl_GetString (objv[2]));
+		}
+
+		case OPT_CURSOR_LISTEN: {
+			return mongotcl_listenObjCmd (interp, mc, objc, objv);
+		}
+
 		case OPT_CURSOR_DATA: {
 			break;
 		}
 
+		case OPT_CURSOR_EXPLAIN: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 1, objv, "explain");
+				return TCL_ERROR;
+			}
+
+			return mongotcl_cursorExplain (interp, mc);
+		}
+
 		case OPT_CURSOR_TO_LIST: {
 			if (objc != 2) {
 				Tcl_WrongNumArgs (interp, 1, objv, "to_list");
@@ -434,16 +1256,16 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 		}
 
 		case OPT_CURSOR_NEXT: {
-			if (mongo_cursor_next (mc->cursor) == MONGO_OK) {
-				Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
-			} else {
-				if (mc->cursor->err == MONGO_CURSOR_EXHAUSTED) {
-					Tcl_SetObjResult (interp, Tcl_NewBooleanObj (0));
-				} else {
-					return mongotcl_setCursorError (interp, mc->cursor);
-				}
+			if (mongotcl_cursorNext (interp, mc) == TCL_OK) {
+				break;
 			}
-			break;
+
+			/* a resumable cursor queries again for the rest and carries on */
+			if (!mongotcl_resumeCursor (mc)) {
+				return TCL_ERROR;
+			}
+			Tcl_ResetResult (interp);
+			return mongotcl_cursorNext (interp, mc);
 		}
 
 		case OPT_CURSOR_DELETE: {
@@ -463,10 +1285,11 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
  *
  *      Create a mongo cursor object...
  *
- *      Give it an interp, mongo connection, command name to be
+ *      Give it an interp, mongo object client data, command name to be
  *      created, and a MongoDB namespace to be a cursor for
  *
- *		If successful, creates a new Tcl command.
+ *		If successful, creates a new Tcl command.  If mcPtr isn't NULL
+ *		the new cursor's client data is stored there.
  *
  * Results:
  *      A standard Tcl result.
@@ -477,7 +1300,7 @@ mongotcl_cursorObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_
 
     /* ARGSUSED */
 int
-mongotcl_createCursorObjCmd(Tcl_Interp *interp, mongo *conn, char *commandName, char *namespace)
+mongotcl_createCursorObjCmd(Tcl_Interp *interp, mongotcl_clientData *md, char *commandName, char *namespace, mongotcl_cursorClientData **mcPtr)
 {
     mongotcl_cursorClientData *mc;
     int                 autoGeneratedName;
@@ -486,12 +1309,31 @@ mongotcl_createCursorObjCmd(Tcl_Interp *interp, mongo *conn, char *commandName,
     mc = (mongotcl_cursorClientData *)ckalloc (sizeof (mongotcl_cursorClientData));
 
     mc->interp = interp;
-    mc->conn = conn;
-    mc->cursor = (mongo_cursor *)ckalloc(sizeof(mongo_cursor));
+    mc->md = md;
+    mc->conn = md->conn;
+    mc->cursor = mongotcl_cursorAlloc (md, namespace);
 	mc->cursor_magic = MONGOTCL_CURSOR_MAGIC;
+	mc->queryBson = NULL;
 	mc->fieldsBson = NULL;
-
-	mongo_cursor_init (mc->cursor, conn, namespace);
+	mc->batch_size = 0;
+	mc->prefetch = 0;
+	mc->prefetch_request = 0;
+	mc->prefetch_failed = 0;
+	mc->prefetch_reply = NULL;
+	mc->prefetch_next = NULL;
+	mc->listen_callback = NULL;
+	mc->listen_tail = NULL;
+	mc->cache_key = NULL;
+	mc->resume_field = NULL;
+	mc->resume_direction = 1;
+	mc->resume_last = NULL;
+	mc->resume_query = NULL;
+	mc->resume_base = NULL;
+	mc->resume_skip = 0;
+	mc->resume_limit = 0;
+	mc->resume_count = 0;
+	mc->resume_sorted = NULL;
+	mongotcl_cursorTrack (mc);
 
     // if commandName is #auto, generate a unique name for the object
     autoGeneratedName = 0;
@@ -507,6 +1349,9 @@ mongotcl_createCursorObjCmd(Tcl_Interp *interp, mongo *conn, char *commandName,
 
     // create a Tcl command to interface to mongo
     mc->cmdToken = Tcl_CreateObjCommand (interp, commandName, mongotcl_cursorObjectObjCmd, mc, mongotcl_cursorObjectDelete);
+    if (mcPtr != NULL) {
+        *mcPtr = mc;
+    }
     Tcl_SetObjResult (interp, Tcl_NewStringObj (commandName, -1));
     if (autoGeneratedName == 1) {
         ckfree(commandName);
@@ -0,0 +1,589 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * distinct - the distinct values of a field, from the distinct command
+ * when they fit in its reply and otherwise from a cursor over the field,
+ * deduplicated here
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+
+/* state of a distinct read through a cursor */
+typedef struct mongotcl_distinctState {
+	Tcl_Interp *interp;
+	Tcl_HashTable seen;
+	Tcl_Obj *callback;
+	Tcl_Obj *valuesObj;
+	Tcl_WideInt count;
+} mongotcl_distinctState;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_distinctKey --
+ *
+ *      Build the key a value is deduplicated by: a type class followed by
+ *      the value's bytes.  Numbers of all types compare as doubles, as
+ *      the server's distinct does, so 1 and 1.0 are the same value.
+ *
+ * Results:
+ *      A new byte array object, or NULL if the value's type can't be
+ *      returned.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+mongotcl_distinctKey (const bson_iterator *it) {
+	const char *value = bson_iterator_value (it);
+	unsigned char *bytes;
+	double d;
+	int len;
+	char class;
+
+	switch (bson_iterator_type (it)) {
+		case BSON_DOUBLE:
+		case BSON_INT:
+		case BSON_LONG: {
+			d = bson_iterator_double (it);
+			if (d == 0.0) {
+				d = 0.0;
+			}
+			class = 'n';
+			value = (const char *)&d;
+			len = sizeof (d);
+			break;
+		}
+
+		case BSON_STRING:
+		case BSON_SYMBOL: {
+			class = 's';
+			value = bson_iterator_string (it);
+			len = bson_iterator_string_len (it) - 1;
+			break;
+		}
+
+		case BSON_OBJECT:
+		case BSON_ARRAY: {
+			class = (bson_iterator_type (it) == BSON_OBJECT) ? 'o' : 'a';
+			bson_little_endian32 (&len, value);
+			break;
+		}
+
+		case BSON_OID: {
+			class = 'i';
+			len = 12;
+			break;
+		}
+
+		case BSON_BOOL: {
+			class = 'b';
+			len = 1;
+			break;
+		}
+
+		case BSON_DATE: {
+			class = 'd';
+			len = 8;
+			break;
+		}
+
+		case BSON_BINDATA: {
+			class = 'x';
+			value = bson_iterator_bin_data (it);
+			len = bson_iterator_bin_len (it);
+			break;
+		}
+
+		case BSON_NULL: {
+			class = 'z';
+			len = 0;
+			break;
+		}
+
+		default: {
+			return NULL;
+		}
+	}
+
+	bytes = (unsigned char *)ckalloc (len + 1);
+	bytes[0] = (unsigned char)class;
+	memcpy (bytes + 1, value, len);
+	{
+		Tcl_Obj *keyObj = Tcl_NewByteArrayObj (bytes, len + 1);
+
+		ckfree ((char *)bytes);
+		return keyObj;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_distinctTooBig --
+ *
+ *      Return 1 if the distinct command failed because its values
+ *      wouldn't fit in the server's 16 MB reply, else 0.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_distinctTooBig (mongo *conn) {
+	if (conn->err != MONGO_COMMAND_FAILED) {
+		return 0;
+	}
+
+	/* 17217 is "distinct too big, 16mb cap", 10334 BSONObjectTooLarge */
+	if (conn->lasterrcode == 17217 || conn->lasterrcode == 10334) {
+		return 1;
+	}
+
+	return (strstr (conn->errstr, "too big") != NULL || strstr (conn->errstr, "too large") != NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_distinctValue --
+ *
+ *      Convert the value the iterator is on to a Tcl object.  Embedded
+ *      documents and arrays come back as lists, the way to_list returns
+ *      them.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+mongotcl_distinctValue (Tcl_Interp *interp, const bson_iterator *it) {
+	Tcl_DString ds;
+	Tcl_Obj *obj;
+
+	switch (bson_iterator_type (it)) {
+		case BSON_OBJECT:
+		case BSON_ARRAY: {
+			return mongotcl_bsontolist_raw (interp, Tcl_NewObj (), bson_iterator_value (it), 1);
+		}
+
+		case BSON_BOOL: {
+			return Tcl_NewBooleanObj (bson_iterator_bool (it));
+		}
+
+		case BSON_DATE: {
+			return Tcl_NewWideIntObj ((Tcl_WideInt)bson_iterator_date (it));
+		}
+
+		case BSON_BINDATA: {
+			return Tcl_NewByteArrayObj ((unsigned char *)bson_iterator_bin_data (it), bson_iterator_bin_len (it));
+		}
+
+		case BSON_NULL: {
+			return Tcl_NewObj ();
+		}
+
+		default: {
+			break;
+		}
+	}
+
+	Tcl_DStringInit (&ds);
+	mongotcl_mirrorKeyString (it, &ds);
+	obj = Tcl_NewStringObj (Tcl_DStringValue (&ds), Tcl_DStringLength (&ds));
+	Tcl_DStringFree (&ds);
+	return obj;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_distinctAdd --
+ *
+ *      Add the value the iterator is on to the values if it hasn't been
+ *      seen.  Arrays are unwound into their elements, as the server's
+ *      distinct does.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_distinctAdd (mongotcl_distinctState *state, Tcl_Obj *batchObj, const bson_iterator *it, int unwind) {
+	Tcl_Obj *keyObj;
+	int new;
+
+	if (unwind && bson_iterator_type (it) == BSON_ARRAY) {
+		bson_iterator sub;
+
+		bson_iterator_subiterator (it, &sub);
+		while (bson_iterator_next (&sub) != BSON_EOO) {
+			mongotcl_distinctAdd (state, batchObj, &sub, 0);
+		}
+		return;
+	}
+
+	keyObj = mongotcl_distinctKey (it);
+	if (keyObj == NULL) {
+		return;
+	}
+
+	Tcl_IncrRefCount (keyObj);
+	Tcl_CreateHashEntry (&state->seen, (char *)keyObj, &new);
+	Tcl_DecrRefCount (keyObj);
+
+	if (new) {
+		Tcl_ListObjAppendElement (state->interp, batchObj, mongotcl_distinctValue (state->interp, it));
+		state->count++;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_distinctDeliver --
+ *
+ *      Hand a batch of new values to the callback, or add them to the
+ *      result.
+ *
+ * Results:
+ *      A standard Tcl result; TCL_BREAK if the callback broke.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_distinctDeliver (mongotcl_distinctState *state, Tcl_Obj *batchObj) {
+	Tcl_Obj *cmdObj;
+	int length;
+	int result;
+
+	Tcl_ListObjLength (NULL, batchObj, &length);
+	if (length == 0) {
+		Tcl_DecrRefCount (batchObj);
+		return TCL_OK;
+	}
+
+	if (state->callback == NULL) {
+		Tcl_ListObjAppendList (state->interp, state->valuesObj, batchObj);
+		Tcl_DecrRefCount (batchObj);
+		return TCL_OK;
+	}
+
+	cmdObj = Tcl_DuplicateObj (state->callback);
+	Tcl_IncrRefCount (cmdObj);
+	Tcl_ListObjAppendElement (NULL, cmdObj, batchObj);
+	Tcl_DecrRefCount (batchObj);
+	result = Tcl_EvalObjEx (state->interp, cmdObj, 0);
+	Tcl_DecrRefCount (cmdObj);
+
+	if (result == TCL_CONTINUE) {
+		result = TCL_OK;
+	}
+	return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_distinctCursor --
+ *
+ *      Read the field from every matching document and keep the values
+ *      not seen before.  Only the field is asked for, and with a hint for
+ *      an index on it, so with such an index the query is covered and
+ *      never reads the documents themselves.
+ *
+ * Results:
+ *      A standard Tcl result; TCL_CONTINUE if the query failed before
+ *      anything was read, which is what a hint for a missing index does.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_distinctCursor (mongotcl_distinctState *state, mongotcl_clientData *md, mongo *conn, int options, const char *ns, const char *field, const bson *filter, int hint, int batchSize) {
+	Tcl_Interp *interp = state->interp;
+	mongo_reply *reply = NULL;
+	Tcl_DString msg;
+	bson query;
+	bson fields;
+	int64_t cursorId;
+	int status;
+	int result = TCL_OK;
+
+	bson_init (&query);
+	if (filter != NULL) {
+		bson_append_bson (&query, "$query", filter);
+	} else {
+		bson_append_start_object (&query, "$query");
+		bson_append_finish_object (&query);
+	}
+	if (hint) {
+		bson_append_start_object (&query, "$hint");
+		bson_append_int (&query, field, 1);
+		bson_append_finish_object (&query);
+	}
+	if (md->op_max_time_ms > 0) {
+		bson_append_int (&query, "$maxTimeMS", md->op_max_time_ms);
+	}
+	bson_finish (&query);
+
+	bson_init (&fields);
+	bson_append_int (&fields, field, 1);
+	if (strcmp (field, "_id") != 0) {
+		bson_append_int (&fields, "_id", 0);
+	}
+	bson_finish (&fields);
+
+	Tcl_DStringInit (&msg);
+	mongotcl_wireBuildQuery (&msg, ns, options, 0, batchSize, &query, &fields);
+	status = mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+	Tcl_DStringFree (&msg);
+	bson_destroy (&query);
+	bson_destroy (&fields);
+
+	if (status != MONGO_OK) {
+		return mongotcl_setMongoError (interp, conn);
+	}
+
+	for (;;) {
+		Tcl_Obj *batchObj;
+		const char *data;
+		int k;
+
+		if (mongotcl_wireReadReply (conn, &reply) != MONGO_OK) {
+			reply = NULL;
+			result = mongotcl_setMongoError (interp, conn);
+			break;
+		}
+		data = &reply->objs;
+
+		if (reply->fields.flag & 0x03) {
+			bson_iterator it;
+			const char *message = (reply->fields.flag & 0x01) ? "cursor not found" : "query failed";
+
+			if (hint && (reply->fields.flag & 0x02)) {
+				result = TCL_CONTINUE;
+				break;
+			}
+
+			if ((reply->fields.flag & 0x02) && reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, data, "$err") == BSON_STRING) {
+				message = bson_iterator_string (&it);
+			}
+			Tcl_SetObjResult (interp, Tcl_NewStringObj (message, -1));
+			Tcl_SetErrorCode (interp, "MONGO", (reply->fields.flag & 0x01) ? "CURSOR_INVALID" : "CURSOR_QUERY_FAIL", NULL);
+			result = TCL_ERROR;
+			break;
+		}
+		hint = 0;
+
+		batchObj = Tcl_NewObj ();
+		Tcl_IncrRefCount (batchObj);
+		for (k = 0; k < reply->fields.num; k++) {
+			bson_iterator it;
+			int size;
+
+			if (mongotcl_mirrorField (&it, data, field) != BSON_EOO) {
+				mongotcl_distinctAdd (state, batchObj, &it, 1);
+			}
+
+			bson_little_endian32 (&size, data);
+			data += size;
+		}
+
+		cursorId = reply->fields.cursorID;
+		if (cursorId == 0) {
+			result = mongotcl_distinctDeliver (state, batchObj);
+			break;
+		}
+
+		/*
+		 * a callback may use the connection itself, so the next batch is
+		 * only asked for once it has returned; without one the server
+		 * reads the next batch while this one is added
+		 */
+		if (state->callback != NULL) {
+			result = mongotcl_distinctDeliver (state, batchObj);
+			batchObj = NULL;
+			if (result != TCL_OK) {
+				mongotcl_cursorKill (md, conn, cursorId);
+				break;
+			}
+		}
+
+		Tcl_DStringInit (&msg);
+		mongotcl_wireBuildGetMore (&msg, ns, batchSize, cursorId);
+		status = mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+		Tcl_DStringFree (&msg);
+
+		if (status != MONGO_OK) {
+			if (batchObj != NULL) {
+				Tcl_DecrRefCount (batchObj);
+			}
+			result = mongotcl_setMongoError (interp, conn);
+			break;
+		}
+
+		if (batchObj != NULL) {
+			mongotcl_distinctDeliver (state, batchObj);
+		}
+
+		bson_free (reply);
+		reply = NULL;
+	}
+
+	if (reply != NULL) {
+		bson_free (reply);
+	}
+	return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_distinctObjCmd --
+ *
+ *      Implements "$mongo distinct namespace field ?-query bson?
+ *      ?-callback script? ?-batch_size n?".
+ *
+ *      The distinct command is tried first.  If the server refuses it,
+ *      as it does when the values don't fit in one reply, the field is
+ *      read through a cursor instead and deduplicated in a hash table.
+ *
+ * Results:
+ *      A standard Tcl result; the list of values, or with -callback the
+ *      number of values delivered, is left in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_distinctObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	mongotcl_distinctState state;
+	const char *ns;
+	const char *field;
+	bson *filter = NULL;
+	bson command;
+	bson out;
+	Tcl_DString db;
+	mongo *conn;
+	int options = 0;
+	int batchSize = 0;
+	int status;
+	int result;
+	int i;
+
+	if (objc < 4 || (objc & 1) != 0) {
+		Tcl_WrongNumArgs (interp, 2, objv, "namespace field ?-query bson? ?-callback script? ?-batch_size n?");
+		return TCL_ERROR;
+	}
+
+	ns = Tcl_GetString (objv[2]);
+	if (strchr (ns, '.') == NULL) {
+		Tcl_AppendResult (interp, "invalid namespace '", ns, "'", NULL);
+		Tcl_SetErrorCode (interp, "MONGO", "NS_INVALID", NULL);
+		return TCL_ERROR;
+	}
+	field = Tcl_GetString (objv[3]);
+
+	state.interp = interp;
+	state.callback = NULL;
+	state.count = 0;
+
+	for (i = 4; i < objc; i += 2) {
+		char *option = Tcl_GetString (objv[i]);
+
+		if (strcmp (option, "-query") == 0) {
+			if (mongotcl_cmdNameObjToBson (interp, objv[i + 1], &filter) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+		} else if (strcmp (option, "-callback") == 0) {
+			state.callback = objv[i + 1];
+		} else if (strcmp (option, "-batch_size") == 0) {
+			if (Tcl_GetIntFromObj (interp, objv[i + 1], &batchSize) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (batchSize < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("batch size must not be negative", -1));
+				return TCL_ERROR;
+			}
+		} else {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -query, -callback or -batch_size", option));
+			return TCL_ERROR;
+		}
+	}
+
+	if (mongotcl_selectReadConnection (interp, md, &conn, &options) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	Tcl_DStringInit (&db);
+	mongotcl_namespaceToDb (ns, &db);
+
+	bson_init (&command);
+	bson_append_string (&command, "distinct", ns + Tcl_DStringLength (&db) + 1);
+	bson_append_string (&command, "key", field);
+	if (filter != NULL) {
+		bson_append_bson (&command, "query", filter);
+	}
+	if (md->op_max_time_ms > 0) {
+		bson_append_int (&command, "maxTimeMS", md->op_max_time_ms);
+	}
+	bson_finish (&command);
+
+	status = mongotcl_runReadCommand (conn, Tcl_DStringValue (&db), &command, options, &out);
+	bson_destroy (&command);
+	Tcl_DStringFree (&db);
+
+	/* only values too many for one reply are read through a cursor */
+	if (status != MONGO_OK && !mongotcl_distinctTooBig (conn)) {
+		return mongotcl_setMongoError (interp, conn);
+	}
+
+	state.valuesObj = Tcl_NewObj ();
+	Tcl_IncrRefCount (state.valuesObj);
+	Tcl_InitObjHashTable (&state.seen);
+
+	if (status == MONGO_OK) {
+		bson_iterator it;
+		Tcl_Obj *batchObj = Tcl_NewObj ();
+
+		Tcl_IncrRefCount (batchObj);
+		if (bson_find (&it, &out, "values") == BSON_ARRAY) {
+			bson_iterator sub;
+
+			bson_iterator_subiterator (&it, &sub);
+			while (bson_iterator_next (&sub) != BSON_EOO) {
+				Tcl_ListObjAppendElement (interp, batchObj, mongotcl_distinctValue (interp, &sub));
+				state.count++;
+			}
+		}
+		bson_destroy (&out);
+		result = mongotcl_distinctDeliver (&state, batchObj);
+	} else {
+		result = mongotcl_distinctCursor (&state, md, conn, options, ns, field, filter, 1, batchSize);
+		if (result == TCL_CONTINUE) {
+			result = mongotcl_distinctCursor (&state, md, conn, options, ns, field, filter, 0, batchSize);
+		}
+	}
+
+	Tcl_DeleteHashTable (&state.seen);
+
+	if (result == TCL_BREAK) {
+		result = TCL_OK;
+	}
+
+	if (result == TCL_OK) {
+		if (state.callback != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewWideIntObj (state.count));
+		} else {
+			Tcl_SetObjResult (interp, state.valuesObj);
+		}
+	}
+	Tcl_DecrRefCount (state.valuesObj);
+	return result;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
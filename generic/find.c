@@ -0,0 +1,330 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * find - a query, with its sort and other modifiers, made into a cursor
+ * object
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_findAppendKeys --
+ *
+ *      Append an object of the fields in fieldList, in order, each 1 or,
+ *      for a field given with a leading -, -1.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_findAppendKeys (Tcl_Interp *interp, bson *b, const char *name, Tcl_Obj *fieldList) {
+	Tcl_Obj **listObjv;
+	int listObjc;
+	int i;
+
+	if (Tcl_ListObjGetElements (interp, fieldList, &listObjc, &listObjv) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	bson_append_start_object (b, name);
+	for (i = 0; i < listObjc; i++) {
+		char *field = Tcl_GetString (listObjv[i]);
+
+		if (*field == '-') {
+			bson_append_int (b, field + 1, -1);
+		} else {
+			bson_append_int (b, field, 1);
+		}
+	}
+	bson_append_finish_object (b);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_findObjCmd --
+ *
+ *      Implements "$mongo find namespace bsonQuery bsonFields limit skip
+ *      options ?-sort fieldList? ?-hint index? ?-max_scan n? ?-snapshot?
+ *      ?-comment string? ?-batch_size n? ?-resumable? ?-name name?".
+ *
+ *      Creates a cursor object for the query.  Nothing is sent until its
+ *      first next, which goes to the member the read preference picks
+ *      like any other cursor's.  The query and fields are copied into the
+ *      cursor, so the bson objects given may be deleted afterwards.
+ *
+ *      A -resumable cursor resumes after the last value of its sort
+ *      field, which must be a single unique one; with no -sort it is
+ *      sorted on _id.
+ *
+ * Results:
+ *      A standard Tcl result; the cursor's name is left in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_findObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	mongotcl_cursorClientData *mc;
+	char *ns;
+	char *commandName = "#auto";
+	bson *bsonQuery;
+	bson *bsonFields;
+	bson_iterator it;
+	Tcl_Obj *sortObj = NULL;
+	Tcl_Obj *hintObj = NULL;
+	char *comment = NULL;
+	int maxScan = 0;
+	int snapshot = 0;
+	int resumable = 0;
+	int batchSize = 0;
+	int limit;
+	int skip;
+	int listObjc;
+	int i;
+	Tcl_Obj **listObjv;
+	int cursorFlags = 0;
+
+	static CONST char *subOptions[] = {
+		"tailable",
+		"slave_ok",
+		"no_timeout",
+		"await_data",
+		"exhaust",
+		"partial",
+		NULL
+	};
+
+	enum suboptions {
+		SUBOPT_CURSOR_TAILABLE,
+		SUBOPT_CURSOR_SLAVE_OK,
+		SUBOPT_CURSOR_NO_TIMEOUT,
+		SUBOPT_CURSOR_AWAIT_DATA,
+		SUBOPT_CURSOR_EXHAUST,
+		SUBOPT_CURSOR_PARTIAL
+	};
+
+	if (objc < 8) {
+		Tcl_WrongNumArgs (interp, 2, objv, "namespace bsonQuery bsonFields limit skip options ?-sort fieldList? ?-hint index? ?-max_scan n? ?-snapshot? ?-comment string? ?-batch_size n? ?-resumable? ?-name name?");
+		return TCL_ERROR;
+	}
+
+	ns = Tcl_GetString (objv[2]);
+
+	if (mongotcl_cmdNameObjToBson (interp, objv[3], &bsonQuery) == TCL_ERROR) {
+		Tcl_AddErrorInfo (interp, " while locating query bson");
+		return TCL_ERROR;
+	}
+
+	if (mongotcl_cmdNameObjToBson (interp, objv[4], &bsonFields) == TCL_ERROR) {
+		Tcl_AddErrorInfo (interp, " while locating query bson");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIntFromObj (interp, objv[5], &limit) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIntFromObj (interp, objv[6], &skip) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (Tcl_ListObjGetElements (interp, objv[7], &listObjc, &listObjv) == TCL_ERROR) {
+		Tcl_AddErrorInfo (interp, "while examining option list");
+		return TCL_ERROR;
+	}
+
+	for (i = 0; i < listObjc; i++) {
+		int suboptIndex;
+
+		if (Tcl_GetIndexFromObj (interp, listObjv[i], subOptions, "indexOption", TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum suboptions)suboptIndex) {
+			case SUBOPT_CURSOR_TAILABLE:
+				cursorFlags |= MONGO_TAILABLE;
+				break;
+
+			case SUBOPT_CURSOR_SLAVE_OK:
+				cursorFlags |= MONGO_SLAVE_OK;
+				break;
+
+			case SUBOPT_CURSOR_NO_TIMEOUT:
+				cursorFlags |= MONGO_NO_CURSOR_TIMEOUT;
+				break;
+
+			case SUBOPT_CURSOR_AWAIT_DATA:
+				cursorFlags |= MONGO_AWAIT_DATA;
+				break;
+
+			case SUBOPT_CURSOR_EXHAUST:
+				cursorFlags |= MONGO_EXHAUST;
+				break;
+
+			case SUBOPT_CURSOR_PARTIAL:
+				cursorFlags |= MONGO_PARTIAL;
+				break;
+		}
+	}
+
+	for (i = 8; i < objc; i++) {
+		char *option = Tcl_GetString (objv[i]);
+
+		if (strcmp (option, "-snapshot") == 0) {
+			snapshot = 1;
+		} else if (strcmp (option, "-resumable") == 0) {
+			resumable = 1;
+		} else if (i + 1 == objc) {
+			goto badOption;
+		} else if (strcmp (option, "-sort") == 0) {
+			sortObj = objv[++i];
+		} else if (strcmp (option, "-hint") == 0) {
+			hintObj = objv[++i];
+		} else if (strcmp (option, "-comment") == 0) {
+			comment = Tcl_GetString (objv[++i]);
+		} else if (strcmp (option, "-name") == 0) {
+			commandName = Tcl_GetString (objv[++i]);
+		} else if (strcmp (option, "-max_scan") == 0) {
+			if (Tcl_GetIntFromObj (interp, objv[++i], &maxScan) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (maxScan < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("max scan must not be negative", -1));
+				return TCL_ERROR;
+			}
+		} else if (strcmp (option, "-batch_size") == 0) {
+			if (Tcl_GetIntFromObj (interp, objv[++i], &batchSize) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (batchSize < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("batch size must not be negative", -1));
+				return TCL_ERROR;
+			}
+		} else {
+		  badOption:
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -sort, -hint, -max_scan, -snapshot, -comment, -batch_size, -resumable or -name", option));
+			return TCL_ERROR;
+		}
+	}
+
+	/* a cursor is resumed after the last value of its one sort field */
+	if (resumable && sortObj != NULL) {
+		int sortObjc;
+
+		if (Tcl_ListObjLength (interp, sortObj, &sortObjc) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+
+		if (sortObjc != 1) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("a resumable cursor must sort on a single field", -1));
+			return TCL_ERROR;
+		}
+	}
+
+	if (mongotcl_createCursorObjCmd (interp, md, commandName, ns, &mc) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	/* the query, with its modifiers if there are any */
+	mc->queryBson = (bson *)ckalloc (sizeof (bson));
+	bson_init (mc->queryBson);
+	if (sortObj == NULL && !resumable && hintObj == NULL && maxScan == 0 && !snapshot && comment == NULL && md->op_max_time_ms == 0) {
+		bson_iterator_init (&it, bsonQuery);
+		while (bson_iterator_next (&it)) {
+			bson_append_element (mc->queryBson, NULL, &it);
+		}
+	} else {
+		if (bson_find (&it, bsonQuery, "$query") == BSON_EOO) {
+			bson_append_bson (mc->queryBson, "$query", bsonQuery);
+		} else {
+			bson_iterator_init (&it, bsonQuery);
+			while (bson_iterator_next (&it)) {
+				bson_append_element (mc->queryBson, NULL, &it);
+			}
+		}
+
+		if (sortObj != NULL && mongotcl_findAppendKeys (interp, mc->queryBson, "$orderby", sortObj) == TCL_ERROR) {
+			goto error;
+		}
+
+		if (sortObj == NULL && resumable) {
+			bson_append_start_object (mc->queryBson, "$orderby");
+			bson_append_int (mc->queryBson, "_id", 1);
+			bson_append_finish_object (mc->queryBson);
+		}
+
+		if (hintObj != NULL) {
+			int hintObjc;
+
+			/* a single word is an index name, anything else its fields */
+			if (Tcl_ListObjLength (interp, hintObj, &hintObjc) == TCL_ERROR) {
+				goto error;
+			}
+
+			if (hintObjc == 1) {
+				bson_append_string (mc->queryBson, "$hint", Tcl_GetString (hintObj));
+			} else if (mongotcl_findAppendKeys (interp, mc->queryBson, "$hint", hintObj) == TCL_ERROR) {
+				goto error;
+			}
+		}
+
+		if (maxScan > 0) {
+			bson_append_int (mc->queryBson, "$maxScan", maxScan);
+		}
+
+		if (snapshot) {
+			bson_append_bool (mc->queryBson, "$snapshot", 1);
+		}
+
+		if (comment != NULL) {
+			bson_append_string (mc->queryBson, "$comment", comment);
+		}
+
+		if (md->op_max_time_ms > 0) {
+			bson_append_int (mc->queryBson, "$maxTimeMS", md->op_max_time_ms);
+		}
+	}
+	bson_finish (mc->queryBson);
+	mongo_cursor_set_query (mc->cursor, mc->queryBson);
+
+	mc->fieldsBson = (bson *)ckalloc (sizeof (bson));
+	bson_copy (mc->fieldsBson, bsonFields);
+	mongo_cursor_set_fields (mc->cursor, mc->fieldsBson);
+
+	mongo_cursor_set_limit (mc->cursor, limit);
+	mongo_cursor_set_skip (mc->cursor, skip);
+	mongo_cursor_set_options (mc->cursor, cursorFlags);
+	mc->batch_size = batchSize;
+
+	if (resumable) {
+		Tcl_Obj *fieldObj = NULL;
+
+		if (sortObj != NULL) {
+			Tcl_ListObjIndex (interp, sortObj, 0, &fieldObj);
+		}
+
+		if (mongotcl_resumeSetField (interp, mc, (fieldObj == NULL) ? "_id" : Tcl_GetString (fieldObj)) == TCL_ERROR) {
+			goto error;
+		}
+	}
+	return TCL_OK;
+
+  error:
+	Tcl_DeleteCommandFromToken (interp, mc->cmdToken);
+	return TCL_ERROR;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -0,0 +1,412 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * hedged reads - a query that the fastest eligible member hasn't
+ * answered within the hedge delay is also sent to the next fastest,
+ * and whichever replies first is used
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <errno.h>
+#include <poll.h>
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_memberForConn --
+ *
+ *      Find the replica set member owning a connection, or NULL.
+ *
+ *----------------------------------------------------------------------
+ */
+static mongotcl_member *
+mongotcl_memberForConn (mongotcl_clientData *md, mongo *conn) {
+	mongotcl_member *m;
+
+	for (m = md->members; m != NULL; m = m->next) {
+		if (m->conn == conn) {
+			return m;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_hedgeWatch / mongotcl_hedgeStop --
+ *
+ *      Watch a member's connection while replies to hedged queries that
+ *      lost on it are due, so they are read and their cursors killed as
+ *      soon as they arrive rather than when the member is next used, and
+ *      stop once none are.  mongotcl_hedgeStop gives up on them, as when
+ *      the connection is closed.
+ *
+ *----------------------------------------------------------------------
+ */
+static void mongotcl_hedgeReadableProc (ClientData clientData, int mask);
+
+static void
+mongotcl_hedgeWatch (mongotcl_member *m) {
+	if (m->hedge_pending > 0 && m->hedge_fd < 0) {
+		m->hedge_fd = m->conn->sock;
+		Tcl_CreateFileHandler (m->hedge_fd, TCL_READABLE, mongotcl_hedgeReadableProc, (ClientData)m);
+	} else if (m->hedge_pending == 0 && m->hedge_fd >= 0) {
+		Tcl_DeleteFileHandler (m->hedge_fd);
+		m->hedge_fd = -1;
+	}
+}
+
+static void
+mongotcl_hedgeStop (mongotcl_member *m) {
+	m->hedge_pending = 0;
+	mongotcl_hedgeWatch (m);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_hedgeDiscardReply --
+ *
+ *      Read the next losing reply on a member's connection and have any
+ *      cursor it opened killed with the object's other kills.
+ *
+ * Results:
+ *      MONGO_OK, or MONGO_ERROR if the connection failed and was closed.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_hedgeDiscardReply (mongotcl_member *m) {
+	mongo_reply *reply;
+	int64_t cursorId;
+
+	if (mongotcl_wireReadReply (m->conn, &reply) != MONGO_OK) {
+		mongotcl_hedgeStop (m);
+		mongo_disconnect (m->conn);
+		mongotcl_cursorPrefetchReset (m->md, m->conn);
+		return MONGO_ERROR;
+	}
+
+	m->hedge_pending--;
+	cursorId = reply->fields.cursorID;
+	bson_free (reply);
+
+	if (cursorId != 0) {
+		mongotcl_cursorKill (m->md, m->conn, cursorId);
+	}
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_hedgeReadableProc --
+ *
+ *      A losing reply is arriving; read it, and any others already
+ *      buffered behind it.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_hedgeReadableProc (ClientData clientData, int mask) {
+	mongotcl_member *m = (mongotcl_member *)clientData;
+
+	/* the socket was closed under the handler */
+	if (!m->conn->connected || m->conn->sock != m->hedge_fd) {
+		mongotcl_hedgeStop (m);
+		return;
+	}
+
+	do {
+		if (mongotcl_hedgeDiscardReply (m) != MONGO_OK) {
+			return;
+		}
+	} while (m->hedge_pending > 0 && mongotcl_wireBuffered (m->conn) > 0);
+
+	mongotcl_hedgeWatch (m);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_drainConnection --
+ *
+ *      Read and discard the replies to hedged queries that lost on this
+ *      connection and haven't been read yet, killing any cursors they
+ *      opened, so the next reply read from it is the right one, then
+ *      settle any cursor read ahead outstanding on it.  Must be called
+ *      before anything else reads from a member connection.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_drainConnection (mongotcl_clientData *md, mongo *conn) {
+	mongotcl_member *m = mongotcl_memberForConn (md, conn);
+
+	if (m != NULL && m->hedge_pending > 0) {
+		while (m->hedge_pending > 0) {
+			if (mongotcl_hedgeDiscardReply (m) != MONGO_OK) {
+				return;
+			}
+		}
+		mongotcl_hedgeWatch (m);
+	}
+
+	mongotcl_cursorSettle (md, conn);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_hedgeForget --
+ *
+ *      A member connection is being closed; stop waiting for losing
+ *      replies on it.  Must be called before the socket is closed.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_hedgeForget (mongotcl_clientData *md, mongo *conn) {
+	mongotcl_member *m = mongotcl_memberForConn (md, conn);
+
+	if (m != NULL) {
+		mongotcl_hedgeStop (m);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_hedgeApplies --
+ *
+ *      Return 1 if reads should be hedged: hedging is on and the read
+ *      preference allows more than one member to take the read.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_hedgeApplies (mongotcl_clientData *md) {
+	return md->hedge && (md->read_preference == MONGOTCL_READ_SECONDARY || md->read_preference == MONGOTCL_READ_NEAREST);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_hedgedQuery --
+ *
+ *      Send an OP_QUERY to the fastest eligible member.  If no reply
+ *      has arrived after the hedge delay, send it to the next fastest
+ *      as well and take the first reply from either.  The loser's reply
+ *      is read when it arrives, and the cursor it opened killed.
+ *
+ *      slave_ok is always set, which the primary ignores.
+ *
+ * Results:
+ *      A standard Tcl result.  On success *connPtr is the connection
+ *      that answered and *replyPtr its reply, which the caller owns.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_hedgedQuery (Tcl_Interp *interp, mongotcl_clientData *md, const char *ns, int options, int skip, int nToReturn, const bson *query, const bson *fields, mongo **connPtr, mongo_reply **replyPtr) {
+	mongotcl_member *ranked[2];
+	mongotcl_member *winner;
+	struct pollfd fds[2];
+	Tcl_DString msg;
+	int n;
+	int ready;
+	int i;
+
+	if ((n = mongotcl_rankReadMembers (md, ranked, 2)) == 0) {
+		return mongotcl_noEligibleMember (interp, md);
+	}
+
+	Tcl_DStringInit (&msg);
+	mongotcl_wireBuildQuery (&msg, ns, options | MONGO_SLAVE_OK, skip, nToReturn, query, fields);
+
+	for (i = 0; i < n; i++) {
+		mongotcl_drainConnection (md, ranked[i]->conn);
+	}
+
+	if (mongotcl_wireSend (ranked[0]->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg)) != MONGO_OK) {
+		Tcl_DStringFree (&msg);
+		return mongotcl_setMongoError (interp, ranked[0]->conn);
+	}
+	md->hedge_reads++;
+	winner = ranked[0];
+
+	if (n == 2) {
+		fds[0].fd = ranked[0]->conn->sock;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+
+		/* a reply already in the ring doesn't make the socket readable */
+		if (mongotcl_wireBuffered (ranked[0]->conn) > 0) {
+			ready = 1;
+		} else {
+			do {
+				ready = poll (fds, 1, md->hedge_delay_ms);
+			} while (ready < 0 && errno == EINTR);
+		}
+
+		if (ready == 0 && mongotcl_wireSend (ranked[1]->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg)) == MONGO_OK) {
+			md->hedge_fired++;
+
+			fds[1].fd = ranked[1]->conn->sock;
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+
+			if (mongotcl_wireBuffered (ranked[0]->conn) > 0) {
+				ready = 1;
+				fds[0].revents = POLLIN;
+			} else if (mongotcl_wireBuffered (ranked[1]->conn) > 0) {
+				ready = 1;
+				fds[1].revents = POLLIN;
+			} else {
+				do {
+					ready = poll (fds, 2, md->conn->op_timeout_ms > 0 ? md->conn->op_timeout_ms : -1);
+				} while (ready < 0 && errno == EINTR);
+			}
+
+			if (ready > 0 && fds[0].revents == 0 && fds[1].revents != 0) {
+				winner = ranked[1];
+				md->hedge_wins++;
+			}
+
+			/* the other reply is still coming */
+			if (winner == ranked[0]) {
+				ranked[1]->hedge_pending++;
+				mongotcl_hedgeWatch (ranked[1]);
+			} else {
+				ranked[0]->hedge_pending++;
+				mongotcl_hedgeWatch (ranked[0]);
+			}
+		}
+	}
+	Tcl_DStringFree (&msg);
+
+	if (mongotcl_wireReadReply (winner->conn, replyPtr) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, winner->conn);
+	}
+
+	*connPtr = winner->conn;
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_hedgeObjCmd --
+ *
+ *      Implements "$mongo hedge on ?-delay ms?|off|status".
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_hedgeObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	int subIndex;
+
+    static CONST char *subOptions[] = {
+        "on",
+        "off",
+        "status",
+        NULL
+    };
+
+    enum subOptions {
+        SUBOPT_ON,
+        SUBOPT_OFF,
+        SUBOPT_STATUS
+    };
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "on|off|status ?-delay ms?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "subcommand", TCL_EXACT, &subIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	switch ((enum subOptions) subIndex) {
+		case SUBOPT_ON: {
+			int delay = md->hedge_delay_ms;
+
+			if (objc != 3 && objc != 5) {
+				Tcl_WrongNumArgs (interp, 3, objv, "?-delay ms?");
+				return TCL_ERROR;
+			}
+
+			if (objc == 5) {
+				if (strcmp (Tcl_GetString (objv[3]), "-delay") != 0) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -delay", Tcl_GetString (objv[3])));
+					return TCL_ERROR;
+				}
+
+				if (Tcl_GetIntFromObj (interp, objv[4], &delay) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				if (delay < 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-delay must not be negative", -1));
+					return TCL_ERROR;
+				}
+			}
+
+			md->hedge = 1;
+			md->hedge_delay_ms = delay;
+			break;
+		}
+
+		case SUBOPT_OFF: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			md->hedge = 0;
+			break;
+		}
+
+		case SUBOPT_STATUS: {
+			Tcl_Obj *listObj = Tcl_NewObj ();
+
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("enabled", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewBooleanObj (md->hedge));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("delay", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->hedge_delay_ms));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("reads", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->hedge_reads));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("fired", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->hedge_fired));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("hedge_wins", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->hedge_wins));
+			Tcl_SetObjResult (interp, listObj);
+			break;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
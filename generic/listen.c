@@ -0,0 +1,680 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * tailable queries followed in the background - a tailable cursor
+ * kept open on a connection of its own, its new documents delivered
+ * through the event loop, and reopened after the last document seen
+ * whenever the server drops it; "$cursor listen" and mirrors are
+ * built on them
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+
+/* how long to wait before reopening a cursor that came back empty and
+ * dead, or whose connection failed */
+#define MONGOTCL_TAIL_RETRY_MS 1000
+
+/* the driver has no name for the OplogReplay query flag */
+#define MONGOTCL_OPLOG_REPLAY (1 << 3)
+
+static void mongotcl_tailReadableProc (ClientData clientData, int mask);
+static void mongotcl_tailRetryProc (ClientData clientData);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailFree --
+ *
+ *      Free a tail once nothing is using it any more.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_tailFree (char *clientData) {
+	mongotcl_tail *tail = (mongotcl_tail *)clientData;
+
+	if (tail->last != NULL) {
+		bson_destroy (tail->last);
+		ckfree ((char *)tail->last);
+	}
+
+	if (tail->fields != NULL) {
+		bson_destroy (tail->fields);
+		ckfree ((char *)tail->fields);
+	}
+
+	bson_destroy (&tail->query);
+	ckfree (tail->ns);
+	ckfree (tail->field);
+	ckfree ((char *)tail);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailClose --
+ *
+ *      Stop watching the tail's connection, kill its server cursor and
+ *      close the connection.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_tailClose (mongotcl_tail *tail) {
+	if (tail->fd >= 0) {
+		Tcl_DeleteFileHandler (tail->fd);
+		tail->fd = -1;
+	}
+
+	if (tail->conn != NULL) {
+		if (tail->cursor_id != 0 && tail->conn->connected) {
+			Tcl_DString msg;
+
+			Tcl_DStringInit (&msg);
+			mongotcl_wireBuildKillCursors (&msg, tail->cursor_id);
+			mongotcl_wireSend (tail->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+			Tcl_DStringFree (&msg);
+		}
+
+		mongotcl_wireRelease (tail->conn);
+		mongo_destroy (tail->conn);
+		ckfree ((char *)tail->conn);
+		tail->conn = NULL;
+	}
+
+	tail->cursor_id = 0;
+	tail->request = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailSchedule --
+ *
+ *      Arrange for the tail's cursor to be reopened after ms.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_tailSchedule (mongotcl_tail *tail, int ms) {
+	if (tail->timer == NULL) {
+		tail->timer = Tcl_CreateTimerHandler (ms, mongotcl_tailRetryProc, (ClientData)tail);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailAppendAfter --
+ *
+ *      Append name: {field: {$gt: last}} to a query being built, or just
+ *      field: {$gt: last} if name is NULL.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_tailAppendAfter (mongotcl_tail *tail, bson *out, const char *name) {
+	bson_iterator last;
+
+	bson_iterator_init (&last, tail->last);
+	bson_iterator_next (&last);
+
+	if (name != NULL) {
+		bson_append_start_object (out, name);
+	}
+	bson_append_start_object (out, tail->field);
+	bson_append_element (out, "$gt", &last);
+	bson_append_finish_object (out);
+	if (name != NULL) {
+		bson_append_finish_object (out);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailQuery --
+ *
+ *      Build the query the tail opens its cursor with: its own query,
+ *      narrowed once a document has been seen to those whose resume
+ *      field is greater than the last one's.  The condition goes at the
+ *      top level when the query doesn't already test the field, which
+ *      is where the server looks for it with OplogReplay.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_tailQuery (mongotcl_tail *tail, bson *out) {
+	bson_iterator it;
+	bson filter;
+	int wrapped;
+
+	bson_init (out);
+
+	if (tail->last == NULL) {
+		bson_iterator_init (&it, &tail->query);
+		while (bson_iterator_next (&it) != BSON_EOO) {
+			bson_append_element (out, NULL, &it);
+		}
+		bson_finish (out);
+		return;
+	}
+
+	wrapped = (bson_find (&it, &tail->query, "$query") == BSON_OBJECT);
+	if (wrapped) {
+		bson_iterator_subobject (&it, &filter);
+	} else {
+		filter = tail->query;
+	}
+
+	bson_append_start_object (out, "$query");
+	if (bson_find (&it, &filter, tail->field) == BSON_EOO) {
+		bson_iterator_init (&it, &filter);
+		while (bson_iterator_next (&it) != BSON_EOO) {
+			bson_append_element (out, NULL, &it);
+		}
+		mongotcl_tailAppendAfter (tail, out, NULL);
+	} else {
+		bson_append_start_array (out, "$and");
+		bson_append_bson (out, "0", &filter);
+		mongotcl_tailAppendAfter (tail, out, "1");
+		bson_append_finish_object (out);
+	}
+	bson_append_finish_object (out);
+
+	/* keep the query's other modifiers, such as $hint */
+	if (wrapped) {
+		bson_iterator_init (&it, &tail->query);
+		while (bson_iterator_next (&it) != BSON_EOO) {
+			if (strcmp (bson_iterator_key (&it), "$query") != 0) {
+				bson_append_element (out, NULL, &it);
+			}
+		}
+	}
+
+	bson_finish (out);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailOpen --
+ *
+ *      Connect the tail if need be, send its tailable await_data query
+ *      and start watching for the reply.
+ *
+ * Results:
+ *      MONGO_OK, or MONGO_ERROR with the error set on tail->conn.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_tailOpen (mongotcl_tail *tail) {
+	int options = tail->options | MONGO_TAILABLE | MONGO_AWAIT_DATA;
+	bson query;
+	Tcl_DString msg;
+	int status;
+
+	if (tail->conn == NULL) {
+		tail->conn = (mongo *)ckalloc (sizeof (mongo));
+		if (mongotcl_connectSide (tail->md, tail->conn) != MONGO_OK) {
+			return MONGO_ERROR;
+		}
+	}
+
+	if (strcmp (tail->field, "ts") == 0) {
+		options |= MONGOTCL_OPLOG_REPLAY;
+	}
+
+	mongotcl_tailQuery (tail, &query);
+	Tcl_DStringInit (&msg);
+	tail->request = mongotcl_wireBuildQuery (&msg, tail->ns, options, tail->last == NULL ? tail->skip : 0, tail->batch_size, &query, tail->fields);
+	status = mongotcl_wireSend (tail->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+	Tcl_DStringFree (&msg);
+	bson_destroy (&query);
+
+	if (status != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (tail->fd < 0) {
+		tail->fd = tail->conn->sock;
+		Tcl_CreateFileHandler (tail->fd, TCL_READABLE, mongotcl_tailReadableProc, (ClientData)tail);
+	}
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailRetryProc --
+ *
+ *      Timer handler reopening the tail's cursor.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_tailRetryProc (ClientData clientData) {
+	mongotcl_tail *tail = (mongotcl_tail *)clientData;
+
+	tail->timer = NULL;
+
+	if (mongotcl_tailOpen (tail) != MONGO_OK) {
+		mongotcl_tailClose (tail);
+		mongotcl_tailSchedule (tail, MONGOTCL_TAIL_RETRY_MS);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailRemember --
+ *
+ *      Note the resume field of a document delivered, so a reopened
+ *      cursor starts after it.  Documents without it are not noted.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_tailRemember (mongotcl_tail *tail, const char *data) {
+	bson_iterator it;
+
+	if (mongotcl_bsonFindRaw (&it, data, tail->field) == BSON_EOO) {
+		return;
+	}
+
+	if (tail->last == NULL) {
+		tail->last = (bson *)ckalloc (sizeof (bson));
+	} else {
+		bson_destroy (tail->last);
+	}
+
+	bson_init (tail->last);
+	bson_append_element (tail->last, NULL, &it);
+	bson_finish (tail->last);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailReadableProc --
+ *
+ *      File handler for the tail's connection.  Reads the reply to its
+ *      query or getMore, hands each document to deliverProc and asks for
+ *      more, or reopens the cursor if the server dropped it.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_tailReadableProc (ClientData clientData, int mask) {
+	mongotcl_tail *tail = (mongotcl_tail *)clientData;
+	mongo_reply *reply;
+	bson_iterator it;
+	const char *data;
+	int i;
+
+	if (mongotcl_wireReadReply (tail->conn, &reply) != MONGO_OK) {
+		mongotcl_tailClose (tail);
+		mongotcl_tailSchedule (tail, MONGOTCL_TAIL_RETRY_MS);
+		return;
+	}
+
+	if (reply->head.responseTo != tail->request) {
+		bson_free (reply);
+		return;
+	}
+	tail->request = 0;
+	data = &reply->objs;
+
+	Tcl_Preserve ((ClientData)tail);
+
+	/* QueryFailure won't go away by asking again */
+	if (reply->fields.flag & 0x02) {
+		const char *message = "query failed";
+
+		if (reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, data, "$err") == BSON_STRING) {
+			message = bson_iterator_string (&it);
+		}
+		mongotcl_tailClose (tail);
+		tail->failProc (tail->clientData, message);
+		bson_free (reply);
+		Tcl_Release ((ClientData)tail);
+		return;
+	}
+
+	/* CursorNotFound */
+	tail->cursor_id = (reply->fields.flag & 0x01) ? 0 : reply->fields.cursorID;
+
+	for (i = 0; i < reply->fields.num && !tail->stopped; i++) {
+		int size;
+
+		mongotcl_tailRemember (tail, data);
+		tail->deliverProc (tail->clientData, data);
+
+		bson_little_endian32 (&size, data);
+		data += size;
+	}
+
+	/* deliverProc may have stopped the tail */
+	if (!tail->stopped) {
+		if (tail->cursor_id != 0) {
+			Tcl_DString msg;
+			int status;
+
+			Tcl_DStringInit (&msg);
+			tail->request = mongotcl_wireBuildGetMore (&msg, tail->ns, tail->batch_size, tail->cursor_id);
+			status = mongotcl_wireSend (tail->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+			Tcl_DStringFree (&msg);
+
+			if (status != MONGO_OK) {
+				mongotcl_tailClose (tail);
+				mongotcl_tailSchedule (tail, MONGOTCL_TAIL_RETRY_MS);
+			}
+		} else if (reply->fields.num > 0) {
+			/* dead, but documents are arriving, so reopen now */
+			mongotcl_tailSchedule (tail, 0);
+		} else {
+			/* dead and empty, as when the collection has no documents
+			 * yet; the server won't keep such a cursor open */
+			mongotcl_tailSchedule (tail, MONGOTCL_TAIL_RETRY_MS);
+		}
+	}
+	bson_free (reply);
+	Tcl_Release ((ClientData)tail);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailStart --
+ *
+ *      Start following a tailable query on a connection of its own to
+ *      the object's server.  Each document is passed to deliverProc.  If
+ *      the server drops the cursor it is reopened for documents whose
+ *      field is greater than the last one delivered, or than the single
+ *      element of after, if given, before any are.  A query the server
+ *      rejects is passed to failProc and not retried.
+ *
+ * Results:
+ *      The tail, which the caller stops with mongotcl_tailStop, or NULL
+ *      with an error left in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+mongotcl_tail *
+mongotcl_tailStart (Tcl_Interp *interp, mongotcl_clientData *md, const char *ns, const bson *query, const bson *fields, int options, int skip, int batchSize, const char *field, const bson *after, mongotcl_tailDeliverProc *deliverProc, mongotcl_tailFailProc *failProc, ClientData clientData) {
+	mongotcl_tail *tail = (mongotcl_tail *)ckalloc (sizeof (mongotcl_tail));
+	bson empty;
+
+	tail->md = md;
+	tail->ns = ckalloc (strlen (ns) + 1);
+	strcpy (tail->ns, ns);
+	bson_copy (&tail->query, query != NULL ? query : bson_empty (&empty));
+	tail->fields = NULL;
+	if (fields != NULL) {
+		tail->fields = (bson *)ckalloc (sizeof (bson));
+		bson_copy (tail->fields, fields);
+	}
+	tail->options = options;
+	tail->skip = skip;
+	tail->batch_size = batchSize;
+	tail->field = ckalloc (strlen (field) + 1);
+	strcpy (tail->field, field);
+	tail->conn = NULL;
+	tail->fd = -1;
+	tail->request = 0;
+	tail->cursor_id = 0;
+	tail->last = NULL;
+	if (after != NULL) {
+		tail->last = (bson *)ckalloc (sizeof (bson));
+		bson_copy (tail->last, after);
+	}
+	tail->timer = NULL;
+	tail->stopped = 0;
+	tail->deliverProc = deliverProc;
+	tail->failProc = failProc;
+	tail->clientData = clientData;
+
+	if (mongotcl_tailOpen (tail) != MONGO_OK) {
+		mongotcl_setMongoError (interp, tail->conn);
+		mongotcl_tailClose (tail);
+		mongotcl_tailFree ((char *)tail);
+		return NULL;
+	}
+
+	tail->next = md->tails;
+	md->tails = tail;
+	return tail;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailStop --
+ *
+ *      Stop a tail and close its connection.  It is freed once it is
+ *      no longer in use.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_tailStop (mongotcl_tail *tail) {
+	if (tail->timer != NULL) {
+		Tcl_DeleteTimerHandler (tail->timer);
+		tail->timer = NULL;
+	}
+
+	mongotcl_tailClose (tail);
+
+	if (tail->md != NULL) {
+		mongotcl_tail **link;
+
+		for (link = &tail->md->tails; *link != NULL; link = &(*link)->next) {
+			if (*link == tail) {
+				*link = tail->next;
+				break;
+			}
+		}
+		tail->md = NULL;
+	}
+
+	tail->stopped = 1;
+	Tcl_EventuallyFree ((ClientData)tail, mongotcl_tailFree);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_tailForget --
+ *
+ *      The mongo object is going away; close every tail started on it,
+ *      since they reconnect through it.  Their owners still stop them.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_tailForget (mongotcl_clientData *md) {
+	mongotcl_tail *tail;
+
+	for (tail = md->tails; tail != NULL; tail = tail->next) {
+		if (tail->timer != NULL) {
+			Tcl_DeleteTimerHandler (tail->timer);
+			tail->timer = NULL;
+		}
+		mongotcl_tailClose (tail);
+		tail->md = NULL;
+		tail->stopped = 1;
+	}
+	md->tails = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_listenDeliver --
+ *
+ *      Pass a document a listening cursor received to its callback.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_listenDeliver (ClientData clientData, const char *data) {
+	mongotcl_cursorClientData *mc = (mongotcl_cursorClientData *)clientData;
+	Tcl_Interp *interp = mc->interp;
+	Tcl_Obj *cmdObj;
+
+	if (mc->listen_callback == NULL) {
+		return;
+	}
+
+	Tcl_Preserve ((ClientData)mc);
+	Tcl_Preserve ((ClientData)interp);
+	cmdObj = Tcl_DuplicateObj (mc->listen_callback);
+	Tcl_IncrRefCount (cmdObj);
+	Tcl_ListObjAppendElement (NULL, cmdObj, mongotcl_bsontolist_raw (interp, Tcl_NewObj (), data, 0));
+	if (Tcl_EvalObjEx (interp, cmdObj, TCL_EVAL_GLOBAL) != TCL_OK) {
+		Tcl_BackgroundError (interp);
+	}
+	Tcl_DecrRefCount (cmdObj);
+	Tcl_Release ((ClientData)interp);
+	Tcl_Release ((ClientData)mc);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_listenFail --
+ *
+ *      A listening cursor's query was rejected; stop listening and
+ *      report it as a background error.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_listenFail (ClientData clientData, const char *message) {
+	mongotcl_cursorClientData *mc = (mongotcl_cursorClientData *)clientData;
+	Tcl_Interp *interp = mc->interp;
+
+	Tcl_SetObjResult (interp, Tcl_ObjPrintf ("tailable cursor on %s failed: %s", mc->cursor->ns, message));
+	Tcl_SetErrorCode (interp, "MONGO", "CURSOR_QUERY_FAIL", NULL);
+	mongotcl_listenStop (mc);
+	Tcl_BackgroundError (interp);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_listenStop --
+ *
+ *      Stop a cursor listening.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_listenStop (mongotcl_cursorClientData *mc) {
+	if (mc->listen_tail != NULL) {
+		mongotcl_tailStop (mc->listen_tail);
+		mc->listen_tail = NULL;
+	}
+
+	if (mc->listen_callback != NULL) {
+		Tcl_DecrRefCount (mc->listen_callback);
+		mc->listen_callback = NULL;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_listenObjCmd --
+ *
+ *      Implements "$cursor listen ?callback? ?-resume_field field?".
+ *      With no callback, returns the current one.  An empty callback
+ *      stops listening.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_listenObjCmd (Tcl_Interp *interp, mongotcl_cursorClientData *mc, int objc, Tcl_Obj *CONST objv[]) {
+	mongo_cursor *cursor = mc->cursor;
+	const char *field;
+	int length;
+
+	if (objc != 2 && objc != 3 && objc != 5) {
+		Tcl_WrongNumArgs (interp, 2, objv, "?callback? ?-resume_field field?");
+		return TCL_ERROR;
+	}
+
+	if (objc == 2) {
+		if (mc->listen_callback != NULL) {
+			Tcl_SetObjResult (interp, mc->listen_callback);
+		}
+		return TCL_OK;
+	}
+
+	if (Tcl_ListObjLength (interp, objv[2], &length) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (length == 0) {
+		mongotcl_listenStop (mc);
+		return TCL_OK;
+	}
+
+	if (objc == 5) {
+		if (strcmp (Tcl_GetString (objv[3]), "-resume_field") != 0) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -resume_field", Tcl_GetString (objv[3])));
+			return TCL_ERROR;
+		}
+		field = Tcl_GetString (objv[4]);
+	} else if (strncmp (cursor->ns, "local.oplog", 11) == 0) {
+		field = "ts";
+	} else {
+		field = "_id";
+	}
+
+	if (mc->md == NULL) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("the cursor's mongo object has been deleted", -1));
+		return TCL_ERROR;
+	}
+
+	/* already listening; a new resume field means starting over */
+	if (mc->listen_tail != NULL && objc == 3) {
+		Tcl_DecrRefCount (mc->listen_callback);
+		mc->listen_callback = objv[2];
+		Tcl_IncrRefCount (mc->listen_callback);
+		return TCL_OK;
+	}
+	mongotcl_listenStop (mc);
+
+	mc->listen_tail = mongotcl_tailStart (interp, mc->md, cursor->ns, cursor->query, cursor->fields, cursor->options, cursor->skip, mc->batch_size, field, NULL, mongotcl_listenDeliver, mongotcl_listenFail, (ClientData)mc);
+	if (mc->listen_tail == NULL) {
+		return TCL_ERROR;
+	}
+
+	mc->listen_callback = objv[2];
+	Tcl_IncrRefCount (mc->listen_callback);
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
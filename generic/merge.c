@@ -0,0 +1,707 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * merge cursors - several cursors sorted the same way read as one
+ * stream in that order, through a heap holding the current document of
+ * each, compared as raw BSON the way the server orders values
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <assert.h>
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergeTypeRank --
+ *
+ *      Return where values of a BSON type sort among other types, as
+ *      the server orders them.  A missing field sorts as null.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mergeTypeRank (bson_type type) {
+	switch (type) {
+		case BSON_MINKEY:
+			return 0;
+
+		case BSON_EOO:
+		case BSON_UNDEFINED:
+		case BSON_NULL:
+			return 1;
+
+		case BSON_INT:
+		case BSON_LONG:
+		case BSON_DOUBLE:
+			return 2;
+
+		case BSON_SYMBOL:
+		case BSON_STRING:
+			return 3;
+
+		case BSON_OBJECT:
+			return 4;
+
+		case BSON_ARRAY:
+			return 5;
+
+		case BSON_BINDATA:
+			return 6;
+
+		case BSON_OID:
+			return 7;
+
+		case BSON_BOOL:
+			return 8;
+
+		case BSON_DATE:
+			return 9;
+
+		case BSON_TIMESTAMP:
+			return 10;
+
+		case BSON_REGEX:
+			return 11;
+
+		case BSON_MAXKEY:
+			return 13;
+
+		default:
+			return 12;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergeCompareBytes --
+ *
+ *      Compare two byte strings, a shorter one before any it begins.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mergeCompareBytes (const char *a, int aLen, const char *b, int bLen) {
+	int c = memcmp (a, b, (aLen < bLen) ? aLen : bLen);
+
+	if (c != 0) {
+		return (c < 0) ? -1 : 1;
+	}
+	return (aLen < bLen) ? -1 : (aLen > bLen);
+}
+
+
+static int
+mongotcl_mergeCompareValues (const bson_iterator *a, bson_type aType, const bson_iterator *b, bson_type bType);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergeCompareDocs --
+ *
+ *      Compare two embedded documents or arrays element by element: by
+ *      type, then name, then value.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mergeCompareDocs (const bson_iterator *a, const bson_iterator *b) {
+	bson_iterator subA;
+	bson_iterator subB;
+
+	bson_iterator_subiterator (a, &subA);
+	bson_iterator_subiterator (b, &subB);
+
+	for (;;) {
+		bson_type aType = bson_iterator_next (&subA);
+		bson_type bType = bson_iterator_next (&subB);
+		int c;
+
+		if (aType == BSON_EOO || bType == BSON_EOO) {
+			return (aType != BSON_EOO) - (bType != BSON_EOO);
+		}
+
+		if ((c = mongotcl_mergeTypeRank (aType) - mongotcl_mergeTypeRank (bType)) != 0) {
+			return (c < 0) ? -1 : 1;
+		}
+
+		if ((c = strcmp (bson_iterator_key (&subA), bson_iterator_key (&subB))) != 0) {
+			return (c < 0) ? -1 : 1;
+		}
+
+		if ((c = mongotcl_mergeCompareValues (&subA, aType, &subB, bType)) != 0) {
+			return c;
+		}
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergeCompareValues --
+ *
+ *      Compare two BSON values the way the server sorts them: first by
+ *      type, then by value within the type.  A type of BSON_EOO means
+ *      the field is missing.
+ *
+ * Results:
+ *      -1, 0 or 1.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mergeCompareValues (const bson_iterator *a, bson_type aType, const bson_iterator *b, bson_type bType) {
+	int c = mongotcl_mergeTypeRank (aType) - mongotcl_mergeTypeRank (bType);
+
+	if (c != 0) {
+		return (c < 0) ? -1 : 1;
+	}
+
+	switch (aType) {
+		case BSON_INT:
+		case BSON_LONG:
+		case BSON_DOUBLE: {
+			if (aType != BSON_DOUBLE && bType != BSON_DOUBLE) {
+				int64_t x = bson_iterator_long (a);
+				int64_t y = bson_iterator_long (b);
+
+				return (x < y) ? -1 : (x > y);
+			} else {
+				double x = bson_iterator_double (a);
+				double y = bson_iterator_double (b);
+
+				return (x < y) ? -1 : (x > y);
+			}
+		}
+
+		case BSON_SYMBOL:
+		case BSON_STRING:
+		case BSON_CODE: {
+			return mongotcl_mergeCompareBytes (bson_iterator_string (a), bson_iterator_string_len (a), bson_iterator_string (b), bson_iterator_string_len (b));
+		}
+
+		case BSON_OBJECT:
+		case BSON_ARRAY: {
+			return mongotcl_mergeCompareDocs (a, b);
+		}
+
+		case BSON_BINDATA: {
+			int aLen = bson_iterator_bin_len (a);
+			int bLen = bson_iterator_bin_len (b);
+
+			if (aLen != bLen) {
+				return (aLen < bLen) ? -1 : 1;
+			}
+
+			if (bson_iterator_bin_type (a) != bson_iterator_bin_type (b)) {
+				return ((unsigned char)bson_iterator_bin_type (a) < (unsigned char)bson_iterator_bin_type (b)) ? -1 : 1;
+			}
+			return mongotcl_mergeCompareBytes (bson_iterator_bin_data (a), aLen, bson_iterator_bin_data (b), bLen);
+		}
+
+		case BSON_OID: {
+			return mongotcl_mergeCompareBytes ((const char *)bson_iterator_oid (a), 12, (const char *)bson_iterator_oid (b), 12);
+		}
+
+		case BSON_BOOL: {
+			return (bson_iterator_bool (a) != 0) - (bson_iterator_bool (b) != 0);
+		}
+
+		case BSON_DATE: {
+			bson_date_t x = bson_iterator_date (a);
+			bson_date_t y = bson_iterator_date (b);
+
+			return (x < y) ? -1 : (x > y);
+		}
+
+		case BSON_TIMESTAMP: {
+			unsigned int x = (unsigned int)bson_iterator_timestamp_time (a);
+			unsigned int y = (unsigned int)bson_iterator_timestamp_time (b);
+
+			if (x == y) {
+				x = (unsigned int)bson_iterator_timestamp_increment (a);
+				y = (unsigned int)bson_iterator_timestamp_increment (b);
+			}
+			return (x < y) ? -1 : (x > y);
+		}
+
+		case BSON_REGEX: {
+			if ((c = strcmp (bson_iterator_regex (a), bson_iterator_regex (b))) == 0) {
+				c = strcmp (bson_iterator_regex_opts (a), bson_iterator_regex_opts (b));
+			}
+			return (c < 0) ? -1 : (c > 0);
+		}
+
+		default: {
+			return 0;
+		}
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergeCompare --
+ *
+ *      Compare the current documents of two inputs by the sort keys.
+ *      Documents that sort the same come from the earlier input first.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mergeCompare (mongotcl_mergeClientData *mg, int x, int y) {
+	const char *a = mg->inputs[x].mc->cursor->current.data;
+	const char *b = mg->inputs[y].mc->cursor->current.data;
+	int i;
+
+	for (i = 0; i < mg->nKeys; i++) {
+		bson_iterator itA;
+		bson_iterator itB;
+		bson_type aType = mongotcl_mirrorField (&itA, a, mg->keys[i]);
+		bson_type bType = mongotcl_mirrorField (&itB, b, mg->keys[i]);
+		int c = mongotcl_mergeCompareValues (&itA, aType, &itB, bType);
+
+		if (c != 0) {
+			return c * mg->directions[i];
+		}
+	}
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergePush --
+ *
+ *      Add an input whose cursor is on a document to the heap.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_mergePush (mongotcl_mergeClientData *mg, int input) {
+	int i = mg->heapSize++;
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (mongotcl_mergeCompare (mg, mg->heap[parent], input) <= 0) {
+			break;
+		}
+		mg->heap[i] = mg->heap[parent];
+		i = parent;
+	}
+	mg->heap[i] = input;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergePop --
+ *
+ *      Take the input with the least current document off the heap.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mergePop (mongotcl_mergeClientData *mg) {
+	int top = mg->heap[0];
+	int last = mg->heap[--mg->heapSize];
+	int i = 0;
+
+	for (;;) {
+		int child = 2 * i + 1;
+
+		if (child >= mg->heapSize) {
+			break;
+		}
+
+		if (child + 1 < mg->heapSize && mongotcl_mergeCompare (mg, mg->heap[child + 1], mg->heap[child]) < 0) {
+			child++;
+		}
+
+		if (mongotcl_mergeCompare (mg, last, mg->heap[child]) <= 0) {
+			break;
+		}
+		mg->heap[i] = mg->heap[child];
+		i = child;
+	}
+
+	if (mg->heapSize > 0) {
+		mg->heap[i] = last;
+	}
+	return top;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergeAdvance --
+ *
+ *      Move an input cursor to its next document, just as "$cursor next"
+ *      would, and put it on the heap if there is one.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mergeAdvance (Tcl_Interp *interp, mongotcl_mergeClientData *mg, int input) {
+	Tcl_Obj *nextObjv[2];
+	int more;
+
+	nextObjv[0] = mg->inputs[input].name;
+	nextObjv[1] = Tcl_NewStringObj ("next", -1);
+	Tcl_IncrRefCount (nextObjv[1]);
+
+	if (mongotcl_cursorObjectObjCmd ((ClientData)mg->inputs[input].mc, interp, 2, nextObjv) == TCL_ERROR) {
+		Tcl_DecrRefCount (nextObjv[1]);
+		Tcl_AppendObjToErrorInfo (interp, Tcl_ObjPrintf ("\n    (reading merge input \"%s\")", Tcl_GetString (mg->inputs[input].name)));
+		return TCL_ERROR;
+	}
+	Tcl_DecrRefCount (nextObjv[1]);
+
+	if (Tcl_GetBooleanFromObj (interp, Tcl_GetObjResult (interp), &more) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (more) {
+		mongotcl_mergePush (mg, input);
+	}
+	return TCL_OK;
+}
+
+
+/*
+ *--------------------------------------------------------------
+ *
+ * mongotcl_mergeObjectDelete -- command deletion callback routine.
+ *
+ *--------------------------------------------------------------
+ */
+static void
+mongotcl_mergeObjectDelete (ClientData clientData)
+{
+	mongotcl_mergeClientData *mg = (mongotcl_mergeClientData *)clientData;
+	int i;
+
+	assert (mg->merge_magic == MONGOTCL_MERGE_MAGIC);
+
+	for (i = 0; i < mg->nInputs; i++) {
+		Tcl_DecrRefCount (mg->inputs[i].name);
+		Tcl_Release ((ClientData)mg->inputs[i].mc);
+	}
+
+	for (i = 0; i < mg->nKeys; i++) {
+		ckfree (mg->keys[i]);
+	}
+
+	if (mg->failure != NULL) {
+		Tcl_DecrRefCount (mg->failure);
+	}
+
+	ckfree ((char *)mg->keys);
+	ckfree ((char *)mg->directions);
+	ckfree ((char *)mg->inputs);
+	ckfree ((char *)mg->heap);
+	ckfree ((char *)mg);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergeObjectObjCmd --
+ *
+ *    dispatches the subcommands of a merge cursor object command
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mergeObjectObjCmd (ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	mongotcl_mergeClientData *mg = (mongotcl_mergeClientData *)cData;
+	int optIndex;
+	int result = TCL_OK;
+	int i;
+
+	static CONST char *options[] = {
+		"next",
+		"to_list",
+		"to_array",
+		"source",
+		"delete",
+		NULL
+	};
+
+	enum options {
+		OPT_MERGE_NEXT,
+		OPT_MERGE_TO_LIST,
+		OPT_MERGE_TO_ARRAY,
+		OPT_MERGE_SOURCE,
+		OPT_MERGE_DELETE
+	};
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	/* the heap points into the inputs' current batches */
+	if (optIndex != OPT_MERGE_DELETE) {
+		for (i = 0; i < mg->nInputs; i++) {
+			if (mg->inputs[i].mc->cursor == NULL) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("merge input \"%s\" was deleted", Tcl_GetString (mg->inputs[i].name)));
+				return TCL_ERROR;
+			}
+		}
+	}
+
+	switch ((enum options) optIndex) {
+		case OPT_MERGE_NEXT: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			/* an input that couldn't be read is missing from the heap,
+			 * so what would follow is no longer the whole stream */
+			if (mg->failure != NULL) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("merge input failed earlier: %s", Tcl_GetString (mg->failure)));
+				Tcl_SetErrorCode (interp, "MONGO", "MERGE_FAILED", NULL);
+				return TCL_ERROR;
+			}
+
+			/* the input the last document came from moves on only now,
+			 * so that document stayed readable until this call */
+			if (!mg->started) {
+				mg->started = 1;
+				for (i = 0; i < mg->nInputs && result == TCL_OK; i++) {
+					result = mongotcl_mergeAdvance (interp, mg, i);
+				}
+			} else if (mg->current >= 0) {
+				int input = mg->current;
+
+				mg->current = -1;
+				result = mongotcl_mergeAdvance (interp, mg, input);
+			}
+
+			if (result == TCL_ERROR) {
+				mg->failure = Tcl_DuplicateObj (Tcl_GetObjResult (interp));
+				Tcl_IncrRefCount (mg->failure);
+				return TCL_ERROR;
+			}
+
+			if (mg->heapSize == 0) {
+				mg->current = -1;
+				Tcl_SetObjResult (interp, Tcl_NewBooleanObj (0));
+				break;
+			}
+
+			mg->current = mongotcl_mergePop (mg);
+			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
+			break;
+		}
+
+		case OPT_MERGE_TO_LIST: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 1, objv, "to_list");
+				return TCL_ERROR;
+			}
+
+			if (mg->current < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("no current document", -1));
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, mongotcl_bsontolist (interp, mongo_cursor_bson (mg->inputs[mg->current].mc->cursor)));
+			break;
+		}
+
+		case OPT_MERGE_TO_ARRAY: {
+			if (objc < 3 || objc > 4) {
+				Tcl_WrongNumArgs (interp, 1, objv, "to_array array ?typeArray?");
+				return TCL_ERROR;
+			}
+
+			if (mg->current < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("no current document", -1));
+				return TCL_ERROR;
+			}
+
+			return mongotcl_bsontoarray (interp, Tcl_GetString (objv[2]), (objc == 4) ? Tcl_GetString (objv[3]) : NULL, mongo_cursor_bson (mg->inputs[mg->current].mc->cursor));
+		}
+
+		case OPT_MERGE_SOURCE: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			if (mg->current >= 0) {
+				Tcl_SetObjResult (interp, mg->inputs[mg->current].name);
+			}
+			break;
+		}
+
+		case OPT_MERGE_DELETE: {
+			Tcl_DeleteCommandFromToken (interp, mg->cmdToken);
+			break;
+		}
+	}
+
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mergeCursorObjCmd --
+ *
+ *      Create a merge cursor object...
+ *
+ *      merge_cursor create name -sort {field ...} cursor ?cursor ...?
+ *
+ *      name may be #auto.  Each input cursor must already be set up to
+ *      return its documents in the sort order; a field starting with -
+ *      sorts descending, as with search.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_mergeCursorObjCmd (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	mongotcl_mergeClientData *mg;
+	char *commandName;
+	Tcl_Obj **sortObjv;
+	int sortObjc;
+	int optIndex;
+	int nInputs;
+	int i;
+
+	static CONST char *options[] = {
+		"create",
+		NULL
+	};
+
+	enum options {
+		OPT_CREATE
+	};
+
+	if (objc < 6) {
+		Tcl_WrongNumArgs (interp, 1, objv, "create name -sort fieldList cursor ?cursor ...?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (strcmp (Tcl_GetString (objv[3]), "-sort") != 0) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -sort", Tcl_GetString (objv[3])));
+		return TCL_ERROR;
+	}
+
+	if (Tcl_ListObjGetElements (interp, objv[4], &sortObjc, &sortObjv) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (sortObjc == 0) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-sort needs at least one field", -1));
+		return TCL_ERROR;
+	}
+
+	nInputs = objc - 5;
+	mg = (mongotcl_mergeClientData *)ckalloc (sizeof (mongotcl_mergeClientData));
+	mg->merge_magic = MONGOTCL_MERGE_MAGIC;
+	mg->interp = interp;
+	mg->nKeys = sortObjc;
+	mg->keys = (char **)ckalloc (sizeof (char *) * sortObjc);
+	mg->directions = (int *)ckalloc (sizeof (int) * sortObjc);
+	mg->nInputs = 0;
+	mg->inputs = (mongotcl_mergeInput *)ckalloc (sizeof (mongotcl_mergeInput) * nInputs);
+	mg->heap = (int *)ckalloc (sizeof (int) * nInputs);
+	mg->heapSize = 0;
+	mg->started = 0;
+	mg->current = -1;
+	mg->failure = NULL;
+
+	for (i = 0; i < sortObjc; i++) {
+		char *field = Tcl_GetString (sortObjv[i]);
+
+		mg->directions[i] = 1;
+		if (*field == '-') {
+			mg->directions[i] = -1;
+			field++;
+		}
+		mg->keys[i] = ckalloc (strlen (field) + 1);
+		strcpy (mg->keys[i], field);
+	}
+
+	for (i = 0; i < nInputs; i++) {
+		Tcl_Obj *nameObj = objv[5 + i];
+		Tcl_CmdInfo cmdInfo;
+		mongotcl_cursorClientData *mc;
+		int j;
+
+		if (!Tcl_GetCommandInfo (interp, Tcl_GetString (nameObj), &cmdInfo) || cmdInfo.objClientData == NULL || ((mongotcl_cursorClientData *)cmdInfo.objClientData)->cursor_magic != MONGOTCL_CURSOR_MAGIC) {
+			Tcl_AppendResult (interp, "Error: '", Tcl_GetString (nameObj), "' is not a cursor object", NULL);
+			mongotcl_mergeObjectDelete ((ClientData)mg);
+			return TCL_ERROR;
+		}
+		mc = (mongotcl_cursorClientData *)cmdInfo.objClientData;
+
+		for (j = 0; j < mg->nInputs; j++) {
+			if (mg->inputs[j].mc == mc) {
+				Tcl_AppendResult (interp, "cursor '", Tcl_GetString (nameObj), "' is given more than once", NULL);
+				mongotcl_mergeObjectDelete ((ClientData)mg);
+				return TCL_ERROR;
+			}
+		}
+
+		Tcl_Preserve ((ClientData)mc);
+		mg->inputs[i].mc = mc;
+		mg->inputs[i].name = nameObj;
+		Tcl_IncrRefCount (nameObj);
+		mg->nInputs++;
+	}
+
+	commandName = Tcl_GetString (objv[2]);
+
+	// if commandName is #auto, generate a unique name for the object
+	if (strcmp (commandName, "#auto") == 0) {
+		static unsigned long nextAutoCounter = 0;
+		char autoName[32];
+
+		snprintf (autoName, sizeof (autoName), "merge%lu", nextAutoCounter++);
+		mg->cmdToken = Tcl_CreateObjCommand (interp, autoName, mongotcl_mergeObjectObjCmd, mg, mongotcl_mergeObjectDelete);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (autoName, -1));
+	} else {
+		mg->cmdToken = Tcl_CreateObjCommand (interp, commandName, mongotcl_mergeObjectObjCmd, mg, mongotcl_mergeObjectDelete);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (commandName, -1));
+	}
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
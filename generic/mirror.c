@@ -0,0 +1,788 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * mirrors - a small collection loaded once into a hash table and kept
+ * up to date by tailing the oplog, so lookups are memory reads
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <assert.h>
+
+#define MONGOTCL_DEFAULT_OPLOG "local.oplog.rs"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorField --
+ *
+ *      Like mongotcl_bsonFindRaw, but the key may be a dotted path into
+ *      embedded documents.
+ *
+ *----------------------------------------------------------------------
+ */
+bson_type
+mongotcl_mirrorField (bson_iterator *it, const char *data, const char *path) {
+	const char *dot;
+
+	while ((dot = strchr (path, '.')) != NULL) {
+		Tcl_DString name;
+		bson_type t;
+
+		Tcl_DStringInit (&name);
+		Tcl_DStringAppend (&name, path, (int)(dot - path));
+		t = mongotcl_bsonFindRaw (it, data, Tcl_DStringValue (&name));
+		Tcl_DStringFree (&name);
+
+		if (t != BSON_OBJECT) {
+			return BSON_EOO;
+		}
+		data = bson_iterator_value (it);
+		path = dot + 1;
+	}
+
+	return mongotcl_bsonFindRaw (it, data, path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorKeyString --
+ *
+ *      Append the string form of the element the iterator is on, the
+ *      way it is looked up with "$mirror get".
+ *
+ * Results:
+ *      1, or 0 if the element's type can't be used as a key.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_mirrorKeyString (const bson_iterator *it, Tcl_DString *ds) {
+	char buf[TCL_DOUBLE_SPACE];
+
+	switch (bson_iterator_type (it)) {
+		case BSON_STRING: {
+			Tcl_DStringAppend (ds, bson_iterator_string (it), -1);
+			return 1;
+		}
+
+		case BSON_OID: {
+			bson_oid_to_string (bson_iterator_oid (it), buf);
+			break;
+		}
+
+		case BSON_INT: {
+			snprintf (buf, sizeof (buf), "%d", bson_iterator_int (it));
+			break;
+		}
+
+		case BSON_LONG: {
+			snprintf (buf, sizeof (buf), "%" TCL_LL_MODIFIER "d", (Tcl_WideInt)bson_iterator_long (it));
+			break;
+		}
+
+		case BSON_DOUBLE: {
+			Tcl_PrintDouble (NULL, bson_iterator_double (it), buf);
+			break;
+		}
+
+		default: {
+			return 0;
+		}
+	}
+
+	Tcl_DStringAppend (ds, buf, -1);
+	return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorRemove --
+ *
+ *      Drop a document from the mirror.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_mirrorRemove (mongotcl_mirrorDoc *doc) {
+	mongotcl_mirrorUnindexDoc (doc);
+
+	if (doc->keyEntry != NULL) {
+		Tcl_DeleteHashEntry (doc->keyEntry);
+	}
+	Tcl_DeleteHashEntry (doc->idEntry);
+	Tcl_DecrRefCount (doc->doc);
+	ckfree (doc->data);
+	ckfree ((char *)doc);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorRemoveId --
+ *
+ *      Drop the document with the _id the iterator is on, if we have it.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_mirrorRemoveId (mongotcl_mirrorClientData *mm, const bson_iterator *it) {
+	Tcl_DString id;
+	Tcl_HashEntry *entry;
+
+	Tcl_DStringInit (&id);
+	if (mongotcl_mirrorKeyString (it, &id) && (entry = Tcl_FindHashEntry (&mm->byId, Tcl_DStringValue (&id))) != NULL) {
+		mongotcl_mirrorRemove ((mongotcl_mirrorDoc *)Tcl_GetHashValue (entry));
+	}
+	Tcl_DStringFree (&id);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorClear --
+ *
+ *      Drop every document from the mirror.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_mirrorClear (mongotcl_mirrorClientData *mm) {
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch search;
+
+	while ((entry = Tcl_FirstHashEntry (&mm->byId, &search)) != NULL) {
+		mongotcl_mirrorRemove ((mongotcl_mirrorDoc *)Tcl_GetHashValue (entry));
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorStore --
+ *
+ *      Add a document to the mirror, replacing the one with the same
+ *      _id and any other with the same key.  Documents are kept by _id
+ *      so deletes, which only carry the _id, can find them; those
+ *      without a usable key can't be looked up but are still kept.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_mirrorStore (mongotcl_mirrorClientData *mm, const char *data) {
+	mongotcl_mirrorDoc *doc;
+	Tcl_DString id;
+	Tcl_DString key;
+	Tcl_HashEntry *entry;
+	bson_iterator it;
+	int new;
+	int size;
+
+	Tcl_DStringInit (&id);
+	if (mongotcl_bsonFindRaw (&it, data, "_id") == BSON_EOO || !mongotcl_mirrorKeyString (&it, &id)) {
+		Tcl_DStringFree (&id);
+		return;
+	}
+
+	if ((entry = Tcl_FindHashEntry (&mm->byId, Tcl_DStringValue (&id))) != NULL) {
+		mongotcl_mirrorRemove ((mongotcl_mirrorDoc *)Tcl_GetHashValue (entry));
+	}
+
+	doc = (mongotcl_mirrorDoc *)ckalloc (sizeof (mongotcl_mirrorDoc));
+	doc->doc = mongotcl_bsontolist_raw (mm->interp, Tcl_NewObj (), data, 0);
+	Tcl_IncrRefCount (doc->doc);
+	bson_little_endian32 (&size, data);
+	doc->data = ckalloc (size);
+	memcpy (doc->data, data, size);
+	doc->keyEntry = NULL;
+	doc->postings = NULL;
+	doc->idEntry = Tcl_CreateHashEntry (&mm->byId, Tcl_DStringValue (&id), &new);
+	Tcl_SetHashValue (doc->idEntry, doc);
+	Tcl_DStringFree (&id);
+
+	Tcl_DStringInit (&key);
+	if (mongotcl_mirrorField (&it, data, mm->key) != BSON_EOO && mongotcl_mirrorKeyString (&it, &key)) {
+		doc->keyEntry = Tcl_CreateHashEntry (&mm->byKey, Tcl_DStringValue (&key), &new);
+		if (!new) {
+			mongotcl_mirrorDoc *other = (mongotcl_mirrorDoc *)Tcl_GetHashValue (doc->keyEntry);
+
+			other->keyEntry = NULL;
+			mongotcl_mirrorRemove (other);
+		}
+		Tcl_SetHashValue (doc->keyEntry, doc);
+	}
+	Tcl_DStringFree (&key);
+
+	mongotcl_mirrorIndexDoc (mm, doc);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorFetch --
+ *
+ *      Re-read a document an update changed with operators, which we
+ *      don't apply ourselves, and store or drop it.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_mirrorFetch (mongotcl_mirrorClientData *mm, const char *selectorData) {
+	mongotcl_clientData *md = mm->tail->md;
+	bson selector;
+	bson out;
+	bson_iterator it;
+
+	if (md == NULL) {
+		return;
+	}
+
+	if (md->pipeline_pending > 0 && mongotcl_pipelineDrain (md) != MONGO_OK) {
+		return;
+	}
+
+	if (mongotcl_flushWrites (md) != MONGO_OK) {
+		return;
+	}
+
+	bson_init_finished_data (&selector, (char *)selectorData);
+	mongo_clear_errors (md->conn);
+
+	if (mongo_find_one (md->conn, mm->ns, &selector, NULL, &out) == MONGO_OK) {
+		mongotcl_mirrorStore (mm, out.data);
+		bson_destroy (&out);
+	} else if (md->conn->err == MONGO_CONN_SUCCESS && mongotcl_bsonFindRaw (&it, selectorData, "_id") != BSON_EOO) {
+		/* it no longer exists */
+		mongotcl_mirrorRemoveId (mm, &it);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorApply --
+ *
+ *      Apply an oplog entry for the mirrored collection.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_mirrorApply (ClientData clientData, const char *data) {
+	mongotcl_mirrorClientData *mm = (mongotcl_mirrorClientData *)clientData;
+	bson_iterator it;
+	const char *op;
+	const char *o;
+
+	if (mongotcl_bsonFindRaw (&it, data, "op") != BSON_STRING) {
+		return;
+	}
+	op = bson_iterator_string (&it);
+
+	if (mongotcl_bsonFindRaw (&it, data, "o") != BSON_OBJECT) {
+		return;
+	}
+	o = bson_iterator_value (&it);
+
+	switch (op[0]) {
+		case 'i': {
+			mongotcl_mirrorStore (mm, o);
+			mm->inserts++;
+			break;
+		}
+
+		case 'u': {
+			bson_iterator first;
+
+			/* a whole replacement document can be stored as it is */
+			bson_iterator_from_buffer (&first, o);
+			if (bson_iterator_next (&first) != BSON_EOO && bson_iterator_key (&first)[0] != '$' && mongotcl_bsonFindRaw (&it, o, "_id") != BSON_EOO) {
+				mongotcl_mirrorStore (mm, o);
+			} else if (mongotcl_bsonFindRaw (&it, data, "o2") == BSON_OBJECT) {
+				mongotcl_mirrorFetch (mm, bson_iterator_value (&it));
+			}
+			mm->updates++;
+			break;
+		}
+
+		case 'd': {
+			if (mongotcl_bsonFindRaw (&it, o, "_id") != BSON_EOO) {
+				mongotcl_mirrorRemoveId (mm, &it);
+			}
+			mm->deletes++;
+			break;
+		}
+
+		case 'c': {
+			/* the collection being dropped */
+			if (mongotcl_bsonFindRaw (&it, o, "drop") == BSON_STRING && strcmp (bson_iterator_string (&it), strchr (mm->ns, '.') + 1) == 0) {
+				mongotcl_mirrorClear (mm);
+			}
+			break;
+		}
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorFail --
+ *
+ *      The oplog query was rejected.  The mirror keeps what it has but
+ *      is no longer kept up to date; report it as a background error.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_mirrorFail (ClientData clientData, const char *message) {
+	mongotcl_mirrorClientData *mm = (mongotcl_mirrorClientData *)clientData;
+	Tcl_Interp *interp = mm->interp;
+
+	if (mm->error != NULL) {
+		Tcl_DecrRefCount (mm->error);
+	}
+	mm->error = Tcl_NewStringObj (message, -1);
+	Tcl_IncrRefCount (mm->error);
+
+	Tcl_SetObjResult (interp, Tcl_ObjPrintf ("mirror of %s stopped following the oplog: %s", mm->ns, message));
+	Tcl_SetErrorCode (interp, "MONGO", "MIRROR", NULL);
+	Tcl_BackgroundError (interp);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorLoad --
+ *
+ *      Note where the oplog ends, then read the whole collection into
+ *      the mirror and start following the oplog from that point, so
+ *      nothing written while loading is missed.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mirrorLoad (Tcl_Interp *interp, mongotcl_mirrorClientData *mm, mongotcl_clientData *md, const char *oplog) {
+	mongo_cursor *cursor;
+	bson newest;
+	bson out;
+	bson after;
+	bson filter;
+	bson empty;
+	bson_iterator it;
+	Tcl_DString cmdNs;
+	int haveAfter = 0;
+
+	if (md->pipeline_pending > 0 && mongotcl_pipelineDrain (md) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	if (mongotcl_flushWrites (md) != MONGO_OK) {
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	bson_init (&newest);
+	bson_append_start_object (&newest, "$query");
+	bson_append_finish_object (&newest);
+	bson_append_start_object (&newest, "$orderby");
+	bson_append_int (&newest, "$natural", -1);
+	bson_append_finish_object (&newest);
+	bson_finish (&newest);
+
+	mongo_clear_errors (md->conn);
+	if (mongo_find_one (md->conn, oplog, &newest, NULL, &out) == MONGO_OK) {
+		if (bson_find (&it, &out, "ts") != BSON_EOO) {
+			bson_init (&after);
+			bson_append_element (&after, NULL, &it);
+			bson_finish (&after);
+			haveAfter = 1;
+		}
+		bson_destroy (&out);
+	} else if (md->conn->err != MONGO_CONN_SUCCESS) {
+		bson_destroy (&newest);
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+	bson_destroy (&newest);
+
+	if ((cursor = mongo_find (md->conn, mm->ns, bson_empty (&empty), NULL, 0, 0, 0)) == NULL) {
+		if (haveAfter) {
+			bson_destroy (&after);
+		}
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	while (mongo_cursor_next (cursor) == MONGO_OK) {
+		mongotcl_mirrorStore (mm, cursor->current.data);
+		mm->loaded++;
+	}
+
+	if (cursor->err != MONGO_CURSOR_EXHAUSTED) {
+		mongotcl_setCursorError (interp, cursor);
+		mongo_cursor_destroy (cursor);
+		if (haveAfter) {
+			bson_destroy (&after);
+		}
+		return TCL_ERROR;
+	}
+	mongo_cursor_destroy (cursor);
+
+	/* entries for the collection, and commands in its database that
+	 * might drop it */
+	Tcl_DStringInit (&cmdNs);
+	mongotcl_namespaceToDb (mm->ns, &cmdNs);
+	Tcl_DStringAppend (&cmdNs, ".$cmd", -1);
+
+	bson_init (&filter);
+	bson_append_start_object (&filter, "ns");
+	bson_append_start_array (&filter, "$in");
+	bson_append_string (&filter, "0", mm->ns);
+	bson_append_string (&filter, "1", Tcl_DStringValue (&cmdNs));
+	bson_append_finish_object (&filter);
+	bson_append_finish_object (&filter);
+	bson_finish (&filter);
+	Tcl_DStringFree (&cmdNs);
+
+	mm->tail = mongotcl_tailStart (interp, md, oplog, &filter, NULL, 0, 0, 0, "ts", haveAfter ? &after : NULL, mongotcl_mirrorApply, mongotcl_mirrorFail, (ClientData)mm);
+
+	bson_destroy (&filter);
+	if (haveAfter) {
+		bson_destroy (&after);
+	}
+
+	return mm->tail == NULL ? TCL_ERROR : TCL_OK;
+}
+
+
+/*
+ *--------------------------------------------------------------
+ *
+ * mongotcl_mirrorObjectDelete -- command deletion callback routine.
+ *
+ *--------------------------------------------------------------
+ */
+static void
+mongotcl_mirrorObjectDelete (ClientData clientData)
+{
+	mongotcl_mirrorClientData *mm = (mongotcl_mirrorClientData *)clientData;
+
+	assert (mm->mirror_magic == MONGOTCL_MIRROR_MAGIC);
+
+	if (mm->tail != NULL) {
+		mongotcl_tailStop (mm->tail);
+	}
+
+	mongotcl_mirrorClear (mm);
+	mongotcl_mirrorIndexCleanup (mm);
+	Tcl_DeleteHashTable (&mm->byId);
+	Tcl_DeleteHashTable (&mm->byKey);
+
+	if (mm->error != NULL) {
+		Tcl_DecrRefCount (mm->error);
+	}
+
+	ckfree (mm->ns);
+	ckfree (mm->key);
+	ckfree ((char *)mm);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorObjectObjCmd --
+ *
+ *    dispatches the subcommands of a mirror object command
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_mirrorObjectObjCmd (ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	mongotcl_mirrorClientData *mm = (mongotcl_mirrorClientData *)cData;
+	Tcl_HashEntry *entry;
+	int optIndex;
+
+	static CONST char *options[] = {
+		"get",
+		"exists",
+		"keys",
+		"size",
+		"index",
+		"find",
+		"range",
+		"status",
+		"delete",
+		NULL
+	};
+
+	enum options {
+		OPT_MIRROR_GET,
+		OPT_MIRROR_EXISTS,
+		OPT_MIRROR_KEYS,
+		OPT_MIRROR_SIZE,
+		OPT_MIRROR_INDEX,
+		OPT_MIRROR_FIND,
+		OPT_MIRROR_RANGE,
+		OPT_MIRROR_STATUS,
+		OPT_MIRROR_DELETE
+	};
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	switch ((enum options) optIndex) {
+		case OPT_MIRROR_GET: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "key");
+				return TCL_ERROR;
+			}
+
+			mm->lookups++;
+			if ((entry = Tcl_FindHashEntry (&mm->byKey, Tcl_GetString (objv[2]))) != NULL) {
+				mm->hits++;
+				Tcl_SetObjResult (interp, ((mongotcl_mirrorDoc *)Tcl_GetHashValue (entry))->doc);
+			}
+			break;
+		}
+
+		case OPT_MIRROR_EXISTS: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "key");
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (Tcl_FindHashEntry (&mm->byKey, Tcl_GetString (objv[2])) != NULL));
+			break;
+		}
+
+		case OPT_MIRROR_KEYS: {
+			Tcl_Obj *listObj = Tcl_NewObj ();
+			Tcl_HashSearch search;
+			char *pattern = NULL;
+
+			if (objc != 2 && objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?pattern?");
+				return TCL_ERROR;
+			}
+
+			if (objc == 3) {
+				pattern = Tcl_GetString (objv[2]);
+			}
+
+			for (entry = Tcl_FirstHashEntry (&mm->byKey, &search); entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+				char *key = Tcl_GetHashKey (&mm->byKey, entry);
+
+				if (pattern == NULL || Tcl_StringMatch (key, pattern)) {
+					Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (key, -1));
+				}
+			}
+			Tcl_SetObjResult (interp, listObj);
+			break;
+		}
+
+		case OPT_MIRROR_SIZE: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewIntObj (mm->byKey.numEntries));
+			break;
+		}
+
+		case OPT_MIRROR_INDEX: {
+			return mongotcl_mirrorIndexObjCmd (interp, mm, objc, objv);
+		}
+
+		case OPT_MIRROR_FIND: {
+			return mongotcl_mirrorFindObjCmd (interp, mm, objc, objv);
+		}
+
+		case OPT_MIRROR_RANGE: {
+			return mongotcl_mirrorRangeObjCmd (interp, mm, objc, objv);
+		}
+
+		case OPT_MIRROR_STATUS: {
+			Tcl_Obj *listObj = Tcl_NewObj ();
+
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("namespace", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (mm->ns, -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("key", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (mm->key, -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("size", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (mm->byKey.numEntries));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("following", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewBooleanObj (mm->error == NULL && mm->tail->md != NULL));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("loaded", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (mm->loaded));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("inserts", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (mm->inserts));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("updates", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (mm->updates));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("deletes", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (mm->deletes));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("lookups", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (mm->lookups));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("hits", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (mm->hits));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("error", -1));
+			Tcl_ListObjAppendElement (interp, listObj, mm->error != NULL ? mm->error : Tcl_NewObj ());
+			Tcl_SetObjResult (interp, listObj);
+			break;
+		}
+
+		case OPT_MIRROR_DELETE: {
+			Tcl_DeleteCommandFromToken (interp, mm->cmdToken);
+			break;
+		}
+	}
+
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorObjCmd --
+ *
+ *      Create a mirror object...
+ *
+ *      mirror create name mongoObject namespace ?-key field? ?-oplog ns?
+ *
+ *      name may be #auto.  The collection is read into the mirror
+ *      before the command returns.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_mirrorObjCmd (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	mongotcl_mirrorClientData *mm;
+	mongotcl_clientData *md;
+	char *commandName;
+	char *namespace;
+	const char *key = "_id";
+	const char *oplog = MONGOTCL_DEFAULT_OPLOG;
+	int optIndex;
+	int i;
+
+	static CONST char *options[] = {
+		"create",
+		NULL
+	};
+
+	enum options {
+		OPT_CREATE
+	};
+
+	if (objc < 5 || (objc & 1) == 0) {
+		Tcl_WrongNumArgs (interp, 1, objv, "create name mongo namespace ?-key field? ?-oplog namespace?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (mongotcl_cmdNameObjToMongo (interp, objv[3], &md) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	namespace = Tcl_GetString (objv[4]);
+	if (strchr (namespace, '.') == NULL) {
+		Tcl_AppendResult (interp, "invalid namespace '", namespace, "'", NULL);
+		Tcl_SetErrorCode (interp, "MONGO", "NS_INVALID", NULL);
+		return TCL_ERROR;
+	}
+
+	for (i = 5; i < objc; i += 2) {
+		char *option = Tcl_GetString (objv[i]);
+
+		if (strcmp (option, "-key") == 0) {
+			key = Tcl_GetString (objv[i + 1]);
+		} else if (strcmp (option, "-oplog") == 0) {
+			oplog = Tcl_GetString (objv[i + 1]);
+		} else {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -key or -oplog", option));
+			return TCL_ERROR;
+		}
+	}
+
+	mm = (mongotcl_mirrorClientData *)ckalloc (sizeof (mongotcl_mirrorClientData));
+	mm->mirror_magic = MONGOTCL_MIRROR_MAGIC;
+	mm->interp = interp;
+	mm->ns = ckalloc (strlen (namespace) + 1);
+	strcpy (mm->ns, namespace);
+	mm->key = ckalloc (strlen (key) + 1);
+	strcpy (mm->key, key);
+	Tcl_InitHashTable (&mm->byId, TCL_STRING_KEYS);
+	Tcl_InitHashTable (&mm->byKey, TCL_STRING_KEYS);
+	mm->indexes = NULL;
+	mm->tail = NULL;
+	mm->error = NULL;
+	mm->loaded = 0;
+	mm->inserts = 0;
+	mm->updates = 0;
+	mm->deletes = 0;
+	mm->lookups = 0;
+	mm->hits = 0;
+
+	if (mongotcl_mirrorLoad (interp, mm, md, oplog) == TCL_ERROR) {
+		mongotcl_mirrorClear (mm);
+		Tcl_DeleteHashTable (&mm->byId);
+		Tcl_DeleteHashTable (&mm->byKey);
+		ckfree (mm->ns);
+		ckfree (mm->key);
+		ckfree ((char *)mm);
+		return TCL_ERROR;
+	}
+
+	commandName = Tcl_GetString (objv[2]);
+
+	// if commandName is #auto, generate a unique name for the object
+	if (strcmp (commandName, "#auto") == 0) {
+		static unsigned long nextAutoCounter = 0;
+		char autoName[32];
+
+		snprintf (autoName, sizeof (autoName), "mirror%lu", nextAutoCounter++);
+		mm->cmdToken = Tcl_CreateObjCommand (interp, autoName, mongotcl_mirrorObjectObjCmd, mm, mongotcl_mirrorObjectDelete);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (autoName, -1));
+	} else {
+		mm->cmdToken = Tcl_CreateObjCommand (interp, commandName, mongotcl_mirrorObjectObjCmd, mm, mongotcl_mirrorObjectDelete);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (commandName, -1));
+	}
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -0,0 +1,585 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * mirror secondary indexes - hash indexes for equality lookups and
+ * ordered skip list indexes for ranges, on any field of a mirrored
+ * collection, kept up to date as documents are stored and removed
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <stdlib.h>
+
+#define MONGOTCL_SKIP_LEVELS 16
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_postingAlloc --
+ *
+ *      Allocate a zeroed posting with room for levels forward links.
+ *
+ *----------------------------------------------------------------------
+ */
+static mongotcl_mirrorPosting *
+mongotcl_postingAlloc (int levels) {
+	size_t size = sizeof (mongotcl_mirrorPosting) + (levels - 1) * sizeof (mongotcl_mirrorPosting *);
+	mongotcl_mirrorPosting *p = (mongotcl_mirrorPosting *)ckalloc (size);
+
+	memset (p, 0, size);
+	p->levels = levels;
+	return p;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_indexCompareValue --
+ *
+ *      Compare a posting in an ordered index with a value.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_indexCompareValue (mongotcl_mirrorIndex *index, const mongotcl_mirrorPosting *p, double number, const char *string) {
+	if (index->numeric) {
+		return (p->number < number) ? -1 : (p->number > number);
+	}
+	return strcmp (p->string, string);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_indexCompare --
+ *
+ *      Order two postings in an ordered index.  Postings with the same
+ *      value are ordered by document so every posting has one place.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_indexCompare (mongotcl_mirrorIndex *index, const mongotcl_mirrorPosting *a, const mongotcl_mirrorPosting *b) {
+	int c = mongotcl_indexCompareValue (index, a, b->number, b->string);
+
+	if (c != 0) {
+		return c;
+	}
+	return (a->doc < b->doc) ? -1 : (a->doc > b->doc);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_indexAdd --
+ *
+ *      Add a document to an index, if it has a value for the field that
+ *      the index can hold.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_indexAdd (mongotcl_mirrorIndex *index, mongotcl_mirrorDoc *doc) {
+	mongotcl_mirrorPosting *p;
+	bson_iterator it;
+	Tcl_DString value;
+
+	if (mongotcl_mirrorField (&it, doc->data, index->field) == BSON_EOO) {
+		return;
+	}
+
+	Tcl_DStringInit (&value);
+	if (index->numeric) {
+		switch (bson_iterator_type (&it)) {
+			case BSON_INT:
+			case BSON_LONG:
+			case BSON_DOUBLE: {
+				break;
+			}
+
+			default: {
+				return;
+			}
+		}
+	} else if (!mongotcl_mirrorKeyString (&it, &value)) {
+		Tcl_DStringFree (&value);
+		return;
+	}
+
+	if (!index->ordered) {
+		int new;
+
+		p = mongotcl_postingAlloc (1);
+		p->bucket = Tcl_CreateHashEntry (&index->buckets, Tcl_DStringValue (&value), &new);
+		if (!new) {
+			p->next = (mongotcl_mirrorPosting *)Tcl_GetHashValue (p->bucket);
+			p->next->prev = p;
+		}
+		Tcl_SetHashValue (p->bucket, p);
+	} else {
+		mongotcl_mirrorPosting *update[MONGOTCL_SKIP_LEVELS];
+		mongotcl_mirrorPosting *x = index->head;
+		int levels = 1;
+		int i;
+
+		while (levels < MONGOTCL_SKIP_LEVELS && (mongotcl_random (&index->random_state) & 3) == 0) {
+			levels++;
+		}
+
+		p = mongotcl_postingAlloc (levels);
+		p->doc = doc;
+		if (index->numeric) {
+			p->number = bson_iterator_double (&it);
+		} else {
+			p->string = ckalloc (Tcl_DStringLength (&value) + 1);
+			strcpy (p->string, Tcl_DStringValue (&value));
+		}
+
+		for (i = index->levels - 1; i >= 0; i--) {
+			while (x->forward[i] != NULL && mongotcl_indexCompare (index, x->forward[i], p) < 0) {
+				x = x->forward[i];
+			}
+			update[i] = x;
+		}
+
+		for (i = index->levels; i < levels; i++) {
+			update[i] = index->head;
+		}
+		if (levels > index->levels) {
+			index->levels = levels;
+		}
+
+		for (i = 0; i < levels; i++) {
+			p->forward[i] = update[i]->forward[i];
+			update[i]->forward[i] = p;
+		}
+	}
+	Tcl_DStringFree (&value);
+
+	p->index = index;
+	p->doc = doc;
+	p->docNext = doc->postings;
+	doc->postings = p;
+	index->count++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_indexRemove --
+ *
+ *      Take a posting out of its index and free it.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_indexRemove (mongotcl_mirrorPosting *p) {
+	mongotcl_mirrorIndex *index = p->index;
+
+	if (!index->ordered) {
+		if (p->prev != NULL) {
+			p->prev->next = p->next;
+		} else if (p->next != NULL) {
+			Tcl_SetHashValue (p->bucket, p->next);
+		} else {
+			Tcl_DeleteHashEntry (p->bucket);
+		}
+
+		if (p->next != NULL) {
+			p->next->prev = p->prev;
+		}
+	} else {
+		mongotcl_mirrorPosting *update[MONGOTCL_SKIP_LEVELS];
+		mongotcl_mirrorPosting *x = index->head;
+		int i;
+
+		for (i = index->levels - 1; i >= 0; i--) {
+			while (x->forward[i] != NULL && mongotcl_indexCompare (index, x->forward[i], p) < 0) {
+				x = x->forward[i];
+			}
+			update[i] = x;
+		}
+
+		for (i = 0; i < p->levels && i < index->levels; i++) {
+			if (update[i]->forward[i] == p) {
+				update[i]->forward[i] = p->forward[i];
+			}
+		}
+
+		while (index->levels > 1 && index->head->forward[index->levels - 1] == NULL) {
+			index->levels--;
+		}
+
+		if (p->string != NULL) {
+			ckfree (p->string);
+		}
+	}
+
+	index->count--;
+	ckfree ((char *)p);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorIndexDoc --
+ *
+ *      Add a document newly stored in the mirror to every index.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_mirrorIndexDoc (mongotcl_mirrorClientData *mm, mongotcl_mirrorDoc *doc) {
+	mongotcl_mirrorIndex *index;
+
+	for (index = mm->indexes; index != NULL; index = index->next) {
+		mongotcl_indexAdd (index, doc);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorUnindexDoc --
+ *
+ *      Take a document being dropped from the mirror out of every index.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_mirrorUnindexDoc (mongotcl_mirrorDoc *doc) {
+	while (doc->postings != NULL) {
+		mongotcl_mirrorPosting *p = doc->postings;
+
+		doc->postings = p->docNext;
+		mongotcl_indexRemove (p);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorIndexCleanup --
+ *
+ *      Free the mirror's indexes, once its documents are gone.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_mirrorIndexCleanup (mongotcl_mirrorClientData *mm) {
+	while (mm->indexes != NULL) {
+		mongotcl_mirrorIndex *index = mm->indexes;
+
+		mm->indexes = index->next;
+		Tcl_DeleteHashTable (&index->buckets);
+		ckfree ((char *)index->head);
+		ckfree (index->field);
+		ckfree ((char *)index);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorFindIndex --
+ *
+ *      Find the mirror's index on a field, or NULL.
+ *
+ *----------------------------------------------------------------------
+ */
+static mongotcl_mirrorIndex *
+mongotcl_mirrorFindIndex (mongotcl_mirrorClientData *mm, const char *field) {
+	mongotcl_mirrorIndex *index;
+
+	for (index = mm->indexes; index != NULL; index = index->next) {
+		if (strcmp (index->field, field) == 0) {
+			return index;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_indexSeek --
+ *
+ *      Return the first posting of an ordered index whose value is not
+ *      less than the one given.
+ *
+ *----------------------------------------------------------------------
+ */
+static mongotcl_mirrorPosting *
+mongotcl_indexSeek (mongotcl_mirrorIndex *index, double number, const char *string) {
+	mongotcl_mirrorPosting *x = index->head;
+	int i;
+
+	for (i = index->levels - 1; i >= 0; i--) {
+		while (x->forward[i] != NULL && mongotcl_indexCompareValue (index, x->forward[i], number, string) < 0) {
+			x = x->forward[i];
+		}
+	}
+	return x->forward[0];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_indexBound --
+ *
+ *      Get a value to compare with an ordered index from a Tcl object.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_indexBound (Tcl_Interp *interp, mongotcl_mirrorIndex *index, Tcl_Obj *obj, double *numberPtr, const char **stringPtr) {
+	*numberPtr = 0.0;
+	*stringPtr = NULL;
+
+	if (index->numeric) {
+		return Tcl_GetDoubleFromObj (interp, obj, numberPtr);
+	}
+
+	*stringPtr = Tcl_GetString (obj);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorIndexObjCmd --
+ *
+ *      Implements "$mirror index ?field? ?-ordered? ?-numeric?".  With
+ *      a field, indexes the mirror on it; without, lists the indexes.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_mirrorIndexObjCmd (Tcl_Interp *interp, mongotcl_mirrorClientData *mm, int objc, Tcl_Obj *CONST objv[]) {
+	mongotcl_mirrorIndex *index;
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch search;
+	char *field;
+	int ordered = 0;
+	int numeric = 0;
+	int i;
+
+	if (objc == 2) {
+		Tcl_Obj *listObj = Tcl_NewObj ();
+
+		for (index = mm->indexes; index != NULL; index = index->next) {
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (index->field, -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (index->numeric ? "numeric" : index->ordered ? "ordered" : "hash", -1));
+		}
+		Tcl_SetObjResult (interp, listObj);
+		return TCL_OK;
+	}
+
+	field = Tcl_GetString (objv[2]);
+
+	for (i = 3; i < objc; i++) {
+		char *option = Tcl_GetString (objv[i]);
+
+		if (strcmp (option, "-ordered") == 0) {
+			ordered = 1;
+		} else if (strcmp (option, "-numeric") == 0) {
+			ordered = 1;
+			numeric = 1;
+		} else {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -ordered or -numeric", option));
+			return TCL_ERROR;
+		}
+	}
+
+	if (mongotcl_mirrorFindIndex (mm, field) != NULL) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("field \"%s\" is already indexed", field));
+		return TCL_ERROR;
+	}
+
+	index = (mongotcl_mirrorIndex *)ckalloc (sizeof (mongotcl_mirrorIndex));
+	index->field = ckalloc (strlen (field) + 1);
+	strcpy (index->field, field);
+	index->ordered = ordered;
+	index->numeric = numeric;
+	index->random_state = 0;
+	index->count = 0;
+	Tcl_InitHashTable (&index->buckets, TCL_STRING_KEYS);
+	index->head = mongotcl_postingAlloc (MONGOTCL_SKIP_LEVELS);
+	index->levels = 1;
+	index->next = mm->indexes;
+	mm->indexes = index;
+
+	for (entry = Tcl_FirstHashEntry (&mm->byId, &search); entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+		mongotcl_indexAdd (index, (mongotcl_mirrorDoc *)Tcl_GetHashValue (entry));
+	}
+
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorFindObjCmd --
+ *
+ *      Implements "$mirror find field value", returning the documents
+ *      whose field has the value in its string form.  Uses an index on
+ *      the field if there is one, else looks at every document.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_mirrorFindObjCmd (Tcl_Interp *interp, mongotcl_mirrorClientData *mm, int objc, Tcl_Obj *CONST objv[]) {
+	mongotcl_mirrorIndex *index;
+	mongotcl_mirrorPosting *p;
+	Tcl_Obj *listObj;
+	char *field;
+	char *value;
+
+	if (objc != 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "field value");
+		return TCL_ERROR;
+	}
+
+	field = Tcl_GetString (objv[2]);
+	value = Tcl_GetString (objv[3]);
+	listObj = Tcl_NewObj ();
+	mm->lookups++;
+
+	if ((index = mongotcl_mirrorFindIndex (mm, field)) == NULL) {
+		Tcl_HashEntry *entry;
+		Tcl_HashSearch search;
+
+		for (entry = Tcl_FirstHashEntry (&mm->byId, &search); entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+			mongotcl_mirrorDoc *doc = (mongotcl_mirrorDoc *)Tcl_GetHashValue (entry);
+			bson_iterator it;
+			Tcl_DString ds;
+
+			Tcl_DStringInit (&ds);
+			if (mongotcl_mirrorField (&it, doc->data, field) != BSON_EOO && mongotcl_mirrorKeyString (&it, &ds) && strcmp (Tcl_DStringValue (&ds), value) == 0) {
+				Tcl_ListObjAppendElement (interp, listObj, doc->doc);
+			}
+			Tcl_DStringFree (&ds);
+		}
+	} else if (!index->ordered) {
+		Tcl_HashEntry *bucket = Tcl_FindHashEntry (&index->buckets, value);
+
+		for (p = (bucket == NULL) ? NULL : (mongotcl_mirrorPosting *)Tcl_GetHashValue (bucket); p != NULL; p = p->next) {
+			Tcl_ListObjAppendElement (interp, listObj, p->doc->doc);
+		}
+	} else {
+		double number;
+		const char *string;
+
+		if (mongotcl_indexBound (interp, index, objv[3], &number, &string) == TCL_ERROR) {
+			Tcl_DecrRefCount (listObj);
+			return TCL_ERROR;
+		}
+
+		for (p = mongotcl_indexSeek (index, number, string); p != NULL && mongotcl_indexCompareValue (index, p, number, string) == 0; p = p->forward[0]) {
+			Tcl_ListObjAppendElement (interp, listObj, p->doc->doc);
+		}
+	}
+
+	if (Tcl_ListObjLength (interp, listObj, &objc) == TCL_OK && objc > 0) {
+		mm->hits++;
+	}
+	Tcl_SetObjResult (interp, listObj);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_mirrorRangeObjCmd --
+ *
+ *      Implements "$mirror range field ?-from value? ?-to value?
+ *      ?-limit n?", returning in order the documents whose field lies
+ *      between the bounds, inclusive.  The field must have an ordered
+ *      index.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_mirrorRangeObjCmd (Tcl_Interp *interp, mongotcl_mirrorClientData *mm, int objc, Tcl_Obj *CONST objv[]) {
+	mongotcl_mirrorIndex *index;
+	mongotcl_mirrorPosting *p;
+	Tcl_Obj *listObj;
+	double fromNumber = 0.0;
+	double toNumber = 0.0;
+	const char *fromString = NULL;
+	const char *toString = NULL;
+	int haveFrom = 0;
+	int haveTo = 0;
+	int limit = -1;
+	int n = 0;
+	int i;
+
+	if (objc < 3 || (objc & 1) == 0) {
+		Tcl_WrongNumArgs (interp, 2, objv, "field ?-from value? ?-to value? ?-limit n?");
+		return TCL_ERROR;
+	}
+
+	if ((index = mongotcl_mirrorFindIndex (mm, Tcl_GetString (objv[2]))) == NULL || !index->ordered) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("field \"%s\" has no ordered index", Tcl_GetString (objv[2])));
+		return TCL_ERROR;
+	}
+
+	for (i = 3; i < objc; i += 2) {
+		char *option = Tcl_GetString (objv[i]);
+
+		if (strcmp (option, "-from") == 0) {
+			if (mongotcl_indexBound (interp, index, objv[i + 1], &fromNumber, &fromString) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+			haveFrom = 1;
+		} else if (strcmp (option, "-to") == 0) {
+			if (mongotcl_indexBound (interp, index, objv[i + 1], &toNumber, &toString) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+			haveTo = 1;
+		} else if (strcmp (option, "-limit") == 0) {
+			if (Tcl_GetIntFromObj (interp, objv[i + 1], &limit) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+		} else {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -from, -to or -limit", option));
+			return TCL_ERROR;
+		}
+	}
+
+	listObj = Tcl_NewObj ();
+	mm->lookups++;
+
+	p = haveFrom ? mongotcl_indexSeek (index, fromNumber, fromString) : index->head->forward[0];
+	for (; p != NULL && (limit < 0 || n < limit); p = p->forward[0], n++) {
+		if (haveTo && mongotcl_indexCompareValue (index, p, toNumber, toString) > 0) {
+			break;
+		}
+		Tcl_ListObjAppendElement (interp, listObj, p->doc->doc);
+	}
+
+	if (n > 0) {
+		mm->hits++;
+	}
+	Tcl_SetObjResult (interp, listObj);
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
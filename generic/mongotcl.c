@@ -8,6 +8,7 @@
 
 #include "mongotcl.h"
 #include <assert.h>
+#include <unistd.h>
 
 
 /*
@@ -126,6 +127,377 @@ mongotcl_setMongoError (Tcl_Interp *interp, mongo *conn) {
     return TCL_ERROR;
 }
 
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_isConnectionError --
+ *
+ *      Return 1 if the connection's last error means the connection
+ *      itself is unusable or no longer talking to the primary, as
+ *      opposed to the server rejecting the operation.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_isConnectionError (mongo *conn) {
+	switch (conn->err) {
+		case MONGO_CONN_NO_SOCKET:
+		case MONGO_CONN_FAIL:
+		case MONGO_CONN_ADDR_FAIL:
+		case MONGO_CONN_NOT_MASTER:
+		case MONGO_CONN_NO_PRIMARY:
+		case MONGO_IO_ERROR:
+		case MONGO_SOCKET_ERROR: {
+			return 1;
+		}
+
+		case MONGO_WRITE_ERROR: {
+			/* "not master" reported by getLastError after a failover */
+			return (conn->errcode == 10058 || conn->errcode == 10107 || conn->errcode == 13435);
+		}
+
+		default: {
+			return 0;
+		}
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_milliseconds / mongotcl_microseconds --
+ *
+ *      Return the current time in milliseconds or microseconds.
+ *
+ *----------------------------------------------------------------------
+ */
+Tcl_WideInt
+mongotcl_milliseconds (void) {
+	Tcl_Time now;
+
+	Tcl_GetTime (&now);
+	return (Tcl_WideInt)now.sec * 1000 + now.usec / 1000;
+}
+
+
+Tcl_WideInt
+mongotcl_microseconds (void) {
+	Tcl_Time now;
+
+	Tcl_GetTime (&now);
+	return (Tcl_WideInt)now.sec * 1000000 + now.usec;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_random --
+ *
+ *      Return the next of a sequence of pseudo-random numbers kept in
+ *      *state, seeded from the process ID, the time and where the state
+ *      lives the first time, so separate processes and objects don't
+ *      draw the same numbers.  rand () is left to the application.
+ *
+ *----------------------------------------------------------------------
+ */
+unsigned int
+mongotcl_random (unsigned int *state) {
+	unsigned int x = *state;
+
+	if (x == 0) {
+		x = (unsigned int)getpid () ^ (unsigned int)mongotcl_microseconds () ^ (unsigned int)(size_t)state;
+		if (x == 0) {
+			x = 0x9e3779b9;
+		}
+	}
+
+	/* xorshift32 */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_timeoutOption --
+ *
+ *      Recognize a "-timeout ms" at the end of a command's arguments,
+ *      removing it from objc.
+ *
+ * Results:
+ *      A standard Tcl result.  *msPtr is set to the timeout, or to 0
+ *      if there was none.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_timeoutOption (Tcl_Interp *interp, int *objcPtr, Tcl_Obj *CONST objv[], int *msPtr) {
+	int objc = *objcPtr;
+
+	*msPtr = 0;
+	if (objc < 4 || strcmp (Tcl_GetString (objv[objc - 2]), "-timeout") != 0) {
+		return TCL_OK;
+	}
+
+	if (Tcl_GetIntFromObj (interp, objv[objc - 1], msPtr) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (*msPtr <= 0) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-timeout must be positive", -1));
+		return TCL_ERROR;
+	}
+
+	*objcPtr = objc - 2;
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_opTimeoutBegin --
+ *
+ *      Start an operation with its own timeout: the socket timeout of
+ *      the object's connection and of every replica set member it may
+ *      read from is set to ms, and reads sent while it's in effect ask
+ *      the server to give up after ms too.  Errors are cleared so that
+ *      mongotcl_opTimeoutEnd sees only this operation's.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_opTimeoutBegin (mongotcl_clientData *md, int ms) {
+	mongotcl_member *m;
+
+	md->op_timeout_saved = md->conn->op_timeout_ms;
+	md->op_max_time_ms = ms;
+
+	mongo_clear_errors (md->conn);
+	mongo_set_op_timeout (md->conn, ms);
+	for (m = md->members; m != NULL; m = m->next) {
+		mongo_clear_errors (m->conn);
+		mongo_set_op_timeout (m->conn, ms);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_opTimeoutEnd --
+ *
+ *      Finish an operation started with mongotcl_opTimeoutBegin,
+ *      restoring the connection-wide timeout.
+ *
+ *      If the operation failed because the server hit its time limit,
+ *      or because we stopped waiting for the server, the error is
+ *      replaced with one whose errorCode is MONGO TIMEOUT.  In the
+ *      second case the reply may still arrive, so the connection it
+ *      was due on is closed; "reconnect" (or resilient mode) brings it
+ *      back.
+ *
+ * Results:
+ *      result, the operation's Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_opTimeoutEnd (Tcl_Interp *interp, mongotcl_clientData *md, int ms, Tcl_WideInt start, int result) {
+	mongotcl_member *m;
+	int expired = (mongotcl_milliseconds () - start >= ms);
+	int timedOut = 0;
+
+	md->op_max_time_ms = 0;
+
+	/* 50 is ExceededTimeLimit */
+	if (md->conn->lasterrcode == 50 || (result == TCL_ERROR && strstr (Tcl_GetStringResult (interp), "exceeded time limit") != NULL)) {
+		timedOut = 1;
+	}
+
+	if (expired && (md->conn->err == MONGO_IO_ERROR || md->conn->err == MONGO_SOCKET_ERROR)) {
+		mongotcl_cursorPrefetchReset (md, md->conn);
+		mongotcl_wireReset (md->conn);
+		mongo_disconnect (md->conn);
+		timedOut = 1;
+	}
+	mongo_set_op_timeout (md->conn, md->op_timeout_saved);
+
+	for (m = md->members; m != NULL; m = m->next) {
+		if (m->conn->lasterrcode == 50) {
+			timedOut = 1;
+		}
+
+		if (expired && (m->conn->err == MONGO_IO_ERROR || m->conn->err == MONGO_SOCKET_ERROR)) {
+			mongotcl_hedgeForget (md, m->conn);
+			mongotcl_cursorPrefetchReset (md, m->conn);
+			mongotcl_wireReset (m->conn);
+			mongo_disconnect (m->conn);
+			timedOut = 1;
+		}
+		mongo_set_op_timeout (m->conn, md->op_timeout_saved);
+	}
+
+	if (result == TCL_ERROR && timedOut) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("operation exceeded its %d ms timeout", ms));
+		Tcl_SetErrorCode (interp, "MONGO", "TIMEOUT", NULL);
+	}
+
+	return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_bsonWithMaxTime --
+ *
+ *      Initialize out with a copy of a query or command that also asks
+ *      the server to give up after ms: a command gets a maxTimeMS
+ *      field, a query is wrapped in $query with a $maxTimeMS modifier.
+ *      src may be NULL for an empty query.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_bsonWithMaxTime (const bson *src, int ms, int isQuery, bson *out) {
+	bson_iterator it;
+	bson empty;
+
+	if (src == NULL) {
+		src = bson_empty (&empty);
+	}
+
+	bson_init (out);
+	if (isQuery && bson_find (&it, src, "$query") == BSON_EOO) {
+		bson_append_bson (out, "$query", src);
+		bson_append_int (out, "$maxTimeMS", ms);
+	} else {
+		bson_iterator_init (&it, src);
+		while (bson_iterator_next (&it)) {
+			bson_append_element (out, NULL, &it);
+		}
+		if (bson_find (&it, src, isQuery ? "$maxTimeMS" : "maxTimeMS") == BSON_EOO) {
+			bson_append_int (out, isQuery ? "$maxTimeMS" : "maxTimeMS", ms);
+		}
+	}
+	bson_finish (out);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_authenticateConnection --
+ *
+ *      Replay the credentials given to the mongo object's authenticate
+ *      method on a connection, such as one just reestablished.  Does
+ *      nothing if the object never authenticated.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_authenticateConnection (mongotcl_clientData *md, mongo *conn) {
+	if (md->auth_user == NULL) {
+		return MONGO_OK;
+	}
+
+	return mongo_cmd_authenticate (conn, md->auth_db, md->auth_user, md->auth_pass);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resetConnectionState --
+ *
+ *      Forget everything we learned about the server on the previous
+ *      connection.  Called whenever the connection is (re)established.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_resetConnectionState (mongotcl_clientData *md) {
+	md->limits_probed = 0;
+	md->max_message_size = MONGOTCL_DEFAULT_MAX_MESSAGE_SIZE;
+	md->max_write_batch_size = MONGOTCL_DEFAULT_MAX_WRITE_BATCH_SIZE;
+	md->max_wire_version = 0;
+	md->members_checked = 0;
+	mongotcl_asyncReset (md);
+	mongotcl_cursorPrefetchReset (md, md->conn);
+	mongotcl_wireReset (md->conn);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_probeServerLimits --
+ *
+ *      Ask the server for its message size, batch size and wire version
+ *      limits via isMaster, once per connection.  The driver already
+ *      tracks maxBsonObjectSize in conn->max_bson_size.
+ *
+ *      Servers too old to report a limit keep the defaults.
+ *
+ *      Pipelined acknowledgements and coalesced writes outstanding on
+ *      the connection are dealt with first, so the driver doesn't take
+ *      one of their replies for the isMaster answer.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_probeServerLimits (mongotcl_clientData *md) {
+	bson out;
+	bson_iterator it;
+
+	if (md->limits_probed) {
+		return MONGO_OK;
+	}
+
+	if (md->pipeline_pending > 0 && mongotcl_pipelineDrain (md) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (mongotcl_flushWrites (md) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (mongo_simple_int_command (md->conn, "admin", "ismaster", 1, &out) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (bson_find (&it, &out, "maxBsonObjectSize") != BSON_EOO) {
+		md->conn->max_bson_size = bson_iterator_int (&it);
+	}
+
+	if (bson_find (&it, &out, "maxMessageSizeBytes") != BSON_EOO) {
+		md->max_message_size = bson_iterator_int (&it);
+	}
+
+	if (bson_find (&it, &out, "maxWriteBatchSize") != BSON_EOO) {
+		md->max_write_batch_size = bson_iterator_int (&it);
+	}
+
+	if (bson_find (&it, &out, "maxWireVersion") != BSON_EOO) {
+		md->max_wire_version = bson_iterator_int (&it);
+	}
+
+	bson_destroy (&out);
+	md->limits_probed = 1;
+	return MONGO_OK;
+}
+
 
 /*
  *--------------------------------------------------------------
@@ -148,8 +520,27 @@ mongotcl_mongoObjectDelete (ClientData clientData)
 
     assert (md->mongo_magic == MONGOTCL_MONGO_MAGIC);
 
+    mongotcl_cursorTrackForget(md);
+    mongotcl_bulkForget(md);
+    mongotcl_resilientCleanup(md);
+    mongotcl_replicaCleanup(md);
+    mongotcl_connectFlushCache(md);
+    mongotcl_asyncCleanup(md);
+    mongotcl_flushWrites(md);
+    mongotcl_cursorPrefetchForget(md);
+    mongotcl_tailForget(md);
+    mongotcl_cacheCleanup(md);
+    if (md->coalesce) {
+        Tcl_DeleteExitHandler(mongotcl_flushExitProc, (ClientData)md);
+    }
+    mongotcl_wireRelease(md->conn);
     mongo_destroy(md->conn);
+    Tcl_DStringFree(&md->pipeline_ns);
+    mongo_write_concern_destroy(md->write_concern);
+    mongo_write_concern_destroy(md->unack_write_concern);
     ckfree((char *)md->conn);
+    ckfree((char *)md->write_concern);
+    ckfree((char *)md->unack_write_concern);
     ckfree((char *)clientData);
 }
 
@@ -176,9 +567,18 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
         "insert",
         "update",
         "insert_batch",
+        "bulk",
+        "pipeline",
+        "async",
+        "resilient",
         "cursor",
+        "cursors",
 		"search",
 		"find",
+		"parallel_scan",
+		"paginate",
+		"aggregate",
+		"distinct",
         "count",
         "init",
 		"last_error",
@@ -196,6 +596,12 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
         "replica_set_init",
         "replica_set_add_seed",
         "replica_set_client",
+        "replica_set_members",
+        "read_preference",
+        "hedge",
+        "cache",
+        "configure",
+        "io_stats",
         "clear_errors",
         "authenticate",
         "add_user",
@@ -209,9 +615,18 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
         OPT_INSERT,
         OPT_UPDATE,
         OPT_INSERT_BATCH,
+        OPT_BULK,
+        OPT_PIPELINE,
+        OPT_ASYNC,
+        OPT_RESILIENT,
         OPT_CURSOR,
+        OPT_CURSORS,
         OPT_SEARCH,
 		OPT_MONGO_FIND,
+		OPT_PARALLEL_SCAN,
+		OPT_PAGINATE,
+		OPT_AGGREGATE,
+		OPT_DISTINCT,
 		OPT_COUNT,
         OPT_INIT,
 		OPT_GET_LAST_ERROR,
@@ -229,6 +644,12 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
         OPT_REPLICA_SET_INIT,
         OPT_REPLICA_SET_ADD_SEED,
         OPT_REPLICA_SET_CLIENT,
+        OPT_REPLICA_SET_MEMBERS,
+        OPT_READ_PREFERENCE,
+        OPT_HEDGE,
+        OPT_CACHE,
+        OPT_CONFIGURE,
+        OPT_IO_STATS,
         OPT_CLEAR_ERRORS,
 		OPT_CMD_AUTHENTICATE,
 		OPT_CMD_ADD_USER,
@@ -247,9 +668,100 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 		return TCL_ERROR;
     }
 
+	/* server cursors waiting to be killed go out ahead of anything else */
+	if (md->kill_count > 0) {
+		mongotcl_cursorKillFlush (md);
+	}
+
+	/* a trailing -timeout runs the operation under its own deadline */
+	switch ((enum options) optIndex) {
+		case OPT_INSERT:
+		case OPT_UPDATE:
+		case OPT_REMOVE:
+		case OPT_MONGO_FIND:
+		case OPT_PAGINATE:
+		case OPT_AGGREGATE:
+		case OPT_DISTINCT:
+		case OPT_COUNT:
+		case OPT_RUN_COMMAND: {
+			int ms;
+
+			if (md->op_max_time_ms > 0) {
+				break;
+			}
+
+			if (mongotcl_timeoutOption (interp, &objc, objv, &ms) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (ms > 0) {
+				Tcl_WideInt start = mongotcl_milliseconds ();
+				int result;
+
+				mongotcl_opTimeoutBegin (md, ms);
+				result = mongotcl_mongoObjectObjCmd (cData, interp, objc, objv);
+				return mongotcl_opTimeoutEnd (interp, md, ms, start, result);
+			}
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	/* anything but another pipelined write must not read the
+	 * connection until the pipeline's acknowledgements are consumed */
+	if (md->pipeline_pending > 0) {
+		switch ((enum options) optIndex) {
+			case OPT_INSERT:
+			case OPT_UPDATE:
+			case OPT_REMOVE:
+			case OPT_INSERT_BATCH:
+			case OPT_PIPELINE:
+			case OPT_RESILIENT:
+			case OPT_CURSOR:
+			case OPT_CURSORS:
+				break;
+
+			default:
+				if (mongotcl_pipelineDrain (md) != MONGO_OK) {
+					return mongotcl_setMongoError (interp, md->conn);
+				}
+				break;
+		}
+	}
+
+	/* likewise the driver must not use the connection while coalesced
+	 * writes are still queued ahead of it or asynchronous replies are
+	 * still due on it, nor while cursors may be reading ahead on it */
+	if (mongotcl_wireQueued (md->conn) > 0 || md->async_pending > 0 || md->prefetch_cursors != NULL) {
+		switch ((enum options) optIndex) {
+			case OPT_INSERT:
+			case OPT_UPDATE:
+			case OPT_REMOVE:
+			case OPT_BULK:
+			case OPT_PIPELINE:
+			case OPT_ASYNC:
+			case OPT_RESILIENT:
+			case OPT_CURSOR:
+			case OPT_CURSORS:
+			case OPT_CACHE:
+			case OPT_CONFIGURE:
+			case OPT_IO_STATS:
+				break;
+
+			default:
+				if (mongotcl_flushWrites (md) != MONGO_OK) {
+					return mongotcl_setMongoError (interp, md->conn);
+				}
+				break;
+		}
+	}
+
     switch ((enum options) optIndex) {
 		case OPT_INSERT: {
 			bson *bson;
+			mongotcl_bulkOp op;
 
 			if (objc != 4) {
 				Tcl_WrongNumArgs (interp, 2, objv, "namespace bson");
@@ -260,7 +772,20 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 				return TCL_ERROR;
 			}
 
-			if (mongo_insert (md->conn, Tcl_GetString(objv[2]), bson, md->write_concern) != MONGO_OK) {
+			if (md->resilient) {
+				return mongotcl_resilientWrite (interp, md, Tcl_GetString(objv[2]), MONGOTCL_BULK_INSERT, bson, NULL, 0, 0);
+			}
+
+			op.type = MONGOTCL_BULK_INSERT;
+			op.upsert = 0;
+			op.multi = 0;
+			op.doc = *bson;
+
+			if (mongotcl_sendWriteOp (md, Tcl_GetString(objv[2]), &op, mongotcl_activeWriteConcern (md)) != MONGO_OK) {
+				return mongotcl_setMongoError (interp, md->conn);
+			}
+
+			if (mongotcl_pipelineNoteWrite (md, Tcl_GetString(objv[2])) != MONGO_OK) {
 				return mongotcl_setMongoError (interp, md->conn);
 			}
 
@@ -272,6 +797,7 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 			bson *opBson;
 			int   suboptIndex;
 			int   updateType;
+			mongotcl_bulkOp op;
 
 			static CONST char *subOptions[] = {
 				"basic",
@@ -324,7 +850,21 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 				}
 			}
 
-			if (mongo_update (md->conn, Tcl_GetString(objv[2]), condBson, opBson, updateType, md->write_concern) != MONGO_OK) {
+			if (md->resilient) {
+				return mongotcl_resilientWrite (interp, md, Tcl_GetString(objv[2]), MONGOTCL_BULK_UPDATE, condBson, opBson, (updateType & MONGO_UPDATE_UPSERT) != 0, (updateType & MONGO_UPDATE_MULTI) != 0);
+			}
+
+			op.type = MONGOTCL_BULK_UPDATE;
+			op.upsert = (updateType & MONGO_UPDATE_UPSERT) != 0;
+			op.multi = (updateType & MONGO_UPDATE_MULTI) != 0;
+			op.doc = *condBson;
+			op.update = *opBson;
+
+			if (mongotcl_sendWriteOp (md, Tcl_GetString(objv[2]), &op, mongotcl_activeWriteConcern (md)) != MONGO_OK) {
+				return mongotcl_setMongoError (interp, md->conn);
+			}
+
+			if (mongotcl_pipelineNoteWrite (md, Tcl_GetString(objv[2])) != MONGO_OK) {
 				return mongotcl_setMongoError (interp, md->conn);
 			}
 
@@ -333,6 +873,7 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 
 		case OPT_REMOVE: {
 			bson *bson;
+			mongotcl_bulkOp op;
 
 			if (objc != 4) {
 				Tcl_WrongNumArgs (interp, 2, objv, "namespace bson");
@@ -343,7 +884,20 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 				return TCL_ERROR;
 			}
 
-			if (mongo_remove (md->conn, Tcl_GetString(objv[2]), bson, md->write_concern) != MONGO_OK) {
+			if (md->resilient) {
+				return mongotcl_resilientWrite (interp, md, Tcl_GetString(objv[2]), MONGOTCL_BULK_REMOVE, bson, NULL, 0, 1);
+			}
+
+			op.type = MONGOTCL_BULK_REMOVE;
+			op.upsert = 0;
+			op.multi = 1;
+			op.doc = *bson;
+
+			if (mongotcl_sendWriteOp (md, Tcl_GetString(objv[2]), &op, mongotcl_activeWriteConcern (md)) != MONGO_OK) {
+				return mongotcl_setMongoError (interp, md->conn);
+			}
+
+			if (mongotcl_pipelineNoteWrite (md, Tcl_GetString(objv[2])) != MONGO_OK) {
 				return mongotcl_setMongoError (interp, md->conn);
 			}
 
@@ -436,6 +990,19 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 				return TCL_ERROR;
 			}
 
+			if (md->op_max_time_ms > 0) {
+				bson command;
+				int status;
+
+				mongotcl_bsonWithMaxTime (commandBson, md->op_max_time_ms, 0, &command);
+				status = mongo_run_command (md->conn, database, &command, outBson);
+				bson_destroy (&command);
+				if (status != MONGO_OK) {
+					return mongotcl_setMongoError (interp, md->conn);
+				}
+				break;
+			}
+
 			if (mongo_run_command (md->conn, database, commandBson, outBson) != MONGO_OK) {
 				return mongotcl_setMongoError (interp, md->conn);
 			}
@@ -445,11 +1012,10 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 
 
 		case OPT_INSERT_BATCH: {
-			bson **bsonList;
 			int listObjc;
-			int i;
 			Tcl_Obj **listObjv;
 			int flags = 0;
+			int confirmed;
 
 			if (objc < 4 || objc > 5) {
 				Tcl_WrongNumArgs (interp, 2, objv, "namespace bsonList ?continue_on_error?");
@@ -470,21 +1036,77 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 				return TCL_ERROR;
 			}
 
-			bsonList = (bson **)ckalloc (sizeof (bson *) * listObjc);
+			/* while writes are buffered, new ones queue behind them */
+			if (md->resilient && md->pending_head != NULL) {
+				return mongotcl_resilientBufferBatch (interp, md, Tcl_GetString(objv[2]), listObjc, listObjv);
+			}
 
-			for (i = 0; i < listObjc; i++) {
-				if (mongotcl_cmdNameObjToBson (interp, listObjv[i], &bsonList[i]) == TCL_ERROR) {
-					return TCL_ERROR;
+			if (mongotcl_insertBatch (interp, md, Tcl_GetString(objv[2]), listObjc, listObjv, flags, &confirmed) == TCL_ERROR) {
+				/* buffer only what the server hasn't acknowledged */
+				if (md->resilient && mongotcl_isConnectionError (md->conn)) {
+					Tcl_ResetResult (interp);
+					return mongotcl_resilientBufferBatch (interp, md, Tcl_GetString(objv[2]), listObjc - confirmed, listObjv + confirmed);
 				}
+				return TCL_ERROR;
 			}
 
-			if (mongo_insert_batch (md->conn, Tcl_GetString(objv[2]), (const bson **)bsonList, listObjc, md->write_concern, flags) != MONGO_OK) {
+			if (mongotcl_pipelineNoteWrite (md, Tcl_GetString(objv[2])) != MONGO_OK) {
 				return mongotcl_setMongoError (interp, md->conn);
 			}
-
 			break;
 		}
 
+		case OPT_PIPELINE: {
+			int result;
+
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "script");
+				return TCL_ERROR;
+			}
+
+			if (md->pipeline_depth++ == 0) {
+				md->pipeline_writes = 0;
+				md->pipeline_replies = 0;
+				md->pipeline_error_index = -1;
+				md->pipeline_error_code = 0;
+				Tcl_DStringSetLength (&md->pipeline_ns, 0);
+			}
+
+			result = Tcl_EvalObjEx (interp, objv[2], 0);
+
+			if (--md->pipeline_depth > 0) {
+				return result;
+			}
+
+			return mongotcl_pipelineFinish (interp, md, result);
+		}
+
+		case OPT_BULK: {
+			int ordered = 1;
+
+			if (objc != 3 && objc != 5) {
+				Tcl_WrongNumArgs (interp, 2, objv, "namespace ?-ordered 0|1?");
+				return TCL_ERROR;
+			}
+
+			if (objc == 5) {
+				if (strcmp (Tcl_GetString (objv[3]), "-ordered") != 0) {
+					Tcl_AppendResult (interp, "unknown option '", Tcl_GetString (objv[3]), "': must be -ordered", NULL);
+					return TCL_ERROR;
+				}
+
+				if (Tcl_GetBooleanFromObj (interp, objv[4], &ordered) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+			}
+
+			return mongotcl_createBulkObjCmd (interp, md, Tcl_GetString(objv[2]), ordered);
+		}
+
+		case OPT_RESILIENT: {
+			return mongotcl_resilientObjCmd (interp, md, objc, objv);
+		}
+
 		case OPT_CURSOR: {
 			char *commandName;
 			char *namespace;
@@ -497,10 +1119,14 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 			commandName = Tcl_GetString(objv[2]);
 			namespace = Tcl_GetString(objv[3]);
 
-			return mongotcl_createCursorObjCmd(interp, md->conn, commandName, namespace);
+			return mongotcl_createCursorObjCmd(interp, md, commandName, namespace, NULL);
 			break;
 		}
 
+		case OPT_CURSORS: {
+			return mongotcl_cursorsObjCmd (interp, md, objc, objv);
+		}
+
 		case OPT_SEARCH: {
 			int i;
 			int result;
@@ -520,110 +1146,27 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 		}
 
 		case OPT_MONGO_FIND: {
-			char *ns;
-			bson *bsonQuery;
-			bson *bsonFields;
-			int limit;
-			int skip;
-			int listObjc;
-			int i;
-			Tcl_Obj **listObjv;
-			int cursorFlags = 0;
-			mongo_cursor *cursor;
-
-			static CONST char *subOptions[] = {
-				"tailable",
-				"slave_ok",
-				"no_timeout",
-				"await_data",
-				"exhaust",
-				"partial",
-				NULL
-			};
-
-			enum suboptions {
-				SUBOPT_CURSOR_TAILABLE,
-				SUBOPT_CURSOR_SLAVE_OK,
-				SUBOPT_CURSOR_NO_TIMEOUT,
-				SUBOPT_CURSOR_AWAIT_DATA,
-				SUBOPT_CURSOR_EXHAUST,
-				SUBOPT_CURSOR_PARTIAL
-			};
-
-			if (objc != 8) {
-				Tcl_WrongNumArgs (interp, 2, objv, "namespace bsonQuery bsonFields limit skip options");
-				return TCL_ERROR;
-			}
-
-			ns = Tcl_GetString (objv[2]);
-
-			if (mongotcl_cmdNameObjToBson (interp, objv[3], &bsonQuery) == TCL_ERROR) {
-				Tcl_AddErrorInfo (interp, " while locating query bson");
-				return TCL_ERROR;
-			}
-
-			if (mongotcl_cmdNameObjToBson (interp, objv[4], &bsonFields) == TCL_ERROR) {
-				Tcl_AddErrorInfo (interp, " while locating query bson");
-				return TCL_ERROR;
-			}
-
-			if (Tcl_GetIntFromObj (interp, objv[5], &limit) == TCL_ERROR) {
-				return TCL_ERROR;
-			}
-
-			if (Tcl_GetIntFromObj (interp, objv[6], &skip) == TCL_ERROR) {
-				return TCL_ERROR;
-			}
-
-			if (Tcl_ListObjGetElements (interp, objv[7], &listObjc, &listObjv) == TCL_ERROR) {
-				Tcl_AddErrorInfo (interp, "while examining option list");
-				return TCL_ERROR;
-			}
-
-			for (i = 0; i < listObjc; i++) {
-				int suboptIndex;
-
-				if (Tcl_GetIndexFromObj (interp, listObjv[i], subOptions, "indexOption", TCL_EXACT, &suboptIndex) != TCL_OK) {
-				return TCL_ERROR;
-				}
-
-				switch ((enum suboptions)suboptIndex) {
-				case SUBOPT_CURSOR_TAILABLE:
-					cursorFlags |= MONGO_TAILABLE;
-					break;
-
-				case SUBOPT_CURSOR_SLAVE_OK:
-					cursorFlags |= MONGO_SLAVE_OK;
-					break;
-
-				case SUBOPT_CURSOR_NO_TIMEOUT:
-					cursorFlags |= MONGO_NO_CURSOR_TIMEOUT;
-					break;
-
-				case SUBOPT_CURSOR_AWAIT_DATA:
-					cursorFlags |= MONGO_AWAIT_DATA;
-					break;
+			return mongotcl_findObjCmd (interp, md, objc, objv);
+		}
 
-				case SUBOPT_CURSOR_EXHAUST:
-					cursorFlags |= MONGO_EXHAUST;
-					break;
+		case OPT_PARALLEL_SCAN: {
+			return mongotcl_parallelScanObjCmd (interp, md, objc, objv);
+		}
 
-				case SUBOPT_CURSOR_PARTIAL:
-					cursorFlags |= MONGO_PARTIAL;
-					break;
-				}
-			}
+		case OPT_PAGINATE: {
+			return mongotcl_paginateObjCmd (interp, md, objc, objv);
+		}
 
-			if ((cursor = mongo_find (md->conn, ns, bsonQuery, bsonFields, limit, skip, cursorFlags)) == NULL) {
-				return TCL_ERROR;
-			}
+		case OPT_AGGREGATE: {
+			return mongotcl_aggregateObjCmd (interp, md, objc, objv);
+		}
 
-			break;
+		case OPT_DISTINCT: {
+			return mongotcl_distinctObjCmd (interp, md, objc, objv);
 		}
 
 		case OPT_COUNT: {
 			bson *query;
-			int count;
 
 			if (objc < 4 || objc > 5) {
 				Tcl_WrongNumArgs (interp, 2, objv, "db collection ?bson?");
@@ -633,16 +1176,12 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 			if (objc == 4) {
 				query = NULL;
 			} else {
-				if (mongotcl_cmdNameObjToBson (interp, objv[3], &query) == TCL_ERROR) {
-					return mongotcl_setMongoError (interp, md->conn);
+				if (mongotcl_cmdNameObjToBson (interp, objv[4], &query) == TCL_ERROR) {
+					return TCL_ERROR;
 				}
 			}
 
-			if ((count = mongo_count (md->conn, Tcl_GetString(objv[2]), Tcl_GetString(objv[3]), query)) == MONGO_ERROR) {
-				return mongotcl_setMongoError (interp, md->conn);
-			}
-			Tcl_SetObjResult (interp, Tcl_NewIntObj (count));
-			break;
+			return mongotcl_readCount (interp, md, Tcl_GetString(objv[2]), Tcl_GetString(objv[3]), query);
 		}
 
 		case OPT_INIT: {
@@ -652,6 +1191,7 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 			}
 
 			mongo_init (md->conn);
+			mongotcl_resetConnectionState (md);
 			break;
 		}
 
@@ -792,12 +1332,28 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 			char *address;
 			int port;
 
-			if (objc != 4) {
-				Tcl_WrongNumArgs (interp, 2, objv, "address port");
+			if (objc < 3 || objc > 4) {
+				Tcl_WrongNumArgs (interp, 2, objv, "address ?port?");
 				return TCL_ERROR;
 			}
 
 			address = Tcl_GetString (objv[2]);
+
+			mongotcl_resetConnectionState (md);
+
+			/* an absolute path is a unix domain socket */
+			if (*address == '/') {
+				if (mongotcl_unixConnect (md, address) != MONGO_OK) {
+					return mongotcl_setMongoError (interp, md->conn);
+				}
+				mongotcl_applySocketOptions (md, md->conn);
+				break;
+			}
+
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 2, objv, "address port");
+				return TCL_ERROR;
+			}
 	
 			if (Tcl_GetIntFromObj (interp, objv[3], &port) == TCL_ERROR) {
 				return TCL_ERROR;
@@ -806,6 +1362,7 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 			if (mongo_client (md->conn, address, port) != MONGO_OK) {
 				return mongotcl_setMongoError (interp, md->conn);
 			}
+			mongotcl_applySocketOptions (md, md->conn);
 			break;
 		}
 
@@ -815,7 +1372,7 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 				return TCL_ERROR;
 			}
 
-			mongo_reconnect (md->conn);
+			mongotcl_reconnect (md);
 			break;
 		  }
 
@@ -825,6 +1382,9 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 				return TCL_ERROR;
 			}
 
+			mongotcl_flushWrites (md);
+			mongotcl_cursorPrefetchReset (md, md->conn);
+			mongotcl_wireReset (md->conn);
 			mongo_disconnect (md->conn);
 			break;
 		}
@@ -898,14 +1458,93 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 		}
 
 		case OPT_REPLICA_SET_CLIENT: {
-			if (objc != 2) {
-				Tcl_WrongNumArgs (interp, 1, objv, "replica_set_client");
+			if (objc != 2 && objc != 4) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-timeout ms?");
 				return TCL_ERROR;
 			}
 
-			if (mongo_replica_set_client (md->conn) != MONGO_OK) {
+			if (objc == 4) {
+				int timeout;
+
+				if (strcmp (Tcl_GetString (objv[2]), "-timeout") != 0) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -timeout", Tcl_GetString (objv[2])));
+					return TCL_ERROR;
+				}
+
+				if (Tcl_GetIntFromObj (interp, objv[3], &timeout) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				if (timeout <= 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-timeout must be positive", -1));
+					return TCL_ERROR;
+				}
+				md->connect_timeout_ms = timeout;
+			}
+
+			mongotcl_resetConnectionState (md);
+
+			if (mongotcl_replicaSetConnect (md) != MONGO_OK) {
 				return mongotcl_setMongoError (interp, md->conn);
 			}
+			mongotcl_applySocketOptions (md, md->conn);
+			break;
+		}
+
+		case OPT_REPLICA_SET_MEMBERS: {
+			return mongotcl_replicaMembersObjCmd (interp, md, objc, objv);
+		}
+
+		case OPT_READ_PREFERENCE: {
+			return mongotcl_readPreferenceObjCmd (interp, md, objc, objv);
+		}
+
+		case OPT_HEDGE: {
+			return mongotcl_hedgeObjCmd (interp, md, objc, objv);
+		}
+
+		case OPT_CACHE: {
+			return mongotcl_cacheObjCmd (interp, md, objc, objv);
+		}
+
+		case OPT_CONFIGURE: {
+			return mongotcl_configureObjCmd (interp, md, objc, objv);
+		}
+
+		case OPT_ASYNC: {
+			return mongotcl_asyncObjCmd (interp, md, objc, objv);
+		}
+
+		case OPT_IO_STATS: {
+			mongotcl_wireStats stats;
+			Tcl_Obj *listObj;
+			int reset = 0;
+
+			if (objc == 3 && strcmp (Tcl_GetString (objv[2]), "-reset") == 0) {
+				reset = 1;
+			} else if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-reset?");
+				return TCL_ERROR;
+			}
+
+			mongotcl_wireGetStats (md->conn, &stats, reset);
+
+			listObj = Tcl_NewObj ();
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("write_calls", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (stats.writeCalls));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("messages_written", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (stats.messagesWritten));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("bytes_written", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (stats.bytesWritten));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("read_calls", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (stats.readCalls));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("replies_read", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (stats.repliesRead));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("bytes_read", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewWideIntObj (stats.bytesRead));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("queued", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (mongotcl_wireQueued (md->conn)));
+			Tcl_SetObjResult (interp, listObj);
 			break;
 		}
 
@@ -928,6 +1567,19 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 			if (mongo_cmd_authenticate (md->conn, Tcl_GetString(objv[2]), Tcl_GetString(objv[3]), Tcl_GetString(objv[4])) != MONGO_OK) {
 				return mongotcl_setMongoError (interp, md->conn);
 			}
+
+			/* remembered so reestablished connections can log in again */
+			if (md->auth_user != NULL) {
+				ckfree (md->auth_db);
+				ckfree (md->auth_user);
+				ckfree (md->auth_pass);
+			}
+			md->auth_db = ckalloc (strlen (Tcl_GetString(objv[2])) + 1);
+			strcpy (md->auth_db, Tcl_GetString(objv[2]));
+			md->auth_user = ckalloc (strlen (Tcl_GetString(objv[3])) + 1);
+			strcpy (md->auth_user, Tcl_GetString(objv[3]));
+			md->auth_pass = ckalloc (strlen (Tcl_GetString(objv[4])) + 1);
+			strcpy (md->auth_pass, Tcl_GetString(objv[4]));
 			break;
 		}
 
@@ -978,6 +1630,35 @@ mongotcl_mongoObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cmdNameObjToMongo --
+ *
+ *    Take a command name, find the Tcl command info structure, return
+ *    a pointer to the mongo object's client data.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_cmdNameObjToMongo (Tcl_Interp *interp, Tcl_Obj *commandNameObj, mongotcl_clientData **md) {
+    Tcl_CmdInfo	cmdInfo;
+
+    if (!Tcl_GetCommandInfo (interp, Tcl_GetString(commandNameObj), &cmdInfo)) {
+		goto lookup_error;
+    }
+
+    if (cmdInfo.objClientData == NULL || ((mongotcl_clientData *)cmdInfo.objClientData)->mongo_magic != MONGOTCL_MONGO_MAGIC) {
+	  lookup_error:
+		Tcl_AppendResult (interp, "Error: '", Tcl_GetString (commandNameObj), "' is not a mongo object", NULL);
+		return TCL_ERROR;
+    }
+
+    *md = (mongotcl_clientData *)cmdInfo.objClientData;
+    return TCL_OK;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1041,6 +1722,74 @@ mongotcl_mongoObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Ob
     md->write_concern->w = 1;
     mongo_write_concern_finish (md->write_concern);
 
+    md->unack_write_concern = (mongo_write_concern *)ckalloc(sizeof(mongo_write_concern));
+    mongo_write_concern_init (md->unack_write_concern);
+    md->unack_write_concern->w = 0;
+    mongo_write_concern_finish (md->unack_write_concern);
+
+    md->async_head = NULL;
+    md->async_tail = NULL;
+    md->async_pending = 0;
+    md->async_fd = -1;
+    md->async_dispatch_scheduled = 0;
+    md->prefetch_cursors = NULL;
+    md->tails = NULL;
+    md->live_cursors = NULL;
+    md->live_bulks = NULL;
+    md->kills = NULL;
+    md->kill_count = 0;
+    md->kill_space = 0;
+    md->kill_scheduled = 0;
+    md->cursor_pool_count = 0;
+    mongotcl_cacheInit (md);
+
+    mongotcl_resetConnectionState (md);
+
+    md->pipeline_depth = 0;
+    md->pipeline_pending = 0;
+    Tcl_DStringInit (&md->pipeline_ns);
+
+    md->resilient = 0;
+    md->resilient_max_buffer = MONGOTCL_RESILIENT_DEFAULT_BUFFER;
+    md->resilient_base_delay = MONGOTCL_RESILIENT_DEFAULT_BASE_DELAY;
+    md->resilient_max_delay = MONGOTCL_RESILIENT_DEFAULT_MAX_DELAY;
+    md->resilient_failures = 0;
+    md->random_state = 0;
+    md->resilient_reconnects = 0;
+    md->resilient_replayed = 0;
+    md->resilient_next_attempt = 0;
+    md->resilient_timer = NULL;
+    md->resilient_errmsg[0] = '\0';
+    md->pending_head = NULL;
+    md->pending_tail = NULL;
+    md->pending_bytes = 0;
+    md->pending_count = 0;
+    md->auth_db = NULL;
+    md->auth_user = NULL;
+    md->auth_pass = NULL;
+
+    md->read_preference = MONGOTCL_READ_PRIMARY;
+    md->heartbeat_ms = MONGOTCL_DEFAULT_HEARTBEAT;
+    md->members_checked = 0;
+    md->members = NULL;
+    md->connect_timeout_ms = MONGOTCL_DEFAULT_CONNECT_TIMEOUT;
+    md->resolved_hosts = NULL;
+
+    md->hedge = 0;
+    md->hedge_delay_ms = MONGOTCL_DEFAULT_HEDGE_DELAY;
+    md->hedge_reads = 0;
+    md->hedge_fired = 0;
+    md->hedge_wins = 0;
+
+    md->sock_nodelay = -1;
+    md->sock_keepalive = -1;
+    md->sock_sndbuf = 0;
+    md->sock_rcvbuf = 0;
+    md->op_timeout_saved = 0;
+    md->op_max_time_ms = 0;
+    md->coalesce = 0;
+    md->flush_scheduled = 0;
+
     commandName = Tcl_GetString (objv[2]);
 
     // if commandName is #auto, generate a unique name for the object
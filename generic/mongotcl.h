@@ -18,6 +18,47 @@
 
 #define MONGOTCL_CURSOR_MAGIC 0xf33dc007
 
+#define MONGOTCL_BULK_MAGIC 0xf33de007
+
+#define MONGOTCL_MIRROR_MAGIC 0xf33d9007
+
+#define MONGOTCL_MERGE_MAGIC 0xf33d8007
+
+/* server limits assumed until isMaster tells us otherwise */
+#define MONGOTCL_DEFAULT_MAX_MESSAGE_SIZE 48000000
+
+#define MONGOTCL_DEFAULT_MAX_WRITE_BATCH_SIZE 1000
+
+/* outstanding pipeline acknowledgements read back before sending more */
+#define MONGOTCL_PIPELINE_MAX_PENDING 512
+
+/* resilient mode defaults */
+#define MONGOTCL_RESILIENT_DEFAULT_BUFFER (16 * 1024 * 1024)
+
+#define MONGOTCL_RESILIENT_DEFAULT_BASE_DELAY 100
+
+#define MONGOTCL_RESILIENT_DEFAULT_MAX_DELAY 30000
+
+/* how often replica set members are rechecked with isMaster, in ms */
+#define MONGOTCL_DEFAULT_HEARTBEAT 10000
+
+/* how long each replica set connection attempt may take, in ms */
+#define MONGOTCL_DEFAULT_CONNECT_TIMEOUT 5000
+
+/* how long a hedged read waits before asking a second member, in ms */
+#define MONGOTCL_DEFAULT_HEDGE_DELAY 20
+
+/* query cache defaults: time to live in ms and byte budget */
+#define MONGOTCL_DEFAULT_CACHE_TTL 1000
+
+#define MONGOTCL_DEFAULT_CACHE_BYTES (16 * 1024 * 1024)
+
+/* how many server cursors to collect before killing them in one message */
+#define MONGOTCL_KILL_BATCH 256
+
+/* how many deleted cursors' structures a mongo object keeps for reuse */
+#define MONGOTCL_CURSOR_POOL_SIZE 16
+
 #include <mongo.h>
 
 // MONGO_HAVE_STDINT, MONGO_HAVE_UNISTD, MONGO_USE__INT64, or MONGO_USE_LONG_LONG_INT.
@@ -31,6 +72,12 @@ mongotcl_cmdNameObjSetBson (Tcl_Interp *interp, Tcl_Obj *commandNameObj, bson *n
 extern Tcl_Obj * 
 mongotcl_bsontolist(Tcl_Interp *interp, const bson *b);
 
+extern Tcl_Obj *
+mongotcl_bsontolist_raw (Tcl_Interp *interp, Tcl_Obj *listObj, const char *data, int depth);
+
+extern bson_type
+mongotcl_bsonFindRaw (bson_iterator *it, const char *data, const char *key);
+
 extern int
 mongotcl_bsontoarray(Tcl_Interp *interp, char *arrayName, char *typeArrayName, const bson *b);
 
@@ -49,8 +96,6 @@ mongotcl_create_bson_command (Tcl_Interp *interp, char *commandName, CONST bson
 extern int
 mongotcl_setBsonError (Tcl_Interp *interp, bson *bson);
 
-extern int
-mongotcl_createCursorObjCmd(Tcl_Interp *interp, mongo *conn, char *commandName, char *namespace); ;
 
 typedef struct mongotcl_clientData
 {
@@ -59,6 +104,81 @@ typedef struct mongotcl_clientData
     mongo *conn;
     Tcl_Command cmdToken;
     mongo_write_concern *write_concern;
+    mongo_write_concern *unack_write_concern;
+    int limits_probed;
+    int max_message_size;
+    int max_write_batch_size;
+    int max_wire_version;
+    int pipeline_depth;
+    int pipeline_writes;
+    int pipeline_pending;
+    int pipeline_replies;
+    int pipeline_error_index;
+    int pipeline_error_code;
+    char pipeline_errmsg[MONGO_ERR_LEN];
+    Tcl_DString pipeline_ns;
+    int resilient;
+    int resilient_max_buffer;
+    int resilient_base_delay;
+    int resilient_max_delay;
+    int resilient_failures;
+    unsigned int random_state;
+    int resilient_reconnects;
+    int resilient_replayed;
+    Tcl_WideInt resilient_next_attempt;
+    Tcl_TimerToken resilient_timer;
+    char resilient_errmsg[MONGO_ERR_LEN];
+    struct mongotcl_pendingWrite *pending_head;
+    struct mongotcl_pendingWrite *pending_tail;
+    int pending_bytes;
+    int pending_count;
+    char *auth_db;
+    char *auth_user;
+    char *auth_pass;
+    int read_preference;
+    int heartbeat_ms;
+    Tcl_WideInt members_checked;
+    struct mongotcl_member *members;
+    int connect_timeout_ms;
+    struct mongotcl_resolvedHost *resolved_hosts;
+    int hedge;
+    int hedge_delay_ms;
+    int hedge_reads;
+    int hedge_fired;
+    int hedge_wins;
+    int sock_nodelay;
+    int sock_keepalive;
+    int sock_sndbuf;
+    int sock_rcvbuf;
+    int coalesce;
+    int flush_scheduled;
+    struct mongotcl_asyncRequest *async_head;
+    struct mongotcl_asyncRequest *async_tail;
+    int async_pending;
+    int async_fd;
+    int async_dispatch_scheduled;
+    int op_timeout_saved;
+    int op_max_time_ms;
+    struct mongotcl_cursorClientData *prefetch_cursors;
+    struct mongotcl_tail *tails;
+    int cache_enabled;
+    int cache_ttl_ms;
+    int cache_max_bytes;
+    int cache_bytes;
+    Tcl_HashTable cache;
+    struct mongotcl_cacheEntry *cache_head;
+    struct mongotcl_cacheEntry *cache_tail;
+    Tcl_WideInt cache_hits;
+    Tcl_WideInt cache_misses;
+    Tcl_WideInt cache_evictions;
+    struct mongotcl_cursorClientData *live_cursors;
+    struct mongotcl_bulkClientData *live_bulks;
+    struct mongotcl_pendingKill *kills;
+    int kill_count;
+    int kill_space;
+    int kill_scheduled;
+    mongo_cursor *cursor_pool[MONGOTCL_CURSOR_POOL_SIZE];
+    int cursor_pool_count;
 } mongotcl_clientData;
 
 typedef struct mongotcl_bsonClientData
@@ -72,11 +192,644 @@ typedef struct mongotcl_bsonClientData
 typedef struct mongotcl_cursorClientData
 {
     int cursor_magic;
+    mongotcl_clientData *md;
     mongo *conn;
     Tcl_Interp *interp;
     mongo_cursor *cursor;
     Tcl_Command cmdToken;
+	bson *queryBson;
 	bson *fieldsBson;
+	int batch_size;
+	int prefetch;
+	int prefetch_request;
+	int prefetch_failed;
+	mongo_reply *prefetch_reply;
+	struct mongotcl_cursorClientData *prefetch_next;
+	Tcl_Obj *listen_callback;
+	struct mongotcl_tail *listen_tail;
+	Tcl_Obj *cache_key;
+	Tcl_DString cache_data;
+	int cache_count;
+	Tcl_WideInt created;
+	Tcl_WideInt docs_read;
+	struct mongotcl_cursorClientData *live_prev;
+	struct mongotcl_cursorClientData *live_next;
+	char *resume_field;
+	int resume_direction;
+	bson *resume_last;
+	bson *resume_query;
+	const bson *resume_base;
+	int resume_skip;
+	int resume_limit;
+	int resume_count;
+	bson *resume_sorted;
 } mongotcl_cursorClientData;
 
+/* a server cursor waiting to be killed */
+typedef struct mongotcl_pendingKill
+{
+	mongo *conn;
+	int64_t cursor_id;
+} mongotcl_pendingKill;
+
+/* an input of a merge cursor; the heap holds the indexes of those
+ * whose cursor is on a document not yet merged */
+typedef struct mongotcl_mergeInput
+{
+	mongotcl_cursorClientData *mc;
+	Tcl_Obj *name;
+} mongotcl_mergeInput;
+
+typedef struct mongotcl_mergeClientData
+{
+	int merge_magic;
+	Tcl_Interp *interp;
+	Tcl_Command cmdToken;
+	int nKeys;
+	char **keys;
+	int *directions;
+	int nInputs;
+	mongotcl_mergeInput *inputs;
+	int *heap;
+	int heapSize;
+	int started;
+	int current;
+	Tcl_Obj *failure;	/* why an input couldn't be read, once one couldn't */
+} mongotcl_mergeClientData;
+
+/* one range of a parallel scan, read on its own connection */
+typedef struct mongotcl_scanWorker
+{
+	mongo conn;
+	int request;
+	int64_t cursor_id;
+} mongotcl_scanWorker;
+
+/* the complete results of a query, kept as a single reply; entries are
+ * listed most recently used first */
+typedef struct mongotcl_cacheEntry
+{
+	Tcl_HashEntry *hashEntry;
+	char *ns;
+	mongo_reply *reply;
+	int size;
+	Tcl_WideInt expires;
+	struct mongotcl_cacheEntry *prev;
+	struct mongotcl_cacheEntry *next;
+} mongotcl_cacheEntry;
+
+/* a tailable query followed in the background on its own connection,
+ * each document handed to deliverProc from the event loop */
+typedef void (mongotcl_tailDeliverProc) (ClientData clientData, const char *data);
+typedef void (mongotcl_tailFailProc) (ClientData clientData, const char *message);
+
+typedef struct mongotcl_tail
+{
+	mongotcl_clientData *md;
+	char *ns;
+	bson query;
+	bson *fields;
+	int options;
+	int skip;
+	int batch_size;
+	char *field;
+	mongo *conn;
+	int fd;
+	int request;
+	int64_t cursor_id;
+	bson *last;
+	Tcl_TimerToken timer;
+	int stopped;
+	mongotcl_tailDeliverProc *deliverProc;
+	mongotcl_tailFailProc *failProc;
+	ClientData clientData;
+	struct mongotcl_tail *next;
+} mongotcl_tail;
+
+enum mongotcl_readPreference {
+	MONGOTCL_READ_PRIMARY,
+	MONGOTCL_READ_PRIMARY_PREFERRED,
+	MONGOTCL_READ_SECONDARY,
+	MONGOTCL_READ_NEAREST
+};
+
+typedef struct mongotcl_member
+{
+	char host[256];
+	int port;
+	mongo *conn;
+	int listed;
+	int is_primary;
+	int is_secondary;
+	double rtt;
+	int hedge_pending;
+	int hedge_fd;
+	mongotcl_clientData *md;
+	struct mongotcl_member *next;
+} mongotcl_member;
+
+enum mongotcl_bulkOpType {
+	MONGOTCL_BULK_INSERT,
+	MONGOTCL_BULK_UPDATE,
+	MONGOTCL_BULK_REMOVE
+};
+
+typedef struct mongotcl_bulkOp
+{
+	enum mongotcl_bulkOpType type;
+	int upsert;
+	int multi;
+	bson doc;
+	bson update;
+} mongotcl_bulkOp;
+
+typedef struct mongotcl_pendingWrite
+{
+	mongotcl_bulkOp op;
+	char *ns;
+	struct mongotcl_pendingWrite *next;
+} mongotcl_pendingWrite;
+
+enum mongotcl_asyncType {
+	MONGOTCL_ASYNC_COMMAND,
+	MONGOTCL_ASYNC_FIND
+};
+
+typedef struct mongotcl_asyncRequest
+{
+	int request_id;
+	enum mongotcl_asyncType type;
+	int done;
+	int failed;
+	Tcl_Obj *callback;
+	Tcl_Obj *result;
+	struct mongotcl_asyncRequest *next;
+} mongotcl_asyncRequest;
+
+/* I/O counters for a connection, kept by the wire layer */
+typedef struct mongotcl_wireStats
+{
+	Tcl_WideInt writeCalls;
+	Tcl_WideInt messagesWritten;
+	Tcl_WideInt bytesWritten;
+	Tcl_WideInt readCalls;
+	Tcl_WideInt repliesRead;
+	Tcl_WideInt bytesRead;
+} mongotcl_wireStats;
+
+typedef struct mongotcl_bulkClientData
+{
+    int bulk_magic;
+    Tcl_Interp *interp;
+    mongotcl_clientData *md;
+    Tcl_Command cmdToken;
+    char *ns;
+    int ordered;
+    int nOps;
+    int opsAllocated;
+    mongotcl_bulkOp *ops;
+    struct mongotcl_bulkClientData *live_prev;
+    struct mongotcl_bulkClientData *live_next;
+} mongotcl_bulkClientData;
+
+typedef struct mongotcl_mirrorDoc
+{
+	Tcl_Obj *doc;
+	char *data;
+	Tcl_HashEntry *idEntry;
+	Tcl_HashEntry *keyEntry;
+	struct mongotcl_mirrorPosting *postings;
+} mongotcl_mirrorDoc;
+
+/* a document's entry in a secondary index; in a hash index postings
+ * with the same value are chained from the value's bucket, in an
+ * ordered index they are the nodes of a skip list */
+typedef struct mongotcl_mirrorPosting
+{
+	struct mongotcl_mirrorIndex *index;
+	mongotcl_mirrorDoc *doc;
+	struct mongotcl_mirrorPosting *docNext;
+	Tcl_HashEntry *bucket;
+	struct mongotcl_mirrorPosting *prev;
+	struct mongotcl_mirrorPosting *next;
+	double number;
+	char *string;
+	int levels;
+	struct mongotcl_mirrorPosting *forward[1];
+} mongotcl_mirrorPosting;
+
+typedef struct mongotcl_mirrorIndex
+{
+	char *field;
+	int ordered;
+	int numeric;
+	int count;
+	Tcl_HashTable buckets;
+	mongotcl_mirrorPosting *head;
+	int levels;
+	unsigned int random_state;
+	struct mongotcl_mirrorIndex *next;
+} mongotcl_mirrorIndex;
+
+typedef struct mongotcl_mirrorClientData
+{
+	int mirror_magic;
+	Tcl_Interp *interp;
+	Tcl_Command cmdToken;
+	char *ns;
+	char *key;
+	Tcl_HashTable byId;
+	Tcl_HashTable byKey;
+	mongotcl_mirrorIndex *indexes;
+	mongotcl_tail *tail;
+	Tcl_Obj *error;
+	Tcl_WideInt loaded;
+	Tcl_WideInt inserts;
+	Tcl_WideInt updates;
+	Tcl_WideInt deletes;
+	Tcl_WideInt lookups;
+	Tcl_WideInt hits;
+} mongotcl_mirrorClientData;
+
+extern int
+mongotcl_probeServerLimits (mongotcl_clientData *md);
+
+extern void
+mongotcl_resetConnectionState (mongotcl_clientData *md);
+
+extern int
+mongotcl_writeConcernIsAcknowledged (mongo_write_concern *writeConcern);
+
+extern void
+mongotcl_namespaceToDb (const char *ns, Tcl_DString *dbString);
+
+extern void
+mongotcl_appendWriteConcern (bson *command, mongo_write_concern *writeConcern);
+
+extern int
+mongotcl_checkLastError (mongotcl_clientData *md, const char *ns);
+
+extern int
+mongotcl_insertBatch (Tcl_Interp *interp, mongotcl_clientData *md, char *ns, int listObjc, Tcl_Obj **listObjv, int flags, int *confirmedPtr);
+
+extern int
+mongotcl_createCursorObjCmd(Tcl_Interp *interp, mongotcl_clientData *md, char *commandName, char *namespace, mongotcl_cursorClientData **mcPtr);
+
+extern int
+mongotcl_sendWriteOp (mongotcl_clientData *md, const char *ns, mongotcl_bulkOp *op, mongo_write_concern *writeConcern);
+
+extern mongo_write_concern *
+mongotcl_activeWriteConcern (mongotcl_clientData *md);
+
+extern int
+mongotcl_pipelineNoteWrite (mongotcl_clientData *md, const char *ns);
+
+extern int
+mongotcl_pipelineDrain (mongotcl_clientData *md);
+
+extern int
+mongotcl_pipelineFinish (Tcl_Interp *interp, mongotcl_clientData *md, int scriptResult);
+
+extern void
+mongotcl_wireAppendInt32 (Tcl_DString *msg, int value);
+
+extern void
+mongotcl_wireAppendInt64 (Tcl_DString *msg, int64_t value);
+
+extern int
+mongotcl_wireStartMessage (Tcl_DString *msg, int opCode);
+
+extern void
+mongotcl_wireFinishMessage (Tcl_DString *msg);
+
+extern int
+mongotcl_wireBuildQuery (Tcl_DString *msg, const char *ns, int flags, int skip, int nToReturn, const bson *query, const bson *fields);
+
+extern int
+mongotcl_wireBuildCommand (Tcl_DString *msg, const char *db, const bson *command);
+
+extern void
+mongotcl_wireBuildKillCursors (Tcl_DString *msg, int64_t cursorId);
+
+extern void
+mongotcl_wireBuildKillCursorsList (Tcl_DString *msg, int nCursors, const int64_t *cursorIds);
+
+extern int
+mongotcl_wireBuildGetMore (Tcl_DString *msg, const char *ns, int nToReturn, int64_t cursorId);
+
+extern void
+mongotcl_wireBuildInsert (Tcl_DString *msg, const char *ns, int flags, const bson *doc);
+
+extern void
+mongotcl_wireBuildUpdate (Tcl_DString *msg, const char *ns, int flags, const bson *cond, const bson *op);
+
+extern void
+mongotcl_wireBuildDelete (Tcl_DString *msg, const char *ns, int flags, const bson *cond);
+
+extern int
+mongotcl_wireSend (mongo *conn, const char *data, int len);
+
+extern int
+mongotcl_wireQueue (mongo *conn, const char *data, int len);
+
+extern int
+mongotcl_wireFlush (mongo *conn);
+
+extern int
+mongotcl_wireQueued (mongo *conn);
+
+extern int
+mongotcl_wireBuffered (mongo *conn);
+
+extern void
+mongotcl_wireGetStats (mongo *conn, mongotcl_wireStats *stats, int reset);
+
+extern void
+mongotcl_wireReset (mongo *conn);
+
+extern void
+mongotcl_wireRelease (mongo *conn);
+
+extern int
+mongotcl_wireReadReply (mongo *conn, mongo_reply **replyPtr);
+
+extern int
+mongotcl_flushWrites (mongotcl_clientData *md);
+
+extern void
+mongotcl_flushExitProc (ClientData clientData);
+
+extern int
+mongotcl_asyncDrain (mongotcl_clientData *md);
+
+extern int
+mongotcl_cursorSettle (mongotcl_clientData *md, mongo *conn);
+
+extern void
+mongotcl_cursorPrefetchReset (mongotcl_clientData *md, mongo *conn);
+
+extern void
+mongotcl_cursorPrefetchForget (mongotcl_clientData *md);
+
+extern void
+mongotcl_cursorTrack (mongotcl_cursorClientData *mc);
+
+extern void
+mongotcl_cursorUntrack (mongotcl_cursorClientData *mc);
+
+extern mongo_cursor *
+mongotcl_cursorAlloc (mongotcl_clientData *md, const char *ns);
+
+extern void
+mongotcl_cursorFree (mongotcl_clientData *md, mongo_cursor *cursor);
+
+extern void
+mongotcl_cursorReuse (mongo_cursor *cursor, mongo *conn, const char *ns, int keepQuery);
+
+extern void
+mongotcl_cursorKill (mongotcl_clientData *md, mongo *conn, int64_t cursorId);
+
+extern void
+mongotcl_cursorKillFlush (mongotcl_clientData *md);
+
+extern void
+mongotcl_cursorTrackForget (mongotcl_clientData *md);
+
+extern int
+mongotcl_cursorsObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern void
+mongotcl_cursorRelease (mongotcl_cursorClientData *mc);
+
+extern void
+mongotcl_bulkForget (mongotcl_clientData *md);
+
+extern void
+mongotcl_resumeReset (mongotcl_cursorClientData *mc);
+
+extern void
+mongotcl_resumeCleanup (mongotcl_cursorClientData *mc);
+
+extern void
+mongotcl_resumeRemember (mongotcl_cursorClientData *mc);
+
+extern int
+mongotcl_resumeCursor (mongotcl_cursorClientData *mc);
+
+extern int
+mongotcl_resumeSetField (Tcl_Interp *interp, mongotcl_cursorClientData *mc, const char *field);
+
+extern int
+mongotcl_resumeSort (Tcl_Interp *interp, mongotcl_cursorClientData *mc, const bson *query);
+
+extern void
+mongotcl_cacheInit (mongotcl_clientData *md);
+
+extern int
+mongotcl_cacheFetch (mongotcl_cursorClientData *mc);
+
+extern void
+mongotcl_cacheRecord (mongotcl_cursorClientData *mc);
+
+extern void
+mongotcl_cacheAbandon (mongotcl_cursorClientData *mc);
+
+extern void
+mongotcl_cacheStore (mongotcl_cursorClientData *mc);
+
+extern int
+mongotcl_cacheInvalidate (mongotcl_clientData *md, const char *pattern);
+
+extern void
+mongotcl_cacheCleanup (mongotcl_clientData *md);
+
+extern int
+mongotcl_cacheObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_cursorObjectObjCmd (ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_mergeCursorObjCmd (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_aggregateObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_findObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_distinctObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_paginateObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_parallelScanObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_listenObjCmd (Tcl_Interp *interp, mongotcl_cursorClientData *mc, int objc, Tcl_Obj *CONST objv[]);
+
+extern void
+mongotcl_listenStop (mongotcl_cursorClientData *mc);
+
+extern mongotcl_tail *
+mongotcl_tailStart (Tcl_Interp *interp, mongotcl_clientData *md, const char *ns, const bson *query, const bson *fields, int options, int skip, int batchSize, const char *field, const bson *after, mongotcl_tailDeliverProc *deliverProc, mongotcl_tailFailProc *failProc, ClientData clientData);
+
+extern void
+mongotcl_tailStop (mongotcl_tail *tail);
+
+extern void
+mongotcl_tailForget (mongotcl_clientData *md);
+
+extern int
+mongotcl_cmdNameObjToMongo (Tcl_Interp *interp, Tcl_Obj *commandNameObj, mongotcl_clientData **md);
+
+extern bson_type
+mongotcl_mirrorField (bson_iterator *it, const char *data, const char *path);
+
+extern int
+mongotcl_mirrorKeyString (const bson_iterator *it, Tcl_DString *ds);
+
+extern void
+mongotcl_mirrorIndexDoc (mongotcl_mirrorClientData *mm, mongotcl_mirrorDoc *doc);
+
+extern void
+mongotcl_mirrorUnindexDoc (mongotcl_mirrorDoc *doc);
+
+extern void
+mongotcl_mirrorIndexCleanup (mongotcl_mirrorClientData *mm);
+
+extern int
+mongotcl_mirrorIndexObjCmd (Tcl_Interp *interp, mongotcl_mirrorClientData *mm, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_mirrorFindObjCmd (Tcl_Interp *interp, mongotcl_mirrorClientData *mm, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_mirrorRangeObjCmd (Tcl_Interp *interp, mongotcl_mirrorClientData *mm, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_mirrorObjCmd (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern void
+mongotcl_asyncReset (mongotcl_clientData *md);
+
+extern void
+mongotcl_asyncCleanup (mongotcl_clientData *md);
+
+extern int
+mongotcl_asyncObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_isConnectionError (mongo *conn);
+
+extern Tcl_WideInt
+mongotcl_milliseconds (void);
+
+extern Tcl_WideInt
+mongotcl_microseconds (void);
+
+extern unsigned int
+mongotcl_random (unsigned int *state);
+
+extern int
+mongotcl_authenticateConnection (mongotcl_clientData *md, mongo *conn);
+
+extern int
+mongotcl_timeoutOption (Tcl_Interp *interp, int *objcPtr, Tcl_Obj *CONST objv[], int *msPtr);
+
+extern void
+mongotcl_opTimeoutBegin (mongotcl_clientData *md, int ms);
+
+extern int
+mongotcl_opTimeoutEnd (Tcl_Interp *interp, mongotcl_clientData *md, int ms, Tcl_WideInt start, int result);
+
+extern void
+mongotcl_bsonWithMaxTime (const bson *src, int ms, int isQuery, bson *out);
+
+extern int
+mongotcl_resilientWrite (Tcl_Interp *interp, mongotcl_clientData *md, const char *ns, enum mongotcl_bulkOpType type, bson *doc, bson *update, int upsert, int multi);
+
+extern int
+mongotcl_resilientBufferBatch (Tcl_Interp *interp, mongotcl_clientData *md, const char *ns, int listObjc, Tcl_Obj **listObjv);
+
+extern int
+mongotcl_resilientObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern void
+mongotcl_resilientCleanup (mongotcl_clientData *md);
+
+extern int
+mongotcl_createBulkObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, char *namespace, int ordered);
+
+extern int
+mongotcl_runReadCommand (mongo *conn, const char *db, const bson *command, int options, bson *out);
+
+extern int
+mongotcl_commandReplyToBson (mongo *conn, mongo_reply *reply, bson *out);
+
+extern int
+mongotcl_rankReadMembers (mongotcl_clientData *md, mongotcl_member **ranked, int max);
+
+extern int
+mongotcl_noEligibleMember (Tcl_Interp *interp, mongotcl_clientData *md);
+
+extern int
+mongotcl_selectReadConnection (Tcl_Interp *interp, mongotcl_clientData *md, mongo **connPtr, int *optionsPtr);
+
+extern int
+mongotcl_readCount (Tcl_Interp *interp, mongotcl_clientData *md, const char *db, const char *collection, const bson *query);
+
+extern int
+mongotcl_readPreferenceObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_replicaMembersObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern void
+mongotcl_replicaCleanup (mongotcl_clientData *md);
+
+extern int
+mongotcl_replicaSetConnect (mongotcl_clientData *md);
+
+extern int
+mongotcl_reconnect (mongotcl_clientData *md);
+
+extern void
+mongotcl_connectFlushCache (mongotcl_clientData *md);
+
+extern int
+mongotcl_unixConnect (mongotcl_clientData *md, const char *path);
+
+extern int
+mongotcl_applySocketOptions (mongotcl_clientData *md, mongo *conn);
+
+extern int
+mongotcl_connectSide (mongotcl_clientData *md, mongo *conn);
+
+extern int
+mongotcl_configureObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_hedgeApplies (mongotcl_clientData *md);
+
+extern int
+mongotcl_hedgedQuery (Tcl_Interp *interp, mongotcl_clientData *md, const char *ns, int options, int skip, int nToReturn, const bson *query, const bson *fields, mongo **connPtr, mongo_reply **replyPtr);
+
+extern void
+mongotcl_drainConnection (mongotcl_clientData *md, mongo *conn);
+
+extern void
+mongotcl_hedgeForget (mongotcl_clientData *md, mongo *conn);
+
+extern int
+mongotcl_hedgeObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]);
+
+extern int
+mongotcl_setCursorError (Tcl_Interp *interp, mongo_cursor *cursor);
+
+extern int
+mongotcl_cursorInstallReply (mongo_cursor *cursor, mongo *conn, mongo_reply *reply);
+
 /* vim: set ts=4 sw=4 sts=4 noet : */
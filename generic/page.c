@@ -0,0 +1,718 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * keyset pagination - each page is read with a range condition on the
+ * sort keys of the last document of the page before, carried between
+ * calls in a continuation token, so deep pages cost no more than the
+ * first where skip would have the server walk every document before
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+
+#define MONGOTCL_MAX_PAGE_KEYS 32
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pageSortString --
+ *
+ *      Append the sort, as given to paginate, to ds.  The token carries
+ *      it so a token isn't used with a different sort.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_pageSortString (int nKeys, char **keys, int *directions, Tcl_DString *ds) {
+	int i;
+
+	for (i = 0; i < nKeys; i++) {
+		if (i > 0) {
+			Tcl_DStringAppend (ds, " ", 1);
+		}
+		if (directions[i] < 0) {
+			Tcl_DStringAppend (ds, "-", 1);
+		}
+		Tcl_DStringAppend (ds, keys[i], -1);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pageMakeToken --
+ *
+ *      Make the continuation token for the page after the one whose
+ *      last document is data: the hex of a document holding the sort
+ *      and the document's value of each sort field, null if missing.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+mongotcl_pageMakeToken (int nKeys, char **keys, int *directions, const char *data) {
+	static const char hex[] = "0123456789abcdef";
+	Tcl_DString sort;
+	Tcl_Obj *tokenObj;
+	bson token;
+	char *out;
+	int size;
+	int i;
+
+	Tcl_DStringInit (&sort);
+	mongotcl_pageSortString (nKeys, keys, directions, &sort);
+
+	bson_init (&token);
+	bson_append_string (&token, "sort", Tcl_DStringValue (&sort));
+	bson_append_start_array (&token, "values");
+	for (i = 0; i < nKeys; i++) {
+		bson_iterator it;
+		char name[16];
+
+		snprintf (name, sizeof (name), "%d", i);
+		if (mongotcl_mirrorField (&it, data, keys[i]) != BSON_EOO) {
+			bson_append_element (&token, name, &it);
+		} else {
+			bson_append_null (&token, name);
+		}
+	}
+	bson_append_finish_array (&token);
+	bson_finish (&token);
+	Tcl_DStringFree (&sort);
+
+	size = bson_size (&token);
+	tokenObj = Tcl_NewObj ();
+	Tcl_SetObjLength (tokenObj, size * 2);
+	out = Tcl_GetString (tokenObj);
+	for (i = 0; i < size; i++) {
+		unsigned char c = (unsigned char)token.data[i];
+
+		out[2 * i] = hex[c >> 4];
+		out[2 * i + 1] = hex[c & 0xf];
+	}
+	bson_destroy (&token);
+	return tokenObj;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pageCheckDocument --
+ *
+ *      Check that the size bytes at data are a document whose elements
+ *      all lie within it, as a token from a client may be anything.
+ *      Embedded documents are only checked to fit; they are passed on
+ *      to the server as they are.
+ *
+ * Results:
+ *      The number of elements, or -1 if the document is malformed.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_pageCheckDocument (const char *data, int size) {
+	const char *p = data + 4;
+	const char *end = data + size - 1;
+	int count = 0;
+	int docSize;
+
+	if (size < 5) {
+		return -1;
+	}
+
+	bson_little_endian32 (&docSize, data);
+	if (docSize != size || *end != '\0') {
+		return -1;
+	}
+
+	while (p < end) {
+		int type = (unsigned char)*p++;
+		int len = -1;
+		int n;
+
+		while (p < end && *p != '\0') {
+			p++;
+		}
+		if (p == end) {
+			return -1;
+		}
+		p++;
+
+		switch (type) {
+			case BSON_UNDEFINED:
+			case BSON_NULL:
+			case BSON_MINKEY:
+			case BSON_MAXKEY: {
+				len = 0;
+				break;
+			}
+
+			case BSON_BOOL: {
+				len = 1;
+				break;
+			}
+
+			case BSON_INT: {
+				len = 4;
+				break;
+			}
+
+			case BSON_DOUBLE:
+			case BSON_DATE:
+			case BSON_TIMESTAMP:
+			case BSON_LONG: {
+				len = 8;
+				break;
+			}
+
+			case BSON_OID: {
+				len = 12;
+				break;
+			}
+
+			case BSON_STRING:
+			case BSON_CODE:
+			case BSON_SYMBOL: {
+				if (end - p < 4) {
+					return -1;
+				}
+				bson_little_endian32 (&n, p);
+				if (n < 1 || n > end - p - 4 || p[4 + n - 1] != '\0') {
+					return -1;
+				}
+				len = 4 + n;
+				break;
+			}
+
+			case BSON_OBJECT:
+			case BSON_ARRAY:
+			case BSON_CODEWSCOPE: {
+				if (end - p < 5) {
+					return -1;
+				}
+				bson_little_endian32 (&n, p);
+				if (n < 5 || n > end - p || p[n - 1] != '\0') {
+					return -1;
+				}
+				len = n;
+				break;
+			}
+
+			case BSON_BINDATA: {
+				if (end - p < 5) {
+					return -1;
+				}
+				bson_little_endian32 (&n, p);
+				if (n < 0 || n > end - p - 5) {
+					return -1;
+				}
+				len = 5 + n;
+				break;
+			}
+
+			case BSON_REGEX: {
+				const char *q = p;
+				int strings = 0;
+
+				while (q < end && strings < 2) {
+					if (*q++ == '\0') {
+						strings++;
+					}
+				}
+				if (strings < 2) {
+					return -1;
+				}
+				len = (int)(q - p);
+				break;
+			}
+
+			case BSON_DBREF: {
+				if (end - p < 4) {
+					return -1;
+				}
+				bson_little_endian32 (&n, p);
+				if (n < 1 || n > end - p - 16 || p[4 + n - 1] != '\0') {
+					return -1;
+				}
+				len = 4 + n + 12;
+				break;
+			}
+
+			default: {
+				return -1;
+			}
+		}
+
+		if (len > end - p) {
+			return -1;
+		}
+		p += len;
+		count++;
+	}
+	return count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pageReadToken --
+ *
+ *      Decode a continuation token made for the same sort into values,
+ *      an array iterator positioned on its values.  bytes must be freed
+ *      with ckfree.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_pageReadToken (Tcl_Interp *interp, Tcl_Obj *tokenObj, int nKeys, char **keys, int *directions, char **bytesPtr, bson_iterator *values) {
+	int length;
+	const char *in = Tcl_GetStringFromObj (tokenObj, &length);
+	Tcl_DString sort;
+	bson_iterator it;
+	char *bytes;
+	int size;
+	int i;
+
+	if (length < 10 || (length & 1)) {
+		goto bad_token;
+	}
+
+	bytes = ckalloc (length / 2);
+	for (i = 0; i < length; i++) {
+		int c = in[i];
+		int nibble;
+
+		if (c >= '0' && c <= '9') {
+			nibble = c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			nibble = c - 'a' + 10;
+		} else {
+			ckfree (bytes);
+			goto bad_token;
+		}
+
+		if (i & 1) {
+			bytes[i / 2] |= nibble;
+		} else {
+			bytes[i / 2] = (char)(nibble << 4);
+		}
+	}
+
+	size = length / 2;
+	if (mongotcl_pageCheckDocument (bytes, size) < 0) {
+		ckfree (bytes);
+		goto bad_token;
+	}
+
+	Tcl_DStringInit (&sort);
+	mongotcl_pageSortString (nKeys, keys, directions, &sort);
+	if (mongotcl_bsonFindRaw (&it, bytes, "sort") != BSON_STRING || strcmp (bson_iterator_string (&it), Tcl_DStringValue (&sort)) != 0) {
+		Tcl_DStringFree (&sort);
+		ckfree (bytes);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("continuation token is for a different sort", -1));
+		return TCL_ERROR;
+	}
+	Tcl_DStringFree (&sort);
+
+	/* one value for each sort field */
+	if (mongotcl_bsonFindRaw (&it, bytes, "values") != BSON_ARRAY) {
+		ckfree (bytes);
+		goto bad_token;
+	}
+
+	bson_little_endian32 (&size, bson_iterator_value (&it));
+	if (mongotcl_pageCheckDocument (bson_iterator_value (&it), size) != nKeys) {
+		ckfree (bytes);
+		goto bad_token;
+	}
+
+	bson_iterator_subiterator (&it, values);
+	*bytesPtr = bytes;
+	return TCL_OK;
+
+  bad_token:
+	Tcl_SetObjResult (interp, Tcl_NewStringObj ("invalid continuation token", -1));
+	return TCL_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pageBuildQuery --
+ *
+ *      Build the query for a page: the caller's filter and, after a
+ *      token, documents sorting after its values, in the page's sort
+ *      order.  For sort keys k1..kn the condition is the $or of
+ *      {k1 > v1}, {k1 = v1, k2 > v2} ... with < for descending keys.
+ *
+ *      $gt and $lt only match values of the same type, so null, which
+ *      a missing field sorts as, is handled apart: everything that isn't
+ *      null or missing follows it ascending, and it follows everything
+ *      descending.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_pageBuildQuery (mongotcl_clientData *md, const bson *filter, int nKeys, char **keys, int *directions, bson_iterator *values, bson *out) {
+	bson_iterator valueIts[MONGOTCL_MAX_PAGE_KEYS];
+	bson_iterator it;
+	int i;
+	int j;
+
+	bson_init (out);
+	bson_append_start_object (out, "$query");
+
+	if (values != NULL) {
+		for (i = 0; i < nKeys; i++) {
+			bson_iterator_next (values);
+			valueIts[i] = *values;
+		}
+
+		if (filter != NULL) {
+			bson_append_start_array (out, "$and");
+			bson_append_bson (out, "0", filter);
+			bson_append_start_object (out, "1");
+		}
+
+		bson_append_start_array (out, "$or");
+		for (i = 0; i < nKeys; i++) {
+			char name[16];
+
+			snprintf (name, sizeof (name), "%d", i);
+			bson_append_start_object (out, name);
+			for (j = 0; j < i; j++) {
+				bson_append_element (out, keys[j], &valueIts[j]);
+			}
+			if (bson_iterator_type (&valueIts[i]) == BSON_NULL) {
+				/* descending, nothing but a tie follows null */
+				bson_append_start_object (out, keys[i]);
+				if (directions[i] > 0) {
+					bson_append_null (out, "$ne");
+				} else {
+					bson_append_null (out, "$lt");
+				}
+				bson_append_finish_object (out);
+			} else if (directions[i] < 0) {
+				bson_append_start_array (out, "$or");
+				bson_append_start_object (out, "0");
+				bson_append_start_object (out, keys[i]);
+				bson_append_element (out, "$lt", &valueIts[i]);
+				bson_append_finish_object (out);
+				bson_append_finish_object (out);
+				bson_append_start_object (out, "1");
+				bson_append_null (out, keys[i]);
+				bson_append_finish_object (out);
+				bson_append_finish_array (out);
+			} else {
+				bson_append_start_object (out, keys[i]);
+				bson_append_element (out, "$gt", &valueIts[i]);
+				bson_append_finish_object (out);
+			}
+			bson_append_finish_object (out);
+		}
+		bson_append_finish_array (out);
+
+		if (filter != NULL) {
+			bson_append_finish_object (out);
+			bson_append_finish_array (out);
+		}
+	} else if (filter != NULL) {
+		bson_iterator_init (&it, filter);
+		while (bson_iterator_next (&it) != BSON_EOO) {
+			bson_append_element (out, NULL, &it);
+		}
+	}
+	bson_append_finish_object (out);
+
+	bson_append_start_object (out, "$orderby");
+	for (i = 0; i < nKeys; i++) {
+		bson_append_int (out, keys[i], directions[i]);
+	}
+	bson_append_finish_object (out);
+
+	if (md->op_max_time_ms > 0) {
+		bson_append_int (out, "$maxTimeMS", md->op_max_time_ms);
+	}
+	bson_finish (out);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_paginateObjCmd --
+ *
+ *      Implements "$mongo paginate namespace -sort fieldList
+ *      -page_size n ?-after token? ?-query bson? ?-fields fieldList?".
+ *
+ *      One more document than the page holds is asked for, so the last
+ *      page is known without another round trip; the cursor is read
+ *      until that document is seen or it is exhausted, then killed if
+ *      the server kept it open.
+ *      _id is added as the last sort key unless given, so the order is
+ *      total and no document falls between two pages.
+ *
+ * Results:
+ *      A standard Tcl result; a list of "documents" and the documents of
+ *      the page and "next" and the token for the page after, empty on
+ *      the last page.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_paginateObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	char *keys[MONGOTCL_MAX_PAGE_KEYS + 1];
+	int directions[MONGOTCL_MAX_PAGE_KEYS + 1];
+	int nKeys = 0;
+	const char *ns;
+	Tcl_Obj *sortObj = NULL;
+	Tcl_Obj *afterObj = NULL;
+	Tcl_Obj *fieldsObj = NULL;
+	bson *filter = NULL;
+	bson fields;
+	bson query;
+	bson_iterator values;
+	char *tokenBytes = NULL;
+	int pageSize = 0;
+	int haveId = 0;
+	mongo *conn;
+	int options = 0;
+	int64_t cursorId = 0;
+	Tcl_Obj *docsObj;
+	Tcl_Obj *listObj;
+	Tcl_Obj *nextObj = NULL;
+	mongo_reply *reply = NULL;
+	Tcl_DString msg;
+	int nDocs = 0;
+	int more = 0;
+	int status;
+	int result = TCL_OK;
+	int i;
+
+	if (objc < 7 || (objc & 1) == 0) {
+		Tcl_WrongNumArgs (interp, 2, objv, "namespace -sort fieldList -page_size n ?-after token? ?-query bson? ?-fields fieldList?");
+		return TCL_ERROR;
+	}
+
+	ns = Tcl_GetString (objv[2]);
+
+	for (i = 3; i < objc; i += 2) {
+		char *option = Tcl_GetString (objv[i]);
+
+		if (strcmp (option, "-sort") == 0) {
+			sortObj = objv[i + 1];
+		} else if (strcmp (option, "-page_size") == 0) {
+			if (Tcl_GetIntFromObj (interp, objv[i + 1], &pageSize) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+		} else if (strcmp (option, "-after") == 0) {
+			afterObj = objv[i + 1];
+		} else if (strcmp (option, "-query") == 0) {
+			if (mongotcl_cmdNameObjToBson (interp, objv[i + 1], &filter) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+		} else if (strcmp (option, "-fields") == 0) {
+			fieldsObj = objv[i + 1];
+		} else {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -sort, -page_size, -after, -query or -fields", option));
+			return TCL_ERROR;
+		}
+	}
+
+	if (sortObj == NULL || pageSize <= 0) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-sort and a positive -page_size are required", -1));
+		return TCL_ERROR;
+	}
+
+	{
+		Tcl_Obj **sortObjv;
+		int sortObjc;
+
+		if (Tcl_ListObjGetElements (interp, sortObj, &sortObjc, &sortObjv) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+
+		if (sortObjc == 0 || sortObjc > MONGOTCL_MAX_PAGE_KEYS) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("-sort must have from 1 to %d fields", MONGOTCL_MAX_PAGE_KEYS));
+			return TCL_ERROR;
+		}
+
+		for (i = 0; i < sortObjc; i++) {
+			char *field = Tcl_GetString (sortObjv[i]);
+
+			directions[nKeys] = 1;
+			if (*field == '-') {
+				directions[nKeys] = -1;
+				field++;
+			}
+			if (strcmp (field, "_id") == 0) {
+				haveId = 1;
+			}
+			keys[nKeys++] = field;
+		}
+
+		if (!haveId) {
+			directions[nKeys] = 1;
+			keys[nKeys++] = "_id";
+		}
+	}
+
+	if (afterObj != NULL && Tcl_GetCharLength (afterObj) > 0) {
+		if (mongotcl_pageReadToken (interp, afterObj, nKeys, keys, directions, &tokenBytes, &values) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+	}
+
+	bson_init (&fields);
+	if (fieldsObj != NULL) {
+		Tcl_Obj **fieldObjv;
+		int fieldObjc;
+
+		if (Tcl_ListObjGetElements (interp, fieldsObj, &fieldObjc, &fieldObjv) == TCL_ERROR) {
+			bson_destroy (&fields);
+			if (tokenBytes != NULL) {
+				ckfree (tokenBytes);
+			}
+			return TCL_ERROR;
+		}
+
+		/* the sort keys are needed for the token */
+		for (i = 0; i < fieldObjc; i++) {
+			bson_append_int (&fields, Tcl_GetString (fieldObjv[i]), 1);
+		}
+		for (i = 0; i < nKeys; i++) {
+			bson_iterator it;
+
+			if (bson_find (&it, &fields, keys[i]) == BSON_EOO) {
+				bson_append_int (&fields, keys[i], 1);
+			}
+		}
+	}
+	bson_finish (&fields);
+
+	mongotcl_pageBuildQuery (md, filter, nKeys, keys, directions, (tokenBytes != NULL) ? &values : NULL, &query);
+	if (tokenBytes != NULL) {
+		ckfree (tokenBytes);
+	}
+
+	if (mongotcl_selectReadConnection (interp, md, &conn, &options) == TCL_ERROR) {
+		bson_destroy (&query);
+		bson_destroy (&fields);
+		return TCL_ERROR;
+	}
+
+	Tcl_DStringInit (&msg);
+	mongotcl_wireBuildQuery (&msg, ns, options, 0, pageSize + 1, &query, (fieldsObj != NULL) ? &fields : NULL);
+	status = mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+	Tcl_DStringFree (&msg);
+	bson_destroy (&query);
+	bson_destroy (&fields);
+
+	if (status != MONGO_OK) {
+		return mongotcl_setMongoError (interp, conn);
+	}
+
+	docsObj = Tcl_NewObj ();
+	Tcl_IncrRefCount (docsObj);
+
+	/* the first batch may stop short of the page if it filled up */
+	for (;;) {
+		const char *data;
+		int k;
+
+		if (mongotcl_wireReadReply (conn, &reply) != MONGO_OK) {
+			result = mongotcl_setMongoError (interp, conn);
+			break;
+		}
+		data = &reply->objs;
+
+		if (reply->fields.flag & 0x03) {
+			bson_iterator it;
+			const char *message = (reply->fields.flag & 0x01) ? "cursor not found" : "query failed";
+
+			if ((reply->fields.flag & 0x02) && reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, data, "$err") == BSON_STRING) {
+				message = bson_iterator_string (&it);
+			}
+			Tcl_SetObjResult (interp, Tcl_NewStringObj (message, -1));
+			Tcl_SetErrorCode (interp, "MONGO", (reply->fields.flag & 0x01) ? "CURSOR_INVALID" : "CURSOR_QUERY_FAIL", NULL);
+			result = TCL_ERROR;
+			break;
+		}
+
+		cursorId = reply->fields.cursorID;
+		for (k = 0; k < reply->fields.num; k++) {
+			int size;
+
+			/* the document past the page only shows there is another */
+			if (nDocs == pageSize) {
+				more = 1;
+				break;
+			}
+
+			Tcl_ListObjAppendElement (interp, docsObj, mongotcl_bsontolist_raw (interp, Tcl_NewObj (), data, 0));
+			nDocs++;
+
+			if (nDocs == pageSize) {
+				nextObj = mongotcl_pageMakeToken (nKeys, keys, directions, data);
+				Tcl_IncrRefCount (nextObj);
+			}
+
+			bson_little_endian32 (&size, data);
+			data += size;
+		}
+
+		if (more || cursorId == 0) {
+			break;
+		}
+
+		bson_free (reply);
+		reply = NULL;
+
+		Tcl_DStringInit (&msg);
+		mongotcl_wireBuildGetMore (&msg, ns, pageSize + 1 - nDocs, cursorId);
+		status = mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+		Tcl_DStringFree (&msg);
+
+		if (status != MONGO_OK) {
+			result = mongotcl_setMongoError (interp, conn);
+			break;
+		}
+	}
+
+	if (reply != NULL) {
+		if (reply->fields.cursorID != 0 && result == TCL_OK) {
+			Tcl_DStringInit (&msg);
+			mongotcl_wireBuildKillCursors (&msg, reply->fields.cursorID);
+			mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+			Tcl_DStringFree (&msg);
+		}
+		bson_free (reply);
+	}
+
+	if (result == TCL_OK) {
+		listObj = Tcl_NewObj ();
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("documents", -1));
+		Tcl_ListObjAppendElement (interp, listObj, docsObj);
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("next", -1));
+		Tcl_ListObjAppendElement (interp, listObj, more ? nextObj : Tcl_NewObj ());
+		Tcl_SetObjResult (interp, listObj);
+	}
+
+	if (nextObj != NULL) {
+		Tcl_DecrRefCount (nextObj);
+	}
+	Tcl_DecrRefCount (docsObj);
+	return result;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -0,0 +1,686 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * replica set read routing - a connection is kept to every member of
+ * the set, each member's round trip time is tracked with isMaster, and
+ * reads are sent to a member chosen by the read preference
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <stdlib.h>
+
+/* weight of a new round trip sample in the moving average */
+#define MONGOTCL_RTT_ALPHA 0.2
+
+static CONST char *readPreferences[] = {
+	"primary",
+	"primaryPreferred",
+	"secondary",
+	"nearest",
+	NULL
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_commandReplyToBson --
+ *
+ *      Check the reply to a command and, if it succeeded, initialize
+ *      out with a copy of the result document.  The reply is freed.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set to
+ *      MONGO_COMMAND_FAILED, the server's errmsg and its error code, 0
+ *      if it gave none.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_commandReplyToBson (mongo *conn, mongo_reply *reply, bson *out) {
+	bson_iterator it;
+	int ok = 0;
+
+	if (reply->fields.num > 0) {
+		switch (mongotcl_bsonFindRaw (&it, &reply->objs, "ok")) {
+			case BSON_DOUBLE: {
+				ok = (bson_iterator_double (&it) != 0.0);
+				break;
+			}
+
+			case BSON_INT:
+			case BSON_LONG:
+			case BSON_BOOL: {
+				ok = bson_iterator_bool (&it);
+				break;
+			}
+
+			default: {
+				break;
+			}
+		}
+	}
+
+	if (!ok) {
+		conn->err = MONGO_COMMAND_FAILED;
+		strcpy (conn->errstr, "command failed");
+		conn->lasterrcode = 0;
+		if (reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, &reply->objs, "code") != BSON_EOO) {
+			conn->lasterrcode = bson_iterator_int (&it);
+		}
+		if (reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, &reply->objs, "errmsg") == BSON_STRING) {
+			strncpy (conn->errstr, bson_iterator_string (&it), MONGO_ERR_LEN - 1);
+			conn->errstr[MONGO_ERR_LEN - 1] = '\0';
+		}
+		bson_free (reply);
+		return MONGO_ERROR;
+	}
+
+	bson_init (out);
+	bson_iterator_from_buffer (&it, &reply->objs);
+	while (bson_iterator_next (&it)) {
+		bson_append_element (out, NULL, &it);
+	}
+	bson_finish (out);
+	bson_free (reply);
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_runReadCommand --
+ *
+ *      Run a command with the given query options, such as
+ *      MONGO_SLAVE_OK, which mongo_run_command can't pass.  On success
+ *      out is initialized with a copy of the reply.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_runReadCommand (mongo *conn, const char *db, const bson *command, int options, bson *out) {
+	Tcl_DString ns;
+	Tcl_DString msg;
+	mongo_reply *reply;
+
+	Tcl_DStringInit (&ns);
+	Tcl_DStringAppend (&ns, db, -1);
+	Tcl_DStringAppend (&ns, ".$cmd", -1);
+	Tcl_DStringInit (&msg);
+	mongotcl_wireBuildQuery (&msg, Tcl_DStringValue (&ns), options, 0, -1, command, NULL);
+	Tcl_DStringFree (&ns);
+
+	if (mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg)) != MONGO_OK) {
+		Tcl_DStringFree (&msg);
+		return MONGO_ERROR;
+	}
+	Tcl_DStringFree (&msg);
+
+	if (mongotcl_wireReadReply (conn, &reply) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	return mongotcl_commandReplyToBson (conn, reply, out);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_replicaFindMember --
+ *
+ *      Find the member for host and port, creating it if it's new.
+ *      Members are never freed before the mongo object is, since
+ *      cursors may hold their connections.
+ *
+ *----------------------------------------------------------------------
+ */
+static mongotcl_member *
+mongotcl_replicaFindMember (mongotcl_clientData *md, const char *host, int port) {
+	mongotcl_member *m;
+	mongotcl_member **tail = &md->members;
+
+	for (m = md->members; m != NULL; m = m->next) {
+		if (m->port == port && strcmp (m->host, host) == 0) {
+			return m;
+		}
+		tail = &m->next;
+	}
+
+	m = (mongotcl_member *)ckalloc (sizeof (mongotcl_member));
+	strncpy (m->host, host, sizeof (m->host) - 1);
+	m->host[sizeof (m->host) - 1] = '\0';
+	m->port = port;
+	m->conn = (mongo *)ckalloc (sizeof (mongo));
+	mongo_init (m->conn);
+	m->listed = 0;
+	m->is_primary = 0;
+	m->is_secondary = 0;
+	m->rtt = -1.0;
+	m->hedge_pending = 0;
+	m->hedge_fd = -1;
+	m->md = md;
+	m->next = NULL;
+	*tail = m;
+	return m;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_replicaNoteHosts --
+ *
+ *      Mark every member named in the hosts and passives arrays of an
+ *      isMaster reply as listed, adding members not seen before.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_replicaNoteHosts (mongotcl_clientData *md, const bson *isMaster) {
+	static CONST char *arrays[] = {"hosts", "passives", NULL};
+	int i;
+
+	for (i = 0; arrays[i] != NULL; i++) {
+		bson_iterator it;
+		bson_iterator sub;
+
+		if (bson_find (&it, isMaster, arrays[i]) != BSON_ARRAY) {
+			continue;
+		}
+
+		bson_iterator_subiterator (&it, &sub);
+		while (bson_iterator_next (&sub)) {
+			char host[256];
+			char *colon;
+			int port = MONGO_DEFAULT_PORT;
+
+			if (bson_iterator_type (&sub) != BSON_STRING) {
+				continue;
+			}
+
+			strncpy (host, bson_iterator_string (&sub), sizeof (host) - 1);
+			host[sizeof (host) - 1] = '\0';
+			if ((colon = strrchr (host, ':')) != NULL) {
+				*colon = '\0';
+				port = atoi (colon + 1);
+			}
+
+			mongotcl_replicaFindMember (md, host, port)->listed = 1;
+		}
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_replicaCheckMember --
+ *
+ *      Connect to a member if need be, then run isMaster on it to learn
+ *      its state, fold the round trip into its moving average, and pick
+ *      up any members it knows of that we don't.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_replicaCheckMember (mongotcl_clientData *md, mongotcl_member *m) {
+	bson out;
+	bson_iterator it;
+	Tcl_WideInt start;
+	double sample;
+
+	if (!m->conn->connected) {
+		/* mongo_client fails with CONN_NOT_MASTER on a secondary but
+		 * leaves it connected, which is all we want */
+		mongotcl_hedgeForget (md, m->conn);
+		mongotcl_cursorPrefetchReset (md, m->conn);
+		mongotcl_wireReset (m->conn);
+		if (m->conn->primary == NULL) {
+			mongo_client (m->conn, m->host, m->port);
+		} else {
+			mongo_reconnect (m->conn);
+		}
+
+		if (!m->conn->connected) {
+			goto unavailable;
+		}
+
+		if (mongotcl_authenticateConnection (md, m->conn) != MONGO_OK) {
+			mongo_disconnect (m->conn);
+			goto unavailable;
+		}
+
+		mongo_set_op_timeout (m->conn, md->conn->op_timeout_ms);
+		mongotcl_applySocketOptions (md, m->conn);
+		m->rtt = -1.0;
+	}
+
+	mongotcl_drainConnection (md, m->conn);
+
+	start = mongotcl_microseconds ();
+	if (mongo_simple_int_command (m->conn, "admin", "ismaster", 1, &out) != MONGO_OK) {
+		mongo_disconnect (m->conn);
+		goto unavailable;
+	}
+	sample = (mongotcl_microseconds () - start) / 1000.0;
+
+	if (m->rtt < 0) {
+		m->rtt = sample;
+	} else {
+		m->rtt = MONGOTCL_RTT_ALPHA * sample + (1.0 - MONGOTCL_RTT_ALPHA) * m->rtt;
+	}
+
+	m->is_primary = (bson_find (&it, &out, "ismaster") == BSON_BOOL && bson_iterator_bool (&it));
+	m->is_secondary = (bson_find (&it, &out, "secondary") == BSON_BOOL && bson_iterator_bool (&it));
+
+	mongotcl_replicaNoteHosts (md, &out);
+	bson_destroy (&out);
+	return;
+
+  unavailable:
+	m->is_primary = 0;
+	m->is_secondary = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_replicaRefresh --
+ *
+ *      If the heartbeat interval has passed, rediscover the members of
+ *      the set and recheck each one.  Members are learned from the
+ *      primary's isMaster, or from the seeds if it can't be reached.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_replicaRefresh (mongotcl_clientData *md) {
+	Tcl_WideInt now = mongotcl_milliseconds ();
+	mongotcl_member *m;
+	bson out;
+
+	if (md->members_checked != 0 && now - md->members_checked < md->heartbeat_ms) {
+		return;
+	}
+	md->members_checked = now;
+
+	for (m = md->members; m != NULL; m = m->next) {
+		m->listed = 0;
+	}
+
+	if (md->conn->connected && mongo_simple_int_command (md->conn, "admin", "ismaster", 1, &out) == MONGO_OK) {
+		mongotcl_replicaNoteHosts (md, &out);
+		bson_destroy (&out);
+	} else if (md->members == NULL && md->conn->replica_set != NULL) {
+		mongo_host_port *seed;
+
+		for (seed = md->conn->replica_set->seeds; seed != NULL; seed = seed->next) {
+			mongotcl_replicaFindMember (md, seed->host, seed->port)->listed = 1;
+		}
+	} else {
+		/* primary is gone; the members' own isMaster replies relist them */
+		for (m = md->members; m != NULL; m = m->next) {
+			m->listed = 1;
+		}
+	}
+
+	/* members discovered while checking are appended and checked too */
+	for (m = md->members; m != NULL; m = m->next) {
+		if (m->listed) {
+			mongotcl_replicaCheckMember (md, m);
+		} else {
+			m->is_primary = 0;
+			m->is_secondary = 0;
+		}
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_rankReadMembers --
+ *
+ *      Fill ranked with up to max members eligible for reads under the
+ *      read preference, lowest round trip time first.
+ *
+ * Results:
+ *      The number of members ranked.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_rankReadMembers (mongotcl_clientData *md, mongotcl_member **ranked, int max) {
+	mongotcl_member *m;
+	int n = 0;
+
+	mongotcl_replicaRefresh (md);
+
+	for (m = md->members; m != NULL; m = m->next) {
+		int i;
+
+		if (!m->listed || !m->conn->connected) {
+			continue;
+		}
+
+		if (!m->is_secondary && !(m->is_primary && md->read_preference == MONGOTCL_READ_NEAREST)) {
+			continue;
+		}
+
+		/* insertion sort into the short list */
+		for (i = n; i > 0 && m->rtt < ranked[i - 1]->rtt; i--) {
+			if (i < max) {
+				ranked[i] = ranked[i - 1];
+			}
+		}
+
+		if (i < max) {
+			ranked[i] = m;
+			if (n < max) {
+				n++;
+			}
+		}
+	}
+
+	return n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_noEligibleMember --
+ *
+ *      Set the error for a read no member can take.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_noEligibleMember (Tcl_Interp *interp, mongotcl_clientData *md) {
+	Tcl_SetObjResult (interp, Tcl_ObjPrintf ("no replica set member is eligible for read preference %s", readPreferences[md->read_preference]));
+	Tcl_SetErrorCode (interp, "MONGO", "NO_ELIGIBLE_MEMBER", NULL);
+	return TCL_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_selectReadConnection --
+ *
+ *      Choose the connection a read should go to under the object's
+ *      read preference: the lowest latency eligible member, or the
+ *      object's own connection for the primary.  MONGO_SLAVE_OK is
+ *      or'ed into *optionsPtr when the choice is not the primary.
+ *
+ * Results:
+ *      A standard Tcl result; an error with errorCode
+ *      MONGO NO_ELIGIBLE_MEMBER if no member can take the read.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_selectReadConnection (Tcl_Interp *interp, mongotcl_clientData *md, mongo **connPtr, int *optionsPtr) {
+	mongotcl_member *best;
+
+	*connPtr = md->conn;
+
+	if (md->read_preference == MONGOTCL_READ_PRIMARY) {
+		return TCL_OK;
+	}
+
+	if (md->read_preference == MONGOTCL_READ_PRIMARY_PREFERRED && md->conn->connected) {
+		return TCL_OK;
+	}
+
+	if (mongotcl_rankReadMembers (md, &best, 1) == 0) {
+		/* nearest against a standalone server */
+		if (md->read_preference == MONGOTCL_READ_NEAREST && md->conn->connected) {
+			return TCL_OK;
+		}
+
+		return mongotcl_noEligibleMember (interp, md);
+	}
+
+	mongotcl_drainConnection (md, best->conn);
+
+	*connPtr = best->conn;
+	if (!best->is_primary) {
+		*optionsPtr |= MONGO_SLAVE_OK;
+	}
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_readCount --
+ *
+ *      Count the documents in a collection matching query, which may
+ *      be NULL, on the member chosen by the read preference, hedged
+ *      across two members if hedged reads are on.
+ *
+ * Results:
+ *      A standard Tcl result; the count is left in the interpreter.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_readCount (Tcl_Interp *interp, mongotcl_clientData *md, const char *db, const char *collection, const bson *query) {
+	mongo *conn;
+	int options = 0;
+	bson command;
+	bson out;
+	bson_iterator it;
+	int status;
+
+	bson_init (&command);
+	bson_append_string (&command, "count", collection);
+	if (query != NULL) {
+		bson_append_bson (&command, "query", query);
+	}
+	if (md->op_max_time_ms > 0) {
+		bson_append_int (&command, "maxTimeMS", md->op_max_time_ms);
+	}
+	bson_finish (&command);
+
+	if (mongotcl_hedgeApplies (md)) {
+		Tcl_DString ns;
+		mongo_reply *reply;
+
+		Tcl_DStringInit (&ns);
+		Tcl_DStringAppend (&ns, db, -1);
+		Tcl_DStringAppend (&ns, ".$cmd", -1);
+		status = mongotcl_hedgedQuery (interp, md, Tcl_DStringValue (&ns), 0, 0, -1, &command, NULL, &conn, &reply);
+		Tcl_DStringFree (&ns);
+		bson_destroy (&command);
+
+		if (status == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+		status = mongotcl_commandReplyToBson (conn, reply, &out);
+	} else {
+		if (mongotcl_selectReadConnection (interp, md, &conn, &options) == TCL_ERROR) {
+			bson_destroy (&command);
+			return TCL_ERROR;
+		}
+
+		/* mongo_count can't carry maxTimeMS */
+		if (conn == md->conn && options == 0 && md->op_max_time_ms == 0) {
+			double count;
+
+			bson_destroy (&command);
+			if ((count = mongo_count (conn, db, collection, query)) == MONGO_ERROR) {
+				return mongotcl_setMongoError (interp, conn);
+			}
+			Tcl_SetObjResult (interp, Tcl_NewIntObj ((int)count));
+			return TCL_OK;
+		}
+
+		status = mongotcl_runReadCommand (conn, db, &command, options, &out);
+		bson_destroy (&command);
+	}
+
+	if (status != MONGO_OK) {
+		return mongotcl_setMongoError (interp, conn);
+	}
+
+	if (bson_find (&it, &out, "n") != BSON_EOO) {
+		Tcl_SetObjResult (interp, Tcl_NewIntObj ((int)bson_iterator_double (&it)));
+	} else {
+		Tcl_SetObjResult (interp, Tcl_NewIntObj (0));
+	}
+	bson_destroy (&out);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_readPreferenceObjCmd --
+ *
+ *      Implements "$mongo read_preference ?mode? ?-heartbeat ms?".
+ *      With no arguments returns the current mode.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_readPreferenceObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	int mode;
+	int heartbeat = md->heartbeat_ms;
+
+	if (objc == 2) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (readPreferences[md->read_preference], -1));
+		return TCL_OK;
+	}
+
+	if (objc != 3 && objc != 5) {
+		Tcl_WrongNumArgs (interp, 2, objv, "?mode? ?-heartbeat ms?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], readPreferences, "read preference", TCL_EXACT, &mode) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (objc == 5) {
+		if (strcmp (Tcl_GetString (objv[3]), "-heartbeat") != 0) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -heartbeat", Tcl_GetString (objv[3])));
+			return TCL_ERROR;
+		}
+
+		if (Tcl_GetIntFromObj (interp, objv[4], &heartbeat) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+
+		if (heartbeat <= 0) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-heartbeat must be positive", -1));
+			return TCL_ERROR;
+		}
+	}
+
+	md->read_preference = mode;
+	md->heartbeat_ms = heartbeat;
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_replicaMembersObjCmd --
+ *
+ *      Implements "$mongo replica_set_members", rechecking every member
+ *      and returning a list with a key-value list for each.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_replicaMembersObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	mongotcl_member *m;
+	Tcl_Obj *resultObj = Tcl_NewObj ();
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs (interp, 1, objv, "replica_set_members");
+		return TCL_ERROR;
+	}
+
+	md->members_checked = 0;
+	mongotcl_replicaRefresh (md);
+
+	for (m = md->members; m != NULL; m = m->next) {
+		Tcl_Obj *listObj;
+		char *state;
+
+		if (!m->listed) {
+			continue;
+		}
+
+		if (!m->conn->connected) {
+			state = "unavailable";
+		} else if (m->is_primary) {
+			state = "primary";
+		} else if (m->is_secondary) {
+			state = "secondary";
+		} else {
+			state = "other";
+		}
+
+		listObj = Tcl_NewObj ();
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("host", -1));
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (m->host, -1));
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("port", -1));
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (m->port));
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("state", -1));
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (state, -1));
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("rtt", -1));
+		Tcl_ListObjAppendElement (interp, listObj, Tcl_NewDoubleObj (m->rtt));
+		Tcl_ListObjAppendElement (interp, resultObj, listObj);
+	}
+
+	Tcl_SetObjResult (interp, resultObj);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_replicaCleanup --
+ *
+ *      Close and free the member connections.  Called when the mongo
+ *      object is deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_replicaCleanup (mongotcl_clientData *md) {
+	mongotcl_member *m = md->members;
+
+	while (m != NULL) {
+		mongotcl_member *next = m->next;
+
+		mongotcl_hedgeForget (md, m->conn);
+		mongotcl_wireRelease (m->conn);
+		mongo_destroy (m->conn);
+		ckfree ((char *)m->conn);
+		ckfree ((char *)m);
+		m = next;
+	}
+
+	md->members = NULL;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
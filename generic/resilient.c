@@ -0,0 +1,536 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * resilient mode - writes that fail because the connection went away
+ * are buffered in memory, the connection is reestablished with
+ * exponential backoff, and the buffered writes are replayed in order
+ * once it is back
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <stdlib.h>
+
+/* cap on the backoff exponent so the shift can't overflow */
+#define MONGOTCL_RESILIENT_MAX_SHIFT 20
+
+static int mongotcl_resilientRecover (mongotcl_clientData *md);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pendingFree --
+ *
+ *      Free one buffered write.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_pendingFree (mongotcl_pendingWrite *pw) {
+	bson_destroy (&pw->op.doc);
+	if (pw->op.type == MONGOTCL_BULK_UPDATE) {
+		bson_destroy (&pw->op.update);
+	}
+	ckfree (pw->ns);
+	ckfree ((char *)pw);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pendingDiscard --
+ *
+ *      Free every buffered write.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_pendingDiscard (mongotcl_clientData *md) {
+	mongotcl_pendingWrite *pw = md->pending_head;
+
+	while (pw != NULL) {
+		mongotcl_pendingWrite *next = pw->next;
+
+		mongotcl_pendingFree (pw);
+		pw = next;
+	}
+
+	md->pending_head = NULL;
+	md->pending_tail = NULL;
+	md->pending_bytes = 0;
+	md->pending_count = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resilientEnqueue --
+ *
+ *      Append a copy of a write to the buffer.
+ *
+ * Results:
+ *      A standard Tcl result; if the buffer would exceed its budget
+ *      the write is not buffered and errorCode is MONGO BUFFER_FULL.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_resilientEnqueue (Tcl_Interp *interp, mongotcl_clientData *md, const char *ns, enum mongotcl_bulkOpType type, bson *doc, bson *update, int upsert, int multi) {
+	mongotcl_pendingWrite *pw;
+	int size = bson_size (doc) + (int)strlen (ns) + 1;
+
+	if (update != NULL) {
+		size += bson_size (update);
+	}
+
+	if (md->pending_bytes + size > md->resilient_max_buffer) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("resilient write buffer full", -1));
+		Tcl_SetErrorCode (interp, "MONGO", "BUFFER_FULL", NULL);
+		return TCL_ERROR;
+	}
+
+	pw = (mongotcl_pendingWrite *)ckalloc (sizeof (mongotcl_pendingWrite));
+	pw->op.type = type;
+	pw->op.upsert = upsert;
+	pw->op.multi = multi;
+	bson_copy (&pw->op.doc, doc);
+	if (type == MONGOTCL_BULK_UPDATE) {
+		bson_copy (&pw->op.update, update);
+	}
+	pw->ns = ckalloc (strlen (ns) + 1);
+	strcpy (pw->ns, ns);
+	pw->next = NULL;
+
+	if (md->pending_tail == NULL) {
+		md->pending_head = pw;
+	} else {
+		md->pending_tail->next = pw;
+	}
+	md->pending_tail = pw;
+	md->pending_bytes += size;
+	md->pending_count++;
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resilientReplay --
+ *
+ *      Send every buffered write, unacknowledged and in order, then
+ *      one getLastError to find out whether they made it.
+ *
+ *      Nothing is freed until the getLastError comes back, so if the
+ *      connection drops partway the whole buffer is replayed on the
+ *      next attempt - writes may then be applied more than once.  A
+ *      write rejected by the server has no caller left to report to;
+ *      it is recorded in the status' last_error instead.
+ *
+ * Results:
+ *      MONGO_OK if the buffer was delivered and freed, otherwise
+ *      MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_resilientReplay (mongotcl_clientData *md) {
+	mongotcl_pendingWrite *pw;
+	const char *lastNs = NULL;
+
+	for (pw = md->pending_head; pw != NULL; pw = pw->next) {
+		if (mongotcl_sendWriteOp (md, pw->ns, &pw->op, md->unack_write_concern) != MONGO_OK) {
+			return MONGO_ERROR;
+		}
+		lastNs = pw->ns;
+	}
+
+	if (lastNs != NULL && mongotcl_checkLastError (md, lastNs) != MONGO_OK) {
+		if (mongotcl_isConnectionError (md->conn)) {
+			return MONGO_ERROR;
+		}
+		strncpy (md->resilient_errmsg, md->conn->errstr, MONGO_ERR_LEN - 1);
+		md->resilient_errmsg[MONGO_ERR_LEN - 1] = '\0';
+	}
+
+	md->resilient_replayed += md->pending_count;
+	mongotcl_pendingDiscard (md);
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resilientTimerProc --
+ *
+ *      Timer handler retrying the reconnect once the backoff delay has
+ *      passed, so buffered writes drain even if no more are issued.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_resilientTimerProc (ClientData clientData) {
+	mongotcl_clientData *md = (mongotcl_clientData *)clientData;
+
+	md->resilient_timer = NULL;
+	mongotcl_resilientRecover (md);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resilientRecover --
+ *
+ *      If writes are buffered and the backoff delay has passed,
+ *      reconnect, log in again and replay them.  mongotcl_reconnect
+ *      goes through the replica set seed list when one was configured,
+ *      so this also finds a newly elected primary.
+ *
+ *      On failure the next attempt is pushed out by an exponentially
+ *      growing delay, capped at the maximum, with random jitter over
+ *      its upper half so many clients don't retry in lockstep, and a
+ *      timer is set to make that attempt.
+ *
+ * Results:
+ *      MONGO_OK if nothing remains buffered, otherwise MONGO_ERROR.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_resilientRecover (mongotcl_clientData *md) {
+	Tcl_WideInt now;
+	Tcl_WideInt delay;
+	int shift;
+
+	if (md->pending_head == NULL) {
+		return MONGO_OK;
+	}
+
+	now = mongotcl_milliseconds ();
+	if (now < md->resilient_next_attempt) {
+		return MONGO_ERROR;
+	}
+
+	if (mongotcl_reconnect (md) == MONGO_OK && mongotcl_authenticateConnection (md, md->conn) == MONGO_OK && mongotcl_resilientReplay (md) == MONGO_OK) {
+		md->resilient_failures = 0;
+		md->resilient_next_attempt = 0;
+		md->resilient_reconnects++;
+		if (md->resilient_timer != NULL) {
+			Tcl_DeleteTimerHandler (md->resilient_timer);
+			md->resilient_timer = NULL;
+		}
+		return MONGO_OK;
+	}
+
+	strncpy (md->resilient_errmsg, md->conn->errstr, MONGO_ERR_LEN - 1);
+	md->resilient_errmsg[MONGO_ERR_LEN - 1] = '\0';
+
+	shift = md->resilient_failures;
+	if (shift > MONGOTCL_RESILIENT_MAX_SHIFT) {
+		shift = MONGOTCL_RESILIENT_MAX_SHIFT;
+	}
+	delay = (Tcl_WideInt)md->resilient_base_delay << shift;
+	if (delay > md->resilient_max_delay) {
+		delay = md->resilient_max_delay;
+	}
+	delay = delay / 2 + mongotcl_random (&md->random_state) % (delay / 2 + 1);
+	md->resilient_failures++;
+	md->resilient_next_attempt = now + delay;
+
+	if (md->resilient_timer != NULL) {
+		Tcl_DeleteTimerHandler (md->resilient_timer);
+	}
+	md->resilient_timer = Tcl_CreateTimerHandler ((int)delay, mongotcl_resilientTimerProc, (ClientData)md);
+	return MONGO_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resilientWrite --
+ *
+ *      Perform an insert, update or remove in resilient mode.  If
+ *      earlier writes are still buffered this one queues behind them
+ *      to keep the order; if the write fails because of the connection
+ *      it is buffered instead of reported.
+ *
+ * Results:
+ *      A standard Tcl result.  Errors are the server rejecting the
+ *      write or the buffer being full.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_resilientWrite (Tcl_Interp *interp, mongotcl_clientData *md, const char *ns, enum mongotcl_bulkOpType type, bson *doc, bson *update, int upsert, int multi) {
+	mongotcl_resilientRecover (md);
+
+	if (md->pending_head == NULL) {
+		mongotcl_bulkOp op;
+
+		op.type = type;
+		op.upsert = upsert;
+		op.multi = multi;
+		op.doc = *doc;
+		if (update != NULL) {
+			op.update = *update;
+		}
+
+		if (mongotcl_sendWriteOp (md, ns, &op, mongotcl_activeWriteConcern (md)) == MONGO_OK) {
+			if (mongotcl_pipelineNoteWrite (md, ns) != MONGO_OK) {
+				return mongotcl_setMongoError (interp, md->conn);
+			}
+			return TCL_OK;
+		}
+
+		if (!mongotcl_isConnectionError (md->conn)) {
+			return mongotcl_setMongoError (interp, md->conn);
+		}
+
+		strncpy (md->resilient_errmsg, md->conn->errstr, MONGO_ERR_LEN - 1);
+		md->resilient_errmsg[MONGO_ERR_LEN - 1] = '\0';
+	}
+
+	if (mongotcl_resilientEnqueue (interp, md, ns, type, doc, update, upsert, multi) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	mongotcl_resilientRecover (md);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resilientBufferBatch --
+ *
+ *      Buffer every document of an insert_batch that could not be
+ *      sent, or that must wait behind writes already buffered.
+ *
+ * Results:
+ *      A standard Tcl result.  If the buffer fills partway, the
+ *      documents before that point stay buffered and the error says
+ *      how many.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_resilientBufferBatch (Tcl_Interp *interp, mongotcl_clientData *md, const char *ns, int listObjc, Tcl_Obj **listObjv) {
+	int i;
+
+	for (i = 0; i < listObjc; i++) {
+		bson *bson;
+
+		if (mongotcl_cmdNameObjToBson (interp, listObjv[i], &bson) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+
+		if (mongotcl_resilientEnqueue (interp, md, ns, MONGOTCL_BULK_INSERT, bson, NULL, 0, 0) == TCL_ERROR) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("resilient write buffer full after %d of %d documents", i, listObjc));
+			return TCL_ERROR;
+		}
+	}
+
+	mongotcl_resilientRecover (md);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resilientCleanup --
+ *
+ *      Cancel any pending retry and free the buffer and stored
+ *      credentials.  Called when the mongo object is deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_resilientCleanup (mongotcl_clientData *md) {
+	if (md->resilient_timer != NULL) {
+		Tcl_DeleteTimerHandler (md->resilient_timer);
+		md->resilient_timer = NULL;
+	}
+
+	mongotcl_pendingDiscard (md);
+
+	if (md->auth_user != NULL) {
+		ckfree (md->auth_db);
+		ckfree (md->auth_user);
+		ckfree (md->auth_pass);
+		md->auth_db = md->auth_user = md->auth_pass = NULL;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resilientObjCmd --
+ *
+ *      Implements "$mongo resilient on|off|flush|status".
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_resilientObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	int subIndex;
+
+    static CONST char *subOptions[] = {
+        "on",
+        "off",
+        "flush",
+        "status",
+        NULL
+    };
+
+    enum subOptions {
+        SUBOPT_ON,
+        SUBOPT_OFF,
+        SUBOPT_FLUSH,
+        SUBOPT_STATUS
+    };
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "on|off|flush|status ?options?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "subcommand", TCL_EXACT, &subIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	switch ((enum subOptions) subIndex) {
+		case SUBOPT_ON: {
+			int i;
+			int maxBuffer = md->resilient_max_buffer;
+			int baseDelay = md->resilient_base_delay;
+			int maxDelay = md->resilient_max_delay;
+
+			static CONST char *onOptions[] = {
+				"-max_buffer",
+				"-base_delay",
+				"-max_delay",
+				NULL
+			};
+
+			enum onOptions {
+				ONOPT_MAX_BUFFER,
+				ONOPT_BASE_DELAY,
+				ONOPT_MAX_DELAY
+			};
+
+			if ((objc - 3) % 2 != 0) {
+				Tcl_WrongNumArgs (interp, 3, objv, "?-max_buffer bytes? ?-base_delay ms? ?-max_delay ms?");
+				return TCL_ERROR;
+			}
+
+			for (i = 3; i < objc; i += 2) {
+				int onIndex;
+				int value;
+
+				if (Tcl_GetIndexFromObj (interp, objv[i], onOptions, "option", TCL_EXACT, &onIndex) != TCL_OK) {
+					return TCL_ERROR;
+				}
+
+				if (Tcl_GetIntFromObj (interp, objv[i + 1], &value) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				if (value <= 0) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s must be positive", Tcl_GetString (objv[i])));
+					return TCL_ERROR;
+				}
+
+				switch ((enum onOptions) onIndex) {
+					case ONOPT_MAX_BUFFER: {
+						maxBuffer = value;
+						break;
+					}
+
+					case ONOPT_BASE_DELAY: {
+						baseDelay = value;
+						break;
+					}
+
+					case ONOPT_MAX_DELAY: {
+						maxDelay = value;
+						break;
+					}
+				}
+			}
+
+			if (maxDelay < baseDelay) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("-max_delay must not be less than -base_delay", -1));
+				return TCL_ERROR;
+			}
+
+			md->resilient = 1;
+			md->resilient_max_buffer = maxBuffer;
+			md->resilient_base_delay = baseDelay;
+			md->resilient_max_delay = maxDelay;
+			break;
+		}
+
+		case SUBOPT_OFF: {
+			/* one last try; whatever still can't be delivered is dropped */
+			md->resilient_next_attempt = 0;
+			mongotcl_resilientRecover (md);
+
+			if (md->resilient_timer != NULL) {
+				Tcl_DeleteTimerHandler (md->resilient_timer);
+				md->resilient_timer = NULL;
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewIntObj (md->pending_count));
+			mongotcl_pendingDiscard (md);
+			md->resilient = 0;
+			md->resilient_failures = 0;
+			break;
+		}
+
+		case SUBOPT_FLUSH: {
+			md->resilient_next_attempt = 0;
+			mongotcl_resilientRecover (md);
+			Tcl_SetObjResult (interp, Tcl_NewIntObj (md->pending_count));
+			break;
+		}
+
+		case SUBOPT_STATUS: {
+			Tcl_Obj *listObj = Tcl_NewObj ();
+
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("enabled", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewBooleanObj (md->resilient));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("buffered_writes", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->pending_count));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("buffered_bytes", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->pending_bytes));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("max_buffer", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->resilient_max_buffer));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("failures", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->resilient_failures));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("reconnects", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->resilient_reconnects));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("replayed", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewIntObj (md->resilient_replayed));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj ("last_error", -1));
+			Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (md->resilient_errmsg, -1));
+			Tcl_SetObjResult (interp, listObj);
+			break;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -0,0 +1,443 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * resumable cursors - a cursor sorted on a unique field remembers the
+ * last value of it delivered, so if the server loses the cursor or the
+ * connection drops it can query again for what comes after and carry on
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resumeReset --
+ *
+ *      Forget the cursor's place and put back the query, skip and limit
+ *      it had before it was first resumed, as when it is reinitialized
+ *      or its query changes.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_resumeReset (mongotcl_cursorClientData *mc) {
+	if (mc->resume_query != NULL) {
+		if (mc->cursor != NULL) {
+			mc->cursor->query = mc->resume_base;
+			mc->cursor->skip = mc->resume_skip;
+			mc->cursor->limit = mc->resume_limit;
+		}
+		bson_destroy (mc->resume_query);
+		ckfree ((char *)mc->resume_query);
+		mc->resume_query = NULL;
+	}
+
+	if (mc->resume_last != NULL) {
+		bson_destroy (mc->resume_last);
+		ckfree ((char *)mc->resume_last);
+		mc->resume_last = NULL;
+	}
+	mc->resume_count = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resumeCleanup --
+ *
+ *      Free a cursor's resume state as it is deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_resumeCleanup (mongotcl_cursorClientData *mc) {
+	mongotcl_resumeReset (mc);
+
+	if (mc->resume_field != NULL) {
+		ckfree (mc->resume_field);
+		mc->resume_field = NULL;
+	}
+
+	if (mc->resume_sorted != NULL) {
+		bson_destroy (mc->resume_sorted);
+		ckfree ((char *)mc->resume_sorted);
+		mc->resume_sorted = NULL;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resumeSort --
+ *
+ *      Make query the query of a resumable cursor, which must be sorted
+ *      on the resume field alone for a resumed query to carry on in the
+ *      same order.  A query that doesn't say how to sort is copied with
+ *      the sort added.
+ *
+ * Results:
+ *      A standard Tcl result; the cursor's query is left as it was if
+ *      query is sorted some other way.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_resumeSort (Tcl_Interp *interp, mongotcl_cursorClientData *mc, const bson *query) {
+	bson_iterator it;
+	bson empty;
+	bson *sorted;
+	int own = (query != NULL && query == mc->resume_sorted);
+
+	if (query == NULL) {
+		query = bson_empty (&empty);
+	}
+
+	/* a sort added here for an earlier resume field is replaced */
+	if (!own && bson_find (&it, query, "$orderby") != BSON_EOO) {
+		bson_iterator key;
+
+		if (bson_iterator_type (&it) != BSON_OBJECT) {
+			goto wrong_sort;
+		}
+
+		bson_iterator_subiterator (&it, &key);
+		if (bson_iterator_next (&key) == BSON_EOO || strcmp (bson_iterator_key (&key), mc->resume_field) != 0) {
+			goto wrong_sort;
+		}
+
+		if ((bson_iterator_double (&key) < 0) != (mc->resume_direction < 0) || bson_iterator_next (&key) != BSON_EOO) {
+			goto wrong_sort;
+		}
+
+		mc->cursor->query = (query == &empty) ? NULL : query;
+		return TCL_OK;
+	}
+
+	sorted = (bson *)ckalloc (sizeof (bson));
+	bson_init (sorted);
+	if (bson_find (&it, query, "$query") != BSON_EOO) {
+		bson_iterator_init (&it, query);
+		while (bson_iterator_next (&it) != BSON_EOO) {
+			if (strcmp (bson_iterator_key (&it), "$orderby") != 0) {
+				bson_append_element (sorted, NULL, &it);
+			}
+		}
+	} else {
+		bson_append_bson (sorted, "$query", query);
+	}
+	bson_append_start_object (sorted, "$orderby");
+	bson_append_int (sorted, mc->resume_field, mc->resume_direction);
+	bson_append_finish_object (sorted);
+	bson_finish (sorted);
+
+	/* query may be the sorted copy being replaced */
+	mc->cursor->query = sorted;
+	if (mc->resume_sorted != NULL) {
+		bson_destroy (mc->resume_sorted);
+		ckfree ((char *)mc->resume_sorted);
+	}
+	mc->resume_sorted = sorted;
+	return TCL_OK;
+
+  wrong_sort:
+	Tcl_SetObjResult (interp, Tcl_ObjPrintf ("a resumable cursor must be sorted on %s alone", mc->resume_field));
+	return TCL_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resumeRemember --
+ *
+ *      Note the sort field of the document the cursor has just moved to.
+ *      A document without it leaves nothing to resume after, so the last
+ *      value is dropped and the cursor can't be resumed until another
+ *      document has one.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_resumeRemember (mongotcl_cursorClientData *mc) {
+	bson_iterator it;
+
+	mc->resume_count++;
+
+	if (mc->resume_last != NULL) {
+		bson_destroy (mc->resume_last);
+	}
+
+	if (mongotcl_mirrorField (&it, mongo_cursor_data (mc->cursor), mc->resume_field) == BSON_EOO) {
+		if (mc->resume_last != NULL) {
+			ckfree ((char *)mc->resume_last);
+			mc->resume_last = NULL;
+		}
+		return;
+	}
+
+	if (mc->resume_last == NULL) {
+		mc->resume_last = (bson *)ckalloc (sizeof (bson));
+	}
+
+	bson_init (mc->resume_last);
+	bson_append_element (mc->resume_last, "v", &it);
+	bson_finish (mc->resume_last);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resumeAppendAfter --
+ *
+ *      Append name: {field: {$gt: last}}, or $lt for a descending sort,
+ *      to a query being built.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_resumeAppendAfter (mongotcl_cursorClientData *mc, bson *out, const char *name) {
+	bson_iterator last;
+
+	bson_iterator_init (&last, mc->resume_last);
+	bson_iterator_next (&last);
+
+	bson_append_start_object (out, name);
+	bson_append_start_object (out, mc->resume_field);
+	bson_append_element (out, (mc->resume_direction > 0) ? "$gt" : "$lt", &last);
+	bson_append_finish_object (out);
+	bson_append_finish_object (out);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resumeQuery --
+ *
+ *      Build the query a resumed cursor is sent with: the original one,
+ *      narrowed to the documents after the last one delivered once there
+ *      is one, and sorted on the resume field if it doesn't say how to
+ *      sort.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_resumeQuery (mongotcl_cursorClientData *mc, bson *out) {
+	const bson *base = mc->resume_base;
+	bson_iterator it;
+	bson empty;
+	bson filter;
+	int wrapped;
+	int sorted = 0;
+
+	if (base == NULL) {
+		base = bson_empty (&empty);
+	}
+
+	wrapped = (bson_find (&it, base, "$query") == BSON_OBJECT);
+	if (wrapped) {
+		bson_iterator_subobject (&it, &filter);
+	} else {
+		filter = *base;
+	}
+
+	bson_init (out);
+	bson_append_start_object (out, "$query");
+	if (mc->resume_last == NULL) {
+		bson_iterator_init (&it, &filter);
+		while (bson_iterator_next (&it) != BSON_EOO) {
+			bson_append_element (out, NULL, &it);
+		}
+	} else {
+		bson_append_start_array (out, "$and");
+		bson_append_bson (out, "0", &filter);
+		mongotcl_resumeAppendAfter (mc, out, "1");
+		bson_append_finish_object (out);
+	}
+	bson_append_finish_object (out);
+
+	/* keep the query's other modifiers, such as $hint */
+	if (wrapped) {
+		bson_iterator_init (&it, base);
+		while (bson_iterator_next (&it) != BSON_EOO) {
+			const char *key = bson_iterator_key (&it);
+
+			if (strcmp (key, "$orderby") == 0) {
+				sorted = 1;
+			}
+
+			if (strcmp (key, "$query") != 0) {
+				bson_append_element (out, NULL, &it);
+			}
+		}
+	}
+
+	if (!sorted) {
+		bson_append_start_object (out, "$orderby");
+		bson_append_int (out, mc->resume_field, mc->resume_direction);
+		bson_append_finish_object (out);
+	}
+	bson_finish (out);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resumeCursor --
+ *
+ *      Called when next has failed on a resumable cursor.  If the
+ *      failure was the server losing the cursor or the connection
+ *      dropping, reconnect if need be and set the cursor up to query
+ *      again for the documents after the last one delivered, with what
+ *      is left of its limit, so the next "next" carries on where it left
+ *      off.  A query the server refused, or one under a -timeout
+ *      deadline, isn't resumed.
+ *
+ *      If the connection can't be made again the cursor is still set up
+ *      to resume, so a later next can try again.
+ *
+ * Results:
+ *      1 if the cursor can be resumed now, else 0.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_resumeCursor (mongotcl_cursorClientData *mc) {
+	mongotcl_clientData *md = mc->md;
+	mongo_cursor *cursor = mc->cursor;
+	mongo *conn = mc->conn;
+	int resumed = 1;
+	int lost;
+
+	if (mc->resume_field == NULL || md == NULL || md->op_max_time_ms > 0) {
+		return 0;
+	}
+
+	/* cursors the driver fetches for can't be picked up again */
+	if (cursor->err == MONGO_CURSOR_QUERY_FAIL || cursor->limit < 0 || (cursor->options & MONGO_EXHAUST)) {
+		return 0;
+	}
+
+	lost = (conn->err == MONGO_IO_ERROR || conn->err == MONGO_SOCKET_ERROR || !conn->connected);
+	if (cursor->err != MONGO_CURSOR_INVALID && !lost) {
+		return 0;
+	}
+
+	/* documents were delivered but the last had no sort field */
+	if (mc->resume_count > 0 && mc->resume_last == NULL) {
+		return 0;
+	}
+
+	if (mc->resume_query != NULL && mc->resume_limit > 0 && mc->resume_count >= mc->resume_limit) {
+		return 0;
+	}
+
+	if (mc->resume_query == NULL) {
+		mc->resume_base = cursor->query;
+		mc->resume_skip = cursor->skip;
+		mc->resume_limit = cursor->limit;
+	} else {
+		bson_destroy (mc->resume_query);
+		ckfree ((char *)mc->resume_query);
+	}
+
+	mongotcl_cacheAbandon (mc);
+	mongotcl_cursorRelease (mc);
+
+	if (lost) {
+		if (conn == md->conn) {
+			if (mongotcl_reconnect (md) != MONGO_OK || mongotcl_authenticateConnection (md, md->conn) != MONGO_OK) {
+				resumed = 0;
+			}
+		} else {
+			/* a replica set member is reconnected when it's next chosen */
+			mongotcl_hedgeForget (md, conn);
+			mongotcl_cursorPrefetchReset (md, conn);
+			mongotcl_wireReset (conn);
+			mongo_disconnect (conn);
+		}
+	}
+
+	mc->resume_query = (bson *)ckalloc (sizeof (bson));
+	mongotcl_resumeQuery (mc, mc->resume_query);
+
+	mc->conn = md->conn;
+	mongotcl_cursorReuse (cursor, mc->conn, cursor->ns, 1);
+	cursor->query = mc->resume_query;
+
+	/* the skip has been used up once anything was delivered */
+	if (mc->resume_count > 0) {
+		cursor->skip = 0;
+	}
+
+	if (mc->resume_limit > 0) {
+		cursor->limit = mc->resume_limit - mc->resume_count;
+	}
+	return resumed;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_resumeSetField --
+ *
+ *      Implements "$cursor set_resumable field".  field, with a leading
+ *      - to sort on it descending, must be unique, such as _id.  The
+ *      cursor's query is sorted on it if it isn't already.  This must
+ *      come before the query is sent.  An empty field turns resuming
+ *      off.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_resumeSetField (Tcl_Interp *interp, mongotcl_cursorClientData *mc, const char *field) {
+	int direction = 1;
+	char *previous = mc->resume_field;
+	int previousDirection = mc->resume_direction;
+
+	if (*field == '-') {
+		direction = -1;
+		field++;
+	}
+
+	if (*field != '\0' && (mc->cursor->reply != NULL || (mc->cursor->flags & MONGO_CURSOR_QUERY_SENT))) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("a cursor must be made resumable before its query is sent", -1));
+		return TCL_ERROR;
+	}
+
+	mongotcl_resumeReset (mc);
+	mc->resume_field = NULL;
+	mc->resume_direction = direction;
+
+	if (*field != '\0') {
+		mc->resume_field = ckalloc (strlen (field) + 1);
+		strcpy (mc->resume_field, field);
+
+		if (mongotcl_resumeSort (interp, mc, mc->cursor->query) == TCL_ERROR) {
+			ckfree (mc->resume_field);
+			mc->resume_field = previous;
+			mc->resume_direction = previousDirection;
+			return TCL_ERROR;
+		}
+	}
+
+	if (previous != NULL) {
+		ckfree (previous);
+	}
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
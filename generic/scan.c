@@ -0,0 +1,546 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * parallel scans - a collection's key space split into ranges, each
+ * read by a cursor on a connection of its own, all in flight at once
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <errno.h>
+#include <poll.h>
+
+#define MONGOTCL_DEFAULT_SCAN_WORKERS 4
+
+#define MONGOTCL_MAX_SCAN_WORKERS 64
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_scanRawQuery --
+ *
+ *      Run a query on the object's connection asking for a single
+ *      document and return the reply.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_scanRawQuery (mongo *conn, const char *ns, int skip, const bson *query, const bson *fields, mongo_reply **replyPtr) {
+	Tcl_DString msg;
+	int status;
+
+	Tcl_DStringInit (&msg);
+	mongotcl_wireBuildQuery (&msg, ns, 0, skip, -1, query, fields);
+	status = mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+	Tcl_DStringFree (&msg);
+
+	if (status != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+	return mongotcl_wireReadReply (conn, replyPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_scanBound --
+ *
+ *      Save a split point as a one element document named for the
+ *      split field.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_scanBound (bson *bound, const char *field, const bson_iterator *it) {
+	bson_init (bound);
+	bson_append_element (bound, field, it);
+	bson_finish (bound);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_scanSplit --
+ *
+ *      Find up to workers - 1 values of field splitting the collection
+ *      into ranges of about the same number of documents.  The server's
+ *      splitVector is asked first; where it can't be used, as through a
+ *      mongos or without the privilege, the collection is sampled in
+ *      field order instead.
+ *
+ * Results:
+ *      The number of split points stored in bounds, or -1 with the
+ *      connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_scanSplit (mongotcl_clientData *md, const char *ns, const char *field, int workers, bson *bounds) {
+	Tcl_DString db;
+	bson command;
+	bson out;
+	bson_iterator it;
+	double count = 0;
+	int nBounds = 0;
+	int status;
+	int i;
+
+	Tcl_DStringInit (&db);
+	mongotcl_namespaceToDb (ns, &db);
+
+	bson_init (&command);
+	bson_append_string (&command, "count", ns + Tcl_DStringLength (&db) + 1);
+	bson_finish (&command);
+	status = mongotcl_runReadCommand (md->conn, Tcl_DStringValue (&db), &command, 0, &out);
+	bson_destroy (&command);
+
+	if (status != MONGO_OK) {
+		Tcl_DStringFree (&db);
+		return -1;
+	}
+
+	if (bson_find (&it, &out, "n") != BSON_EOO) {
+		count = bson_iterator_double (&it);
+	}
+	bson_destroy (&out);
+
+	if (count < workers) {
+		Tcl_DStringFree (&db);
+		return 0;
+	}
+
+	bson_init (&command);
+	bson_append_string (&command, "splitVector", ns);
+	bson_append_start_object (&command, "keyPattern");
+	bson_append_int (&command, field, 1);
+	bson_append_finish_object (&command);
+	bson_append_long (&command, "maxChunkObjects", (int64_t)(count / workers) + 1);
+	bson_finish (&command);
+	status = mongotcl_runReadCommand (md->conn, Tcl_DStringValue (&db), &command, 0, &out);
+	bson_destroy (&command);
+	Tcl_DStringFree (&db);
+
+	if (status == MONGO_OK) {
+		if (bson_find (&it, &out, "splitKeys") == BSON_ARRAY) {
+			bson_iterator sub;
+			int nKeys = 0;
+			int next = 1;
+
+			bson_iterator_subiterator (&it, &sub);
+			while (bson_iterator_next (&sub) != BSON_EOO) {
+				nKeys++;
+			}
+
+			/* take evenly spaced keys if there are more than we need */
+			bson_iterator_subiterator (&it, &sub);
+			for (i = 0; bson_iterator_next (&sub) != BSON_EOO && nBounds < workers - 1; i++) {
+				bson_iterator key;
+
+				if (nKeys > workers - 1 && i != (int)((double)next * nKeys / workers)) {
+					continue;
+				}
+
+				bson_iterator_subiterator (&sub, &key);
+				if (bson_iterator_next (&key) != BSON_EOO) {
+					mongotcl_scanBound (&bounds[nBounds++], field, &key);
+				}
+				next++;
+			}
+		}
+		bson_destroy (&out);
+		return nBounds;
+	}
+
+	if (mongotcl_isConnectionError (md->conn)) {
+		return -1;
+	}
+
+	/* no splitVector, so sample the collection in field order */
+	for (i = 1; i < workers; i++) {
+		mongo_reply *reply;
+		bson query;
+		bson fields;
+
+		bson_init (&query);
+		bson_append_start_object (&query, "$query");
+		bson_append_finish_object (&query);
+		bson_append_start_object (&query, "$orderby");
+		bson_append_int (&query, field, 1);
+		bson_append_finish_object (&query);
+		bson_finish (&query);
+
+		bson_init (&fields);
+		bson_append_int (&fields, field, 1);
+		bson_finish (&fields);
+
+		status = mongotcl_scanRawQuery (md->conn, ns, (int)(count * i / workers), &query, &fields, &reply);
+		bson_destroy (&query);
+		bson_destroy (&fields);
+
+		if (status != MONGO_OK) {
+			while (nBounds > 0) {
+				bson_destroy (&bounds[--nBounds]);
+			}
+			return -1;
+		}
+
+		if (!(reply->fields.flag & 0x02) && reply->fields.num > 0 && mongotcl_mirrorField (&it, &reply->objs, field) != BSON_EOO) {
+			mongotcl_scanBound (&bounds[nBounds++], field, &it);
+		}
+		bson_free (reply);
+	}
+
+	return nBounds;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_scanRangeQuery --
+ *
+ *      Build the query for one worker: the caller's filter, if any, and
+ *      the worker's range of the split field, from lo inclusive to hi
+ *      exclusive.  The first range has no lower bound and also takes
+ *      documents without the field; the last has no upper bound.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_scanRangeQuery (const char *field, const bson *filter, const bson *lo, const bson *hi, bson *out) {
+	bson_iterator it;
+
+	bson_init (out);
+	if (filter != NULL && (lo != NULL || hi != NULL)) {
+		bson_append_start_array (out, "$and");
+		bson_append_bson (out, "0", filter);
+		bson_append_start_object (out, "1");
+	} else if (filter != NULL) {
+		bson_iterator_init (&it, filter);
+		while (bson_iterator_next (&it) != BSON_EOO) {
+			bson_append_element (out, NULL, &it);
+		}
+	}
+
+	if (lo != NULL || hi != NULL) {
+		bson_append_start_object (out, field);
+		if (lo != NULL) {
+			bson_iterator_init (&it, lo);
+			bson_iterator_next (&it);
+			bson_append_element (out, "$gte", &it);
+			if (hi != NULL) {
+				bson_iterator_init (&it, hi);
+				bson_iterator_next (&it);
+				bson_append_element (out, "$lt", &it);
+			}
+		} else {
+			bson_append_start_object (out, "$not");
+			bson_iterator_init (&it, hi);
+			bson_iterator_next (&it);
+			bson_append_element (out, "$gte", &it);
+			bson_append_finish_object (out);
+		}
+		bson_append_finish_object (out);
+
+		if (filter != NULL) {
+			bson_append_finish_object (out);
+			bson_append_finish_array (out);
+		}
+	}
+	bson_finish (out);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_scanCleanup --
+ *
+ *      Kill the cursors of workers that didn't finish and close their
+ *      connections.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_scanCleanup (mongotcl_scanWorker *workers, int nWorkers) {
+	int i;
+
+	for (i = 0; i < nWorkers; i++) {
+		mongotcl_scanWorker *w = &workers[i];
+
+		if (w->cursor_id != 0) {
+			Tcl_DString msg;
+
+			Tcl_DStringInit (&msg);
+			mongotcl_wireBuildKillCursors (&msg, w->cursor_id);
+			mongotcl_wireSend (&w->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+			Tcl_DStringFree (&msg);
+		}
+
+		mongotcl_wireRelease (&w->conn);
+		mongo_destroy (&w->conn);
+	}
+	ckfree ((char *)workers);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_parallelScanObjCmd --
+ *
+ *      Implements "$mongo parallel_scan namespace -callback script
+ *      ?-workers n? ?-split field? ?-query bson? ?-batch_size n?".
+ *
+ *      The collection is split into ranges of the split field and each
+ *      range queried on its own connection.  As each batch arrives the
+ *      worker's next getMore is sent at once, so every server keeps
+ *      working while the batch is passed, as a list of documents, to
+ *      the callback.  The callback may break to end the scan early.
+ *
+ * Results:
+ *      A standard Tcl result; the number of documents delivered is left
+ *      in the interpreter.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_parallelScanObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	mongotcl_scanWorker *workers;
+	bson bounds[MONGOTCL_MAX_SCAN_WORKERS];
+	struct pollfd fds[MONGOTCL_MAX_SCAN_WORKERS];
+	int polled[MONGOTCL_MAX_SCAN_WORKERS];
+	const char *ns;
+	const char *field = "_id";
+	Tcl_Obj *callback = NULL;
+	bson *filter = NULL;
+	int nWorkers = MONGOTCL_DEFAULT_SCAN_WORKERS;
+	int batchSize = 0;
+	int nBounds;
+	int active;
+	Tcl_WideInt delivered = 0;
+	int result = TCL_OK;
+	int i;
+
+	if (objc < 5 || (objc & 1) == 0) {
+		Tcl_WrongNumArgs (interp, 2, objv, "namespace -callback script ?-workers n? ?-split field? ?-query bson? ?-batch_size n?");
+		return TCL_ERROR;
+	}
+
+	ns = Tcl_GetString (objv[2]);
+	if (strchr (ns, '.') == NULL) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad namespace \"%s\"", ns));
+		return TCL_ERROR;
+	}
+
+	for (i = 3; i < objc; i += 2) {
+		char *option = Tcl_GetString (objv[i]);
+
+		if (strcmp (option, "-callback") == 0) {
+			callback = objv[i + 1];
+		} else if (strcmp (option, "-workers") == 0) {
+			if (Tcl_GetIntFromObj (interp, objv[i + 1], &nWorkers) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (nWorkers < 1 || nWorkers > MONGOTCL_MAX_SCAN_WORKERS) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("-workers must be from 1 to %d", MONGOTCL_MAX_SCAN_WORKERS));
+				return TCL_ERROR;
+			}
+		} else if (strcmp (option, "-split") == 0) {
+			field = Tcl_GetString (objv[i + 1]);
+		} else if (strcmp (option, "-query") == 0) {
+			if (mongotcl_cmdNameObjToBson (interp, objv[i + 1], &filter) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+		} else if (strcmp (option, "-batch_size") == 0) {
+			if (Tcl_GetIntFromObj (interp, objv[i + 1], &batchSize) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (batchSize < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("batch size must not be negative", -1));
+				return TCL_ERROR;
+			}
+		} else {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad option \"%s\": must be -callback, -workers, -split, -query or -batch_size", option));
+			return TCL_ERROR;
+		}
+	}
+
+	if (callback == NULL) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-callback is required", -1));
+		return TCL_ERROR;
+	}
+
+	nBounds = (nWorkers > 1) ? mongotcl_scanSplit (md, ns, field, nWorkers, bounds) : 0;
+	if (nBounds < 0) {
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	/* one worker per range */
+	nWorkers = nBounds + 1;
+	workers = (mongotcl_scanWorker *)ckalloc (sizeof (mongotcl_scanWorker) * nWorkers);
+	for (i = 0; i < nWorkers; i++) {
+		mongotcl_scanWorker *w = &workers[i];
+		Tcl_DString msg;
+		bson query;
+		int status;
+
+		w->cursor_id = 0;
+		w->request = 0;
+		if (mongotcl_connectSide (md, &w->conn) != MONGO_OK || mongotcl_authenticateConnection (md, &w->conn) != MONGO_OK) {
+			result = mongotcl_setMongoError (interp, &w->conn);
+			mongotcl_scanCleanup (workers, i + 1);
+			goto done;
+		}
+
+		mongotcl_scanRangeQuery (field, filter, (i > 0) ? &bounds[i - 1] : NULL, (i < nBounds) ? &bounds[i] : NULL, &query);
+		Tcl_DStringInit (&msg);
+		w->request = mongotcl_wireBuildQuery (&msg, ns, 0, 0, batchSize, &query, NULL);
+		status = mongotcl_wireSend (&w->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+		Tcl_DStringFree (&msg);
+		bson_destroy (&query);
+
+		if (status != MONGO_OK) {
+			result = mongotcl_setMongoError (interp, &w->conn);
+			mongotcl_scanCleanup (workers, i + 1);
+			goto done;
+		}
+	}
+
+	for (active = nWorkers; active > 0 && result == TCL_OK; ) {
+		int nfds = 0;
+		int ready;
+		int j;
+
+		for (i = 0; i < nWorkers; i++) {
+			if (workers[i].request != 0) {
+				fds[nfds].fd = workers[i].conn.sock;
+				fds[nfds].events = POLLIN;
+				fds[nfds].revents = 0;
+				polled[nfds++] = i;
+			}
+		}
+
+		ready = poll (fds, nfds, md->conn->op_timeout_ms > 0 ? md->conn->op_timeout_ms : -1);
+		if (ready < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (ready <= 0) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj (ready < 0 ? Tcl_PosixError (interp) : "timed out waiting for the server", -1));
+			Tcl_SetErrorCode (interp, "MONGO", "IO_ERROR", NULL);
+			result = TCL_ERROR;
+			break;
+		}
+
+		for (j = 0; j < nfds && result == TCL_OK; j++) {
+			mongotcl_scanWorker *w = &workers[polled[j]];
+			mongo_reply *reply;
+			bson_iterator it;
+			Tcl_Obj *cmdObj;
+			Tcl_Obj *docsObj;
+			const char *data;
+			int k;
+
+			if (fds[j].revents == 0) {
+				continue;
+			}
+
+			if (mongotcl_wireReadReply (&w->conn, &reply) != MONGO_OK) {
+				result = mongotcl_setMongoError (interp, &w->conn);
+				break;
+			}
+			w->request = 0;
+			data = &reply->objs;
+
+			if (reply->fields.flag & 0x03) {
+				const char *message = (reply->fields.flag & 0x01) ? "cursor not found" : "query failed";
+
+				if ((reply->fields.flag & 0x02) && reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, data, "$err") == BSON_STRING) {
+					message = bson_iterator_string (&it);
+				}
+				Tcl_SetObjResult (interp, Tcl_NewStringObj (message, -1));
+				Tcl_SetErrorCode (interp, "MONGO", (reply->fields.flag & 0x01) ? "CURSOR_INVALID" : "CURSOR_QUERY_FAIL", NULL);
+				w->cursor_id = 0;
+				bson_free (reply);
+				result = TCL_ERROR;
+				break;
+			}
+
+			/* ask for the next batch before handing this one over */
+			w->cursor_id = reply->fields.cursorID;
+			if (w->cursor_id != 0) {
+				Tcl_DString msg;
+				int status;
+
+				Tcl_DStringInit (&msg);
+				w->request = mongotcl_wireBuildGetMore (&msg, ns, batchSize, w->cursor_id);
+				status = mongotcl_wireSend (&w->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+				Tcl_DStringFree (&msg);
+
+				if (status != MONGO_OK) {
+					result = mongotcl_setMongoError (interp, &w->conn);
+					bson_free (reply);
+					break;
+				}
+			} else {
+				active--;
+			}
+
+			if (reply->fields.num == 0) {
+				bson_free (reply);
+				continue;
+			}
+
+			docsObj = Tcl_NewObj ();
+			for (k = 0; k < reply->fields.num; k++) {
+				int size;
+
+				Tcl_ListObjAppendElement (interp, docsObj, mongotcl_bsontolist_raw (interp, Tcl_NewObj (), data, 0));
+				bson_little_endian32 (&size, data);
+				data += size;
+			}
+			delivered += reply->fields.num;
+			bson_free (reply);
+
+			cmdObj = Tcl_DuplicateObj (callback);
+			Tcl_IncrRefCount (cmdObj);
+			Tcl_ListObjAppendElement (NULL, cmdObj, docsObj);
+			result = Tcl_EvalObjEx (interp, cmdObj, 0);
+			Tcl_DecrRefCount (cmdObj);
+
+			if (result == TCL_CONTINUE) {
+				result = TCL_OK;
+			}
+		}
+	}
+
+	mongotcl_scanCleanup (workers, nWorkers);
+
+	if (result == TCL_BREAK) {
+		result = TCL_OK;
+	}
+
+	if (result == TCL_OK) {
+		Tcl_SetObjResult (interp, Tcl_NewWideIntObj (delivered));
+	}
+
+  done:
+	for (i = 0; i < nBounds; i++) {
+		bson_destroy (&bounds[i]);
+	}
+	return result;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
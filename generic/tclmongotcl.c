@@ -61,6 +61,12 @@ Mongo_Init(Tcl_Interp *interp)
     /* Create the mongo command  */
     Tcl_CreateObjCommand(interp, "::mongo::mongo", (Tcl_ObjCmdProc *) mongotcl_mongoObjCmd, (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
 
+    /* Create the mirror command  */
+    Tcl_CreateObjCommand(interp, "::mongo::mirror", (Tcl_ObjCmdProc *) mongotcl_mirrorObjCmd, (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+
+    /* Create the merge_cursor command  */
+    Tcl_CreateObjCommand(interp, "::mongo::merge_cursor", (Tcl_ObjCmdProc *) mongotcl_mergeCursorObjCmd, (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+
     Tcl_Export (interp, namespace, "*", 0);
 
     return TCL_OK;
@@ -0,0 +1,355 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * cursor tracking - every cursor object of a mongo object is kept on a
+ * list, so the server cursors still open when they are deleted, or when
+ * the mongo object is, can be killed rather than left to time out, a
+ * batch at a time
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorTrack / mongotcl_cursorUntrack --
+ *
+ *      Add a new cursor object to its mongo object's list of live
+ *      cursors, or take one off it.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cursorTrack (mongotcl_cursorClientData *mc) {
+	mongotcl_clientData *md = mc->md;
+
+	mc->created = mongotcl_milliseconds ();
+	mc->docs_read = 0;
+	mc->live_prev = NULL;
+	mc->live_next = md->live_cursors;
+	if (md->live_cursors != NULL) {
+		md->live_cursors->live_prev = mc;
+	}
+	md->live_cursors = mc;
+}
+
+void
+mongotcl_cursorUntrack (mongotcl_cursorClientData *mc) {
+	if (mc->md == NULL) {
+		return;
+	}
+
+	if (mc->live_prev != NULL) {
+		mc->live_prev->live_next = mc->live_next;
+	} else {
+		mc->md->live_cursors = mc->live_next;
+	}
+
+	if (mc->live_next != NULL) {
+		mc->live_next->live_prev = mc->live_prev;
+	}
+	mc->live_prev = NULL;
+	mc->live_next = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorReuse --
+ *
+ *      Ready a cursor structure whose reply has been freed for a new
+ *      query on ns, keeping its copy of the namespace if it is the same.
+ *      With keepQuery its query, fields, skip, limit and options are kept
+ *      too; otherwise they are cleared as mongo_cursor_init would.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cursorReuse (mongo_cursor *cursor, mongo *conn, const char *ns, int keepQuery) {
+	if (cursor->ns == NULL || strcmp (cursor->ns, ns) != 0) {
+		bson_free ((char *)cursor->ns);
+		cursor->ns = (const char *)bson_malloc (strlen (ns) + 1);
+		strcpy ((char *)cursor->ns, ns);
+	}
+
+	if (!keepQuery) {
+		cursor->query = NULL;
+		cursor->fields = NULL;
+		cursor->skip = 0;
+		cursor->limit = 0;
+		cursor->options = 0;
+	}
+
+	cursor->conn = conn;
+	cursor->reply = NULL;
+	cursor->flags = 0;
+	cursor->seen = 0;
+	cursor->err = 0;
+	memset (&cursor->current, 0, sizeof (cursor->current));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorAlloc / mongotcl_cursorFree --
+ *
+ *      Get a cursor structure initialized for ns on the object's
+ *      connection, from the object's pool if it has one, preferring one
+ *      last used on the same namespace.  Give one whose reply has been
+ *      freed back to the pool, or free it if the pool is full, so that
+ *      cursors created and deleted for each of a stream of small queries
+ *      don't allocate afresh every time.
+ *
+ *----------------------------------------------------------------------
+ */
+mongo_cursor *
+mongotcl_cursorAlloc (mongotcl_clientData *md, const char *ns) {
+	mongo_cursor *cursor;
+	int i;
+
+	if (md->cursor_pool_count == 0) {
+		cursor = (mongo_cursor *)ckalloc (sizeof (mongo_cursor));
+		mongo_cursor_init (cursor, md->conn, ns);
+		return cursor;
+	}
+
+	for (i = md->cursor_pool_count - 1; i > 0; i--) {
+		if (strcmp (md->cursor_pool[i]->ns, ns) == 0) {
+			break;
+		}
+	}
+
+	cursor = md->cursor_pool[i];
+	md->cursor_pool[i] = md->cursor_pool[--md->cursor_pool_count];
+	mongotcl_cursorReuse (cursor, md->conn, ns, 0);
+	return cursor;
+}
+
+void
+mongotcl_cursorFree (mongotcl_clientData *md, mongo_cursor *cursor) {
+	if (md != NULL && md->cursor_pool_count < MONGOTCL_CURSOR_POOL_SIZE) {
+		md->cursor_pool[md->cursor_pool_count++] = cursor;
+		return;
+	}
+
+	mongo_cursor_destroy (cursor);
+	ckfree ((char *)cursor);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorKillIdleProc --
+ *
+ *      Kill the server cursors collected since the interpreter was last
+ *      idle.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_cursorKillIdleProc (ClientData clientData) {
+	mongotcl_clientData *md = (mongotcl_clientData *)clientData;
+
+	md->kill_scheduled = 0;
+	mongotcl_cursorKillFlush (md);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorKill --
+ *
+ *      Arrange for a server cursor on conn to be killed.  Kills are
+ *      collected and sent together once the interpreter is idle, before
+ *      the mongo object's next operation, or when a batch fills up,
+ *      whichever comes first.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cursorKill (mongotcl_clientData *md, mongo *conn, int64_t cursorId) {
+	if (md->kill_count == md->kill_space) {
+		md->kill_space = (md->kill_space == 0) ? 16 : md->kill_space * 2;
+		md->kills = (mongotcl_pendingKill *)ckrealloc ((char *)md->kills, md->kill_space * sizeof (mongotcl_pendingKill));
+	}
+
+	md->kills[md->kill_count].conn = conn;
+	md->kills[md->kill_count].cursor_id = cursorId;
+	md->kill_count++;
+
+	if (md->kill_count >= MONGOTCL_KILL_BATCH) {
+		mongotcl_cursorKillFlush (md);
+	} else if (!md->kill_scheduled) {
+		Tcl_DoWhenIdle (mongotcl_cursorKillIdleProc, (ClientData)md);
+		md->kill_scheduled = 1;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorKillFlush --
+ *
+ *      Send the collected kills, one OP_KILL_CURSORS message for each
+ *      connection they are on.  Nothing is read back, so this can be
+ *      done whatever else is outstanding on the connections.  A kill
+ *      that can't be sent is dropped; the server times the cursor out.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cursorKillFlush (mongotcl_clientData *md) {
+	int64_t *ids;
+	int i;
+
+	if (md->kill_scheduled) {
+		Tcl_CancelIdleCall (mongotcl_cursorKillIdleProc, (ClientData)md);
+		md->kill_scheduled = 0;
+	}
+
+	if (md->kill_count == 0) {
+		return;
+	}
+
+	ids = (int64_t *)ckalloc (md->kill_count * sizeof (int64_t));
+	for (i = 0; i < md->kill_count; i++) {
+		mongo *conn = md->kills[i].conn;
+		Tcl_DString msg;
+		int nIds = 0;
+		int j;
+
+		if (conn == NULL) {
+			continue;
+		}
+
+		for (j = i; j < md->kill_count; j++) {
+			if (md->kills[j].conn == conn) {
+				ids[nIds++] = md->kills[j].cursor_id;
+				md->kills[j].conn = NULL;
+			}
+		}
+
+		Tcl_DStringInit (&msg);
+		mongotcl_wireBuildKillCursorsList (&msg, nIds, ids);
+		mongotcl_wireSend (conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+		Tcl_DStringFree (&msg);
+	}
+	ckfree ((char *)ids);
+
+	md->kill_count = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorTrackForget --
+ *
+ *      The mongo object is going away.  Kill the server cursors of its
+ *      cursor objects now, while their connections are still there,
+ *      detach the objects so they don't touch it when they are deleted,
+ *      and free the pool of cursor structures.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_cursorTrackForget (mongotcl_clientData *md) {
+	mongotcl_cursorClientData *mc;
+	mongotcl_cursorClientData *next;
+
+	for (mc = md->live_cursors; mc != NULL; mc = next) {
+		mongo_cursor *cursor = mc->cursor;
+
+		next = mc->live_next;
+
+		if (cursor->reply != NULL && cursor->reply->fields.cursorID != 0) {
+			mongotcl_cursorKill (md, cursor->conn, cursor->reply->fields.cursorID);
+			cursor->reply->fields.cursorID = 0;
+		}
+
+		mc->live_prev = NULL;
+		mc->live_next = NULL;
+		mc->md = NULL;
+		mc->conn = NULL;
+		cursor->conn = NULL;
+	}
+	md->live_cursors = NULL;
+
+	while (md->cursor_pool_count > 0) {
+		mongotcl_cursorFree (NULL, md->cursor_pool[--md->cursor_pool_count]);
+	}
+
+	mongotcl_cursorKillFlush (md);
+	if (md->kills != NULL) {
+		ckfree ((char *)md->kills);
+		md->kills = NULL;
+	}
+	md->kill_space = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_cursorsObjCmd --
+ *
+ *      Implements "$mongo cursors".  Returns a list with an element for
+ *      each of the object's cursor objects, a list of key-value pairs:
+ *      name, namespace, id (the server cursor's, 0 if none is open), age
+ *      in milliseconds and the number of documents read.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_cursorsObjCmd (Tcl_Interp *interp, mongotcl_clientData *md, int objc, Tcl_Obj *CONST objv[]) {
+	mongotcl_cursorClientData *mc;
+	Tcl_WideInt now = mongotcl_milliseconds ();
+	Tcl_Obj *listObj;
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs (interp, 2, objv, "");
+		return TCL_ERROR;
+	}
+
+	listObj = Tcl_NewObj ();
+	for (mc = md->live_cursors; mc != NULL; mc = mc->live_next) {
+		mongo_cursor *cursor = mc->cursor;
+		Tcl_Obj *cursorObj = Tcl_NewObj ();
+		int64_t cursorId = 0;
+
+		if (cursor->reply != NULL) {
+			cursorId = cursor->reply->fields.cursorID;
+		}
+
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewStringObj ("name", -1));
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewStringObj (Tcl_GetCommandName (interp, mc->cmdToken), -1));
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewStringObj ("namespace", -1));
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewStringObj ((cursor->ns != NULL) ? cursor->ns : "", -1));
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewStringObj ("id", -1));
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewWideIntObj ((Tcl_WideInt)cursorId));
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewStringObj ("age", -1));
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewWideIntObj (now - mc->created));
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewStringObj ("read", -1));
+		Tcl_ListObjAppendElement (interp, cursorObj, Tcl_NewWideIntObj (mc->docs_read));
+
+		Tcl_ListObjAppendElement (interp, listObj, cursorObj);
+	}
+
+	Tcl_SetObjResult (interp, listObj);
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
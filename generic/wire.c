@@ -0,0 +1,870 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * wire protocol - messages we build and replies we read ourselves,
+ * on the socket the driver connected, when the driver's API would
+ * force a round trip per request
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <assert.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* replies larger than this are treated as a corrupt stream */
+#define MONGOTCL_MAX_REPLY_SIZE (64 * 1024 * 1024)
+
+/* replies are read through a ring buffer of this size; reply bodies
+ * bigger than half of it are read straight into the reply */
+#define MONGOTCL_READ_RING_SIZE (256 * 1024)
+
+/* queued messages are written out once there are this many... */
+#define MONGOTCL_MAX_QUEUED_MESSAGES 64
+
+/* ...or this many bytes of them */
+#define MONGOTCL_MAX_QUEUED_BYTES (1024 * 1024)
+
+/*
+ * Buffered I/O state for one connection, kept in a table keyed by
+ * the mongo structure so every connection we read or write - the
+ * object's own and the replica set members' - gets one.
+ */
+typedef struct mongotcl_wireState {
+	char *ring;
+	int ringStart;
+	int ringCount;
+	struct iovec queue[MONGOTCL_MAX_QUEUED_MESSAGES + 1];
+	char *owned[MONGOTCL_MAX_QUEUED_MESSAGES + 1];
+	int nQueued;
+	int queuedBytes;
+	mongotcl_wireStats stats;
+} mongotcl_wireState;
+
+TCL_DECLARE_MUTEX(requestIdMutex)
+static int nextRequestId = 1;
+
+TCL_DECLARE_MUTEX(wireStateMutex)
+static Tcl_HashTable wireStates;
+static int wireStatesInitialized = 0;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireGetState --
+ *
+ *      Find a connection's buffered I/O state, creating it if create
+ *      is set.
+ *
+ * Results:
+ *      The state, or NULL if there is none and create is not set.
+ *
+ *----------------------------------------------------------------------
+ */
+static mongotcl_wireState *
+mongotcl_wireGetState (mongo *conn, int create) {
+	Tcl_HashEntry *hPtr;
+	mongotcl_wireState *ws = NULL;
+	int new;
+
+	Tcl_MutexLock (&wireStateMutex);
+	if (!wireStatesInitialized) {
+		Tcl_InitHashTable (&wireStates, TCL_ONE_WORD_KEYS);
+		wireStatesInitialized = 1;
+	}
+
+	if (create) {
+		hPtr = Tcl_CreateHashEntry (&wireStates, (char *)conn, &new);
+		if (new) {
+			ws = (mongotcl_wireState *)ckalloc (sizeof (mongotcl_wireState));
+			memset (ws, 0, sizeof (mongotcl_wireState));
+			Tcl_SetHashValue (hPtr, ws);
+		}
+	} else {
+		hPtr = Tcl_FindHashEntry (&wireStates, (char *)conn);
+	}
+
+	if (hPtr != NULL) {
+		ws = (mongotcl_wireState *)Tcl_GetHashValue (hPtr);
+	}
+	Tcl_MutexUnlock (&wireStateMutex);
+
+	return ws;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireDiscardQueue --
+ *
+ *      Free the messages queued on a connection without sending them.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_wireDiscardQueue (mongotcl_wireState *ws) {
+	int i;
+
+	for (i = 0; i < ws->nQueued; i++) {
+		if (ws->owned[i] != NULL) {
+			ckfree (ws->owned[i]);
+			ws->owned[i] = NULL;
+		}
+	}
+	ws->nQueued = 0;
+	ws->queuedBytes = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireReset --
+ *
+ *      Forget any buffered reply bytes and queued messages for a
+ *      connection.  Called whenever its socket is closed or replaced,
+ *      since neither belongs to the new socket.  The counters are kept.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_wireReset (mongo *conn) {
+	mongotcl_wireState *ws = mongotcl_wireGetState (conn, 0);
+
+	if (ws == NULL) {
+		return;
+	}
+
+	mongotcl_wireDiscardQueue (ws);
+	ws->ringStart = 0;
+	ws->ringCount = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireRelease --
+ *
+ *      Free a connection's buffered I/O state.  Called before the
+ *      mongo structure itself is destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_wireRelease (mongo *conn) {
+	Tcl_HashEntry *hPtr = NULL;
+	mongotcl_wireState *ws = NULL;
+
+	Tcl_MutexLock (&wireStateMutex);
+	if (wireStatesInitialized) {
+		hPtr = Tcl_FindHashEntry (&wireStates, (char *)conn);
+	}
+	if (hPtr != NULL) {
+		ws = (mongotcl_wireState *)Tcl_GetHashValue (hPtr);
+		Tcl_DeleteHashEntry (hPtr);
+	}
+	Tcl_MutexUnlock (&wireStateMutex);
+
+	if (ws == NULL) {
+		return;
+	}
+
+	mongotcl_wireDiscardQueue (ws);
+	if (ws->ring != NULL) {
+		ckfree (ws->ring);
+	}
+	ckfree ((char *)ws);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireSetError --
+ *
+ *      Record a socket level failure on the connection the way the
+ *      driver does, so mongotcl_setMongoError reports it.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_wireSetError (mongo *conn, mongo_error_t err, const char *message) {
+	conn->err = err;
+	conn->errcode = errno;
+	strncpy (conn->errstr, message, MONGO_ERR_LEN - 1);
+	conn->errstr[MONGO_ERR_LEN - 1] = '\0';
+	return MONGO_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireAppendInt32 / mongotcl_wireAppendInt64 --
+ *
+ *      Append a little endian integer to a message under construction.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_wireAppendInt32 (Tcl_DString *msg, int value) {
+	char buf[4];
+
+	bson_little_endian32 (buf, &value);
+	Tcl_DStringAppend (msg, buf, 4);
+}
+
+void
+mongotcl_wireAppendInt64 (Tcl_DString *msg, int64_t value) {
+	char buf[8];
+
+	bson_little_endian64 (buf, &value);
+	Tcl_DStringAppend (msg, buf, 8);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireStartMessage --
+ *
+ *      Begin a message in an initialized DString, writing a header
+ *      whose length is filled in by mongotcl_wireFinishMessage.
+ *
+ * Results:
+ *      The request ID of the message.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireStartMessage (Tcl_DString *msg, int opCode) {
+	int requestId;
+
+	Tcl_MutexLock (&requestIdMutex);
+	requestId = nextRequestId++;
+	if (nextRequestId <= 0) {
+		nextRequestId = 1;
+	}
+	Tcl_MutexUnlock (&requestIdMutex);
+
+	mongotcl_wireAppendInt32 (msg, 0);
+	mongotcl_wireAppendInt32 (msg, requestId);
+	mongotcl_wireAppendInt32 (msg, 0);
+	mongotcl_wireAppendInt32 (msg, opCode);
+	return requestId;
+}
+
+void
+mongotcl_wireFinishMessage (Tcl_DString *msg) {
+	int len = Tcl_DStringLength (msg);
+
+	bson_little_endian32 (Tcl_DStringValue (msg), &len);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireBuildQuery --
+ *
+ *      Build an OP_QUERY message.  fields may be NULL.
+ *
+ * Results:
+ *      The request ID of the message.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireBuildQuery (Tcl_DString *msg, const char *ns, int flags, int skip, int nToReturn, const bson *query, const bson *fields) {
+	int requestId = mongotcl_wireStartMessage (msg, MONGO_OP_QUERY);
+
+	mongotcl_wireAppendInt32 (msg, flags);
+	Tcl_DStringAppend (msg, ns, (int)strlen (ns) + 1);
+	mongotcl_wireAppendInt32 (msg, skip);
+	mongotcl_wireAppendInt32 (msg, nToReturn);
+	Tcl_DStringAppend (msg, bson_data (query), bson_size (query));
+	if (fields != NULL) {
+		Tcl_DStringAppend (msg, bson_data (fields), bson_size (fields));
+	}
+
+	mongotcl_wireFinishMessage (msg);
+	return requestId;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireBuildCommand --
+ *
+ *      Build an OP_QUERY message running a command against db.$cmd.
+ *
+ * Results:
+ *      The request ID of the message.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireBuildCommand (Tcl_DString *msg, const char *db, const bson *command) {
+	Tcl_DString ns;
+	int requestId;
+
+	Tcl_DStringInit (&ns);
+	Tcl_DStringAppend (&ns, db, -1);
+	Tcl_DStringAppend (&ns, ".$cmd", -1);
+	requestId = mongotcl_wireBuildQuery (msg, Tcl_DStringValue (&ns), 0, 0, -1, command, NULL);
+	Tcl_DStringFree (&ns);
+	return requestId;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireBuildKillCursors --
+ *
+ *      Build an OP_KILL_CURSORS message for one cursor.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_wireBuildKillCursors (Tcl_DString *msg, int64_t cursorId) {
+	mongotcl_wireBuildKillCursorsList (msg, 1, &cursorId);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireBuildKillCursorsList --
+ *
+ *      Build an OP_KILL_CURSORS message for several cursors at once.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_wireBuildKillCursorsList (Tcl_DString *msg, int nCursors, const int64_t *cursorIds) {
+	int i;
+
+	mongotcl_wireStartMessage (msg, MONGO_OP_KILL_CURSORS);
+	mongotcl_wireAppendInt32 (msg, 0);
+	mongotcl_wireAppendInt32 (msg, nCursors);
+	for (i = 0; i < nCursors; i++) {
+		mongotcl_wireAppendInt64 (msg, cursorIds[i]);
+	}
+	mongotcl_wireFinishMessage (msg);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireBuildGetMore --
+ *
+ *      Build an OP_GET_MORE message asking for up to nToReturn more
+ *      documents from a cursor, or the server's default if it is 0.
+ *
+ * Results:
+ *      The request ID of the message.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireBuildGetMore (Tcl_DString *msg, const char *ns, int nToReturn, int64_t cursorId) {
+	int requestId = mongotcl_wireStartMessage (msg, MONGO_OP_GET_MORE);
+
+	mongotcl_wireAppendInt32 (msg, 0);
+	Tcl_DStringAppend (msg, ns, (int)strlen (ns) + 1);
+	mongotcl_wireAppendInt32 (msg, nToReturn);
+	mongotcl_wireAppendInt64 (msg, cursorId);
+	mongotcl_wireFinishMessage (msg);
+	return requestId;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireBuildInsert / mongotcl_wireBuildUpdate /
+ * mongotcl_wireBuildDelete --
+ *
+ *      Build OP_INSERT, OP_UPDATE and OP_DELETE messages.  These carry
+ *      no acknowledgement; a getlasterror must follow them for one.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_wireBuildInsert (Tcl_DString *msg, const char *ns, int flags, const bson *doc) {
+	mongotcl_wireStartMessage (msg, MONGO_OP_INSERT);
+	mongotcl_wireAppendInt32 (msg, flags);
+	Tcl_DStringAppend (msg, ns, (int)strlen (ns) + 1);
+	Tcl_DStringAppend (msg, bson_data (doc), bson_size (doc));
+	mongotcl_wireFinishMessage (msg);
+}
+
+void
+mongotcl_wireBuildUpdate (Tcl_DString *msg, const char *ns, int flags, const bson *cond, const bson *op) {
+	mongotcl_wireStartMessage (msg, MONGO_OP_UPDATE);
+	mongotcl_wireAppendInt32 (msg, 0);
+	Tcl_DStringAppend (msg, ns, (int)strlen (ns) + 1);
+	mongotcl_wireAppendInt32 (msg, flags);
+	Tcl_DStringAppend (msg, bson_data (cond), bson_size (cond));
+	Tcl_DStringAppend (msg, bson_data (op), bson_size (op));
+	mongotcl_wireFinishMessage (msg);
+}
+
+void
+mongotcl_wireBuildDelete (Tcl_DString *msg, const char *ns, int flags, const bson *cond) {
+	mongotcl_wireStartMessage (msg, MONGO_OP_DELETE);
+	mongotcl_wireAppendInt32 (msg, 0);
+	Tcl_DStringAppend (msg, ns, (int)strlen (ns) + 1);
+	mongotcl_wireAppendInt32 (msg, flags);
+	Tcl_DStringAppend (msg, bson_data (cond), bson_size (cond));
+	mongotcl_wireFinishMessage (msg);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireWrite --
+ *
+ *      Write everything queued on a connection, followed by data if it
+ *      isn't NULL, gathering it all into as few sendmsg calls as the
+ *      socket allows.  The queue is emptied whether or not the write
+ *      succeeds.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_wireWrite (mongo *conn, mongotcl_wireState *ws, const char *data, int len) {
+	struct iovec *iov = ws->queue;
+	int nIov = ws->nQueued;
+	int remaining = ws->queuedBytes;
+	int status = MONGO_OK;
+
+	if (data != NULL) {
+		iov[nIov].iov_base = (char *)data;
+		iov[nIov].iov_len = len;
+		ws->owned[nIov] = NULL;
+		nIov++;
+		remaining += len;
+	}
+
+	if (nIov == 0) {
+		return MONGO_OK;
+	}
+
+	ws->stats.messagesWritten += nIov;
+	ws->stats.bytesWritten += remaining;
+
+	while (remaining > 0) {
+		struct msghdr mh;
+		ssize_t sent;
+
+		memset (&mh, 0, sizeof (mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = nIov;
+
+		ws->stats.writeCalls++;
+		sent = sendmsg (conn->sock, &mh, MSG_NOSIGNAL);
+
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			status = mongotcl_wireSetError (conn, MONGO_IO_ERROR, strerror (errno));
+			break;
+		}
+
+		remaining -= (int)sent;
+
+		/* skip what went out; a partially sent message is resumed */
+		while (nIov > 0 && sent >= (ssize_t)iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++;
+			nIov--;
+		}
+		if (nIov > 0) {
+			iov->iov_base = (char *)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+
+	mongotcl_wireDiscardQueue (ws);
+	return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireQueue --
+ *
+ *      Queue a message on a connection to be written together with the
+ *      next ones, instead of with a send of its own.  The queue is
+ *      written out when it fills, when something is sent with
+ *      mongotcl_wireSend, or by mongotcl_wireFlush, which must be
+ *      called before the driver is used on the connection.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set if a full
+ *      queue couldn't be written.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireQueue (mongo *conn, const char *data, int len) {
+	mongotcl_wireState *ws = mongotcl_wireGetState (conn, 1);
+	char *copy;
+
+	if (ws->nQueued == MONGOTCL_MAX_QUEUED_MESSAGES || ws->queuedBytes + len > MONGOTCL_MAX_QUEUED_BYTES) {
+		if (mongotcl_wireWrite (conn, ws, NULL, 0) != MONGO_OK) {
+			return MONGO_ERROR;
+		}
+	}
+
+	copy = ckalloc (len);
+	memcpy (copy, data, len);
+	ws->queue[ws->nQueued].iov_base = copy;
+	ws->queue[ws->nQueued].iov_len = len;
+	ws->owned[ws->nQueued] = copy;
+	ws->nQueued++;
+	ws->queuedBytes += len;
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireFlush --
+ *
+ *      Write out any messages queued on a connection.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireFlush (mongo *conn) {
+	mongotcl_wireState *ws = mongotcl_wireGetState (conn, 0);
+
+	if (ws == NULL || ws->nQueued == 0) {
+		return MONGO_OK;
+	}
+
+	return mongotcl_wireWrite (conn, ws, NULL, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireQueued --
+ *
+ *      Return the number of messages queued on a connection.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireQueued (mongo *conn) {
+	mongotcl_wireState *ws = mongotcl_wireGetState (conn, 0);
+
+	return (ws == NULL) ? 0 : ws->nQueued;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireBuffered --
+ *
+ *      Return the number of reply bytes already read from a connection
+ *      and waiting in its ring.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireBuffered (mongo *conn) {
+	mongotcl_wireState *ws = mongotcl_wireGetState (conn, 0);
+
+	return (ws == NULL) ? 0 : ws->ringCount;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireGetStats --
+ *
+ *      Copy a connection's I/O counters into stats, zeroing them if
+ *      reset is set.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_wireGetStats (mongo *conn, mongotcl_wireStats *stats, int reset) {
+	mongotcl_wireState *ws = mongotcl_wireGetState (conn, 0);
+
+	if (ws == NULL) {
+		memset (stats, 0, sizeof (mongotcl_wireStats));
+		return;
+	}
+
+	*stats = ws->stats;
+	if (reset) {
+		memset (&ws->stats, 0, sizeof (mongotcl_wireStats));
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireSend --
+ *
+ *      Write a complete message to the connection's socket, along with
+ *      any messages queued ahead of it.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireSend (mongo *conn, const char *data, int len) {
+	return mongotcl_wireWrite (conn, mongotcl_wireGetState (conn, 1), data, len);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireFill --
+ *
+ *      Read from the socket into the ring until it holds at least need
+ *      bytes, taking whatever else has already arrived with the same
+ *      readv.  need may not exceed MONGOTCL_READ_RING_SIZE.
+ *
+ *      Only replies to requests we sent ourselves are ever read ahead
+ *      this way, and all of them are consumed before the driver reads
+ *      from the connection again, so nothing the driver expects can be
+ *      left stranded in the ring.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_wireFill (mongo *conn, mongotcl_wireState *ws, int need) {
+	if (ws->ring == NULL) {
+		ws->ring = ckalloc (MONGOTCL_READ_RING_SIZE);
+		ws->ringStart = 0;
+		ws->ringCount = 0;
+	}
+
+	while (ws->ringCount < need) {
+		struct iovec iov[2];
+		int nIov = 1;
+		int end = (ws->ringStart + ws->ringCount) % MONGOTCL_READ_RING_SIZE;
+		ssize_t got;
+
+		iov[0].iov_base = ws->ring + end;
+		if (end >= ws->ringStart) {
+			iov[0].iov_len = MONGOTCL_READ_RING_SIZE - end;
+			if (ws->ringStart > 0) {
+				iov[1].iov_base = ws->ring;
+				iov[1].iov_len = ws->ringStart;
+				nIov = 2;
+			}
+		} else {
+			iov[0].iov_len = ws->ringStart - end;
+		}
+
+		ws->stats.readCalls++;
+		got = readv (conn->sock, iov, nIov);
+
+		if (got == 0) {
+			return mongotcl_wireSetError (conn, MONGO_IO_ERROR, "connection closed by server");
+		}
+
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return mongotcl_wireSetError (conn, MONGO_IO_ERROR, strerror (errno));
+		}
+
+		ws->ringCount += (int)got;
+		ws->stats.bytesRead += got;
+	}
+
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireTake --
+ *
+ *      Move len buffered bytes out of the ring.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_wireTake (mongotcl_wireState *ws, char *data, int len) {
+	int first = MONGOTCL_READ_RING_SIZE - ws->ringStart;
+
+	assert (len <= ws->ringCount);
+
+	if (first > len) {
+		first = len;
+	}
+	memcpy (data, ws->ring + ws->ringStart, first);
+	memcpy (data + first, ws->ring, len - first);
+
+	ws->ringStart = (ws->ringStart + len) % MONGOTCL_READ_RING_SIZE;
+	ws->ringCount -= len;
+	if (ws->ringCount == 0) {
+		ws->ringStart = 0;
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireRecv --
+ *
+ *      Read exactly len bytes from the connection's socket, bypassing
+ *      the ring.  Used for the rest of replies too big to go through it.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_wireRecv (mongo *conn, mongotcl_wireState *ws, char *data, int len) {
+	while (len > 0) {
+		ssize_t got;
+
+		ws->stats.readCalls++;
+		got = recv (conn->sock, data, len, 0);
+
+		if (got == 0) {
+			return mongotcl_wireSetError (conn, MONGO_IO_ERROR, "connection closed by server");
+		}
+
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return mongotcl_wireSetError (conn, MONGO_IO_ERROR, strerror (errno));
+		}
+
+		ws->stats.bytesRead += got;
+		data += got;
+		len -= (int)got;
+	}
+
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_wireReadReply --
+ *
+ *      Read one OP_REPLY from the connection.  The reply is laid out
+ *      exactly as the driver's mongo_read_response leaves it - header
+ *      and fields in host byte order, allocated with bson_malloc - so
+ *      it can be handed to a mongo_cursor and freed by the driver.
+ *
+ *      Anything queued on the connection is written first.  The reply
+ *      is read through the connection's ring, so a small reply usually
+ *      takes one readv, and a run of pipelined replies far fewer than
+ *      one per reply.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_wireReadReply (mongo *conn, mongo_reply **replyPtr) {
+	mongotcl_wireState *ws = mongotcl_wireGetState (conn, 1);
+	mongo_header head;
+	mongo_reply_fields fields;
+	mongo_reply *reply;
+	int len;
+	int bodyLen;
+	int buffered;
+
+	if (ws->nQueued > 0 && mongotcl_wireWrite (conn, ws, NULL, 0) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (mongotcl_wireFill (conn, ws, (int)(sizeof (head) + sizeof (fields))) != MONGO_OK) {
+		mongotcl_wireReset (conn);
+		return MONGO_ERROR;
+	}
+
+	mongotcl_wireTake (ws, (char *)&head, sizeof (head));
+	mongotcl_wireTake (ws, (char *)&fields, sizeof (fields));
+
+	bson_little_endian32 (&len, &head.len);
+	if (len < (int)(sizeof (head) + sizeof (fields)) || len > MONGOTCL_MAX_REPLY_SIZE) {
+		mongotcl_wireReset (conn);
+		return mongotcl_wireSetError (conn, MONGO_READ_SIZE_ERROR, "bad reply length");
+	}
+
+	reply = (mongo_reply *)bson_malloc (len);
+	reply->head.len = len;
+	bson_little_endian32 (&reply->head.id, &head.id);
+	bson_little_endian32 (&reply->head.responseTo, &head.responseTo);
+	bson_little_endian32 (&reply->head.op, &head.op);
+	bson_little_endian32 (&reply->fields.flag, &fields.flag);
+	bson_little_endian64 (&reply->fields.cursorID, &fields.cursorID);
+	bson_little_endian32 (&reply->fields.start, &fields.start);
+	bson_little_endian32 (&reply->fields.num, &fields.num);
+
+	bodyLen = len - (int)(sizeof (head) + sizeof (fields));
+	buffered = (ws->ringCount < bodyLen) ? ws->ringCount : bodyLen;
+	mongotcl_wireTake (ws, &reply->objs, buffered);
+
+	if (bodyLen - buffered > MONGOTCL_READ_RING_SIZE / 2) {
+		if (mongotcl_wireRecv (conn, ws, &reply->objs + buffered, bodyLen - buffered) != MONGO_OK) {
+			bson_free (reply);
+			mongotcl_wireReset (conn);
+			return MONGO_ERROR;
+		}
+	} else if (bodyLen > buffered) {
+		if (mongotcl_wireFill (conn, ws, bodyLen - buffered) != MONGO_OK) {
+			bson_free (reply);
+			mongotcl_wireReset (conn);
+			return MONGO_ERROR;
+		}
+		mongotcl_wireTake (ws, &reply->objs + buffered, bodyLen - buffered);
+	}
+
+	ws->stats.repliesRead++;
+	*replyPtr = reply;
+	return MONGO_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -0,0 +1,789 @@
+/*
+ * mongotcl - Tcl interface to MongoDB
+ *
+ * write path support - batching, acknowledgement
+ *
+ * Copyright (C) 2014 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ */
+
+#include "mongotcl.h"
+#include <assert.h>
+
+/* OP_INSERT overhead beyond the namespace: header plus flags word */
+#define MONGOTCL_INSERT_OVERHEAD (16 + 4)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_writeConcernIsAcknowledged --
+ *
+ *      Return 1 if writes issued with the write concern are followed
+ *      by a getLastError, 0 if they are fire and forget.  This is the
+ *      same test the driver applies.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_writeConcernIsAcknowledged (mongo_write_concern *writeConcern) {
+	return (writeConcern != NULL && writeConcern->w >= 1 && writeConcern->cmd != NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_namespaceToDb --
+ *
+ *      Extract the database name from a namespace like
+ *      "tutorial.persons" into an initialized DString.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_namespaceToDb (const char *ns, Tcl_DString *dbString) {
+	const char *dot = strchr (ns, '.');
+
+	if (dot == NULL) {
+		Tcl_DStringAppend (dbString, ns, -1);
+	} else {
+		Tcl_DStringAppend (dbString, ns, (int)(dot - ns));
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_checkLastError --
+ *
+ *      Issue a single getLastError using the object's configured write
+ *      concern against the database of the namespace, which covers
+ *      writes previously sent unacknowledged on the connection.
+ *
+ * Results:
+ *      MONGO_OK, or MONGO_ERROR with the connection error and error
+ *      string set as the driver would for an acknowledged write.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_checkLastError (mongotcl_clientData *md, const char *ns) {
+	Tcl_DString db;
+	bson out;
+	bson_iterator it;
+	int status;
+
+	if (!mongotcl_writeConcernIsAcknowledged (md->write_concern)) {
+		return mongotcl_flushWrites (md);
+	}
+
+	if (mongotcl_flushWrites (md) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	Tcl_DStringInit (&db);
+	mongotcl_namespaceToDb (ns, &db);
+	status = mongo_run_command (md->conn, Tcl_DStringValue (&db), md->write_concern->cmd, &out);
+	Tcl_DStringFree (&db);
+
+	if (status != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (bson_find (&it, &out, "err") == BSON_STRING) {
+		md->conn->err = MONGO_WRITE_ERROR;
+		strncpy (md->conn->errstr, bson_iterator_string (&it), MONGO_ERR_LEN - 1);
+		md->conn->errstr[MONGO_ERR_LEN - 1] = '\0';
+
+		if (bson_find (&it, &out, "code") != BSON_EOO) {
+			md->conn->errcode = bson_iterator_int (&it);
+		}
+
+		bson_destroy (&out);
+		return MONGO_ERROR;
+	}
+
+	bson_destroy (&out);
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_flushIdleProc / mongotcl_flushExitProc --
+ *
+ *      Write out coalesced writes once the interpreter goes idle, or
+ *      at exit if it never does.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+mongotcl_flushIdleProc (ClientData clientData) {
+	mongotcl_clientData *md = (mongotcl_clientData *)clientData;
+
+	md->flush_scheduled = 0;
+	mongotcl_wireFlush (md->conn);
+}
+
+void
+mongotcl_flushExitProc (ClientData clientData) {
+	mongotcl_clientData *md = (mongotcl_clientData *)clientData;
+
+	mongotcl_wireFlush (md->conn);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_flushWrites --
+ *
+ *      Write out any writes queued on the object's connection and
+ *      collect the replies to asynchronous requests in flight on it.
+ *      Must be called before the driver is used on it.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_flushWrites (mongotcl_clientData *md) {
+	if (md->flush_scheduled) {
+		Tcl_CancelIdleCall (mongotcl_flushIdleProc, (ClientData)md);
+		md->flush_scheduled = 0;
+	}
+
+	if (mongotcl_wireFlush (md->conn) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (mongotcl_cursorSettle (md, md->conn) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	return mongotcl_asyncDrain (md);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_writeBsonValid --
+ *
+ *      Apply the checks the driver makes before sending a document, for
+ *      writes we send ourselves.  Inserted documents may not have keys
+ *      containing '.' or starting with '$'.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_writeBsonValid (mongo *conn, const bson *b, int isInsert) {
+	if (bson_size (b) > conn->max_bson_size) {
+		conn->err = MONGO_BSON_TOO_LARGE;
+		return MONGO_ERROR;
+	}
+
+	if (!b->finished) {
+		conn->err = MONGO_BSON_NOT_FINISHED;
+		return MONGO_ERROR;
+	}
+
+	if ((b->err & BSON_NOT_UTF8) || (isInsert && (b->err & (BSON_FIELD_HAS_DOT | BSON_FIELD_INIT_DOLLAR)))) {
+		conn->err = MONGO_BSON_INVALID;
+		return MONGO_ERROR;
+	}
+
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_sendUnacknowledged --
+ *
+ *      Send an unacknowledged write.  Inside a pipeline, or with
+ *      "configure -coalesce" on, it is queued so that consecutive
+ *      writes share a sendmsg; the queue is written when it fills,
+ *      before anything else uses the connection, and otherwise once
+ *      the interpreter goes idle.  Resilient mode never queues, since
+ *      it must see a failed send to keep the write.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_sendUnacknowledged (mongotcl_clientData *md, Tcl_DString *msg) {
+	if (!md->conn->connected) {
+		md->conn->err = MONGO_IO_ERROR;
+		strcpy (md->conn->errstr, "not connected");
+		return MONGO_ERROR;
+	}
+
+	if (md->resilient || (!md->coalesce && md->pipeline_depth == 0)) {
+		return mongotcl_wireSend (md->conn, Tcl_DStringValue (msg), Tcl_DStringLength (msg));
+	}
+
+	if (mongotcl_wireQueue (md->conn, Tcl_DStringValue (msg), Tcl_DStringLength (msg)) != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (md->pipeline_depth == 0 && !md->flush_scheduled) {
+		Tcl_DoWhenIdle (mongotcl_flushIdleProc, (ClientData)md);
+		md->flush_scheduled = 1;
+	}
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_sendWriteOp --
+ *
+ *      Send a single queued insert, update or remove with the given
+ *      write concern.  Acknowledged writes go through the driver;
+ *      unacknowledged ones are built here so they can be coalesced.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR with the connection error set.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_sendWriteOp (mongotcl_clientData *md, const char *ns, mongotcl_bulkOp *op, mongo_write_concern *writeConcern) {
+	int acknowledged = mongotcl_writeConcernIsAcknowledged (writeConcern);
+	int updateFlags = 0;
+	Tcl_DString msg;
+	int status;
+
+	if (op->upsert) {
+		updateFlags |= MONGO_UPDATE_UPSERT;
+	}
+	if (op->multi) {
+		updateFlags |= MONGO_UPDATE_MULTI;
+	}
+
+	if (acknowledged) {
+		if (mongotcl_flushWrites (md) != MONGO_OK) {
+			return MONGO_ERROR;
+		}
+
+		switch (op->type) {
+			case MONGOTCL_BULK_INSERT: {
+				return mongo_insert (md->conn, ns, &op->doc, writeConcern);
+			}
+
+			case MONGOTCL_BULK_UPDATE: {
+				if (updateFlags == 0) {
+					updateFlags = MONGO_UPDATE_BASIC;
+				}
+
+				return mongo_update (md->conn, ns, &op->doc, &op->update, updateFlags, writeConcern);
+			}
+
+			case MONGOTCL_BULK_REMOVE: {
+				return mongo_remove (md->conn, ns, &op->doc, writeConcern);
+			}
+		}
+
+		return MONGO_ERROR;
+	}
+
+	Tcl_DStringInit (&msg);
+	switch (op->type) {
+		case MONGOTCL_BULK_INSERT: {
+			if (mongotcl_writeBsonValid (md->conn, &op->doc, 1) != MONGO_OK) {
+				return MONGO_ERROR;
+			}
+			mongotcl_wireBuildInsert (&msg, ns, 0, &op->doc);
+			break;
+		}
+
+		case MONGOTCL_BULK_UPDATE: {
+			if (mongotcl_writeBsonValid (md->conn, &op->doc, 0) != MONGO_OK || mongotcl_writeBsonValid (md->conn, &op->update, 0) != MONGO_OK) {
+				return MONGO_ERROR;
+			}
+			mongotcl_wireBuildUpdate (&msg, ns, updateFlags, &op->doc, &op->update);
+			break;
+		}
+
+		case MONGOTCL_BULK_REMOVE: {
+			if (mongotcl_writeBsonValid (md->conn, &op->doc, 0) != MONGO_OK) {
+				return MONGO_ERROR;
+			}
+			mongotcl_wireBuildDelete (&msg, ns, 0, &op->doc);
+			break;
+		}
+	}
+
+	status = mongotcl_sendUnacknowledged (md, &msg);
+	Tcl_DStringFree (&msg);
+	return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_activeWriteConcern --
+ *
+ *      Return the write concern a write should be sent with.  Inside
+ *      a pipeline writes go out unacknowledged; acknowledgement is
+ *      collected by mongotcl_pipelineNoteWrite and mongotcl_pipelineFinish.
+ *
+ *----------------------------------------------------------------------
+ */
+mongo_write_concern *
+mongotcl_activeWriteConcern (mongotcl_clientData *md) {
+	if (md->pipeline_depth > 0) {
+		return md->unack_write_concern;
+	}
+	return md->write_concern;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pipelineNoteWrite --
+ *
+ *      Called after every write sent through a mongo object.  Outside
+ *      a pipeline this does nothing.
+ *
+ *      Inside a pipeline on an acknowledged connection, a plain
+ *      getlasterror (no w or j, so the server answers immediately) is
+ *      queued behind the write without waiting for its reply.  The
+ *      replies come back in order and are read by mongotcl_pipelineDrain,
+ *      which is how the first failing write is identified.  Draining
+ *      every MONGOTCL_PIPELINE_MAX_PENDING writes keeps the server from
+ *      blocking on a full socket buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_pipelineNoteWrite (mongotcl_clientData *md, const char *ns) {
+	Tcl_DString db;
+	Tcl_DString msg;
+	bson command;
+	int status;
+
+	if (md->pipeline_depth == 0) {
+		return MONGO_OK;
+	}
+
+	Tcl_DStringSetLength (&md->pipeline_ns, 0);
+	Tcl_DStringAppend (&md->pipeline_ns, ns, -1);
+	md->pipeline_writes++;
+
+	if (!mongotcl_writeConcernIsAcknowledged (md->write_concern)) {
+		return MONGO_OK;
+	}
+
+	bson_init (&command);
+	bson_append_int (&command, "getlasterror", 1);
+	bson_finish (&command);
+
+	Tcl_DStringInit (&db);
+	Tcl_DStringInit (&msg);
+	mongotcl_namespaceToDb (ns, &db);
+	mongotcl_wireBuildCommand (&msg, Tcl_DStringValue (&db), &command);
+	status = mongotcl_wireQueue (md->conn, Tcl_DStringValue (&msg), Tcl_DStringLength (&msg));
+	Tcl_DStringFree (&msg);
+	Tcl_DStringFree (&db);
+	bson_destroy (&command);
+
+	if (status != MONGO_OK) {
+		return MONGO_ERROR;
+	}
+
+	if (++md->pipeline_pending >= MONGOTCL_PIPELINE_MAX_PENDING) {
+		return mongotcl_pipelineDrain (md);
+	}
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pipelineDrain --
+ *
+ *      Write out the pipeline's queued messages and read the replies
+ *      to all its getlasterrors, remembering the first write that
+ *      failed.  Must be called before anything else reads from the
+ *      connection.
+ *
+ * Results:
+ *      MONGO_OK or MONGO_ERROR if the connection failed.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_pipelineDrain (mongotcl_clientData *md) {
+	if (mongotcl_flushWrites (md) != MONGO_OK) {
+		md->pipeline_pending = 0;
+		return MONGO_ERROR;
+	}
+
+	while (md->pipeline_pending > 0) {
+		mongo_reply *reply;
+		bson_iterator it;
+
+		if (mongotcl_wireReadReply (md->conn, &reply) != MONGO_OK) {
+			md->pipeline_pending = 0;
+			return MONGO_ERROR;
+		}
+		md->pipeline_pending--;
+
+		if (md->pipeline_error_index < 0 && reply->fields.num > 0 && mongotcl_bsonFindRaw (&it, &reply->objs, "err") == BSON_STRING) {
+			md->pipeline_error_index = md->pipeline_replies;
+			strncpy (md->pipeline_errmsg, bson_iterator_string (&it), MONGO_ERR_LEN - 1);
+			md->pipeline_errmsg[MONGO_ERR_LEN - 1] = '\0';
+
+			if (mongotcl_bsonFindRaw (&it, &reply->objs, "code") != BSON_EOO) {
+				md->pipeline_error_code = bson_iterator_int (&it);
+			}
+		}
+
+		md->pipeline_replies++;
+		bson_free (reply);
+	}
+
+	return MONGO_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_pipelineFinish --
+ *
+ *      Complete the outermost pipeline: collect the outstanding
+ *      acknowledgements, then issue one getLastError with the
+ *      configured w/j so the whole pipeline meets the write concern.
+ *
+ * Results:
+ *      scriptResult if the script failed, otherwise a standard Tcl
+ *      result.  A failed write raises an error with the errorCode
+ *      MONGO WRITE_ERROR index code, where index counts the writes
+ *      in the pipeline from zero.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_pipelineFinish (Tcl_Interp *interp, mongotcl_clientData *md, int scriptResult) {
+	int status = mongotcl_pipelineDrain (md);
+	char indexString[16];
+	char codeString[16];
+
+	if (status == MONGO_OK && md->pipeline_writes > 0 && md->pipeline_error_index < 0) {
+		status = mongotcl_checkLastError (md, Tcl_DStringValue (&md->pipeline_ns));
+	}
+
+	if (scriptResult != TCL_OK) {
+		return scriptResult;
+	}
+
+	if (status != MONGO_OK) {
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	if (md->pipeline_error_index >= 0) {
+		snprintf (indexString, sizeof (indexString), "%d", md->pipeline_error_index);
+		snprintf (codeString, sizeof (codeString), "%d", md->pipeline_error_code);
+		Tcl_ResetResult (interp);
+		Tcl_AppendResult (interp, "pipelined write ", indexString, " failed: ", md->pipeline_errmsg, NULL);
+		Tcl_SetErrorCode (interp, "MONGO", "WRITE_ERROR", indexString, codeString, NULL);
+		return TCL_ERROR;
+	}
+
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_appendWriteConcern --
+ *
+ *      Append a writeConcern subobject for a write command carrying the
+ *      same w/j/fsync/wtimeout as the getLastError command the driver
+ *      built for the write concern.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+mongotcl_appendWriteConcern (bson *command, mongo_write_concern *writeConcern) {
+	bson_iterator it;
+
+	bson_append_start_object (command, "writeConcern");
+	if (writeConcern->cmd != NULL) {
+		bson_iterator_init (&it, writeConcern->cmd);
+		while (bson_iterator_next (&it)) {
+			if (strcmp (bson_iterator_key (&it), "getlasterror") != 0) {
+				bson_append_element (command, NULL, &it);
+			}
+		}
+	} else {
+		bson_append_int (command, "w", 0);
+	}
+	bson_append_finish_object (command);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_insertCommand --
+ *
+ *      Send a slice of documents as an unordered insert write command,
+ *      appending the caller's index (from docIndexes) of every document
+ *      the server rejected to failedList.
+ *
+ * Results:
+ *      A standard Tcl result.  A write concern the server couldn't
+ *      satisfy is an error, with errorCode MONGO WRITE_CONCERN_ERROR
+ *      and the server's code.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+mongotcl_insertCommand (Tcl_Interp *interp, mongotcl_clientData *md, char *ns, bson **docs, int *docIndexes, int nDocs, Tcl_Obj *failedList) {
+	const char *collection = strchr (ns, '.');
+	Tcl_DString db;
+	bson command;
+	bson out;
+	bson_iterator it;
+	bson_iterator sub;
+	char key[16];
+	int i;
+	int status;
+
+	if (collection == NULL) {
+		md->conn->err = MONGO_NS_INVALID;
+		md->conn->errstr[0] = '\0';
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	bson_init (&command);
+	bson_append_string (&command, "insert", collection + 1);
+	bson_append_start_array (&command, "documents");
+	for (i = 0; i < nDocs; i++) {
+		snprintf (key, sizeof (key), "%d", i);
+		bson_append_bson (&command, key, docs[i]);
+	}
+	bson_append_finish_array (&command);
+	bson_append_bool (&command, "ordered", 0);
+
+	mongotcl_appendWriteConcern (&command, md->write_concern);
+
+	if (bson_finish (&command) != BSON_OK) {
+		bson_destroy (&command);
+		md->conn->err = MONGO_BSON_INVALID;
+		md->conn->errstr[0] = '\0';
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	Tcl_DStringInit (&db);
+	mongotcl_namespaceToDb (ns, &db);
+	status = mongo_run_command (md->conn, Tcl_DStringValue (&db), &command, &out);
+	Tcl_DStringFree (&db);
+	bson_destroy (&command);
+
+	if (status != MONGO_OK) {
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	if (bson_find (&it, &out, "writeErrors") == BSON_ARRAY) {
+		bson_iterator_subiterator (&it, &sub);
+		while (bson_iterator_next (&sub)) {
+			bson_iterator field;
+
+			bson_iterator_subiterator (&sub, &field);
+			while (bson_iterator_next (&field)) {
+				if (strcmp (bson_iterator_key (&field), "index") == 0) {
+					Tcl_ListObjAppendElement (interp, failedList, Tcl_NewIntObj (docIndexes[bson_iterator_int (&field)]));
+				}
+			}
+		}
+	}
+
+	if (bson_find (&it, &out, "writeConcernError") == BSON_OBJECT) {
+		const char *errmsg = "write concern error";
+		int code = 0;
+
+		bson_iterator_subiterator (&it, &sub);
+		while (bson_iterator_next (&sub)) {
+			if (strcmp (bson_iterator_key (&sub), "code") == 0) {
+				code = bson_iterator_int (&sub);
+			} else if (strcmp (bson_iterator_key (&sub), "errmsg") == 0) {
+				errmsg = bson_iterator_string (&sub);
+			}
+		}
+
+		/* not a connection error, so a resilient insert doesn't retry */
+		md->conn->err = MONGO_WRITE_ERROR;
+		md->conn->errcode = code;
+		snprintf (key, sizeof (key), "%d", code);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (errmsg, -1));
+		Tcl_SetErrorCode (interp, "MONGO", "WRITE_CONCERN_ERROR", key, NULL);
+		bson_destroy (&out);
+		return TCL_ERROR;
+	}
+
+	bson_destroy (&out);
+	return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * mongotcl_insertBatch --
+ *
+ *      Insert an arbitrarily long list of bson objects, splitting it
+ *      into sub-batches that fit the server's limits.
+ *
+ *      Legacy OP_INSERT sub-batches are bounded by maxBsonObjectSize
+ *      (the driver refuses anything larger) and maxMessageSizeBytes.
+ *      They are sent back to back unacknowledged and covered by one
+ *      trailing getLastError, except when stopping at the first error
+ *      matters (acknowledged without continue_on_error), in which case
+ *      each sub-batch is checked before the next is sent.
+ *
+ *      With continue_on_error on an acknowledged connection to a
+ *      server that supports write commands, the insert command is
+ *      used instead so that the server reports which documents failed.
+ *
+ * Results:
+ *      A standard Tcl result.  With continue_on_error the result is
+ *      the list of indexes of documents that were not inserted.
+ *      *confirmedPtr is set to the number of leading documents of the
+ *      list the server has acknowledged, so that after a failure the
+ *      rest can be retried without writing those again.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+mongotcl_insertBatch (Tcl_Interp *interp, mongotcl_clientData *md, char *ns, int listObjc, Tcl_Obj **listObjv, int flags, int *confirmedPtr) {
+	bson **bsonList;
+	int *indexList;
+	int nDocs = 0;
+	int continueOnError = (flags & MONGO_CONTINUE_ON_ERROR);
+	int acknowledged = mongotcl_writeConcernIsAcknowledged (mongotcl_activeWriteConcern (md));
+	int useCommand;
+	int maxBatchBytes;
+	int maxBatchCount;
+	int start;
+	int i;
+	Tcl_Obj *failedList = Tcl_NewObj ();
+	int result = TCL_ERROR;
+
+	Tcl_IncrRefCount (failedList);
+	*confirmedPtr = 0;
+
+	if (mongotcl_probeServerLimits (md) != MONGO_OK) {
+		Tcl_DecrRefCount (failedList);
+		return mongotcl_setMongoError (interp, md->conn);
+	}
+
+	useCommand = (continueOnError && acknowledged && md->max_wire_version >= 2);
+
+	maxBatchBytes = md->conn->max_bson_size;
+	if (!useCommand && md->max_message_size - MONGOTCL_INSERT_OVERHEAD - (int)strlen (ns) - 1 < maxBatchBytes) {
+		maxBatchBytes = md->max_message_size - MONGOTCL_INSERT_OVERHEAD - (int)strlen (ns) - 1;
+	}
+	maxBatchCount = (useCommand ? md->max_write_batch_size : listObjc);
+
+	bsonList = (bson **)ckalloc (sizeof (bson *) * (listObjc + 1));
+	indexList = (int *)ckalloc (sizeof (int) * (listObjc + 1));
+
+	/* resolve every bson object and set aside the ones no server
+	 * would accept before anything is sent */
+	for (i = 0; i < listObjc; i++) {
+		bson *bson;
+
+		if (mongotcl_cmdNameObjToBson (interp, listObjv[i], &bson) == TCL_ERROR) {
+			goto cleanup;
+		}
+
+		if (bson_size (bson) > md->conn->max_bson_size) {
+			if (!continueOnError) {
+				md->conn->err = MONGO_BSON_TOO_LARGE;
+				md->conn->errstr[0] = '\0';
+				mongotcl_setMongoError (interp, md->conn);
+				Tcl_AppendResult (interp, " (document ", Tcl_GetString (listObjv[i]), ")", NULL);
+				goto cleanup;
+			}
+			Tcl_ListObjAppendElement (interp, failedList, Tcl_NewIntObj (i));
+			continue;
+		}
+
+		bsonList[nDocs] = bson;
+		indexList[nDocs] = i;
+		nDocs++;
+	}
+
+	for (start = 0; start < nDocs; ) {
+		int batchBytes = 0;
+		int end;
+
+		for (end = start; end < nDocs && end - start < maxBatchCount; end++) {
+			int docBytes = bson_size (bsonList[end]) + (useCommand ? 16 : 0);
+
+			if (end > start && batchBytes + docBytes > maxBatchBytes) {
+				break;
+			}
+			batchBytes += docBytes;
+		}
+
+		if (useCommand) {
+			if (mongotcl_insertCommand (interp, md, ns, &bsonList[start], &indexList[start], end - start, failedList) != TCL_OK) {
+				goto cleanup;
+			}
+		} else {
+			if (mongo_insert_batch (md->conn, ns, (const bson **)&bsonList[start], end - start, md->unack_write_concern, flags) != MONGO_OK) {
+				mongotcl_setMongoError (interp, md->conn);
+				goto cleanup;
+			}
+
+			if (!acknowledged || continueOnError) {
+				/* not known to be written until the trailing getLastError */
+				start = end;
+				continue;
+			}
+
+			if (mongotcl_checkLastError (md, ns) != MONGO_OK) {
+				mongotcl_setMongoError (interp, md->conn);
+				goto cleanup;
+			}
+		}
+
+		*confirmedPtr = indexList[end - 1] + 1;
+		start = end;
+	}
+
+	if (acknowledged && !useCommand && continueOnError && nDocs > 0 && mongotcl_checkLastError (md, ns) != MONGO_OK) {
+		mongotcl_setMongoError (interp, md->conn);
+		goto cleanup;
+	}
+
+	if (continueOnError) {
+		Tcl_SetObjResult (interp, failedList);
+	}
+	*confirmedPtr = listObjc;
+	result = TCL_OK;
+
+  cleanup:
+	Tcl_DecrRefCount (failedList);
+	ckfree ((char *)bsonList);
+	ckfree ((char *)indexList);
+	return result;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
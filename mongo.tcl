@@ -70,8 +70,16 @@ proc _search {args} {
 				set namespace $value
 			}
 
+			"-batch_size" {
+				set batchSize $value
+			}
+
+			"-prefetch" {
+				set prefetch $value
+			}
+
 			default {
-				error "unknown key $key: must be one of -namespace, -fields, -code, -array, -typearray, -list, -offset, -limit"
+				error "unknown key $key: must be one of -namespace, -fields, -code, -array, -typearray, -list, -offset, -limit, -comparebson, -sort, -batch_size, -prefetch"
 			}
 		}
 	}
@@ -102,6 +110,14 @@ proc _search {args} {
 		$cursor set_skip $offset
 	}
 
+	if {[info exists batchSize]} {
+		$cursor set_batch_size $batchSize
+	}
+
+	if {[info exists prefetch]} {
+		$cursor set_prefetch $prefetch
+	}
+
 	# generate the query
 	set queryBson [::mongo::bson create #auto]
 
@@ -129,31 +145,41 @@ proc _search {args} {
 	# iterate over the matching rows. 
 	# you have to invoke "next" to get the first row, by the way
 	#
-	while {[$cursor next]} {
-		# pull the data out of the row, get types too if a type array
-		# is specified
-		if {[info exists arrayName]} {
-			if {![info exists typeArrayName]} {
-				unset -nocomplain array
-				$cursor to_array array
-			} else {
-				unset -nocomplain array typeArray
-				$cursor to_array array typeArray
+	# the cursor is deleted however the loop ends, so a break or an
+	# error in the code block doesn't leave the server cursor open
+	#
+	set status [catch {
+		while {[$cursor next]} {
+			# pull the data out of the row, get types too if a type array
+			# is specified
+			if {[info exists arrayName]} {
+				if {![info exists typeArrayName]} {
+					unset -nocomplain array
+					$cursor to_array array
+				} else {
+					unset -nocomplain array typeArray
+					$cursor to_array array typeArray
+				}
 			}
-		}
 
-		# if they specified -list, give them their list of type triplets
-		if {[info exists listName]} {
-			set listVar [$cursor to_list]
-		}
+			# if they specified -list, give them their list of type triplets
+			if {[info exists listName]} {
+				set listVar [$cursor to_list]
+			}
 
-		# if they specified a code block, execute it
-		if {[info exists code]} {
-			uplevel $code
+			# if they specified a code block, execute it
+			if {[info exists code]} {
+				uplevel $code
+			}
 		}
-	}
+	} result options]
 
-	$cursor destroy
+	$cursor delete
+	$queryBson delete
+
+	if {$status != 0} {
+		return -options $options $result
+	}
 }
 
 } ;# namespace ::mongo